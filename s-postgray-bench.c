@@ -0,0 +1,762 @@
+/*@ s-postgray-bench.c: policy load generator for s-postgray(8), see "make bench".
+ *@ Starts a server in a temporary --store-path, drives CLIENTS processes which each speak postfix policy
+ *@ protocol with an own s-postgray client (or, -P, directly with a --policy-listen socket of the server), and
+ *@ reports throughput, latency percentiles and server RSS growth as key=value lines.
+ *@ Requests are synthesized: KEYS distinct graylist triples, RETRY percent repeat one of the last triples of
+ *@ a process (like MTA retries), ALLOW and BLOCK percent hit --allow and --block entries.
+ *
+ * Copyright (c) 2025 Steffen Nurpmeso <steffen@sdaoden.eu>.
+ * SPDX-License-Identifier: ISC
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Name of the --policy-listen socket (-P), and of the latency files of the processes, in the store path */
+#define a_POLICY_SOCK "bench.sock"
+#define a_LAT_NAME "bench.lat."
+
+/* Triples a process remembers for retries */
+#define a_RETRY_RING 64
+
+/* Addresses of --allow and --block hits (RFC 5737 documentation ranges) */
+#define a_ALLOW_NAME "mx.allow.invalid"
+#define a_ALLOW_NET "203.0.113"
+#define a_BLOCK_CIDR "198.51.100.0/24"
+#define a_BLOCK_NET "198.51.100"
+
+#define a_BUF_LEN 1024
+#define a_PATH_LEN 512 /* Of store path */
+#define a_ARGS_MAX 64
+
+/*  >8 -- 8< */
+
+enum{
+	a_EX_OK,
+	a_EX_ERR,
+	a_EX_USAGE = 64,
+	a_EX_UNAVAILABLE = 69,
+	a_EX_OSERR = 71,
+	a_EX_IOERR = 74
+};
+
+enum a_ans{
+	a_ANS_DUNNO,
+	a_ANS_DEFER,
+	a_ANS_REJECT,
+	a_ANS_OTHER,
+	a_ANS__MAX
+};
+
+struct a_conf{
+	char const *c_pg; /* s-postgray binary */
+	char const *c_name; /* Its VAL_NAME (PID file name) */
+	unsigned long c_clients;
+	unsigned long c_requests; /* Per client */
+	unsigned long c_keys;
+	unsigned int c_retry; /* Percent */
+	unsigned int c_allow;
+	unsigned int c_block;
+	unsigned int c_seed;
+	int c_policy; /* -P */
+	char const *c_args[a_ARGS_MAX]; /* -o */
+	unsigned int c_args_no;
+	char c_store[a_PATH_LEN];
+};
+
+/* Written by a process to its latency file, followed by .lh_no nanosecond latencies */
+struct a_lat_hdr{
+	uint64_t lh_no;
+	uint64_t lh_ans[a_ANS__MAX];
+};
+
+static int a_verbose;
+
+static int a_run(struct a_conf *cp);
+static int a_client(struct a_conf const *cp, unsigned long no, int barrier);
+/* Connect to the policy socket, or start an s-postgray client on a socketpair(2), *pidp set then */
+static int a_client__conn(struct a_conf const *cp, long *pidp);
+static int a_client__req(struct a_conf const *cp, char *buf, uint64_t *rngp, unsigned long *ring,
+		unsigned long *ring_no);
+static int a_client__io(int fd, char *buf, size_t len, enum a_ans *ansp);
+
+/* Execute s-postgray with base arguments, and extra if not NULL; wait: return exit status */
+static long a_pg(struct a_conf const *cp, char const **extra, int wait);
+static long a_pg_pid(struct a_conf const *cp);
+static long a_rss(long pid);
+static void a_store_rm(struct a_conf const *cp);
+
+static uint64_t a_rng(uint64_t *rngp);
+static uint64_t a_now(void);
+static int a_lat_cmp(void const *a, void const *b);
+static int a_write_all(int fd, void const *dat, size_t len);
+static long a_fork(void);
+
+int
+main(int argc, char **argv){
+	struct a_conf c;
+	char const *prog, *tmpd;
+	unsigned long *ulp;
+	int es, o;
+
+	es = a_EX_USAGE;
+	prog = (argc == 0) ? "s-postgray-bench" : argv[0];
+
+	memset(&c, 0, sizeof c);
+	c.c_name = "s-postgray";
+	c.c_clients = 8;
+	c.c_requests = 10000;
+	c.c_keys = 100000;
+	c.c_retry = 30;
+	c.c_allow = 5;
+	c.c_block = 5;
+	c.c_seed = 1;
+
+	while((o = getopt(argc, argv, "a:b:c:k:N:n:o:Pr:S:v")) != -1){
+		ulp = NULL;
+
+		switch(o){
+		case 'a': c.c_allow = (unsigned int)strtoul(optarg, NULL, 10); break;
+		case 'b': c.c_block = (unsigned int)strtoul(optarg, NULL, 10); break;
+		case 'c': ulp = &c.c_clients; break;
+		case 'k': ulp = &c.c_keys; break;
+		case 'N': c.c_name = optarg; break;
+		case 'n': ulp = &c.c_requests; break;
+		case 'o':
+			if(c.c_args_no == a_ARGS_MAX - 8){
+				fprintf(stderr, "Too many -o options\n");
+				goto jesyn;
+			}
+			c.c_args[c.c_args_no++] = optarg;
+			break;
+		case 'P': c.c_policy = 1; break;
+		case 'r': c.c_retry = (unsigned int)strtoul(optarg, NULL, 10); break;
+		case 'S': c.c_seed = (unsigned int)strtoul(optarg, NULL, 10); break;
+		case 'v': a_verbose = 1; break;
+		default: goto jesyn;
+		}
+
+		if(ulp != NULL && (*ulp = strtoul(optarg, NULL, 10)) == 0){
+			fprintf(stderr, "Option -%c needs a positive number: %s\n", o, optarg);
+			goto jesyn;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if(argc != 1)
+		goto jesyn;
+	if(strlen(c.c_name) > 64){
+		fprintf(stderr, "Name too long: %s\n", c.c_name);
+		goto jesyn;
+	}
+	if(c.c_retry > 100 || c.c_allow + c.c_block > 100){
+		fprintf(stderr, "Percentages out of range\n");
+		goto jesyn;
+	}
+	c.c_pg = argv[0];
+
+	if((tmpd = getenv("TMPDIR")) == NULL || *tmpd == '\0')
+		tmpd = "/tmp";
+	if((size_t)snprintf(c.c_store, sizeof(c.c_store), "%s/s-postgray-bench.XXXXXX", tmpd
+			) >= sizeof(c.c_store) - sizeof(a_LAT_NAME) - 24){
+		fprintf(stderr, "$TMPDIR path too long\n");
+		es = a_EX_ERR;
+		goto jleave;
+	}
+	if(mkdtemp(c.c_store) == NULL){
+		fprintf(stderr, "Cannot create temporary store path %s: %s\n", c.c_store, strerror(errno));
+		es = a_EX_OSERR;
+		goto jleave;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	es = a_run(&c);
+
+	a_store_rm(&c);
+jleave:
+	return es;
+
+jesyn:
+	fprintf(stderr,
+		"  %s [-v] [-c clients] [-n requests] [-k keys] [-r retry%%] [-a allow%%] [-b block%%]\n"
+		"     [-P] [-S seed] [-N name] [-o s-postgray-option].. s-postgray-path\n",
+		prog);
+	goto jleave;
+}
+
+static int
+a_run(struct a_conf *cp){
+	char buf[a_BUF_LEN], qbuf[64];
+	char const *extra[8];
+	uint64_t ans[a_ANS__MAX], *lat, all, t, i;
+	struct a_lat_hdr lh;
+	unsigned long no;
+	long pid, rss1, rss2, x;
+	int barrier[2], es, fd;
+
+	lat = NULL;
+	t = 0;
+	barrier[0] = barrier[1] = -1;
+
+	/* Server; --server-queue must allow for all clients */
+	i = 0;
+	extra[i++] = "--startup";
+	extra[i++] = "--allow=" a_ALLOW_NAME;
+	extra[i++] = "--block=" a_BLOCK_CIDR;
+	if(cp->c_clients >= 60){
+		snprintf(qbuf, sizeof qbuf, "--server-queue=%lu", cp->c_clients + 4);
+		extra[i++] = qbuf;
+	}
+	if(cp->c_policy)
+		extra[i++] = "--policy-listen=" a_POLICY_SOCK;
+	extra[i] = NULL;
+
+	if((x = a_pg(cp, extra, 1)) != 0){
+		fprintf(stderr, "Server startup failed (status %ld)\n", x);
+		es = a_EX_UNAVAILABLE;
+		goto jleave;
+	}
+
+	if((pid = a_pg_pid(cp)) <= 0){
+		fprintf(stderr, "Cannot read server PID from %s/%s.pid\n", cp->c_store, cp->c_name);
+		es = a_EX_UNAVAILABLE;
+		goto jshutdown;
+	}
+	rss1 = a_rss(pid);
+
+	/* Clients wait for the barrier to go away, then start at once */
+	if(pipe(barrier) == -1){
+		fprintf(stderr, "Cannot create pipe: %s\n", strerror(errno));
+		es = a_EX_OSERR;
+		goto jshutdown;
+	}
+
+	for(no = 0; no < cp->c_clients; ++no){
+		if((x = a_fork()) < 0){
+			fprintf(stderr, "Cannot fork client: %s\n", strerror((int)-x));
+			es = a_EX_OSERR;
+			close(barrier[1]);
+			barrier[1] = -1;
+			goto jwait;
+		}
+		if(x == 0){
+			close(barrier[1]);
+			_exit(a_client(cp, no, barrier[0]));
+		}
+	}
+	close(barrier[0]);
+	barrier[0] = -1;
+
+	t = a_now();
+	close(barrier[1]);
+	barrier[1] = -1;
+	es = a_EX_OK;
+
+jwait:
+	for(;;){
+		int s;
+
+		if((x = waitpid(-1, &s, 0)) == -1){
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(!WIFEXITED(s) || WEXITSTATUS(s) != a_EX_OK)
+			es = a_EX_ERR;
+	}
+	if(es != a_EX_OK){
+		fprintf(stderr, "Client process(es) failed\n");
+		goto jshutdown;
+	}
+	t = a_now() - t;
+	rss2 = a_rss(pid);
+
+	/* Collect */
+	memset(ans, 0, sizeof ans);
+	all = (uint64_t)cp->c_clients * cp->c_requests;
+	if((lat = (uint64_t*)malloc(sizeof(*lat) * all)) == NULL){
+		fprintf(stderr, "Out of memory\n");
+		es = a_EX_OSERR;
+		goto jshutdown;
+	}
+
+	for(all = 0, no = 0; no < cp->c_clients; ++no){
+		snprintf(buf, sizeof buf, "%s/" a_LAT_NAME "%lu", cp->c_store, no);
+		if((fd = open(buf, O_RDONLY)) == -1 || read(fd, &lh, sizeof lh) != sizeof lh ||
+				lh.lh_no > cp->c_requests ||
+				read(fd, &lat[all], sizeof(*lat) * lh.lh_no) != (ssize_t)(sizeof(*lat) * lh.lh_no)){
+			fprintf(stderr, "Cannot read client latencies of %s\n", buf);
+			if(fd != -1)
+				close(fd);
+			es = a_EX_IOERR;
+			goto jshutdown;
+		}
+		close(fd);
+
+		all += lh.lh_no;
+		for(i = 0; i < a_ANS__MAX; ++i)
+			ans[i] += lh.lh_ans[i];
+	}
+	qsort(lat, all, sizeof *lat, &a_lat_cmp);
+
+#undef a_P
+#define a_P(Q) (double)lat[(all * (Q) + 999) / 1000 - 1] / 1000.0
+
+	printf("mode=%s\nclients=%lu\nrequests=%llu\nkeys=%lu\nretry_pct=%u\nallow_pct=%u\nblock_pct=%u\n"
+			"seconds=%.6f\nrequests_per_sec=%.1f\n"
+			"latency_usec_p50=%.1f\nlatency_usec_p99=%.1f\nlatency_usec_p999=%.1f\nlatency_usec_max=%.1f\n"
+			"answers_dunno=%llu\nanswers_defer=%llu\nanswers_reject=%llu\nanswers_other=%llu\n"
+			"server_rss_kib_start=%ld\nserver_rss_kib_end=%ld\nserver_rss_kib_growth=%ld\n",
+		(cp->c_policy ? "policy" : "client"), cp->c_clients, (unsigned long long)all, cp->c_keys,
+		cp->c_retry, cp->c_allow, cp->c_block,
+		(double)t / 1e9, (double)all / ((double)t / 1e9),
+		a_P(500), a_P(990), a_P(999), (double)lat[all - 1] / 1000.0,
+		(unsigned long long)ans[a_ANS_DUNNO], (unsigned long long)ans[a_ANS_DEFER],
+		(unsigned long long)ans[a_ANS_REJECT], (unsigned long long)ans[a_ANS_OTHER],
+		rss1, rss2, ((rss1 >= 0 && rss2 >= 0) ? rss2 - rss1 : -1));
+#undef a_P
+
+jshutdown:
+	if(barrier[0] != -1)
+		close(barrier[0]);
+	if(barrier[1] != -1)
+		close(barrier[1]);
+
+	extra[0] = "--shutdown";
+	extra[1] = NULL;
+	if((x = a_pg(cp, extra, 1)) != 0){
+		fprintf(stderr, "Server shutdown failed (status %ld)\n", x);
+		if(es == a_EX_OK)
+			es = a_EX_ERR;
+	}
+
+jleave:
+	if(lat != NULL)
+		free(lat);
+
+	return es;
+}
+
+static int
+a_client(struct a_conf const *cp, unsigned long no, int barrier){
+	char buf[a_BUF_LEN];
+	struct a_lat_hdr lh;
+	unsigned long ring[a_RETRY_RING], ring_no;
+	uint64_t rng, *lat, t;
+	enum a_ans ans;
+	long pid;
+	int es, fd, lfd;
+	size_t len;
+
+	es = a_EX_OSERR;
+	fd = lfd = -1;
+	pid = -1;
+
+	memset(&lh, 0, sizeof lh);
+	if((lat = (uint64_t*)malloc(sizeof(*lat) * cp->c_requests)) == NULL){
+		fprintf(stderr, "Client %lu: out of memory\n", no);
+		goto jleave;
+	}
+	rng = ((uint64_t)cp->c_seed << 32) ^ (no + 1) * 0x9E3779B97F4A7C15ull;
+	ring_no = 0;
+
+	if((fd = a_client__conn(cp, &pid)) == -1)
+		goto jleave;
+
+	snprintf(buf, sizeof buf, "%s/" a_LAT_NAME "%lu", cp->c_store, no);
+	if((lfd = open(buf, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1){
+		fprintf(stderr, "Client %lu: cannot create %s: %s\n", no, buf, strerror(errno));
+		goto jleave;
+	}
+
+	/* Barrier */
+	while(read(barrier, buf, 1) == -1 && errno == EINTR){
+	}
+	close(barrier);
+
+	es = a_EX_IOERR;
+	for(; lh.lh_no < cp->c_requests; ++lh.lh_no){
+		len = (size_t)a_client__req(cp, buf, &rng, ring, &ring_no);
+
+		t = a_now();
+		if(!a_client__io(fd, buf, len, &ans)){
+			fprintf(stderr, "Client %lu: request %llu failed\n", no, (unsigned long long)lh.lh_no);
+			goto jleave;
+		}
+		lat[lh.lh_no] = a_now() - t;
+		++lh.lh_ans[ans];
+	}
+
+	if(!a_write_all(lfd, &lh, sizeof lh) || !a_write_all(lfd, lat, sizeof(*lat) * lh.lh_no)){
+		fprintf(stderr, "Client %lu: cannot write latencies: %s\n", no, strerror(errno));
+		goto jleave;
+	}
+	es = a_EX_OK;
+
+jleave:
+	if(lfd != -1)
+		close(lfd);
+	if(fd != -1){
+		shutdown(fd, SHUT_WR);
+		close(fd);
+	}
+	if(pid > 0){
+		int s;
+
+		while(waitpid((pid_t)pid, &s, 0) == -1 && errno == EINTR){
+		}
+	}
+	if(lat != NULL)
+		free(lat);
+
+	return es;
+}
+
+static int
+a_client__conn(struct a_conf const *cp, long *pidp){
+	struct sockaddr_un soaun;
+	int sv[2], fd;
+
+	if(cp->c_policy){
+		memset(&soaun, 0, sizeof soaun);
+		soaun.sun_family = AF_UNIX;
+		if((size_t)snprintf(soaun.sun_path, sizeof(soaun.sun_path), "%s/" a_POLICY_SOCK, cp->c_store
+				) >= sizeof(soaun.sun_path)){
+			fprintf(stderr, "Policy socket path too long: %s/%s\n", cp->c_store, a_POLICY_SOCK);
+			fd = -1;
+			goto jleave;
+		}
+
+		while((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+			if(errno != EINTR){
+				fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+				goto jleave;
+			}
+		}
+		while(connect(fd, (struct sockaddr const*)&soaun, sizeof soaun) == -1){
+			if(errno != EINTR){
+				fprintf(stderr, "Cannot connect to %s: %s\n", soaun.sun_path, strerror(errno));
+				close(fd);
+				fd = -1;
+				goto jleave;
+			}
+		}
+	}else{
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1){
+			fprintf(stderr, "Cannot create socketpair: %s\n", strerror(errno));
+			fd = -1;
+			goto jleave;
+		}
+
+		/* The client speaks via standard input and output */
+		if((*pidp = a_fork()) < 0){
+			fprintf(stderr, "Cannot fork s-postgray client: %s\n", strerror((int)-*pidp));
+			close(sv[0]);
+			close(sv[1]);
+			fd = -1;
+			goto jleave;
+		}
+		if(*pidp == 0){
+			close(sv[0]);
+			if(dup2(sv[1], STDIN_FILENO) == -1 || dup2(sv[1], STDOUT_FILENO) == -1)
+				_exit(a_EX_OSERR);
+			close(sv[1]);
+			a_pg(cp, NULL, 0);
+			_exit(a_EX_OSERR);
+		}
+		close(sv[1]);
+		fd = sv[0];
+	}
+
+jleave:
+	return fd;
+}
+
+static int
+a_client__req(struct a_conf const *cp, char *buf, uint64_t *rngp, unsigned long *ring, unsigned long *ring_no){
+	uint64_t r;
+	unsigned long id;
+	unsigned int pct;
+	int rv;
+
+	r = a_rng(rngp);
+	pct = (unsigned int)(r % 100);
+	r /= 100;
+
+	if(pct < cp->c_allow)
+		rv = snprintf(buf, a_BUF_LEN,
+				"request=smtpd_access_policy\nprotocol_state=RCPT\nprotocol_name=ESMTP\n"
+				"client_address=" a_ALLOW_NET ".%u\nclient_name=" a_ALLOW_NAME "\n"
+				"sender=s%lu@allow.invalid\nrecipient=r%lu@bench.invalid\n\n",
+				(unsigned int)(r % 254 + 1), (unsigned long)(r % cp->c_keys),
+				(unsigned long)((r >> 20) % 512));
+	else if(pct < cp->c_allow + cp->c_block)
+		rv = snprintf(buf, a_BUF_LEN,
+				"request=smtpd_access_policy\nprotocol_state=RCPT\nprotocol_name=ESMTP\n"
+				"client_address=" a_BLOCK_NET ".%u\nclient_name=unknown\n"
+				"sender=s%lu@block.invalid\nrecipient=r%lu@bench.invalid\n\n",
+				(unsigned int)(r % 254 + 1), (unsigned long)(r % cp->c_keys),
+				(unsigned long)((r >> 20) % 512));
+	else{
+		/* Graylisting: a retry of a triple of ours, or any */
+		if(*ring_no > 0 && (unsigned int)((r >> 32) % 100) < cp->c_retry)
+			id = ring[(r % 0xFFFF) % (*ring_no < a_RETRY_RING ? *ring_no : a_RETRY_RING)];
+		else{
+			id = (unsigned long)(r % cp->c_keys);
+			ring[*ring_no % a_RETRY_RING] = id;
+			++*ring_no;
+		}
+
+		rv = snprintf(buf, a_BUF_LEN,
+				"request=smtpd_access_policy\nprotocol_state=RCPT\nprotocol_name=ESMTP\n"
+				"client_address=10.%lu.%lu.%lu\nclient_name=mta%lu.bench.invalid\n"
+				"sender=s%lu@sender%lu.invalid\nrecipient=r%lu@bench.invalid\n\n",
+				(id >> 16) & 0xFF, (id >> 8) & 0xFF, id & 0xFF, id % 1000,
+				id, id % 97, id % 4096);
+	}
+
+	return rv;
+}
+
+static int
+a_client__io(int fd, char *buf, size_t len, enum a_ans *ansp){
+	size_t i;
+	ssize_t r;
+	int rv;
+
+	rv = 0;
+
+	if(!a_write_all(fd, buf, len))
+		goto jleave;
+
+	/* action=WHAT\n\n; we never pipeline, so this is all of it */
+	for(len = 0;;){
+		if((r = read(fd, &buf[len], a_BUF_LEN - 1 - len)) == -1){
+			if(errno == EINTR)
+				continue;
+			goto jleave;
+		}
+		if(r == 0)
+			goto jleave;
+		len += (size_t)r;
+		if(len >= 2 && buf[len - 1] == '\n' && buf[len - 2] == '\n')
+			break;
+		if(len == a_BUF_LEN - 1)
+			goto jleave;
+	}
+	buf[len] = '\0';
+
+	i = sizeof("action=") -1;
+	if(len < i || memcmp(buf, "action=", i))
+		*ansp = a_ANS_OTHER;
+	else if(!strncmp(&buf[i], "DUNNO", sizeof("DUNNO") -1))
+		*ansp = a_ANS_DUNNO;
+	else if(!strncmp(&buf[i], "DEFER", sizeof("DEFER") -1))
+		*ansp = a_ANS_DEFER;
+	else if(!strncmp(&buf[i], "REJECT", sizeof("REJECT") -1))
+		*ansp = a_ANS_REJECT;
+	else
+		*ansp = a_ANS_OTHER;
+
+	if(a_verbose)
+		fprintf(stderr, "%s", buf);
+	rv = 1;
+jleave:
+	return rv;
+}
+
+static long
+a_pg(struct a_conf const *cp, char const **extra, int wait){
+	char const *argv[a_ARGS_MAX];
+	unsigned int i, j;
+	long pid;
+	int s;
+
+	i = 0;
+	argv[i++] = cp->c_pg;
+	argv[i++] = "-s";
+	argv[i++] = cp->c_store;
+	for(j = 0; j < cp->c_args_no; ++j)
+		argv[i++] = cp->c_args[j];
+	if(extra != NULL)
+		while(*extra != NULL)
+			argv[i++] = *extra++;
+	argv[i] = NULL;
+
+	if(wait && (pid = a_fork()) != 0){
+		if(pid < 0)
+			goto jleave;
+		while((pid = waitpid((pid_t)pid, &s, 0)) == -1 && errno == EINTR){
+		}
+		pid = (pid == -1) ? -1 : WIFEXITED(s) ? WEXITSTATUS(s) : 128 + (WIFSIGNALED(s) ? WTERMSIG(s) : 0);
+		goto jleave;
+	}
+
+	execv(cp->c_pg, (char*const*)argv);
+	fprintf(stderr, "Cannot execute %s: %s\n", cp->c_pg, strerror(errno));
+	_exit(a_EX_UNAVAILABLE);
+
+jleave:
+	return pid;
+}
+
+static long
+a_pg_pid(struct a_conf const *cp){
+	char buf[a_BUF_LEN];
+	ssize_t r;
+	long rv;
+	int fd;
+
+	rv = -1;
+
+	snprintf(buf, sizeof buf, "%s/%s.pid", cp->c_store, cp->c_name);
+	if((fd = open(buf, O_RDONLY)) != -1){
+		while((r = read(fd, buf, sizeof(buf) - 1)) == -1 && errno == EINTR){
+		}
+		if(r > 0){
+			buf[r] = '\0';
+			rv = strtol(buf, NULL, 10);
+		}
+		close(fd);
+	}
+
+	return rv;
+}
+
+static long
+a_rss(long pid){
+	char buf[64];
+	FILE *fp;
+	long rv;
+
+	/* ps(1) knows it everywhere; KiB */
+	rv = -1;
+	snprintf(buf, sizeof buf, "ps -o rss= -p %ld", pid);
+	if((fp = popen(buf, "r")) != NULL){
+		if(fgets(buf, sizeof buf, fp) != NULL)
+			rv = strtol(buf, NULL, 10);
+		pclose(fp);
+	}
+
+	return rv;
+}
+
+static void
+a_store_rm(struct a_conf const *cp){
+	char const *argv[4];
+	long pid;
+	int s;
+
+	if((pid = a_fork()) == 0){
+		argv[0] = "rm";
+		argv[1] = "-rf";
+		argv[2] = cp->c_store;
+		argv[3] = NULL;
+		execvp("rm", (char*const*)argv);
+		_exit(a_EX_UNAVAILABLE);
+	}
+	if(pid > 0)
+		while(waitpid((pid_t)pid, &s, 0) == -1 && errno == EINTR){
+		}
+}
+
+static uint64_t
+a_rng(uint64_t *rngp){
+	/* xorshift64* */
+	uint64_t x;
+
+	x = *rngp;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*rngp = x;
+
+	return x * 0x2545F4914F6CDD1Dull;
+}
+
+static uint64_t
+a_now(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int
+a_lat_cmp(void const *a, void const *b){
+	uint64_t x, y;
+
+	x = *(uint64_t const*)a;
+	y = *(uint64_t const*)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static int
+a_write_all(int fd, void const *dat, size_t len){
+	char const *cp;
+	ssize_t w;
+
+	for(cp = (char const*)dat; len > 0; cp += w, len -= (size_t)w){
+		if((w = write(fd, cp, len)) == -1){
+			if(errno == EINTR){
+				w = 0;
+				continue;
+			}
+			break;
+		}
+	}
+
+	return (len == 0);
+}
+
+static long
+a_fork(void){
+	struct timespec ts;
+	long i;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 250000000L;
+
+	for(;;){
+		i = fork();
+		if(i != -1)
+			break;
+		i = -(errno);
+		if(i == -ENOSYS)
+			break;
+		nanosleep(&ts, NULL);
+	}
+
+	return i;
+}
+
+/* s-itt-mode */
@@ -16,7 +16,7 @@ MSG_DEFER='DEFER_IF_PERMIT 4.2.0 Cannot hurry love'
 LC_ALL=C SOURCE_DATE_EPOCH=844221007
 export LC_ALL SOURCE_DATE_EPOCH
 
-s4= s5= s6= s7= s8= s9= s10=
+s4= s5= s6= s7= s8= s9= s10= s11= s12= s13= s14= s15= s16= s17= s18= s19= s20= s21= s22= s23= s24= s25= s26=
 while [ $# -gt 0 ]; do
 	case $1 in
 	1|2|3) ;;
@@ -27,6 +27,22 @@ while [ $# -gt 0 ]; do
 	8) s8=y;;
 	9) s9=y;;
 	10) s10=y;;
+	11) s11=y;;
+	12) s12=y;;
+	13) s13=y;;
+	14) s14=y;;
+	15) s15=y;;
+	16) s16=y;;
+	17) s17=y;;
+	18) s18=y;;
+	19) s19=y;;
+	20) s20=y;;
+	21) s21=y;;
+	22) s22=y;;
+	23) s23=y;;
+	24) s24=y;;
+	25) s25=y;;
+	26) s26=y;;
 	*)
 		echo >&2 'No such test to skip: '$1
 		echo >&2 'Synopsis: '$0' [:test major number to skip, eg 5:]'
@@ -45,6 +61,8 @@ trap 'exit 1' HUP INT TERM
 cd ./.test || exit 2
 #pwd=$(pwd) || exit 3
 pwd=. #$(pwd) || exit 3
+# (Servers with an own --store-path change directory, these need absolute paths)
+apwd=$(pwd) || exit 3
 
 ### First of all fetch+adjust compile time defaults, create some resources {{{
 
@@ -67,6 +85,9 @@ else
 	sdelay() { sleep 1; }
 fi
 
+# Value of a --stats key
+sval() { sed -n 's/^'"$1"'=//p' < $2; }
+
 echo '=def: calibration=' # {{{
 
 eval $PGX -# > ./tdef1 || exit 1
@@ -178,6 +199,18 @@ t 1.18 limit-delay 333333 -l 333333
 t 1.19 server-timeout 0 --server-timeout=0
 t 1.20 server-timeout 5 -t 5
 
+t 1.21 server-threads 0 --server-threads=0
+
+t 1.22 gray-format text --gray-format=text
+t 1.23 gray-format binary --gray-format binary
+
+t 1.24 limit-delay-time 2000 --limit-delay-time=2000
+t 1.25 limit-delay-time 500:4000 --limit-delay-time 500:4000
+t 1.26 memory-limit 512 --memory-limit=512
+t 1.27 memory-limit-delay 256 --memory-limit-delay 256
+t 1.28 client-cache 30 --client-cache=30
+t 1.29 gray-shared-time 30 --gray-shared-time=30
+
 # TODO No tests for boolean options!
 # }}}
 
@@ -489,6 +522,11 @@ eval $PG -R ./x.rc --status $REDIR
 [ $? -eq 0 ] || exit 102
 [ -n "$REDIR" ] || echo ok 4.sig-7
 
+# (saved in background via temporary file)
+delay
+[ -f ./*.db ] && [ ! -f ./*.tmp ] || exit 101
+[ -n "$REDIR" ] || echo ok 4.sig-7a
+
 kill -TERM $spid || exit 101
 delay
 
@@ -500,6 +538,22 @@ eval $PG -R ./x.rc --status $REDIR
 [ $? -eq 1 ] || exit 102
 [ -n "$REDIR" ] || echo ok 4.sig-9
 
+# --gray-save-background: USR2 snapshot of a child, via temporary file and rotated journal
+rm -f *.db *.jnl *.jno *.tmp
+eval $PG -R ./x.rc --gray-save-background --startup $REDIR
+[ $? -eq 0 ] || exit 102
+printf 'recipient=x@y\nsender=y@z\nclient_address=128.0.0.2\nclient_name=du.bi\n\n' |
+	eval $PG -R ./x.rc > /dev/null $REDIR
+spid=$(cat *.pid);
+kill -USR2 $spid || exit 101
+delay
+[ -s ./*.db ] && [ ! -f ./*.tmp ] && [ ! -f ./*.jno ] || exit 101
+[ -n "$REDIR" ] || echo ok 4.sig-10
+
+eval $PG -R ./x.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 102
+[ -n "$REDIR" ] || echo ok 4.sig-11
+
 ## corner cases
 # empty sender=, whitelisted client
 printf 'recipient=x@y\nsender=\nclient_address=127.0.0.1\nclient_name=du.bi\n\n' |
@@ -796,7 +850,7 @@ if [ -n "$s6" ]; then
 	echo 'skipping 6'
 else
 
-rm -f *.db
+rm -f *.db *.jnl *.jno *.tmp
 
 # max1: X*2  max2: max 255*255
 #max1=32 max2=16
@@ -909,7 +963,7 @@ else
 
 ## --focus-sender
 
-rm -f *.db
+rm -f *.db *.jnl *.jno *.tmp
 
 # Without -f!
 cat <<'_EOT' | eval $PG -R ./x.rc > ./7.0 $REDIR; cat > ./7.x <<_EOT
@@ -960,7 +1014,7 @@ eval $PG -R ./x.rc --shutdown $REDIR
 
 ## --focus-domain
 
-rm -f *.db
+rm -f *.db *.jnl *.jno *.tmp
 
 # Without -F!
 cat <<'_EOT' | eval $PG -R ./x.rc > ./7.3 $REDIR; cat > ./7.x <<_EOT
@@ -1012,7 +1066,7 @@ eval $PG -R ./x.rc --shutdown $REDIR
 
 ## --focus-domain --focus-sender
 
-rm -f *.db
+rm -f *.db *.jnl *.jno *.tmp
 
 # Without -Ff!
 cat <<'_EOT' | eval $PG -R ./x.rc > ./7.6 $REDIR; cat > ./7.x <<_EOT
@@ -1069,7 +1123,7 @@ echo '=8: --startup, more --shutdown=' # {{{
 if [ -n "$s8" ]; then
 	echo 'skipping 8'
 else
-	rm -f *.db
+	rm -f *.db *.jnl *.jno *.tmp
 
 	i=0 j= k= dokill=
 	doit() {
@@ -1162,7 +1216,7 @@ limit-delay=0
 _EOT
 
 doit() {
-	rm -f *.db
+	rm -f *.db *.jnl *.jno *.tmp
 	> ./9.x
 	> ./9.0
 	i=0
@@ -1217,7 +1271,7 @@ if [ -n "$s10" ]; then
 	echo 'skipping 10'
 else
 
-rm -f *.db
+rm -f *.db *.jnl *.jno *.tmp
 cat > ./10.rc-base <<_EOT; cat > ./10.in <<'_EOT'; cat > ./10.x <<_EOT; cat > ./10.y <<_EOT
 untamed
 count 1
@@ -1379,11 +1433,1335 @@ _EOT
 cmp -s ./10.10 ./10.x || exit 101
 [ -n "$REDIR" ] || echo ok 10.10
 
+# crash: journal replay
+printf 'action=%s\n\n' "$MSG_DEFER" > ./10.x
+printf 'action=%s\n\n' "DUNNO" > ./10.y
+printf \
+'recipient=x@y\nsender=y@z\nclient_address=127.1.5.0\nclient_name=xy\n\n' | eval $PG -R ./10.rc > ./10.11 $REDIR
+cmp -s ./10.11 ./10.x || exit 101
+[ -n "$REDIR" ] || echo ok 10.11
+
+delay
+spid=$(cat *.pid);
+kill -KILL $spid || exit 101
+delay
+
+printf \
+'recipient=x@y\nsender=y@z\nclient_address=127.1.5.0\nclient_name=xy\n\n' | eval $PG -R ./10.rc > ./10.12 $REDIR
+cmp -s ./10.12 ./10.y || exit 101
+[ -n "$REDIR" ] || echo ok 10.12
+
 eval $PG -R ./10.rc --shutdown $REDIR
 [ $? -eq 0 ] || exit 101
 fi
 # }}}
 
+##
+: ${PEER_PORT:=40125}
+echo '=11: --peer replication (two servers on loopback)=' # {{{
+if [ -n "$s11" ]; then
+	echo 'skipping 11'
+else
+
+rm -rf 11.a 11.b 11.c
+mkdir 11.a 11.b 11.c || exit 101
+cat > ./11.rc-base <<_EOT
+count 1
+delay-min 0
+delay-max 100
+gc-timeout 200
+msg-defer=$MSG_DEFER
+_EOT
+{ cat 11.rc-base; echo store-path=$apwd/11.a; echo peer-key=s-postgray-test-peer-key;
+	echo peer-listen=127.0.0.1:$PEER_PORT; echo peer=127.0.0.1:$((PEER_PORT + 1)); } > ./11.rca
+{ cat 11.rc-base; echo store-path=$apwd/11.b; echo peer-key=s-postgray-test-peer-key;
+	echo peer-listen=127.0.0.1:$((PEER_PORT + 1)); echo peer=127.0.0.1:$PEER_PORT; } > ./11.rcb
+# Forger: right address, wrong key
+{ cat 11.rc-base; echo store-path=$apwd/11.c; echo peer-key=s-postgray-test-bad-key;
+	echo peer=127.0.0.1:$((PEER_PORT + 1)); } > ./11.rcc
+
+for i in a b c; do
+	eval $PG -R $apwd/11.rc$i --startup $REDIR
+	[ $? -eq 0 ] || exit 101
+done
+[ -n "$REDIR" ] || echo ok 11.0
+
+printf 'action=%s\n\n' "$MSG_DEFER" > ./11.x
+printf 'action=%s\n\n' "DUNNO" > ./11.y
+
+# Deferred on A, known to B
+printf \
+'recipient=x@y\nsender=y@z\nclient_address=127.1.11.1\nclient_name=xy\n\n'\
+	| eval $PG -R $apwd/11.rca > ./11.1 $REDIR
+cmp -s ./11.1 ./11.x || exit 101
+[ -n "$REDIR" ] || echo ok 11.1
+delay
+
+printf \
+'recipient=x@y\nsender=y@z\nclient_address=127.1.11.1\nclient_name=xy\n\n'\
+	| eval $PG -R $apwd/11.rcb > ./11.2 $REDIR
+cmp -s ./11.2 ./11.y || exit 101
+[ -n "$REDIR" ] || echo ok 11.2
+
+eval $PG -R $apwd/11.rcb --stats > ./11.3 $REDIR
+[ $? -eq 0 ] && [ "$(sval peer_merged 11.3)" -eq 1 ] || exit 101
+[ -n "$REDIR" ] || echo ok 11.3
+
+# Deferred on C, datagram fails the MAC on B
+printf \
+'recipient=x@y\nsender=y@z\nclient_address=127.1.12.2\nclient_name=xy\n\n'\
+	| eval $PG -R $apwd/11.rcc > ./11.4 $REDIR
+cmp -s ./11.4 ./11.x || exit 101
+[ -n "$REDIR" ] || echo ok 11.4
+delay
+
+printf \
+'recipient=x@y\nsender=y@z\nclient_address=127.1.12.2\nclient_name=xy\n\n'\
+	| eval $PG -R $apwd/11.rcb > ./11.5 $REDIR
+cmp -s ./11.5 ./11.x || exit 101
+[ -n "$REDIR" ] || echo ok 11.5
+
+eval $PG -R $apwd/11.rcb --stats > ./11.6 $REDIR
+[ $? -eq 0 ] && [ "$(sval peer_merged 11.6)" -eq 1 ] &&
+	[ "$(sval peer_ignored 11.6)" -ge 1 ] || exit 101
+[ -n "$REDIR" ] || echo ok 11.6
+
+# Without --peer-key peers are turned off
+eval $PGX -# --peer=127.0.0.1:$PEER_PORT > ./11.7 2>/dev/null
+[ $? -ne 0 ] && ! grep -q '^peer ' ./11.7 || exit 101
+[ -n "$REDIR" ] || echo ok 11.7
+
+for i in a b c; do
+	eval $PG -R $apwd/11.rc$i --shutdown $REDIR
+	[ $? -eq 0 ] || exit 101
+done
+fi
+# }}}
+
+##
+echo '=12: --policy-listen (perl(1) as policy client)=' # {{{
+if [ -n "$s12" ]; then
+	echo 'skipping 12'
+elif ! command -v perl >/dev/null 2>&1; then
+	echo 'skipping 12: no perl(1)'
+else
+
+rm -rf 12
+mkdir 12 || exit 101
+cat > ./12.rc <<_EOT
+store-path=$apwd/12
+count 1
+delay-min 0
+delay-max 100
+gc-timeout 200
+limit-delay 1
+limit-delay-time 1500
+policy-listen pol
+msg-defer=$MSG_DEFER
+_EOT
+
+# Connection X: blocks given in one write; A: new triple, later completed; B: --limit-delay excess, held back;
+# C: known triple, answered meanwhile
+cat > ./12.pl <<'_EOT'
+use strict;
+use IO::Socket::UNIX;
+use IO::Select;
+
+my $path = shift;
+$SIG{ALRM} = sub {die "timeout\n"};
+alarm 20;
+
+sub con {IO::Socket::UNIX->new(Type => SOCK_STREAM(), Peer => $path) or die "connect: $!\n"}
+sub blk {"request=smtpd_access_policy\nrecipient=x\@y\nsender=y\@z\nclient_address=$_[0]\nclient_name=xy\n\n"}
+sub ans{
+	my ($s, $no) = @_;
+	my $r = '';
+	while(($r =~ tr/\n//) < 2 * $no){
+		sysread($s, my $pb, 512) or die "eof\n";
+		$r .= $pb;
+	}
+	return $r;
+}
+
+my $px = con();
+syswrite($px, blk('127.1.12.1') . blk('127.1.12.1') . "request=junk\nsender=y\@z\n\n\n");
+print "X ", ans($px, 3);
+
+my $pa = con();
+syswrite($pa, "request=smtpd_access_policy\nrecipient=x\@y\nsen");
+my $pb = con();
+syswrite($pb, blk('127.2.12.2'));
+select(undef, undef, undef, .3);
+my $pc = con();
+syswrite($pc, blk('127.1.12.1'));
+print "C ", ans($pc, 1);
+print "B held\n" unless IO::Select->new($pb)->can_read(0);
+print "B ", ans($pb, 1);
+syswrite($pa, "der=y\@z\nclient_address=127.3.12.3\n");
+select(undef, undef, undef, .3);
+syswrite($pa, "client_name=xy\n\n");
+print "A ", ans($pa, 1);
+_EOT
+
+eval $PG -R $apwd/12.rc --startup $REDIR
+[ $? -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 12.0
+
+perl ./12.pl ./12/pol > ./12.1 2>&1
+{
+	printf 'X action=%s\n\naction=DUNNO\n\naction=DUNNO\n\n' "$MSG_DEFER"
+	printf 'C action=DUNNO\n\nB held\nB action=%s\n\nA action=%s\n\n' "$MSG_DEFER" "$MSG_DEFER"
+} > ./12.x
+cmp -s ./12.1 ./12.x || exit 101
+[ -n "$REDIR" ] || echo ok 12.1
+
+eval $PG -R $apwd/12.rc --stats > ./12.2 $REDIR
+[ $? -eq 0 ] && [ "$(sval gray_hits_delay 12.2)" -eq 2 ] || exit 101
+[ -n "$REDIR" ] || echo ok 12.2
+
+eval $PG -R $apwd/12.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+fi
+# }}}
+
+##
+echo '=13: client protocol v2 header checks (perl(1) as client)=' # {{{
+if [ -n "$s13" ]; then
+	echo 'skipping 13'
+elif ! command -v perl >/dev/null 2>&1; then
+	echo 'skipping 13: no perl(1)'
+else
+
+rm -rf 13
+mkdir 13 || exit 101
+cat > ./13.rc <<_EOT
+store-path=$apwd/13
+count 1
+delay-min 0
+delay-max 100
+gc-timeout 200
+_EOT
+
+# G: well-formed request; R: recipient length does not match; A: address length does not match
+# (the frame size is kept, so that the server does not wait for more); S: request split over three writes,
+# Q (known triple) is answered while it is incomplete
+cat > ./13.pl <<'_EOT'
+use strict;
+use IO::Socket::UNIX;
+
+my ($path) = glob(shift . '/*.socket');
+$SIG{ALRM} = sub {die "timeout\n"};
+alarm 20;
+
+sub con {IO::Socket::UNIX->new(Type => SOCK_STREAM(), Peer => $path) or die "connect: $!\n"}
+sub msg{
+	my ($ca, $dr, $dca, $dcn) = @_;
+	my ($r, $s, $cn) = ('x@y', 'y@z', 'xy');
+	return pack('CxSSSS', 2, length($r) + $dr, length($s), length($ca) + $dca, length($cn) + $dcn) .
+		"$r\0$s\0$ca\0$cn\0";
+}
+sub ans{
+	my ($tag, $so) = @_;
+	my $pa;
+	print $tag, (sysread($so, $pa, 1) ? ' answer=' . ord($pa) : ' dropped'), "\n";
+}
+sub req{
+	my $tag = shift;
+	my $so = con();
+	syswrite($so, msg('127.1.13.1', @_));
+	ans($tag, $so);
+}
+req('G', 0, 0, 0);
+req('R', 1, -1, 0);
+req('A', 0, 1, -1);
+
+my $ps = con();
+my $m = msg('127.2.13.1', 0, 0, 0);
+syswrite($ps, substr($m, 0, 5));
+select(undef, undef, undef, .2);
+req('Q', 0, 0, 0);
+syswrite($ps, substr($m, 5, 12));
+select(undef, undef, undef, .2);
+syswrite($ps, substr($m, 17));
+ans('S', $ps);
+_EOT
+
+eval $PG -R $apwd/13.rc --startup $REDIR
+[ $? -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 13.0
+
+perl ./13.pl ./13 > ./13.1 2>&1
+printf 'G answer=3\nR dropped\nA dropped\nQ answer=4\nS answer=3\n' > ./13.x
+cmp -s ./13.1 ./13.x || exit 101
+[ -n "$REDIR" ] || echo ok 13.1
+
+eval $PG -R $apwd/13.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+fi
+# }}}
+
+##
+echo '=14: --server-threads (parallel clients, same answers as unthreaded)=' # {{{
+if [ -n "$s14" ]; then
+	echo 'skipping 14'
+elif ! eval $PGX -# --server-threads=4 >/dev/null 2>&1; then
+	echo 'skipping 14: no server-threads support'
+else
+
+eval $PGX -# --server-queue=512 --server-threads=300 > /dev/null 2> ./14.0 && exit 101
+grep -q 'server-threads is > 256' ./14.0 || exit 101
+[ -n "$REDIR" ] || echo ok 14.0
+
+rm -rf 14.s0 14.s4
+mkdir 14.s0 14.s4 || exit 101
+cat > ./14.rc-base <<_EOT
+4-mask 24
+6-mask 64
+count 1
+delay-min 0
+delay-max 100
+gc-timeout 200
+allow-file=$apwd/x.a1
+block-file=$apwd/x.a2
+msg-allow=$MSG_ALLOW
+msg-block=$MSG_BLOCK
+msg-defer=$MSG_DEFER
+_EOT
+{ cat 14.rc-base; echo store-path=$apwd/14.s0; echo server-threads 0; } > ./14.rc0
+{ cat 14.rc-base; echo store-path=$apwd/14.s4; echo server-threads 4; } > ./14.rc4
+
+# Per client: allowed and blocked address, allowed name, a new triple twice, and one shared by all clients
+for k in 1 2 3 4 5 6 7 8; do
+	for ca in 127.0.0.1 193.92.150.243 200.200.200.$k:exact.match 127.1.$k.14 127.1.$k.14 127.1.99.14; do
+		cn=${ca#*:}
+		[ "$cn" = "$ca" ] && cn=xy
+		printf 'recipient=x@y\nsender=y@z\nclient_address=%s\nclient_name=%s\n\n' "${ca%:*}" "$cn"
+	done > ./14.in$k
+done
+
+for t in 0 4; do
+	eval $PG -R $apwd/14.rc$t --startup $REDIR
+	[ $? -eq 0 ] || exit 101
+	for k in 1 2 3 4 5 6 7 8; do
+		eval $PG -R $apwd/14.rc$t < ./14.in$k > ./14.out$t.$k $REDIR &
+	done
+	wait
+	cat ./14.out$t.[1-8] > ./14.out$t
+	eval $PG -R $apwd/14.rc$t --stats > ./14.stats$t $REDIR
+	[ $? -eq 0 ] || exit 101
+	eval $PG -R $apwd/14.rc$t --shutdown $REDIR
+	[ $? -eq 0 ] || exit 101
+done
+
+# The shared triple is deferred once, for whichever client comes first
+[ "$(grep -c "^action=$MSG_DEFER\$" ./14.out0)" -eq 9 ] &&
+	[ "$(grep -c "^action=$MSG_DEFER\$" ./14.out4)" -eq 9 ] || exit 101
+[ -n "$REDIR" ] || echo ok 14.1
+sed "s/^action=$MSG_DEFER\$/action=DUNNO/" < ./14.out0 > ./14.x
+sed "s/^action=$MSG_DEFER\$/action=DUNNO/" < ./14.out4 > ./14.y
+cmp -s ./14.x ./14.y || exit 101
+[ -n "$REDIR" ] || echo ok 14.2
+
+[ "$(sval server_threads 14.stats4)" -eq 4 ] && [ "$(sval gray_shards 14.stats4)" -eq 4 ] || exit 101
+grep -E '^((white|black|gray)_hits_|gray_count=)' < ./14.stats0 > ./14.x
+grep -E '^((white|black|gray)_hits_|gray_count=)' < ./14.stats4 > ./14.y
+cmp -s ./14.x ./14.y || exit 101
+[ -n "$REDIR" ] || echo ok 14.3
+
+# Lists larger than twice the chunk minimum are parsed in parallel; chunks must not split escaped lines
+awk 'BEGIN{
+	for(i = 0; i < 16000; ++i){
+		printf "# Comment %d, entries span lines\n", i
+		printf "  d%d.\\\n\texample.com\n", i
+		printf "10.%d.\\\n%d.0/24\n", i % 256, int(i / 256)
+		if(i % 7 == 0)
+			printf "\n\t# Comment continues\\\n.gone%d.org\n.s%d.example\\\n.org\n", i, i
+	}
+}' > ./14.ab
+[ "$(wc -c < ./14.ab)" -gt $((256 * 1024 * 2)) ] || exit 101
+for t in 1 4; do
+	eval $PGX --test-mode --server-threads=$t -424 -A 14.ab -B 14.ab > ./14.ab$t $REDIR
+	[ $? -eq 0 ] || exit 101
+done
+grep -q '^allow \.s7\.example\.org$' ./14.ab1 && ! grep -q gone ./14.ab1 || exit 101
+sed '/^server-threads /d' < ./14.ab1 > ./14.x
+sed '/^server-threads /d' < ./14.ab4 > ./14.y
+cmp -s ./14.x ./14.y || exit 101
+[ -n "$REDIR" ] || echo ok 14.4
+
+# --gray-save-background child only writes, and skips expired entries (reproducible mode: minutes are seconds);
+# workers go on serving meanwhile, shutdown reaps it
+rm -rf 14.bg
+mkdir 14.bg || exit 101
+{ cat 14.rc-base; echo store-path=$apwd/14.bg; echo server-threads 4; echo gray-save-background;
+	echo delay-max 2; echo gc-timeout 4; } > ./14.rcbg
+q() {
+	printf 'recipient=x@y\nsender=y@z\nclient_address=%s\nclient_name=xy\n\n' $1 | eval $PG -R $apwd/14.rcbg $REDIR
+}
+eval $PG -R $apwd/14.rcbg --startup $REDIR
+[ $? -eq 0 ] || exit 101
+q 10.14.1.1 > ./14.bg1
+xsleep 2
+q 10.14.2.1 >> ./14.bg1
+printf 'action=%s\n\n' "$MSG_DEFER" "$MSG_DEFER" > ./14.x
+cmp -s ./14.bg1 ./14.x || exit 101
+kill -USR2 $(cat 14.bg/*.pid) || exit 101
+for k in 1 2 3 4 5 6 7 8; do
+	eval $PG -R $apwd/14.rcbg < ./14.in$k > ./14.bgo$k $REDIR &
+done
+wait
+delay
+cat ./14.bgo[1-8] > ./14.y
+[ "$(grep -c '^action=' ./14.y)" -eq 48 ] || exit 101
+[ ! -f 14.bg/*.tmp ] && grep -q ' x@y/y@z/10\.14\.2\.0$' 14.bg/*.db && ! grep -q '/10\.14\.1\.0$' 14.bg/*.db ||
+	exit 101
+eval $PG -R $apwd/14.rcbg --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 14.5
+fi
+# }}}
+
+##
+: ${LAZY_MAX:=500000}
+echo '=15: --gray-lazy-load (DB of '$LAZY_MAX' plus journal)=' # {{{
+if [ -n "$s15" ]; then
+	echo 'skipping 15'
+else
+
+rm -rf 15.a 15.b 15.c
+mkdir 15.a 15.b 15.c || exit 101
+cat > ./15.rc-base <<_EOT
+4-mask 24
+count 1
+delay-min 0
+delay-max 5000
+gc-timeout 10000
+limit $((LAZY_MAX * 2))
+limit-delay 0
+msg-defer=$MSG_DEFER
+_EOT
+{ cat 15.rc-base; echo store-path=$apwd/15.a; echo gray-lazy-load defer; } > ./15.rca
+{ cat 15.rc-base; echo store-path=$apwd/15.b; echo gray-lazy-load defer; } > ./15.rcb
+{ cat 15.rc-base; echo store-path=$apwd/15.c; } > ./15.rcc
+
+# Time base (see 9), then accepted entries, the last loaded last; the journal adds J1 and deletes S5
+eval </dev/null $PG -R $apwd/15.rcc $REDIR >/dev/null
+eval $PG -R $apwd/15.rcc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+db=$(cd 15.c && echo *.db)
+start=$(sed '1p;d' 15.c/$db)
+awk -v start=$start -v n=$LAZY_MAX 'BEGIN{
+	print start
+	for(i = 0; i < n; ++i)
+		printf "2147549184 x@y/s%d@z/10.1.1.0\n", i
+}' > 15.c/$db
+printf '+%s 2147549184 x@y/j1@z/10.1.1.0\n-x@y/s5@z/10.1.1.0\n' $start > 15.c/${db%.db}.jnl
+for i in a b; do
+	cp 15.c/$db 15.c/${db%.db}.jnl 15.$i/ || exit 101
+done
+[ -n "$REDIR" ] || echo ok 15.0
+
+q() {
+	printf 'recipient=x@y\nsender=%s@z\nclient_address=10.1.1.1\nclient_name=xy\n\n' $1 |
+		eval $PG -R $apwd/15.rca $REDIR
+}
+loaded() {
+	j=0
+	while [ $j -lt 100 ]; do
+		eval $PG -R $apwd/15.rc$1 --stats > ./15.st $REDIR || exit 101
+		[ "$(sval gray_loading 15.st)" -eq 0 ] && return
+		sdelay
+		j=$((j + 1))
+	done
+	exit 101
+}
+
+# While loading: journal hits pass, misses are deferred but not created
+eval $PG -R $apwd/15.rca --startup $REDIR
+[ $? -eq 0 ] || exit 101
+{ q j1; q m1; } > ./15.1
+eval $PG -R $apwd/15.rca --stats > ./15.st $REDIR
+printf 'action=DUNNO\n\naction=%s\n\n' "$MSG_DEFER" > ./15.x
+if [ "$(sval gray_loading 15.st)" -ne 1 ]; then
+	echo 'skipping 15.1, due to speed the DB was loaded already'
+else
+	cmp -s ./15.1 ./15.x || exit 101
+	[ -n "$REDIR" ] || echo ok 15.1
+fi
+
+# Loaded: journal deletion won, the last entry is known, the miss is new
+loaded a
+{ q s5; q s$((LAZY_MAX - 1)); q m1; q m1; } > ./15.2
+printf 'action=%s\n\naction=DUNNO\n\naction=%s\n\naction=DUNNO\n\n' "$MSG_DEFER" "$MSG_DEFER" > ./15.x
+cmp -s ./15.2 ./15.x || exit 101
+[ -n "$REDIR" ] || echo ok 15.2
+eval $PG -R $apwd/15.rca --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+
+# Untouched, the lazily loaded DB saves like a normally loaded one (entry states and keys; times differ)
+for i in b c; do
+	eval $PG -R $apwd/15.rc$i --startup $REDIR
+	[ $? -eq 0 ] || exit 101
+	loaded $i
+	eval $PG -R $apwd/15.rc$i --shutdown $REDIR
+	[ $? -eq 0 ] || exit 101
+	[ ! -s 15.$i/${db%.db}.jnl ] || exit 101
+	awk 'NR > 1 {printf "%d %s\n", int($1 / 65536), $2}' < 15.$i/$db | sort > ./15.$i.db
+done
+[ "$(wc -l < ./15.b.db)" -eq $LAZY_MAX ] && ! grep -q '/s5@' ./15.b.db || exit 101
+cmp -s ./15.b.db ./15.c.db || exit 101
+[ -n "$REDIR" ] || echo ok 15.3
+fi
+# }}}
+
+##
+echo '=16: clients answer themselves (--client-cache, --gray-shared)=' # {{{
+if [ -n "$s16" ]; then
+	echo 'skipping 16'
+else
+
+eval $PGX -# --client-cache=301 > /dev/null 2>&1 && exit 101
+eval $PGX -# --client-cache=300 > ./16.0 $REDIR || exit 101
+grep -q '^client-cache 300$' ./16.0 || exit 101
+[ -n "$REDIR" ] || echo ok 16.0
+
+rm -rf 16.s
+mkdir 16.s || exit 101
+cat > ./16.rc <<_EOT
+4-mask 24
+count 1
+delay-min 0
+delay-max 100
+gc-timeout 200
+allow-file=$apwd/x.a1
+block-file=$apwd/x.a2
+msg-allow=$MSG_ALLOW
+msg-block=$MSG_BLOCK
+msg-defer=$MSG_DEFER
+store-path=$apwd/16.s
+_EOT
+
+# Each request in a batch of its own: allowed, blocked, and a gray triple (deferred, passed), each repeated
+cc() {
+	for ca in 127.0.0.1 127.0.0.1 193.92.150.243 193.92.150.243 10.1.$1.1 10.1.$1.1 10.1.$1.1; do
+		printf 'recipient=x@y\nsender=y@z\nclient_address=%s\nclient_name=xy\n\n' $ca
+		delay
+	done | eval $PG -R $apwd/16.rc $2 $REDIR
+}
+printf 'action=%s\n\n' "$MSG_ALLOW" "$MSG_ALLOW" "$MSG_BLOCK" "$MSG_BLOCK" "$MSG_DEFER" DUNNO DUNNO > ./16.x
+
+eval $PG -R $apwd/16.rc --startup $REDIR
+[ $? -eq 0 ] || exit 101
+
+cc 1 > ./16.1
+cmp -s ./16.1 ./16.x || exit 101
+sdelay
+eval $PG -R $apwd/16.rc --stats > ./16.st1 $REDIR || exit 101
+[ "$(sval client_hits_allow 16.st1)" -eq 0 ] && [ "$(sval client_hits_block 16.st1)" -eq 0 ] &&
+	[ "$(sval client_hits_pass 16.st1)" -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 16.1
+
+# The repetitions are answered by the client, and reported upon exit
+cc 2 --client-cache=60 > ./16.2
+cmp -s ./16.2 ./16.x || exit 101
+sdelay
+eval $PG -R $apwd/16.rc --stats > ./16.st2 $REDIR || exit 101
+[ "$(sval client_hits_allow 16.st2)" -eq 1 ] && [ "$(sval client_hits_block 16.st2)" -eq 1 ] &&
+	[ "$(sval client_hits_pass 16.st2)" -eq 1 ] || exit 101
+[ "$(sval gray_hits_pass 16.st2)" -eq "$(($(sval gray_hits_pass 16.st1) + 1))" ] || exit 101
+[ -n "$REDIR" ] || echo ok 16.2
+
+eval $PG -R $apwd/16.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+
+# --gray-shared: a triple accepted by the server passes another client without asking it
+rm -rf 16.t
+mkdir 16.t || exit 101
+{ sed -e '/^store-path/d' < 16.rc; echo store-path=$apwd/16.t; echo gray-shared; echo gray-shared-time 3; } \
+	> ./16.rcs
+eval $PG -R $apwd/16.rcs --startup $REDIR
+[ $? -eq 0 ] || exit 101
+if [ ! -f 16.t/*.shm ]; then
+	echo 'skipping 16.3: no --gray-shared support'
+else
+	for i in 1 2; do
+		printf 'recipient=x@y\nsender=y@z\nclient_address=10.1.3.1\nclient_name=xy\n\n'
+		delay
+	done | eval $PG -R $apwd/16.rcs > ./16.3 $REDIR
+	printf 'action=%s\n\n' "$MSG_DEFER" DUNNO > ./16.x
+	cmp -s ./16.3 ./16.x || exit 101
+	sdelay
+	eval $PG -R $apwd/16.rcs --stats > ./16.st3 $REDIR || exit 101
+
+	printf 'recipient=x@y\nsender=y@z\nclient_address=10.1.3.1\nclient_name=xy\n\n' |
+		eval $PG -R $apwd/16.rcs > ./16.4 $REDIR
+	printf 'action=DUNNO\n\n' > ./16.x
+	cmp -s ./16.4 ./16.x || exit 101
+	sdelay
+	eval $PG -R $apwd/16.rcs --stats > ./16.st4 $REDIR || exit 101
+	[ "$(sval client_hits_pass 16.st4)" -eq "$(($(sval client_hits_pass 16.st3) + 1))" ] || exit 101
+	grep '^gray_hits_' < ./16.st3 > ./16.x
+	grep '^gray_hits_' < ./16.st4 > ./16.y
+	cmp -s ./16.x ./16.y || exit 101
+	[ -n "$REDIR" ] || echo ok 16.3
+
+	# After --gray-shared-time the server is asked again
+	xsleep 3
+	printf 'recipient=x@y\nsender=y@z\nclient_address=10.1.3.1\nclient_name=xy\n\n' |
+		eval $PG -R $apwd/16.rcs > ./16.5 $REDIR
+	cmp -s ./16.4 ./16.5 || exit 101
+	sdelay
+	eval $PG -R $apwd/16.rcs --stats > ./16.st5 $REDIR || exit 101
+	[ "$(sval client_hits_pass 16.st5)" -eq "$(sval client_hits_pass 16.st4)" ] &&
+		[ "$(sval gray_hits_pass 16.st5)" -eq "$(($(sval gray_hits_pass 16.st4) + 1))" ] || exit 101
+	[ -n "$REDIR" ] || echo ok 16.4
+fi
+eval $PG -R $apwd/16.rcs --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+fi
+# }}}
+
+##
+echo '=17: event loop (more clients than --server-queue, signals while serving)=' # {{{
+if [ -n "$s17" ]; then
+	echo 'skipping 17'
+else
+
+rm -rf 17.s
+mkdir 17.s || exit 101
+cat > ./17.rc <<_EOT
+4-mask 24
+count 1
+delay-min 0
+delay-max 100
+gc-timeout 200
+server-queue 16
+allow-file=$apwd/x.a1
+block-file=$apwd/x.a2
+msg-allow=$MSG_ALLOW
+msg-block=$MSG_BLOCK
+msg-defer=$MSG_DEFER
+store-path=$apwd/17.s
+_EOT
+
+# Clients keep their connections open over requests, so that accept(2) is suspended and resumed
+k=0
+while [ $k -lt 32 ]; do
+	k=$((k + 1))
+	for ca in 127.0.0.1 193.92.150.243 127.2.$k.1; do
+		printf 'recipient=x@y\nsender=y@z\nclient_address=%s\nclient_name=xy\n\n' $ca
+	done > ./17.in$k
+done
+printf 'action=%s\n\n' "$MSG_ALLOW" "$MSG_BLOCK" "$MSG_DEFER" > ./17.x
+
+eval $PG -R $apwd/17.rc --startup $REDIR
+[ $? -eq 0 ] || exit 101
+spid=$(cat 17.s/*.pid)
+
+k=0
+while [ $k -lt 32 ]; do
+	k=$((k + 1))
+	{
+		while read -r l; do
+			printf '%s\n' "$l"
+			[ -n "$l" ] || delay
+		done < ./17.in$k
+	} | eval $PG -R $apwd/17.rc > ./17.out$k $REDIR &
+done
+delay
+kill -USR1 $spid || exit 101
+kill -HUP $spid || exit 101
+wait
+
+k=0
+while [ $k -lt 32 ]; do
+	k=$((k + 1))
+	cmp -s ./17.out$k ./17.x || exit 101
+done
+[ -n "$REDIR" ] || echo ok 17.1
+
+eval $PG -R $apwd/17.rc --stats > ./17.st $REDIR || exit 101
+[ "$(sval gray_hits_new 17.st)" -eq 32 ] && [ "$(sval gray_count 17.st)" -eq 32 ] || exit 101
+eval $PG -R $apwd/17.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 17.2
+fi
+# }}}
+
+##
+echo '=18: CIDR allow and block ranges (boundaries, nesting, IPv6)=' # {{{
+if [ -n "$s18" ]; then
+	echo 'skipping 18'
+else
+
+rm -rf 18.s
+mkdir 18.s || exit 101
+cat > ./18.rc <<_EOT
+4-mask 32
+6-mask 128
+allow-file=$apwd/x.a1
+block-file=$apwd/x.a2
+block 10.0.0.0/8
+allow 10.20.30.0/24
+block 10.20.30.128/25
+allow 2001:db8::/32
+block 2001:db8:1::/48
+msg-allow=$MSG_ALLOW
+msg-block=$MSG_BLOCK
+msg-defer=$MSG_DEFER
+store-path=$apwd/18.s
+_EOT
+
+# Address and expected answer: a(llow), b(lock), g(ray)
+cat > ./18.t <<'_EOT'
+193.92.150.0 b
+193.92.150.255 b
+193.92.151.0 g
+193.92.149.255 g
+193.95.150.96 b
+193.95.150.111 b
+193.95.150.95 g
+193.95.150.112 g
+195.90.108.0 b
+195.90.111.255 b
+195.90.107.255 g
+195.90.112.99 b
+195.90.112.98 g
+195.90.112.100 g
+10.1.2.3 b
+10.255.255.255 b
+11.0.0.0 g
+9.255.255.255 g
+10.20.30.0 a
+10.20.30.200 a
+10.20.31.0 b
+2a03:2880:20:4f00:: a
+2a03:2880:20:4fff:ffff:ffff:ffff:ffff a
+2a03:2880:20:5000:: g
+2a03:2880:20:4eff:ffff:ffff:ffff:ffff g
+2a03:2880:20:6f06:c000:: a
+2a03:2880:20:6f06:ffff:ffff:ffff:ffff a
+2a03:2880:20:6f06:bfff:ffff:ffff:ffff g
+2a03:2880:20:8f06:face:b00c:0:14 a
+2a03:2880:20:8f06:face:b00c:0:15 g
+2a03:2880:33:5f06:: b
+2a03:2880:33:5f06::1 g
+2001:db8:ffff:ffff:ffff:ffff:ffff:ffff a
+2001:db8:1:: a
+2001:db9:: g
+_EOT
+while read -r ca a; do
+	printf 'recipient=x@y\nsender=y@z\nclient_address=%s\nclient_name=xy\n\n' $ca >> ./18.in
+	case $a in
+	a) printf 'action=%s\n\n' "$MSG_ALLOW";;
+	b) printf 'action=%s\n\n' "$MSG_BLOCK";;
+	*) printf 'action=%s\n\n' "$MSG_DEFER";;
+	esac
+done < ./18.t > ./18.x
+
+eval $PG -R $apwd/18.rc --startup $REDIR
+[ $? -eq 0 ] || exit 101
+eval $PG -R $apwd/18.rc < ./18.in > ./18.1 $REDIR
+cmp -s ./18.1 ./18.x || exit 101
+[ -n "$REDIR" ] || echo ok 18.1
+
+# The ranges are found by the fuzzy (non-exact) search
+eval $PG -R $apwd/18.rc --stats > ./18.st $REDIR || exit 101
+[ "$(sval white_hits_ca_fuzzy 18.st)" -ge 8 ] && [ "$(sval black_hits_ca_fuzzy 18.st)" -ge 9 ] || exit 101
+eval $PG -R $apwd/18.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 18.2
+fi
+# }}}
+
+##
+echo '=19: client_name allow and block (exact, domain and subdomains)=' # {{{
+if [ -n "$s19" ]; then
+	echo 'skipping 19'
+else
+
+rm -rf 19.s
+mkdir 19.s || exit 101
+cat > ./19.rc <<_EOT
+4-mask 24
+allow-file=$apwd/x.a1
+block-file=$apwd/x.a2
+allow .good.example.net
+block .example.net
+block bad.example.org
+msg-allow=$MSG_ALLOW
+msg-block=$MSG_BLOCK
+msg-defer=$MSG_DEFER
+store-path=$apwd/19.s
+_EOT
+
+# Name and expected answer: a(llow), b(lock), g(ray)
+cat > ./19.t <<'_EOT'
+exact.match a
+also.exact.match a
+sub.exact.match g
+xexact.match g
+exact g
+d.a.s a
+a.b.c.d.a.s a
+xd.a.s g
+a.s g
+domain.and.subdomain a
+x.domain.and.subdomain a
+good.example.net a
+x.good.example.net a
+xgood.example.net b
+example.net b
+a.b.example.net b
+example.net.org g
+net g
+bad.example.org b
+x.bad.example.org g
+unknown g
+_EOT
+i=0
+while read -r cn a; do
+	i=$((i + 1))
+	printf 'recipient=x@y\nsender=y@z\nclient_address=10.3.%s.1\nclient_name=%s\n\n' $i $cn >> ./19.in
+	case $a in
+	a) printf 'action=%s\n\n' "$MSG_ALLOW";;
+	b) printf 'action=%s\n\n' "$MSG_BLOCK";;
+	*) printf 'action=%s\n\n' "$MSG_DEFER";;
+	esac
+done < ./19.t > ./19.x
+
+eval $PG -R $apwd/19.rc --startup $REDIR
+[ $? -eq 0 ] || exit 101
+eval $PG -R $apwd/19.rc < ./19.in > ./19.1 $REDIR
+cmp -s ./19.1 ./19.x || exit 101
+eval $PG -R $apwd/19.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 19.1
+fi
+# }}}
+
+##
+echo '=20: pipelined requests (batches answered in order)=' # {{{
+if [ -n "$s20" ]; then
+	echo 'skipping 20'
+else
+
+rm -rf 20.s
+mkdir 20.s || exit 101
+cat > ./20.rc <<_EOT
+4-mask 24
+count 1
+delay-min 0
+delay-max 100
+gc-timeout 200
+allow-file=$apwd/x.a1
+block-file=$apwd/x.a2
+msg-allow=$MSG_ALLOW
+msg-block=$MSG_BLOCK
+msg-defer=$MSG_DEFER
+store-path=$apwd/20.s
+_EOT
+
+# 50 requests (more than a batch) at once: allowed, blocked, a new triple, and it again (within the batch)
+: > ./20.in
+: > ./20.x
+i=0
+while [ $i -lt 50 ]; do
+	case $((i % 4)) in
+	0) ca=127.0.0.1 a=$MSG_ALLOW;;
+	1) ca=193.92.150.243 a=$MSG_BLOCK;;
+	2) ca=10.4.$i.1 a=$MSG_DEFER;;
+	*) ca=10.4.$((i - 1)).1 a=DUNNO;;
+	esac
+	printf 'recipient=x@y\nsender=y@z\nclient_address=%s\nclient_name=xy\n\n' $ca >> ./20.in
+	printf 'action=%s\n\n' "$a" >> ./20.x
+	i=$((i + 1))
+done
+
+eval $PG -R $apwd/20.rc --startup $REDIR
+[ $? -eq 0 ] || exit 101
+eval $PG -R $apwd/20.rc < ./20.in > ./20.1 $REDIR
+cmp -s ./20.1 ./20.x || exit 101
+[ -n "$REDIR" ] || echo ok 20.1
+
+# Concurrent pipelining clients do not get each others answers
+for i in 1 2 3 4; do
+	sed -e "s/^client_address=10\.4\./client_address=10.$((4 + i))./" < ./20.in > ./20.in$i
+	eval $PG -R $apwd/20.rc < ./20.in$i > ./20.2.$i $REDIR &
+done
+wait
+for i in 1 2 3 4; do
+	cmp -s ./20.2.$i ./20.x || exit 101
+done
+eval $PG -R $apwd/20.rc --stats > ./20.st $REDIR || exit 101
+[ "$(sval gray_hits_new 20.st)" -eq 60 ] || exit 101
+eval $PG -R $apwd/20.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 20.2
+fi
+# }}}
+
+##
+echo '=21: --gray-fingerprint (conversion, save and load round trip)=' # {{{
+if [ -n "$s21" ]; then
+	echo 'skipping 21'
+else
+
+rm -rf 21.d 21.f 21.g
+mkdir 21.d 21.f 21.g || exit 101
+cat > ./21.rc-base <<_EOT
+4-mask 24
+count 2
+delay-min 0
+delay-max 100
+gc-timeout 200
+msg-defer=$MSG_DEFER
+_EOT
+{ cat 21.rc-base; echo store-path=$apwd/21.d; } > ./21.rcd
+{ cat 21.rc-base; echo store-path=$apwd/21.f; echo gray-fingerprint; } > ./21.rcf
+{ cat 21.rc-base; echo store-path=$apwd/21.g; } > ./21.rcg
+
+# Triples in all states: accepted, counted once, counted twice
+q() {
+	for ca in "$@"; do
+		printf 'recipient=x@y\nsender=y@z\nclient_address=10.9.%s.1\nclient_name=xy\n\n' $ca
+	done
+}
+q 1 1 1 1 2 3 3 > ./21.in1
+q 1 2 3 4 1 2 3 4 > ./21.in2
+
+run() {
+	eval $PG -R $apwd/21.rc$1 --startup $REDIR
+	[ $? -eq 0 ] || exit 101
+	[ -z "$2" ] || eval $PG -R $apwd/21.rc$1 < ./21.in$2 > ./21.out$1$2 $REDIR
+	eval $PG -R $apwd/21.rc$1 --stats > ./21.st$1 $REDIR || exit 101
+	eval $PG -R $apwd/21.rc$1 --shutdown $REDIR
+	[ $? -eq 0 ] || exit 101
+}
+
+# A dictionary DB is converted upon load, and saved as fingerprints
+run d 1
+cp 21.d/*.db 21.f/ || exit 101
+run f
+[ "$(sval gray_count 21.stf)" -eq 3 ] || exit 101
+[ -n "$REDIR" ] || echo ok 21.1
+
+# The fingerprint DB continues where the dictionary one is
+run f 2
+run d 2
+cmp -s ./21.outf2 ./21.outd2 || exit 101
+[ "$(sed -n 1p ./21.outd2)" = 'action=DUNNO' ] || exit 101
+[ "$(sval gray_count 21.stf)" -eq "$(sval gray_count 21.std)" ] || exit 101
+[ -n "$REDIR" ] || echo ok 21.2
+
+# A fingerprint DB is skipped without the option
+cp 21.f/*.db 21.g/ || exit 101
+run g
+[ "$(sval gray_count 21.stg)" -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 21.3
+fi
+# }}}
+
+##
+echo '=22: gray expiry via timing wheel sweeps (slow: needs sleeping)=' # {{{
+if [ -n "$s22" ]; then
+	echo 'skipping 22'
+else
+
+rm -rf 22.s
+mkdir 22.s || exit 101
+cat > ./22.rc <<_EOT
+4-mask 24
+count 1
+delay-min 0
+delay-max 3
+gc-timeout 4
+msg-defer=$MSG_DEFER
+store-path=$apwd/22.s
+_EOT
+
+# Group A is left alone, group B is used every other second; (reproducible mode: minutes are seconds)
+q() {
+	i=$1
+	while [ $i -le $2 ]; do
+		printf 'recipient=x@y\nsender=y@z\nclient_address=10.10.%s.1\nclient_name=xy\n\n' $i
+		i=$((i + 1))
+	done | eval $PG -R $apwd/22.rc $REDIR
+}
+ans() {
+	i=0
+	while [ $i -lt $2 ]; do
+		printf 'action=%s\n\n' "$1"
+		i=$((i + 1))
+	done
+}
+ans "$MSG_DEFER" 20 > ./22.x20
+ans "$MSG_DEFER" 10 > ./22.x10
+ans DUNNO 10 > ./22.y10
+
+eval $PG -R $apwd/22.rc --startup $REDIR
+[ $? -eq 0 ] || exit 101
+q 1 20 > ./22.1
+cmp -s ./22.1 ./22.x20 || exit 101
+for j in 1 2 3; do
+	xsleep 2
+	q 11 20 > ./22.1
+	cmp -s ./22.1 ./22.y10 || exit 101
+done
+[ -n "$REDIR" ] || echo ok 22.1
+
+# Sweeps remove the expired entries without a full GC (or a request for them)
+j=0
+while :; do
+	eval $PG -R $apwd/22.rc --stats > ./22.st $REDIR || exit 101
+	[ "$(sval gray_count 22.st)" -eq 10 ] && break
+	j=$((j + 1))
+	[ $j -lt 10 ] || exit 101
+	q 11 20 > ./22.1
+	cmp -s ./22.1 ./22.y10 || exit 101
+	sdelay
+done
+[ -n "$REDIR" ] || echo ok 22.2
+
+q 1 10 > ./22.3
+cmp -s ./22.3 ./22.x10 || exit 101
+q 11 20 > ./22.3
+cmp -s ./22.3 ./22.y10 || exit 101
+eval $PG -R $apwd/22.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 22.3
+fi
+# }}}
+
+##
+echo '=23: --stats (keys and counters)=' # {{{
+if [ -n "$s23" ]; then
+	echo 'skipping 23'
+else
+
+rm -rf 23.s
+mkdir 23.s || exit 101
+cat > ./23.rc <<_EOT
+4-mask 24
+count 1
+delay-min 1
+delay-max 100
+gc-timeout 200
+server-queue 20
+allow-file=$apwd/x.a1
+block-file=$apwd/x.a2
+msg-allow=$MSG_ALLOW
+msg-block=$MSG_BLOCK
+msg-defer=$MSG_DEFER
+store-path=$apwd/23.s
+_EOT
+
+eval $PG -R $apwd/23.rc --stats $REDIR >/dev/null
+[ $? -eq 75 ] || exit 101
+[ -n "$REDIR" ] || echo ok 23.0
+
+q() {
+	printf 'recipient=x@y\nsender=y@z\nclient_address=%s\nclient_name=xy\n\n' $1 | eval $PG -R $apwd/23.rc $REDIR
+}
+eval $PG -R $apwd/23.rc --startup $REDIR
+[ $? -eq 0 ] || exit 101
+{ q 127.0.0.1; q 193.92.150.243; q 10.11.1.1; q 10.11.1.1; xsleep 1; q 10.11.1.1; } > ./23.1
+printf 'action=%s\n\n' "$MSG_ALLOW" "$MSG_BLOCK" "$MSG_DEFER" "$MSG_DEFER" DUNNO > ./23.x
+cmp -s ./23.1 ./23.x || exit 101
+kill -USR2 $(cat 23.s/*.pid) || exit 101
+delay
+eval $PG -R $apwd/23.rc --stats > ./23.st $REDIR || exit 101
+
+# Only numeric key=value lines, each key once
+grep -qvE '^[a-z0-9_]+=[0-9]+$' ./23.st && exit 101
+[ -z "$(sed 's/=.*$//' < ./23.st | sort | uniq -d)" ] || exit 101
+for k in version clients server_queue server_threads domain_nodes image_size image_domain_nodes \
+		gray_shards gray_count gray_size gray_mem gray_epoch_min gray_loading \
+		gray_hits_new gray_hits_defer gray_hits_pass gray_hits_delay \
+		client_hits_allow client_hits_block client_hits_pass peers peer_sent peer_merged peer_ignored; do
+	grep -q "^$k=" ./23.st || exit 101
+done
+for w in white black; do
+	for k in ca ca_size ca_fuzzy cname image_ca image_ca_fuzzy image_cname \
+			hits_ca hits_ca_fuzzy hits_cname hits_cname_fuzzy; do
+		grep -q "^${w}_$k=" ./23.st || exit 101
+	done
+done
+for h in request_usec maintenance_usec save_usec gray_count gray_mem; do
+	for k in count sum max; do
+		grep -q "^hist_${h}_$k=" ./23.st || exit 101
+	done
+done
+[ -n "$REDIR" ] || echo ok 23.1
+
+# Counters of what was done
+for kv in version=1 server_queue=20 server_threads=0 gray_count=1 gray_loading=0 \
+		white_hits_ca=1 black_hits_ca=1 gray_hits_new=1 gray_hits_defer=2 gray_hits_pass=1 gray_hits_delay=0 \
+		hist_request_usec_count=5 hist_save_usec_count=1; do
+	grep -q "^$kv\$" ./23.st || exit 101
+done
+[ -n "$REDIR" ] || echo ok 23.2
+
+# Histogram buckets are cumulative, the last holds all
+awk -F= '
+	/^hist_.*_count=/ {n = $1; sub(/_count$/, "", n); cnt[n] = $2}
+	/^hist_.*_le_/ {
+		n = $1; sub(/_le_.*$/, "", n)
+		if($2 < last[n]) exit 1
+		last[n] = $2
+	}
+	END {for(n in last) if(last[n] != cnt[n]) exit 1}
+' < ./23.st || exit 101
+eval $PG -R $apwd/23.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 23.3
+fi
+# }}}
+
+##
+echo '=24: --compile-lists and --list-image=' # {{{
+if [ -n "$s24" ]; then
+	echo 'skipping 24'
+else
+
+rm -rf 24.s 24.t
+mkdir 24.s 24.t || exit 101
+cat > ./24.rc-base <<_EOT
+4-mask 32
+6-mask 128
+count 1
+delay-min 0
+delay-max 100
+gc-timeout 200
+msg-allow=$MSG_ALLOW
+msg-block=$MSG_BLOCK
+msg-defer=$MSG_DEFER
+_EOT
+cat > ./24.lists <<_EOT
+allow-file=$apwd/x.a1
+block-file=$apwd/x.a2
+block 10.0.0.0/8
+allow 10.20.30.0/24
+block 10.20.30.128/25
+allow 2001:db8::/32
+block 2001:db8:1::/48
+allow .good.example.net
+block .example.net
+block bad.example.org
+_EOT
+{ cat 24.rc-base 24.lists; echo store-path=$apwd/24.t; } > ./24.rct
+{ cat 24.rc-base; echo store-path=$apwd/24.s; echo list-image=$apwd/24.s/24.img; } > ./24.rci
+
+eval $PG -R $apwd/24.rct --store-path=$apwd/24.s --compile-lists 24.img $REDIR
+[ $? -eq 0 ] && [ -f 24.s/24.img ] && [ ! -f 24.s/24.img.tmp ] || exit 101
+eval $PG -R $apwd/24.rci --test-mode > /dev/null $REDIR || exit 101
+[ -n "$REDIR" ] || echo ok 24.0
+
+# Addresses and names around all list entries
+: > ./24.in
+for ca in 127.0.0.1 127.0.0.2 193.92.150.0 193.92.150.255 193.92.151.0 193.95.150.96 193.95.150.112 \
+		195.90.108.0 195.90.107.255 195.90.112.99 195.90.112.98 10.1.2.3 11.0.0.0 10.20.30.0 10.20.30.200 \
+		10.20.31.0 2a03:2880:20:4fff:ffff:ffff:ffff:ffff 2a03:2880:20:5000:: 2a03:2880:20:6f06:c000:: \
+		2a03:2880:20:6f06:bfff:ffff:ffff:ffff 2a03:2880:20:8f06:face:b00c:0:14 2a03:2880:33:5f06:: \
+		2001:db8:1:: 2001:db9::; do
+	printf 'recipient=x@y\nsender=y@z\nclient_address=%s\nclient_name=xy\n\n' $ca >> ./24.in
+done
+i=0
+for cn in exact.match sub.exact.match d.a.s a.b.c.d.a.s xd.a.s domain.and.subdomain good.example.net \
+		x.good.example.net xgood.example.net example.net bad.example.org x.bad.example.org; do
+	i=$((i + 1))
+	printf 'recipient=x@y\nsender=y@z\nclient_address=192.0.2.%s\nclient_name=%s\n\n' $i $cn >> ./24.in
+done
+
+for i in t i; do
+	eval $PG -R $apwd/24.rc$i --startup $REDIR
+	[ $? -eq 0 ] || exit 101
+	eval $PG -R $apwd/24.rc$i < ./24.in > ./24.out$i $REDIR
+	eval $PG -R $apwd/24.rc$i --stats > ./24.st$i $REDIR || exit 101
+	eval $PG -R $apwd/24.rc$i --shutdown $REDIR
+	[ $? -eq 0 ] || exit 101
+done
+cmp -s ./24.outt ./24.outi || exit 101
+[ "$(grep -c "^action=$MSG_ALLOW\$" ./24.outi)" -ge 10 ] &&
+	[ "$(grep -c "^action=$MSG_BLOCK\$" ./24.outi)" -ge 10 ] || exit 101
+[ "$(sval image_size 24.sti)" -gt 0 ] && [ "$(sval image_size 24.stt)" -eq 0 ] || exit 101
+[ -n "$REDIR" ] || echo ok 24.1
+
+# Corrupt, truncated, or compiled with other masks: rejected
+cp 24.s/24.img 24.s/24.img.orig || exit 101
+printf 'X' | dd of=24.s/24.img bs=1 seek=0 count=1 conv=notrunc 2>/dev/null || exit 101
+eval $PG -R $apwd/24.rci --test-mode > /dev/null 2>&1 && exit 101
+head -c 64 < 24.s/24.img.orig > 24.s/24.img
+eval $PG -R $apwd/24.rci --test-mode > /dev/null 2>&1 && exit 101
+cp 24.s/24.img.orig 24.s/24.img || exit 101
+sed -e 's/^4-mask 32$/4-mask 24/' < ./24.rci > ./24.rcm
+eval $PG -R $apwd/24.rcm --test-mode > /dev/null 2>&1 && exit 101
+eval $PG -R $apwd/24.rci --test-mode > /dev/null $REDIR || exit 101
+[ -n "$REDIR" ] || echo ok 24.2
+
+# Truncation of the image in place does not affect a running server
+rm -f 24.s/*.db 24.s/*.jnl
+eval $PG -R $apwd/24.rci --startup $REDIR
+[ $? -eq 0 ] || exit 101
+: > 24.s/24.img
+eval $PG -R $apwd/24.rci < ./24.in > ./24.outi $REDIR
+x=$?
+eval $PG -R $apwd/24.rci --shutdown $REDIR
+[ $? -eq 0 ] && [ $x -eq 0 ] || exit 101
+cmp -s ./24.outt ./24.outi || exit 101
+[ -n "$REDIR" ] || echo ok 24.3
+fi
+# }}}
+
+##
+echo '=25: server-held --limit-delay answers, SIGHUP list swap while serving=' # {{{
+if [ -n "$s25" ]; then
+	echo 'skipping 25'
+else
+
+rm -rf 25.s
+mkdir 25.s || exit 101
+cat > ./25.rc <<_EOT
+4-mask 32
+count 1
+delay-min 0
+delay-max 100
+gc-timeout 200
+limit-delay 1
+limit-delay-time 1500:3000
+allow-file=$apwd/25.al
+block-file=$apwd/25.bl
+msg-allow=$MSG_ALLOW
+msg-block=$MSG_BLOCK
+msg-defer=$MSG_DEFER
+store-path=$apwd/25.s
+_EOT
+: > ./25.al
+echo 10.25.0.1 > ./25.bl
+
+req() {
+	for ca in "$@"; do
+		printf 'recipient=x@y\nsender=y@z\nclient_address=%s\nclient_name=xy\n\n' $ca
+	done
+}
+
+eval $PG -R $apwd/25.rc --startup $REDIR
+[ $? -eq 0 ] || exit 101
+spid=$(cat 25.s/*.pid)
+
+# The first triple fills --limit-delay, the two of the batch exceed it and are held 1.5 then 3 seconds,
+# whereas a known triple of another client is answered meanwhile
+req 127.1.25.1 | eval $PG -R $apwd/25.rc > ./25.1 $REDIR
+t=$(date +%s)
+req 127.1.25.2 127.1.25.3 | eval $PG -R $apwd/25.rc > ./25.held $REDIR &
+delay
+req 127.1.25.1 | eval $PG -R $apwd/25.rc > ./25.2 $REDIR
+[ -s ./25.held ] && exit 101
+wait
+[ $(($(date +%s) - t)) -ge 4 ] || exit 101
+printf 'action=%s\n\n' "$MSG_DEFER" > ./25.x
+cmp -s ./25.1 ./25.x || exit 101
+printf 'action=DUNNO\n\n' | cmp -s ./25.2 - || exit 101
+printf 'action=%s\n\n' "$MSG_DEFER" "$MSG_DEFER" | cmp -s ./25.held - || exit 101
+eval $PG -R $apwd/25.rc --stats > ./25.st $REDIR || exit 101
+[ "$(sval gray_hits_delay 25.st)" -eq 2 ] || exit 101
+[ -n "$REDIR" ] || echo ok 25.1
+
+# While a client streams requests the lists are swapped; its answers switch once, none is lost
+k=0
+{
+	while [ $k -lt 40 ]; do
+		k=$((k + 1))
+		req 10.25.0.1
+		sdelay
+	done
+} | eval $PG -R $apwd/25.rc > ./25.3 $REDIR &
+delay
+echo 10.25.0.1 > ./25.al
+: > ./25.bl
+kill -HUP $spid || exit 101
+wait
+[ "$(grep -c '^action=' ./25.3)" -eq 40 ] || exit 101
+awk -v b="action=$MSG_BLOCK" -v a="action=$MSG_ALLOW" '
+	/^$/ {next}
+	$0 == b {if(na) bad = 1; ++nb; next}
+	$0 == a {++na; next}
+	{bad = 1}
+	END {exit (bad || !nb || !na)}
+' < ./25.3 || exit 101
+req 10.25.0.1 | eval $PG -R $apwd/25.rc > ./25.4 $REDIR
+printf 'action=%s\n\n' "$MSG_ALLOW" | cmp -s ./25.4 - || exit 101
+[ -n "$REDIR" ] || echo ok 25.2
+
+eval $PG -R $apwd/25.rc --shutdown $REDIR
+[ $? -eq 0 ] || exit 101
+fi
+# }}}
+
+##
+echo '=26: --memory-limit and --memory-limit-delay (long keys)=' # {{{
+if [ -n "$s26" ]; then
+	echo 'skipping 26'
+else
+
+rm -rf 26.a 26.b 26.c
+mkdir 26.a 26.b 26.c || exit 101
+cat > ./26.rc-base <<_EOT
+4-mask 32
+count 1
+delay-min 0
+delay-max 100
+gc-timeout 200
+limit 100000
+limit-delay 0
+limit-delay-time 1
+msg-defer=$MSG_DEFER
+_EOT
+{ cat 26.rc-base; echo store-path=$apwd/26.a; } > ./26.rca
+{ cat 26.rc-base; echo memory-limit 1; echo store-path=$apwd/26.b; } > ./26.rcb
+{ cat 26.rc-base; echo memory-limit-delay 1; echo store-path=$apwd/26.c; } > ./26.rcc
+
+# 4000 new triples with keys of about 500 bytes: more than 1 MiB
+awk 'BEGIN{
+	for(p = ""; length(p) < 200; p = p "long-domain.")
+		;
+	for(i = 0; i < 4000; ++i)
+		printf "recipient=r%059d@%sexample\nsender=s%059d@%sexample\nclient_address=127.26.%d.%d\n" \
+			"client_name=xy\n\n", i, p, i, p, int(i / 250), i % 250
+}' > ./26.in
+
+for i in a b c; do
+	eval $PG -R $apwd/26.rc$i --startup $REDIR
+	[ $? -eq 0 ] || exit 101
+	eval $PG -R $apwd/26.rc$i < ./26.in > ./26.out$i $REDIR
+	eval $PG -R $apwd/26.rc$i --stats > ./26.st$i $REDIR || exit 101
+	eval $PG -R $apwd/26.rc$i --shutdown $REDIR
+	[ $? -eq 0 ] || exit 101
+	[ "$(grep -c '^action=' ./26.out$i)" -eq 4000 ] || exit 101
+done
+
+# Unlimited: all entries exist, and need more than 1 MiB
+ca=$(sval gray_count 26.sta) ma=$(sval gray_mem 26.sta)
+[ "$ca" -eq 4000 ] && [ "$ma" -gt 1048576 ] || exit 101
+[ "$(grep -c "^action=$MSG_DEFER\$" ./26.outa)" -eq 4000 ] || exit 101
+[ -n "$REDIR" ] || echo ok 26.1
+
+# --memory-limit: the entry limit is lowered to what fits (a quarter of slack for table growth)
+cb=$(sval gray_count 26.stb)
+[ "$cb" -gt 0 ] && [ "$cb" -lt 4000 ] || exit 101
+[ $((cb * ma)) -le $((4000 * 1048576 * 5 / 4)) ] || exit 101
+[ "$(sval gray_mem 26.stb)" -le $((1048576 * 5 / 4)) ] || exit 101
+[ -n "$REDIR" ] || echo ok 26.2
+
+# --memory-limit-delay: entries are still created, but excess answers were held back
+[ "$(sval gray_count 26.stc)" -eq 4000 ] || exit 101
+x=$(sval gray_hits_delay 26.stc)
+[ "$x" -gt 0 ] && [ "$x" -lt 4000 ] || exit 101
+[ "$(grep -c "^action=$MSG_DEFER\$" ./26.outc)" -eq 4000 ] || exit 101
+[ -n "$REDIR" ] || echo ok 26.3
+fi
+# }}}
+
 )
 exit $?
 
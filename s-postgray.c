@@ -25,7 +25,7 @@
  *@   Just extend the DB format to a 64-bit integer, and use bits 32..48.
  *@   (Adding this feature should work with existing DBs.)
  *@
- *@ DB format:
+ *@ DB format (--gray-format=text):
  *@	- line 1: UNIX epoch timestamp: base epoch
  *@	- further: BITMASK DATA-TUPLE
  *@	  + BITMASK:
@@ -34,6 +34,11 @@
  *@		* BIT 0-15 (0x0000FFFF): minutes relative to base epoch when seen last;
  *@		  with gc-timeout==0 S16_MIN means "timed out beyond representability"
  *@	  + DATA TUPLE or TRIPLE: [recipient/]sender/client_address
+ *@ DB format (--gray-format=binary; host byte order):
+ *@	- header (struct a_gray_bin_hdr): magic, byte order mark, version,
+ *@	  base epoch, record count, arena length, checksums of records and arena
+ *@	- records (struct a_gray_bin_rec): BITMASK, offset of DATA in arena
+ *@	- arena: NUL terminated DATA
  */
 #define a_VERSION "0.8.4"
 #define a_CONTACT "Steffen Nurpmeso <steffen@sdaoden.eu>"
@@ -62,6 +67,9 @@
 /* Maximum accept(2) backlog */
 #define a_SERVER_LISTEN (VAL_SERVER_QUEUE / 2)
 
+/* Maximum --server-threads (each has a gray DB shard, event set and pipe) */
+#define a_SERVER_THREADS_MAX 256
+
 /**/
 
 /* Maximum size of the triple recipient/sender/client_address we look out for,
@@ -86,8 +94,12 @@
 #define a_MSG_DEFER "DEFER_IF_PERMIT 4.2.0 Service RFC 6647 greylisted you"
 #define a_MSG_NODEFER "DUNNO"
 
-/* When hitting limit, new entries are delayed that long */
-#define a_LIMIT_DELAY_SECS 1 /* xxx configurable? */
+/* When hitting limit, new entries are delayed that long (--limit-delay-time default) */
+#define a_LIMIT_DELAY_MSECS 1000
+
+/* --allow/--block files of at least two times this size are parsed in parallel by --server-threads (at most) threads
+ * in chunks of at least this size, when not sandboxed (server startup, --test-mode, --compile-lists) */
+#define a_CONF_AB_PAR_MIN (256u * 1024)
 
 /**/
 #define a_OPENLOG_FLAGS (LOG_NDELAY)
@@ -171,25 +183,89 @@
 # endif
 #endif
 
+/* --gray-shared: client reads of server written memory are lock-free (seqlock), that needs atomics, as do threads */
+#undef a_HAVE_ATOMICS
+#undef a_HAVE_GRAY_SHM
+#if defined __clang__ || (defined __GNUC__ && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)))
+# define a_HAVE_ATOMICS
+# define a_HAVE_GRAY_SHM
+# define a_SHM_LOAD(P) __atomic_load_n(P, __ATOMIC_ACQUIRE)
+# define a_SHM_LOAD_RLX(P) __atomic_load_n(P, __ATOMIC_RELAXED)
+# define a_SHM_STORE(P,V) __atomic_store_n(P, V, __ATOMIC_RELEASE)
+# define a_SHM_STORE_RLX(P,V) __atomic_store_n(P, V, __ATOMIC_RELAXED)
+# define a_SHM_CAS(P,O,N) __atomic_compare_exchange_n(P, O, N, FAL0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+# define a_SHM_FENCE_ACQ() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+/* Threaded server (--server-threads) requires a thread-safe SU */
+#undef a_HAVE_MT
+#if VAL_MT > 0
+# ifndef su_HAVE_MT
+#  warning SU library not configured with su_HAVE_MT, turning off server threads
+# elif !defined a_HAVE_ATOMICS
+#  warning Compiler lacks atomic builtins, turning off server threads
+# elif VAL_OS_SANDBOX > 0 && su_OS_LINUX && (!defined __NR_seccomp || !defined SECCOMP_FILTER_FLAG_TSYNC)
+#  warning seccomp(2) cannot synchronize threads, turning off server threads
+# else
+#  define a_HAVE_MT
+# endif
+#endif
+#ifdef a_HAVE_MT
+# define a_MT(X) X
+#else
+# define a_MT(X)
+#endif
+
+/* Set by signal handler and server threads */
+#ifdef a_HAVE_MT
+# define a_SERVER_TERM() __atomic_load_n(&a_server_term, __ATOMIC_ACQUIRE)
+# define a_SERVER_TERM_SET() __atomic_store_n(&a_server_term, TRU1, __ATOMIC_RELEASE)
+#else
+# define a_SERVER_TERM() (a_server_term)
+# define a_SERVER_TERM_SET() (a_server_term = TRU1)
+#endif
+
+/* Server readiness notification backend (else pselect(2)) */
+#undef a_HAVE_EV_EPOLL
+#undef a_HAVE_EV_KQUEUE
+#if su_OS_LINUX
+# define a_HAVE_EV_EPOLL
+#elif su_OS_DRAGONFLY || su_OS_FREEBSD || su_OS_NETBSD || su_OS_OPENBSD
+# define a_HAVE_EV_KQUEUE
+#endif
+
 /* TODO all std or posix, nono */
 #include <sys/file.h>
 #include <sys/mman.h>
+#ifdef a_HAVE_EV_EPOLL
+# include <sys/epoll.h>
+#elif defined a_HAVE_EV_KQUEUE
+# include <sys/types.h>
+# include <sys/event.h>
+# include <sys/time.h>
+#endif
 #include <sys/resource.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
 #include <fcntl.h>
+#ifdef a_HAVE_MT
+# include <errno.h>
+# include <pthread.h>
+#endif
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h> /* XXX fmtcodec, then all *printf -> unroll! */
 #include <stdlib.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <su/avopt.h>
@@ -199,6 +275,7 @@
 #include <su/icodec.h>
 #include <su/mem.h>
 #include <su/path.h>
+#include <su/random.h>
 #include <su/time.h>
 
 #if VAL_OS_SANDBOX > 0
@@ -224,15 +301,70 @@ NSPC_USE(su)
 
 /* Dictionary flags.  No need for _CASE since keys are normalized already.  No _AUTO_SHRINK! */
 #define a_WB_CA_FLAGS (su_CS_DICT_HEAD_RESORT)
-#define a_WB_CNAME_FLAGS (su_CS_DICT_HEAD_RESORT)
 
 /* Gray dictionary; is balanced() after resize; no _ERR_PASS, set later on!
  * Always in FROZEN state to delay resize costs to balance()!
  * MIN_LIMIT is also used to consider whether _this_ balance() is needed */
 #define a_GRAY_FLAGS (su_CS_DICT_HEAD_RESORT | su_CS_DICT_STRONG /*| su_CS_DICT_ERR_PASS*/)
 #define a_GRAY_THRESH 4
+/* --gray-fingerprint open addressing tables: minimum slots, maximum load (7/8) */
+#define a_GRAY_FP_MIN 64u
+#define a_GRAY_FP_LOAD(SZ) ((SZ) - ((SZ) >> 3))
 #define a_GRAY_MIN_LIMIT 1000
+/* Timing wheel of entries by last touch minute: 64 x 1, 64 x 64, 8 x 4096 minutes (covers S16_MAX); its minute
+ * counter starts high enough to stay positive for S16_MIN.  Sweeps expire at most BATCH entries per call */
+#define a_GRAY_WHEEL_SLOTS 64
+#define a_GRAY_WHEEL_L2 8
+#define a_GRAY_WHEEL_BASE (S(s64,1) << 16)
+#define a_GRAY_SWEEP_BATCH 256
 #define a_GRAY_DB_NAME VAL_NAME ".db" /* (len LE REA_NAME!) */
+#define a_GRAY_DB_TMP_NAME VAL_NAME ".tmp" /* Save target, then rename(2)d (len LE REA_NAME!) */
+
+/* Binary gray DB, see top of file; no text DB starts with NUL */
+#define a_GRAY_BIN_MAGIC "\0s-pgdb"
+#define a_GRAY_BIN_BOM 0x01020304u
+#define a_GRAY_BIN_VERSION 1
+#define a_GRAY_BIN_VERSION_FP 2 /* --gray-fingerprint: seed, fingerprints, data words */
+#define a_GRAY_WBUF_SIZE (1u << 16) /* Save output buffer */
+
+/* Append-only gray DB journal, compacted into a snapshot by gray_save() */
+#define a_GRAY_JNL_NAME VAL_NAME ".jnl" /* (len LE REA_NAME!) */
+#define a_GRAY_JNL_OLD_NAME VAL_NAME ".jno" /* Rotated during background save (len LE REA_NAME!) */
+#define a_GRAY_JNL_CKPT_MIN 100000 /* Records until checkpoint: MAX(this, DB entries) */
+
+/* --gray-lazy-load: records (or checksummed bytes of binary DB / 256) loaded per event loop round */
+#define a_GRAY_LAZY_STEP 4096
+
+/* --gray-shared: mapping of answers for accepted triples clients read themselves (see struct a_gray_shm).
+ * Slots: power of two of half --limit, in bounds */
+#define a_GRAY_SHM_NAME VAL_NAME ".shm" /* (len LE REA_NAME!) */
+#define a_GRAY_SHM_MAGIC "\0s-pgsm"
+#define a_GRAY_SHM_VERSION 1
+#define a_GRAY_SHM_MIN (1u << 12)
+#define a_GRAY_SHM_MAX (1u << 22)
+#define a_GRAY_SHM_TIME 60 /* --gray-shared-time default (minutes) */
+
+/* --peer: datagrams of MAGIC, a sequence number (16 hex digits, sender seconds << 20 | counter) plus LF,
+ * gray DB journal records (without time base minutes), and a --peer-key MAC (16 hex digits), sent when the next
+ * record would not fit, and after each event loop round; received ones are merged at most BATCH per round, and
+ * only if the sequence number is larger than the last one of the sender, and within WINDOW_SECS of our clock */
+#define a_PEER_MAGIC "\0s-pgp2" /* (Version number included) */
+#define a_PEER_HDR_SIZE (sizeof(a_PEER_MAGIC) + 16 + 1)
+#define a_PEER_MAC_SIZE 16
+#define a_PEER_DGRAM_SIZE 1400
+#define a_PEER_BATCH 64
+#define a_PEER_WINDOW_SECS 300
+#define a_PEER_KEY_MIN 16 /* --peer-key characters */
+
+/* --compile-lists: image of the white and blacklists (see struct a_lim_hdr), written to TMP_SUF and rename(2)d;
+ * --list-image reads it into private memory and searches it in place */
+#define a_LIM_MAGIC "\0s-pgli"
+#define a_LIM_VERSION 1
+#define a_LIM_TMP_SUF ".tmp"
+
+/* --stats: histogram buckets (values up to 2**39), protocol version of answer */
+#define a_HIST_BUCKETS 40
+#define a_STATS_VERSION 1
 
 /* MIN(sizeof(pg_buf), this) actually used (and never more than 1024-some!) */
 #ifdef a_HAVE_LOG_FIFO
@@ -282,16 +414,21 @@ enum a_flags{
 	a_F_NONE,
 
 	/* Setup: command line option and shared persistent flags */
+	a_F_GRAY_SAVE_BG = 1u<<0, /* --gray-save-background */
 	a_F_MODE_SHUTDOWN = 1u<<1, /* -. (client asks EOT,\0,\0) */
 	a_F_MODE_STARTUP = 1u<<2, /* -@ (client asks ENQ,\0,\0) */
 	a_F_MODE_STATUS = 1u<<3, /* -% */
 	a_F_MODE_TEST = 1u<<4, /* -# */
-	a__F_MODE_MASK = a_F_MODE_SHUTDOWN | a_F_MODE_STARTUP | a_F_MODE_STATUS | a_F_MODE_TEST,
+	a_F_MODE_STATS = 1u<<10, /* --stats (client asks ACK,\0,\0) */
+	a_F_MODE_COMPILE = 1u<<22, /* --compile-lists */
+	a__F_MODE_MASK = a_F_MODE_SHUTDOWN | a_F_MODE_STARTUP | a_F_MODE_STATUS | a_F_MODE_TEST | a_F_MODE_STATS |
+			a_F_MODE_COMPILE,
 
 	a_F_CLIENT_ONCE = 1u<<5, /* -o */
 	a_F_FOCUS_DOMAIN = 1u<<6, /* -F */
 	a_F_FOCUS_SENDER = 1u<<7, /* -f */
 	a_F_UNTAMED = 1u<<8, /* -u */
+	a_F_GRAY_FPRINT = 1u<<9, /* --gray-fingerprint */
 
 	/* */
 	a_F_TEST_ERRORS = 1u<<11,
@@ -311,13 +448,19 @@ enum a_flags{
 	a_F_MASTER_NOMEM_LOGGED = 1u<<19,
 	a_F_MASTER_FLAG = 1u<<20, /* It is the master */
 
+	/* Setup, continued */
+	a_F_GRAY_SHM = 1u<<21, /* --gray-shared */
+	a_F_GRAY_LAZY = 1u<<23, /* --gray-lazy-load */
+
 	/* Modifieable bits */
 	a_F_SETUP_CONST_MASK = (1u<<24) - 1,
 
 	a_F_DELAY_PROGRESSIVE = 1u<<24, /* -p */
 	a_F_GC_LINGER = 1u<<25, /* --gc-linger */
-	a_F_V = 1u<<26, /* -v */
-	a_F_VV = 1u<<27,
+	a_F_GRAY_BINARY = 1u<<26, /* --gray-format=binary */
+	a_F_V = 1u<<27, /* -v */
+	a_F_VV = 1u<<28,
+	a_F_GRAY_LAZY_PASS = 1u<<29, /* --gray-lazy-load=pass */
 	a_F_V_MASK = a_F_V | a_F_VV
 };
 
@@ -335,10 +478,19 @@ enum a_answer{
 	a_ANSWER_NODEFER
 };
 
+#ifdef a_HAVE_MT
+enum a_mt_reload{
+	a_MT_RELOAD_NONE,
+	a_MT_RELOAD_WANT, /* Master asks helper */
+	a_MT_RELOAD_DONE, /* Helper is done, .m_rld_rv */
+	a_MT_RELOAD_EXIT
+};
+#endif
+
 enum a_srch_type{
-	a_SRCH_TYPE_NONE,
 	a_SRCH_TYPE_IPV4,
-	a_SRCH_TYPE_IPV6
+	a_SRCH_TYPE_IPV6,
+	a_SRCH_TYPE__MAX
 };
 
 /* Fuzzy search white/blacklist */
@@ -351,11 +503,148 @@ union a_srch_ip{
 	char const *cp;
 };
 
+/* Client/server request protocol v2: header, then R, S, CA, CNAME, each \0 terminated; answer is one byte.
+ * The header only frames (key hash and address are derived by the server, as for v1).
+ * v1 (the four strings plus a final \0) is still served (mixed-version upgrades), as are the special
+ * ENQ/EOT requests */
+#define a_REQ_MAGIC '\02' /* STX, cannot start a v1 request */
+struct a_req_hdr{
+	u8 rh_magic;
+	u8 rh__pad;
+	u16 rh_r_len; /* (Lengths exclude \0) */
+	u16 rh_s_len;
+	u16 rh_ca_len;
+	u16 rh_cn_len;
+};
+
+/* Requests may be pipelined: the client sends all complete policy blocks it has buffered at once, the server
+ * answers all requests of one read(2) with one write(2), in order */
+#define a_REQ_BATCH 16
+
+/* Answers clients gave themselves (--client-cache, --gray-shared) are reported lazily, after the requests of the
+ * next batch, or before exit; there is no answer */
+#define a_REQ_CNT_MAGIC '\03' /* ETX */
+struct a_req_cnt{
+	u8 rc_magic;
+	u8 rc__pad[3];
+	u32 rc_allow;
+	u32 rc_block;
+	u32 rc_pass;
+};
+
+struct a_client_batch{
+	u32 cb_req_no; /* Requests in .cb_buf */
+	u32 cb_ans_no;
+	uz cb_len; /* Of .cb_buf: requests, then answers for postfix */
+	char const *cb_ans[a_REQ_BATCH]; /* Policy block answers; NIL: by server, in order */
+	u32 cb_req_off[a_REQ_BATCH]; /* Of requests in .cb_buf */
+	struct a_req_cnt cb_cnt; /* Not yet reported (survives batches) */
+	char cb_buf[sizeof(struct a_req_cnt) + a_REQ_BATCH * ALIGN_Z(a_BUF_SIZE)];
+};
+
+/* --client-cache: direct mapped; ALLOW, BLOCK and NODEFER answers of the server, for .pg_client_cache seconds;
+ * list changes (HUP) are not seen meanwhile, therefore it is bound */
+#define a_CLIENT_CACHE_SLOTS 32 /* Power of two */
+#define a_CLIENT_CACHE_MAX 300
+struct a_client_cache{
+	u32 cc_hash; /* a_misc_cksum() of .cc_key */
+	u32 cc_len; /* Of .cc_key; 0: free slot */
+	s64 cc_time; /* CLOCK_MONOTONIC seconds */
+	u8 cc_ans; /* a_answer */
+	char cc_key[a_BUF_SIZE]; /* R/S/CA\0CNAME */
+};
+
+/* a_misc_policy_block() */
+enum a_policy{
+	a_POLICY_EOF, /* Or error (.l_err) */
+	a_POLICY_PROTO, /* Protocol error */
+	a_POLICY_EMPTY, /* Nothing but an empty line */
+	a_POLICY_DUNNO, /* Block of no interest */
+	a_POLICY_TRIPLE /* .pg_r etc. are set */
+};
+
+/* --policy-listen address: socket name in --store-path, or loopback ADDR:PORT; --peer and --peer-listen: any */
+union a_sockaddr{
+	struct sockaddr sa;
+	struct sockaddr_un un;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+};
+
+/* Path-compressed binary (radix) trie node, see __srch_*() */
 struct a_srch{
-	struct a_srch *s_next;
-	BITENUM(u32,a_srch_type) s_type;
-	u32 s_mask; /* CIDR mask */
-	union a_srch_ip s_ip;
+	struct a_srch *s_kid[2]; /* By bit .s_plen of a key */
+	u8 s_plen; /* CIDR mask */
+	boole s_term; /* Entry ends here, otherwise fork node */
+	u8 s__pad[6];
+	u8 s_key[16]; /* Network byte order, bits past .s_plen are zero */
+};
+
+/* client_name= trie of white and blacklist, keyed by reversed domain name (bytes, path-compressed):
+ * see __dom_*() */
+enum a_dom_flags{
+	a_DOM_NONE,
+	a_DOM_ALLOW = 1u<<0, /* Exact */
+	a_DOM_ALLOW_WILD = 1u<<1, /* Plus subdomains */
+	a_DOM_BLOCK = 1u<<2,
+	a_DOM_BLOCK_WILD = 1u<<3
+};
+
+struct a_dom{
+	struct a_dom *d_kid; /* First child */
+	struct a_dom *d_sib; /* Next sibling, sorted by .d_edge[0] */
+	u32 d_len; /* Of .d_edge */
+	BITENUM(u32,a_dom_flags) d_flags; /* Entry ends here if set */
+	char d_edge[su_VFIELD_SIZE(8)]; /* Reversed, not terminated */
+};
+
+/* --compile-lists image: integers in host byte order (.lh_bom), parts 4-byte aligned and addressed by image offset
+ * (0: none), trie nodes only refer to nodes which follow them, and a NUL ends it.  Per list client_address= is an
+ * open addressing table (a_misc_cksum(), linear probing) of string offsets, CIDRs are a_srch tries; client_name=
+ * is one a_dom trie, as in the server.  Addresses were masked with .lh_4_mask and .lh_6_mask */
+struct a_lim_wb{
+	u32 lw_ca; /* Table of .lw_ca_mask+1 string offsets */
+	u32 lw_ca_mask;
+	u32 lw_ca_no;
+	u32 lw_srch[a_SRCH_TYPE__MAX];
+	u32 lw_srch_no;
+	u32 lw_cname_no;
+};
+
+struct a_lim_hdr{
+	char lh_magic[sizeof(a_LIM_MAGIC)];
+	u32 lh_bom; /* a_GRAY_BIN_BOM */
+	u32 lh_version;
+	u32 lh_size; /* Of image */
+	u8 lh_4_mask;
+	u8 lh_6_mask;
+	u8 lh__pad[2];
+	u32 lh_dom;
+	u32 lh_dom_no; /* Trie nodes */
+	struct a_lim_wb lh_wb[2]; /* White, black */
+};
+
+struct a_lim_srch{
+	u32 ls_kid[2];
+	u8 ls_plen;
+	u8 ls_term;
+	u8 ls__pad[2];
+	u8 ls_key[16];
+};
+
+struct a_lim_dom{
+	u32 ld_kid;
+	u32 ld_sib;
+	u32 ld_len; /* Of .ld_edge */
+	u32 ld_flags; /* a_dom_flags */
+	char ld_edge[su_VFIELD_SIZE(4)];
+};
+
+/* a_compile() output buffer (also --allow/--block staging, see struct a_conf_ab_rec) */
+struct a_compile{
+	char *c_buf;
+	uz c_len;
+	uz c_size;
 };
 
 struct a_line{
@@ -367,11 +656,54 @@ struct a_line{
 };
 #define a_LINE_SETUP(LP) do{(LP)->l_curr = (LP)->l_fill = 0;}while(0)
 
+/* a_misc_line_get() with fd -1 reads from memory; overlong lines are then staged (a_CONF_AB_ELONG), not logged */
+struct a_line_mem{
+	struct a_line lm_line; /* (First!) */
+	char const *lm_dat;
+	uz lm_len;
+	struct a_compile *lm_st;
+};
+
+/* --allow/--block: entries are parsed into staging records (possibly in parallel), then applied in order */
+enum a_conf_ab_type{
+	a_CONF_AB_CNAME, /* .cabr_dat: normalized domain */
+	a_CONF_AB_CNAME_WILD, /* ditto, plus subdomains */
+	a_CONF_AB_CA, /* .cabr_dat: address as normalized by the C library */
+	a_CONF_AB_SRCH, /* .cabr_ip/.cabr_mask; .cabr_dat: address (--test-mode) */
+	a_CONF_AB_ELONG, /* .cabr_dat: start of overlong line */
+	a_CONF_AB_WARN, /* .cabr_msg; .cabr_dat: three arguments */
+	a_CONF_AB_ERR /* ditto, entry is bogus */
+};
+
+struct a_conf_ab_rec{
+	char const *cabr_msg;
+	union a_srch_ip cabr_ip;
+	u32 cabr_len; /* Of record, aligned */
+	u32 cabr_mask;
+	u8 cabr_type; /* a_conf_ab_type */
+	boole cabr_v6;
+	u8 cabr__pad[2];
+	char cabr_dat[su_VFIELD_SIZE(0)];
+};
+
+#ifdef a_HAVE_MT
+/* One chunk of a_conf__AB_par() */
+struct a_conf_ab_par{
+	pthread_t cabp_tid;
+	struct a_pg *cabp_pgp;
+	char const *cabp_dat;
+	uz cabp_len;
+	struct a_compile cabp_st;
+	boole cabp_thr; /* Parsed in .cabp_tid (else in order) */
+	u8 cabp__pad[7];
+};
+#endif
+
 struct a_wb{
-	struct a_srch *wb_srch; /* ca list, fuzzy */
-	struct a_srch **wb_srch_tail;
+	struct a_srch *wb_srch[a_SRCH_TYPE__MAX]; /* ca tries, fuzzy */
+	ul wb_srch_cnt;
 	struct su_cs_dict wb_ca; /* client_address=, exact */
-	struct su_cs_dict wb_cname; /* client_name=, exact + fuzzy */
+	ul wb_cname_cnt; /* client_name= entries in .m_dom */
 };
 
 struct a_wb_cnt{
@@ -381,24 +713,281 @@ struct a_wb_cnt{
 	ul wbc_cname_fuzzy;
 };
 
+struct a_gray_bin_hdr{
+	char gbh_magic[sizeof(a_GRAY_BIN_MAGIC)];
+	u32 gbh_bom;
+	u32 gbh_version;
+	s64 gbh_base_epoch;
+	u32 gbh_count;
+	u32 gbh_arena_len;
+	u32 gbh_cksum_rec;
+	u32 gbh_cksum_arena;
+};
+
+struct a_gray_bin_rec{
+	u32 gbr_data;
+	u32 gbr_key_off;
+};
+
+/* Buffered gray DB save output */
+struct a_gray_out{
+	char *go_buf;
+	uz go_len;
+	s32 go_fd;
+	s32 go_err; /* Of the failed write(2), if any */
+	boole go_trunc; /* Stopped near 2GB */
+	u8 go__pad[7];
+	s64 go_epoch; /* Time base of the snapshot (see server__gray_save_data()) */
+};
+
+/* --gray-lazy-load: the journals are replayed first, deletions are remembered, then the snapshot follows, with
+ * entries already present (or deleted) skipped; lookups trust entries once the journals are done, misses not
+ * before the end.  See server__gray_lazy_*() */
+enum a_gray_lazy_state{
+	a_GRAY_LAZY_NONE,
+	a_GRAY_LAZY_JNL, /* Journals in progress: all lookups answered conservatively */
+	a_GRAY_LAZY_DB /* Snapshot in progress: misses answered conservatively */
+};
+
+enum a_gray_lazy_src{
+	a_GRAY_LAZY_SRC_JNO, /* a_GRAY_JNL_OLD_NAME */
+	a_GRAY_LAZY_SRC_JNL,
+	a_GRAY_LAZY_SRC_DB,
+	a_GRAY_LAZY_SRC__MAX
+};
+
+struct a_gray_lazy{
+	char *gl_map[a_GRAY_LAZY_SRC__MAX]; /* Mappings (taken before sandbox), or NIL */
+	u32 gl_len[a_GRAY_LAZY_SRC__MAX];
+	u32 gl_src; /* a_gray_lazy_src in progress */
+	u32 gl_off; /* Offset therein; binary DB: record index */
+	u32 gl_recs; /* Journal records replayed */
+	u32 gl_ck_off; /* Binary DB: bytes checksummed of records, then arena.. */
+	u32 gl_ck_rec; /* ..and their checksums */
+	u32 gl_ck_arena;
+	boole gl_bin; /* DB is binary (header is checked) */
+	boole gl_have_be; /* .gl_base is known */
+	u8 gl__pad[6];
+	s64 gl_base; /* Of DB */
+	struct su_timespec gl_ts; /* Of start */
+	struct su_cs_dict gl_dead; /* Keys the journals deleted */
+};
+
+/* See server__gray_jnl_*() */
+struct a_gray_jnl{
+	char *gj_buf; /* a_GRAY_WBUF_SIZE */
+	uz gj_len;
+	u32 gj_recs; /* Since last checkpoint */
+	u32 gj_ckpt_recs;
+	s32 gj_fd;
+	boole gj_unsynced;
+	boole gj_ckpt_want;
+	boole gj_err_logged;
+	boole gj_jno; /* a_GRAY_JNL_OLD_NAME exists */
+#ifdef a_HAVE_MT
+	pthread_mutex_t gj_mtx;
+#endif
+};
+
+/* --gray-shared: the server stores fingerprints of triple plus client_name which it answered accepted, direct
+ * mapped by the low bits, together with the time of that answer.  Clients pass on requests they find in there
+ * for less than .gs_ttl seconds, without asking; so the server still sees each triple once per half --gc-timeout.
+ * Slots are seqlocks: writers (the server, competing threads skip) make .gss_seq odd while updating, readers
+ * which see it change ask the server.  Configuration reload empties all slots */
+struct a_gray_shm_slot{
+	u32 gss_seq;
+	u32 gss_time; /* Of last answer, UNIX epoch truncated */
+	u64 gss_fp; /* 0: empty */
+};
+
+struct a_gray_shm{
+	char gs_magic[sizeof(a_GRAY_SHM_MAGIC)];
+	u32 gs_bom; /* a_GRAY_BIN_BOM */
+	u32 gs_version;
+	u32 gs_mask; /* Slots -1 */
+	u32 gs_ttl;
+	u64 gs_key[2]; /* SipHash key of fingerprints */
+	struct a_gray_shm_slot gs_slot[su_VFIELD_SIZE(0)];
+};
+
+/* Log-bucketed histogram: .h_bkt[I] counts values of bit width I (0 for 0), the last one also all wider */
+struct a_hist{
+	u64 h_cnt;
+	u64 h_sum;
+	u64 h_max;
+	u64 h_bkt[a_HIST_BUCKETS];
+};
+
+struct a_cnt{
+	struct a_wb_cnt c_white;
+	struct a_wb_cnt c_black;
+	ul c_gray_new;
+	ul c_gray_defer;
+	ul c_gray_pass;
+	ul c_gray_delay; /* --limit-delay excess answers held back */
+	ul c_client_allow; /* Answered by clients themselves */
+	ul c_client_block;
+	ul c_client_pass;
+	ul c_peer_sent; /* Records queued for --peer */
+	ul c_peer_merged;
+	ul c_peer_ignored; /* Older than ours, stale, beyond --limit, or bogus */
+	struct a_hist c_hist_req; /* Service time of requests, microseconds */
+};
+
+/* Entries counted per last touch minute; wheel minute of an entry is .g_wheel_base + nmin, so that updates of the
+ * time base do not move it.  Slots of .gw_l0 cover the current 64 minute block, those of .gw_l1 the blocks of the
+ * current 4096 minute superblock, those of .gw_l2 the superblocks before; older ones (and lingering) are .gw_old */
+struct a_gray_wheel{
+	s64 gw_now;
+	u32 gw_old;
+	u32 gw_l2[a_GRAY_WHEEL_L2];
+	u32 gw_l1[a_GRAY_WHEEL_SLOTS];
+	u32 gw_l0[a_GRAY_WHEEL_SLOTS];
+	u8 gw__pad[4];
+};
+
+/* The gray DB is split in shards (one per --server-threads), keys are distributed by hash */
+struct a_gray{
+	struct su_cs_dict g_dict; /* Unless --gray-fingerprint.. */
+	u64 *g_fp_slot; /* ..then a Robin Hood hashed fingerprint table (0: empty), .. */
+	u32 *g_fp_data; /* ..its data words follow in the same allocation */
+	u32 g_fp_size; /* Power of two, or 0 (dictionary in use) */
+	u32 g_fp_count;
+	u32 g_min; /* Minimum entries _balance() and _grow() consider */
+	struct a_gray_rehash *g_rh; /* Incremental growth in progress, or NIL */
+	u64 g_key_mem; /* Dictionary: bytes of keys, NUL included */
+	s64 g_epoch; /* Of last tick */
+	s64 g_base_epoch; /* Base of gray DB, entries are relative to that; updated by gray_maintenance() */
+	s64 g_wheel_base; /* Wheel minute of .g_base_epoch */
+	s64 g_sweep_next; /* Wheel minute before which no new sweep starts */
+	struct a_gray_wheel g_wheel[2]; /* Gray, accepted */
+	s64 g_hist_epoch; /* Of last sample of .g_hist_count and .g_hist_mem (once a minute) */
+	struct a_hist g_hist_main5ce; /* Duration of maintenance(), microseconds */
+	struct a_hist g_hist_count; /* Store entries */
+	struct a_hist g_hist_mem; /* Store memory, bytes */
+	char *g_sweep_key; /* Dictionary: next key the sweep visits (empty: start over) */
+	u32 g_sweep_idx; /* --gray-fingerprint: slot the sweep visits next, .. */
+	u32 g_sweep_left; /* ..and slots left (0: start over) */
+	u32 g_ograycnt; /* Growth barrier for next balance(), see server__gray_afterwork() */
+	u16 g_cleanup_cnt;
+	s16 g_epoch_min; /* .g_epoch - .g_base_epoch .. in minutes; updated by gray_maintenance() */
+	boole g_sweep_on; /* A sweep cycle is in progress */
+	u8 g_lazy; /* a_gray_lazy_state */
+	u8 g__pad[6];
+#ifdef a_HAVE_MT
+	pthread_mutex_t g_mtx;
+#endif
+};
+
+/* Iterates a shard whichever store it uses; see server__gray_st_*() */
+struct a_gray_view{
+	struct a_gray *gv_gp;
+	struct su_cs_dict_view gv_dv;
+	u32 gv_idx; /* --gray-fingerprint: current slot, .. */
+	u32 gv_left; /* ..slots yet to visit (0: invalid) */
+	char gv_key[1 + 16 +1]; /* .. "~HEX" as the key */
+};
+
+/* Stores grow incrementally: the shard gets a larger one, and .rh_old, the previous (store members only), is drained
+ * into it VAL_GRAY_REHASH_STEP entries at a time, see server__gray_st_rehash_*() */
+struct a_gray_rehash{
+	struct a_gray rh_old;
+	struct a_gray_view rh_view; /* Migration position in .rh_old */
+	boole rh_begun;
+	u8 rh__pad[7];
+};
+
+/* Readiness notification (see __ev_*()).  Client cookies are indices into .pg_cli_fds */
+#define a_EV_COOKIE_LISTEN U32_MAX /* Master: the accept(2) socket */
+#define a_EV_COOKIE_PIPE (U32_MAX - 1) /* Master: worker wakeups; worker: clients from master */
+#define a_EV_COOKIE_SIG (U32_MAX - 2) /* kqueue(2) EVFILT_SIGNAL (never reported) */
+#define a_EV_COOKIE_POLICY (U32_MAX - 3) /* Master: the --policy-listen accept(2) socket */
+#define a_EV_COOKIE_PEER (U32_MAX - 4) /* Master: the --peer-listen datagram socket */
+
+/* .pg_cli_fds entry speaks postfix policy protocol (--policy-listen), not client/server one */
+#define a_CLI_POLICY 0x40000000
+#define a_CLI_FD(X) ((X) & ~a_CLI_POLICY)
+#define a_EV_BATCH 64
+
+/* --limit-delay excess: answers of a client are held back until .p_due, its fd is not watched meanwhile,
+ * see __cli_park*().  (Also the --policy-listen per-connection input state, see __cli_policy()) */
+struct a_park{
+	s64 p_due; /* Milliseconds; 0: not parked */
+	char *p_buf; /* Requests read but not yet served (or a partial one), or NIL */
+	struct a_line *p_line; /* a_CLI_POLICY: input collected so far (always) */
+	u32 p_len;
+	u32 p_cnt; /* Excesses in a row (--limit-delay-time progression) */
+	u32 p_ans_no;
+	char p_ans[a_REQ_BATCH];
+	u8 p__pad[4];
+};
+
+struct a_ev{
+	s32 ev_fd; /* epoll(7), kqueue(2); -1 for pselect(2) */
+	u32 ev_no; /* Cookies in .ev_ready from last __ev_wait() */
+#if !defined a_HAVE_EV_EPOLL && !defined a_HAVE_EV_KQUEUE
+	s32 ev_maxfd;
+	u8 ev__pad[4];
+	fd_set ev_set;
+	u32 ev_cookie[FD_SETSIZE];
+#endif
+	u32 ev_ready[a_EV_BATCH];
+};
+
+/* --peer: connect(2)ed datagram socket, and address datagrams of --peer-listen must come from */
+struct a_peer{
+	s32 p_fd;
+	u32 p_salen;
+	u64 p_seq; /* Of last datagram accepted from that address */
+	union a_sockaddr p_sa;
+};
+
 struct a_master{
 	char const *m_sockpath;
 	s32 m_reafd; /* Client/Master reassurance fd (locked; server PID storage) */
+	u32 m_cli_no; /* Of all threads (a_HAVE_MT: .m_mt_mtx) */
+	struct a_gray *m_grays;
+	u32 m_gray_no;
+	u64 m_gray_fp_key[2]; /* --gray-fingerprint: SipHash key, persists in binary DB */
+	u32 m_thr_no; /* --server-threads actually running */
+	struct a_ev m_ev;
+	s32 m_polfd; /* --policy-listen accept(2) socket, or -1 */
+	s32 m_peer_fd; /* --peer-listen datagram socket, or -1 */
+	u32 m_peer_no;
+	struct a_peer *m_peers;
+	char *m_peer_buf; /* Outgoing datagram (.m_peer_mtx) */
+	uz m_peer_len;
+	u64 m_peer_seq; /* Of last one sent (.m_peer_mtx) */
+	u64 m_peer_key[2]; /* Derived from --peer-key */
+	struct a_gray_jnl m_jnl;
+	struct a_gray_lazy *m_lazy; /* --gray-lazy-load in progress, or NIL */
+	s32 m_save_pid; /* Background gray_save() child, or 0 */
+	u32 m_save_cnt;
+	struct su_timespec m_save_ts;
+	struct a_hist m_hist_save; /* Duration of successful gray_save(), microseconds */
+#ifdef a_HAVE_MT
+	s32 m_mt_wake[2]; /* Worker->master wakeup pipe */
+	u32 m_conf_gen; /* Bumped by configuration reload (.m_wb_rwl) */
 	su_64( u8 m__pad[4]; )
-	s32 *m_cli_fds;
-	u32 m_cli_no;
-	u16 m_cleanup_cnt;
-	s16 m_epoch_min; /* .m_epoch - .m_base_epoch .. in minutes; updated by gray_maintenance() */
-	s64 m_epoch; /* Of last tick */
-	s64 m_base_epoch; /* Base of gray DB, entries are relative to that; updated by gray_maintenance() */
+	struct a_mt_worker *m_thrs;
+	struct a_pg *m_pg; /* Configuration source for workers */
+	pthread_mutex_t m_mt_mtx; /* Client accounting */
+	pthread_rwlock_t m_wb_rwl; /* White/blacklist and configuration reload */
+	pthread_mutex_t m_peer_mtx;
+	/* Configuration reload by helper thread: it parses into .m_rld_pg, whose .pg_master has only list fields;
+	 * master swaps them once done (see __mt_reload*()) */
+	pthread_t m_rld_tid;
+	pthread_cond_t m_rld_cnd; /* (.m_mt_mtx) */
+	struct a_pg *m_rld_pg;
+	s32 m_rld_state; /* enum a_mt_reload (.m_mt_mtx) */
+	s32 m_rld_rv;
+#endif
 	struct a_wb m_white;
 	struct a_wb m_black;
-	struct su_cs_dict m_gray;
-	struct a_wb_cnt m_cnt_white;
-	struct a_wb_cnt m_cnt_black;
-	ul m_cnt_gray_new;
-	ul m_cnt_gray_defer;
-	ul m_cnt_gray_pass;
+	struct a_dom *m_dom; /* client_name=, exact + fuzzy, white and black */
+	ul m_dom_no; /* Trie nodes */
+	char const *m_lim; /* --list-image snapshot (a_lim_hdr), or NIL */
+	struct a_cnt m_cnt;
 };
 
 struct a_pg{
@@ -412,32 +1001,87 @@ struct a_pg{
 	u16 pg_gc_rebalance;
 	u16 pg_gc_timeout;
 	u16 pg_server_timeout;
-	su_64( u8 pg__pad[4]; )
+	u16 pg_server_threads;
+	u16 pg_client_cache; /* Seconds, or 0 */
+	u16 pg_gray_shared_time; /* Minutes; applies bound to half .pg_gc_timeout */
+	u8 pg__pad1[2];
 	u32 pg_count;
 	u32 pg_limit;
 	u32 pg_limit_delay;
+	u32 pg_limit_delay_time; /* Milliseconds */
+	u32 pg_limit_delay_time_max;
+	u32 pg_mem_limit; /* MiB, or 0 */
+	u32 pg_mem_limit_delay;
 	u32 pg_server_queue;
 	char const *pg_msg_allow;
 	char const *pg_msg_block;
 	char const *pg_msg_defer;
 	char const *pg_store_path;
+	char const *pg_policy_listen; /* NIL, or --policy-listen (not SIGHUP) */
+	char const *pg_peer_listen; /* NIL, or --peer-listen (not SIGHUP) */
+	char const *pg_peer_key; /* NIL, or --peer-key (not SIGHUP) */
+	char **pg_peers; /* --peer (not SIGHUP) */
+	u32 pg_peer_no;
+	su_64( u8 pg__pad2[4]; )
+	char const *pg_compile; /* --compile-lists target, or NIL */
 	/**/
 	char **pg_argv;
 	u32 pg_argc;
 	s32 pg_clima_fd; /* Client/Master comm fd */
+	struct a_gray_shm *pg_shm; /* --gray-shared mapping (client: read-only), or NIL */
+	struct a_client_cache *pg_cc; /* --client-cache slots (client), or NIL */
 #ifdef a_HAVE_LOG_FIFO
 	s32 pg_log_fd; /* Opened pre-sandbox and kept (:() */
 	s32 pg_store_path_fd; /* FreeBSD: for openat(2) purposes (LOG_FIFO: unrelated, save pad) */
 #endif
+	/* Server thread state: workers copy anything above from master upon configuration change */
+	struct a_cnt *pg_cnt;
+	struct a_ev *pg_ev;
+	s32 *pg_cli_fds; /* Closed ones are -1 until __cli_compact() */
+	struct a_park *pg_park; /* Parallel to .pg_cli_fds */
+	u32 pg_cli_no;
+	u32 pg_conf_gen;
+	u32 pg_park_no;
+	u8 pg__pad3[4];
 	/* Triple data plus client_name, pointing into .pg_buf */
 	char *pg_r; /* Ignored with _F_FOCUS_SENDER */
 	char *pg_s;
 	char *pg_ca;
 	char *pg_cname;
+	u32 pg_key_hash; /* a_GRAY_KEY_HASH() of R/S/CA */
+	u32 pg_key_len; /* R/S/CA/CNAME (sans final NUL), as --gray-shared fingerprints it */
+	BITENUM(u32,a_srch_type) pg_ca_type;
+	u8 pg_ca_ip[16]; /* Binary .pg_ca (masked) */
 	char pg_buf[ALIGN_Z(a_BUF_SIZE)];
 };
 
-static char const a_sopts[] = "4:6:" "A:a:B:b:" "c:D:d:pFfG:g:L:l:" "m:~:!:" "o" "R:" "q:t:" "s:" "u" "v" ".@%#" "Hh";
+#ifdef a_HAVE_MT
+struct a_mt_worker{
+	struct a_pg w_pg; /* (First: a_MT_WORKER()) */
+	struct a_cnt w_cnt;
+	struct a_ev w_ev;
+	pthread_t w_tid;
+	s32 w_pipe[2]; /* Master->worker: accepted client FDs, -1 to exit */
+	u32 w_cli_no; /* Assigned clients (master .m_mt_mtx) */
+};
+# define a_MT_WORKER(PGP) R(struct a_mt_worker*,PGP)
+#endif
+
+/* Gray DB shard of KEY, or of its hash H; (not the hash of cs_dict, client computes it, too) */
+#define a_GRAY_KEY_HASH(KEY) a_misc_cksum(a_MISC_CKSUM_INIT, KEY, su_cs_len(KEY))
+#define a_GRAY_SHARD_OF(MP,H) (&(MP)->m_grays[((MP)->m_gray_no == 1) ? 0 : (H) % (MP)->m_gray_no])
+#define a_GRAY_SHARD(MP,KEY) a_GRAY_SHARD_OF(MP, ((MP)->m_gray_no == 1 ? 0 : a_GRAY_KEY_HASH(KEY)))
+/* --gray-fingerprint: high bits select the shard, low bits the table slot */
+#define a_GRAY_SHARD_FP(MP,FP) a_GRAY_SHARD_OF(MP, S(u32,(FP) >> 32))
+#define a_GRAY_IS_FP(GP) ((GP)->g_fp_size != 0)
+/* Stores of shard GP, starting with SGP=GP: during growth the old one follows */
+#define a_GRAY_ST_NEXT(GP,SGP) (((SGP) == (GP) && (GP)->g_rh != NIL) ? &(GP)->g_rh->rh_old : NIL)
+/* (--gray-fingerprint DBs have no keys to write in text) */
+#define a_GRAY_SAVE_TEXT(PGP) (!((PGP)->pg_flags & (a_F_GRAY_BINARY | a_F_GRAY_FPRINT)))
+/* Share of one shard in a DB-wide limit (rounded up) */
+#define a_GRAY_SHARE(MP,L) (((MP)->m_gray_no == 1) ? (L) : ((L) + (MP)->m_gray_no - 1) / (MP)->m_gray_no)
+
+static char const a_sopts[] = "4:6:" "A:a:B:b:" "c:D:d:pFfG:g:L:l:" "m:~:!:" "o" "P:" "R:" "q:T:t:" "s:" "u" "v" ".@%#" "Hh";
 static char const * const a_lopts[] = {
 	/* long option order */
 	"4-mask:;4;" N_("IPv4 mask to strip off addresses before match"),
@@ -448,6 +1092,7 @@ static char const * const a_lopts[] = {
 	"block-file:;B;" N_("load a file of blacklist entries"),
 	"block:;b;" N_("add domain/address/CIDR to blacklist"),
 
+	"client-cache:;-13;" N_("clients answer repetitions themselves for that long (seconds, max 300; 0=off)"),
 	"count:;c;" N_("of SMTP retries before accepting sender"),
 	"delay-max:;D;" N_("until an email \"is not a retry\" but new (minutes)"),
 	"delay-min:;d;" N_("before an email \"is a retry\" (minutes)"),
@@ -457,8 +1102,18 @@ static char const * const a_lopts[] = {
 	"gc-rebalance:;G;" N_("no of GC DB cleanup runs before rebalance"),
 	"gc-timeout:;g;" N_("until gray DB entry classified unused (minutes)"),
 	"gc-linger;-1;" N_("keep timeout gray DB entries until --limit excess"),
+	"gray-fingerprint;-3;" N_("gray DB stores key fingerprints only (read manual; not SIGHUP)"),
+	"gray-format:;-2;" N_("gray DB save format: text, or binary"),
+	"gray-lazy-load:;-14;" N_("serve at once while loading gray DB, answer unknown: defer, or pass (read manual)"),
+	"gray-save-background;-16;" N_("journal checkpoints and USR2 save gray DB in a child process (not SIGHUP)"),
+	"gray-shared;-5;" N_("clients pass accepted triples via shared memory (read manual; not SIGHUP)"),
+	"gray-shared-time:;-17;" N_("of --gray-shared passes after the server answered (minutes; max gc-timeout/2)"),
 	"limit:;L;" N_("DB entries after which new ones are not handled"),
 	"limit-delay:;l;" N_("DB entries after which new ones cause sleeps"),
+	"limit-delay-time:;-10;" N_("of --limit-delay sleeps (milliseconds; MIN[:MAX] doubles per excess in a row)"),
+	"list-image:;-9;" N_("search white/blacklists precompiled by --compile-lists (read manual)"),
+	"memory-limit:;-11;" N_("gray DB memory after which new entries are not handled (MiB; 0=off)"),
+	"memory-limit-delay:;-12;" N_("gray DB memory after which new entries cause sleeps (MiB; 0=off)"),
 
 	"msg-allow:;~;" N_("whitelist message (read manual; not SIGHUP)"),
 	"msg-block:;!;" N_("blacklist message (\")"),
@@ -466,10 +1121,15 @@ static char const * const a_lopts[] = {
 
 	/**/
 	"once;o;" N_("process only one request per client invocation"),
+	"peer:;-6;" N_("replicate gray DB changes to ADDR:PORT (multiple; not SIGHUP)"),
+	"peer-key:;-15;" N_("shared secret authenticating --peer datagrams (required; not SIGHUP)"),
+	"peer-listen:;-7;" N_("receive --peer replication at ADDR:PORT (not SIGHUP)"),
+	"policy-listen:;P;" N_("server speaks postfix policy protocol there (not SIGHUP)"),
 
 	"resource-file:;R;" N_("path to configuration file with long options"),
 
 	"server-queue:;q;" N_("number of clients a server supports (not SIGHUP)"),
+	"server-threads:;T;" N_("worker threads of the server (0=none; not SIGHUP)"),
 	"server-timeout:;t;" N_("until client-less server exits (0=never; minutes)"),
 
 	"store-path:;s;" N_("DB and server/client socket directory (not SIGHUP)"),
@@ -479,8 +1139,10 @@ static char const * const a_lopts[] = {
 	"verbose;v;" N_("increase syslog verbosity (multiply for more verbosity)"),
 
 	/**/
+	"compile-lists:;-8;" N_("[*] compile white/blacklists into an image for --list-image"),
 	"shutdown;.;" N_("[*] force running server to exit, synchronize on that"),
 	"startup;@;" N_("[*] only startup the server"),
+	"stats;-4;" N_("[*] print statistics of running server as key=value lines"),
 	"status;%;" N_("[*] exit status 0 or 1 state whether server runs; otherwise error"),
 	"test-mode;#;" N_("[*] check and list configuration, exit according status"),
 
@@ -494,22 +1156,25 @@ static char const * const a_lopts[] = {
 #define a_AVOPT_CASES \
 	case '4': case '6':\
 	case 'A': case 'a': case 'B': case 'b':\
-	case 'c': case 'D': case 'd': case 'p': case 'F': case 'f': case 'G': case 'g': case -1: case 'L': case 'l':\
+	case -13: case 'c': case 'D': case 'd': case 'p': case 'F': case 'f': case 'G': case 'g': case -1: case -3: case -2: case -14: case -16: case -5: case -17:\
+		case 'L': case 'l': case -10: case -9: case -11: case -12:\
 	case '~': case '!': case 'm':\
 	/**/\
 	case 'o':\
+	case -6: case -7: case -15:\
+	case 'P':\
 	case 'R':\
-	case 'q': case 't':\
+	case 'q': case 'T': case 't':\
 	case 's':\
 	case 'u':\
 	case 'v':
 
 #ifdef a_HAVE_LOG_FIFO
 static struct a_pg *a_pg_i;
-static s32 ATOMIC a_server_chld;
 #endif
+static s32 ATOMIC a_server_chld;
 static s32 ATOMIC a_server_hup;
-static s32 ATOMIC a_server_term;
+static s32 ATOMIC a_server_term; /* a_SERVER_TERM*() */
 static s32 ATOMIC a_server_usr1;
 static s32 ATOMIC a_server_usr2;
 /* }}} */
@@ -520,7 +1185,21 @@ static s32 ATOMIC a_server_usr2;
 static s32 a_client(struct a_pg *pgp);
 
 static s32 a_client__loop(struct a_pg *pgp);
-static s32 a_client__req(struct a_pg *pgp);
+/* Send batch, await its answers, and write all policy answers; -su_EX_IOERR if server is gone */
+static s32 a_client__req(struct a_pg *pgp, struct a_client_batch *cbp);
+/* Append to .cb_buf, flushing to STDOUT as necessary */
+static boole a_client__out(struct a_client_batch *cbp, void const *dat, uz len);
+/* Normalize .pg_r etc., and prepare protocol v2 request: false if data is bogus */
+static boole a_client__req_prep(struct a_pg *pgp, struct a_req_hdr *rhp, struct iovec iov[5]);
+/* The server key R/S/CA\0CNAME of a queued request; returns its length */
+static uz a_client__key(char buf[a_BUF_SIZE], char const *req);
+/* Answer queued request at .cb_buf[off] without the server (counted in .cb_cnt), or NIL */
+static char const *a_client__local(struct a_pg *pgp, struct a_client_batch *cbp, uz off);
+#ifdef a_HAVE_GRAY_SHM
+/* --gray-shared: map server table if it exists and is valid; find a key in there */
+static void a_client__shm_open(struct a_pg *pgp);
+static boole a_client__shm_find(struct a_pg *pgp, char const *key, uz len);
+#endif
 
 /* server */
 static s32 a_server(struct a_pg *pgp, char const *sockpath, s32 reafd);
@@ -532,22 +1211,264 @@ static void a_server__logger(struct a_pg *pgp, pid_t srvpid);
 static s32 a_server__setup(struct a_pg *pgp);
 static s32 a_server__reset(struct a_pg *pgp);
 static s32 a_server__wb_setup(struct a_pg *pgp, boole reset);
+/* _parse(): the configuration passes of _setup() into .pg_master lists, without locking (reset: do reload) */
+static s32 a_server__wb_parse(struct a_pg *pgp, boole reset);
+/* _reloaded(): after (w/b lists and) configuration have been replaced */
+static void a_server__wb_reloaded(struct a_pg *pgp);
 static void a_server__wb_reset(struct a_master *mp);
 static s32 a_server__loop(struct a_pg *pgp);
 static void a_server__log_stat(struct a_pg *pgp);
+/* Clients are edge-triggered, _ready() reads until EAGAIN; _del() leaves a hole for _compact(), which closes
+ * those of the last __ev_wait() in O(1) each */
+static boole a_server__cli_add(struct a_pg *pgp, s32 fd);
 static void a_server__cli_ready(struct a_pg *pgp, u32 client);
+/* --policy-listen: _open() in __setup(); _policy() serves a_CLI_POLICY clients (O_NONBLOCK, blocks are parsed
+ * once complete); _policy_msg() maps an a_answer to the according action */
+static s32 a_server__policy_open(struct a_pg *pgp);
+static void a_server__cli_policy(struct a_pg *pgp, u32 client);
+static char const *a_server__cli_policy_msg(struct a_pg const *pgp, char ans);
+static void a_server__cli_del(struct a_pg *pgp, u32 client);
+static void a_server__cli_compact(struct a_pg *pgp);
+/* --limit-delay excess: _park() holds back answers ans of client, and keeps the unserved requests of buf;
+ * _park_tos() returns a timeout shortened to the next due one (in *tosp), or tosp_or_nil; _park_due() appends
+ * due ones to .ev_ready of the last __ev_wait(), for _ready() to answer and serve them, returns their number */
+static void a_server__cli_park(struct a_pg *pgp, u32 client, char const *ans, u32 ans_no, char const *buf, uz len);
+static struct timespec *a_server__cli_park_tos(struct a_pg *pgp, struct timespec *tosp,
+		struct timespec *tosp_or_nil);
+static u32 a_server__cli_park_due(struct a_pg *pgp);
+/* _req(): len is that of a complete request of either protocol version */
 static char a_server__cli_req(struct a_pg *pgp, u32 client, uz len);
-static boole a_server__cli_lookup(struct a_pg *pgp, struct a_wb *wbp, struct a_wb_cnt *wbcp);
+/* Whether the v2 header at cp matches the strings that follow it */
+static boole a_server__cli_req_hdr(char const *cp);
+/* cname_or_nil: matching suffix of .pg_cname as of __dom_lookup() */
+static boole a_server__cli_lookup(struct a_pg *pgp, struct a_wb *wbp, struct a_wb_cnt *wbcp,
+		char const *cname_or_nil);
 static void a_server__on_sig(int sig);
 
+/* Statistics: _cnt_add() sums up counters, _hist_add() accounts v, _hist_usec() microseconds since *tsp;
+ * _stats() answers a --stats request on fd with key=value lines (see manual) */
+#ifdef a_HAVE_MT
+static void a_server__cnt_add(struct a_cnt *cp, struct a_cnt const *xcp);
+#endif
+static void a_server__hist_add(struct a_hist *hp, u64 v);
+static void a_server__hist_usec(struct a_hist *hp, struct su_timespec const *tsp);
+static void a_server__hist_merge(struct a_hist *hp, struct a_hist const *xhp);
+static boole a_server__stats(struct a_pg *pgp, s32 fd);
+static boole a_server__stats__kv(struct a_gray_out *gop, char const *key, char const *key2, u64 v);
+static boole a_server__stats__hist(struct a_gray_out *gop, char const *key, struct a_hist const *hp);
+
+/* --gray-shared: _open() creates the mapping anew (a stale one is removed if not in use), pre-sandbox;
+ * _put(): key (R/S/CA, followed by \0 and .pg_cname) was answered accepted at now; _clear(): empty all slots */
+#ifdef a_HAVE_GRAY_SHM
+static void a_server__gray_shm_open(struct a_pg *pgp);
+static void a_server__gray_shm_put(struct a_pg *pgp, char const *key, uz len, s64 now);
+static void a_server__gray_shm_clear(struct a_pg *pgp);
+#endif
+
+/* --peer replication: _open() creates the sockets in __setup(); _add() queues a gray DB change (shard locked),
+ * _flush() sends queued ones to all peers; _ready() receives --peer-listen datagrams, _merge() applies one record,
+ * last writer wins */
+static s32 a_server__peer_open(struct a_pg *pgp);
+static void a_server__peer_add(struct a_pg *pgp, char const *key, up d, s64 epoch);
+static void a_server__peer_flush(struct a_pg *pgp);
+static void a_server__peer__send(struct a_master *mp); /* (Locked) */
+static void a_server__peer_ready(struct a_pg *pgp);
+static boole a_server__peer_merge(struct a_pg *pgp, char const *base, uz len, s64 epoch, up d);
+
+/* CIDR tries: _insert(): key is masked to plen, false if already present; _lookup(): longest prefix match of
+ * a full address of bits length, in O(bits) */
+static boole a_server__srch_insert(struct a_srch **rootp, u8 const *key, u32 plen);
+static struct a_srch const *a_server__srch_lookup(struct a_srch const *sp, u8 const *key, u32 bits);
+static void a_server__srch_free(struct a_srch *sp);
+
+/* client_name= trie: _insert(): false if already present; _lookup(): longest matching suffix of name for white
+ * and black list in one pass over name (or NIL) */
+static boole a_server__dom_insert(struct a_master *mp, char const *name, BITENUM(u32,a_dom_flags) f);
+static void a_server__dom_lookup(struct a_dom const *dp, char const *name, char const **wcpp, char const **bcpp);
+static void a_server__dom_free(struct a_dom *dp);
+
+/* --list-image searches in place, as above: _at(): pointer to len bytes at off, NIL if invalid; _ca(): exact
+ * client_address= of list lwp; _srch(): trie at off; _dom(): only replaces NIL or shorter matches of __dom_lookup() */
+static void const *a_server__lim_at(char const *lim, u32 off, uz len);
+static boole a_server__lim_ca(char const *lim, struct a_lim_wb const *lwp, char const *ca);
+static boole a_server__lim_srch(char const *lim, u32 off, u8 const *key, u32 bits);
+static void a_server__lim_dom(char const *lim, char const *name, char const **wcpp, char const **bcpp);
+
+/* Readiness notification: epoll(7), kqueue(2), or pselect(2).
+ * _open(): sigs: (kqueue) wake on handled signals.  _add(): edge: edge-triggered, mod: update cookie of fd.
+ * _del(): closing: fd is about to be close(2)d.  _wait(): returns -1 and su_err() on error (_ERR_INTR also if only
+ * signals occurred), 0 on timeout, or .ev_no; sigmask_or_nil: like for pselect(2) */
+static boole a_server__ev_open(struct a_ev *evp, boole sigs);
+static void a_server__ev_close(struct a_ev *evp);
+static boole a_server__ev_add(struct a_ev *evp, s32 fd, u32 cookie, boole edge, boole mod);
+static void a_server__ev_del(struct a_ev *evp, s32 fd, boole closing);
+static s32 a_server__ev_wait(struct a_ev *evp, struct timespec const *tosp_or_nil, sigset_t const *sigmask_or_nil);
+
+/* --server-threads: workers serve clients which master accept(2)s and passes on.
+ * _start() is called with all signals blocked, pre-sandbox */
+#ifdef a_HAVE_MT
+static s32 a_server__mt_start(struct a_pg *pgp);
+static void a_server__mt_stop(struct a_pg *pgp);
+static void a_server__mt_wake(struct a_master *mp);
+static void *a_server__mt_worker(void *vp);
+/* Configuration reload off the hot path: _reload() hands SIGHUP to the helper, false if one is still running;
+ * _reload_swap() returns -1 unless the helper is done, otherwise its status, and upon success the new lists
+ * and configuration are in place (old lists are freed after the write lock is released) */
+static boole a_server__mt_reload(struct a_pg *pgp);
+static s32 a_server__mt_reload_swap(struct a_pg *pgp);
+static void *a_server__mt_reloader(void *vp);
+#endif
+
+/* Shard store: su_cs_dict, or (--gray-fingerprint) open addressing table of keyed key hashes; key is used by the
+ * former, fp by the latter.  _insert() returns like su_cs_dict_insert(); _view_remove() moves to the next
+ * entry.  To avoid visiting entries twice a fingerprint view starts with an empty slot, or one that is home
+ * of its fingerprint, since backward shift deletion cannot move entries across that */
+static void a_server__gray_st_create(struct a_gray *gp, boole fp, u32 min);
+static void a_server__gray_st_gut(struct a_gray *gp);
+static u32 a_server__gray_st_count(struct a_gray const *gp);
+static u32 a_server__gray_st_size(struct a_gray const *gp);
+/* Estimated bytes of tables and entry nodes, keys included */
+static u64 a_server__gray_st_mem(struct a_gray const *gp);
+static void a_server__gray_st_min_size(struct a_gray *gp, u32 min);
+static void a_server__gray_st_balance(struct a_gray *gp);
+static void a_server__gray_st_clear(struct a_gray *gp);
+static s32 a_server__gray_st_insert(struct a_gray *gp, char const *key, u64 fp, up d);
+static void a_server__gray_st_remove(struct a_gray *gp, char const *key, u64 fp);
+static boole a_server__gray_st_fp_resize(struct a_gray *gp, u32 size, boole mayfail);
+static void a_server__gray_st_fp_put(u64 *slot, u32 *data, u32 mask, u64 fp, u32 d);
+static u32 a_server__gray_st_fp_find(struct a_gray const *gp, u64 fp);
+static void a_server__gray_st_fp_del(struct a_gray *gp, u32 i);
+static struct a_gray_view *a_server__gray_st_view(struct a_gray_view *gvp, struct a_gray *gp);
+static boole a_server__gray_st_view_find(struct a_gray_view *gvp, char const *key, u64 fp);
+static void a_server__gray_st_view_begin(struct a_gray_view *gvp);
+static boole a_server__gray_st_view_is_valid(struct a_gray_view const *gvp);
+static void a_server__gray_st_view_next(struct a_gray_view *gvp);
+static up a_server__gray_st_view_data(struct a_gray_view const *gvp);
+static void a_server__gray_st_view_set_data(struct a_gray_view *gvp, up d);
+static void a_server__gray_st_view_remove(struct a_gray_view *gvp);
+static char const *a_server__gray_st_view_key(struct a_gray_view *gvp);
+static void a_server__gray_st_view__skip(struct a_gray_view *gvp);
+/* Incremental growth: _grow() starts draining the store into a larger one if needed (with --gray-fingerprint
+ * _insert() may, too), _rehash_step() migrates up to no entries, false when none are left, _rehash_finish() all.
+ * While a rehash is in progress, _view_find() may return a view into the old store, and full views are illegal */
+static void a_server__gray_st_grow(struct a_gray *gp);
+static boole a_server__gray_st_rehash_start(struct a_gray *gp, u32 min);
+static boole a_server__gray_st_rehash_step(struct a_gray *gp, u32 no);
+static void a_server__gray_st_rehash_finish(struct a_gray *gp);
+static void a_server__gray_st_rehash__end(struct a_gray *gp);
+static u32 a_server__gray_st_fp__size(u32 min);
+/* Continue at the sweep position of the shard, or begin; _pause() stores it, false if the view is exhausted */
+static void a_server__gray_st_view_resume(struct a_gray_view *gvp);
+static boole a_server__gray_st_view_pause(struct a_gray_view *gvp);
+/* The shard of key (with --gray-fingerprint its *fpp is calculated), or, if NIL, of *fpp */
+static struct a_gray *a_server__gray_shard(struct a_pg *pgp, char const *key, u64 *fpp);
+
 /* Initially zeroed! */
 static void a_server__gray_create(struct a_pg *pgp);
+/* Map name for reading (pre-sandbox): false if it does not exist; *mapp is NIL if it is empty or on error */
+static boole a_server__gray_map(struct a_pg *pgp, char const *name, boole jnl, char **mapp, u32 *lenp);
 static void a_server__gray_load(struct a_pg *pgp);
-static boole a_server__gray_save(struct a_pg *pgp);
-/* xlimit: if 0, only minimal housekeeping (deletions), otherwise try reach this target */
-static void a_server__gray_maintenance(struct a_pg *pgp, boole only_time_tick, u32 xlimit,
+/* _text(), _bin(): false if nothing happened, _base(): oe_ne_min, or S32_MIN if all content timed out;
+ * _text_line(): the line from base to end (a newline): !ent: base epoch to *bep (-1 if corrupt, else 1);
+ * _bin_check(): -1 if corrupt, 0 if unusable (logged), 1 if OK (checksums verified only with cksum);
+ * _bin_ptr(): fingerprints (or NIL) and records (or NIL) of a checked DB, returns arena;
+ * _ent(), _bin_rec(), _text_line(): -1 if corrupt, 0 if skipped, 1 if inserted, 2 if out of memory;
+ * base==NIL: fingerprint fp; data is relative to epoch; glp: --gray-lazy-load, shard is locked;
+ * _del(): as for a journal deletion record; key==NIL: fingerprint fp */
+static boole a_server__gray_load_text(struct a_pg *pgp, char *dat, u32 len, s64 now);
+static s32 a_server__gray_load_text_line(struct a_pg *pgp, char *base, char const *end, s64 *bep, boole ent,
+		struct a_gray_lazy *glp);
+static boole a_server__gray_load_bin(struct a_pg *pgp, char *dat, u32 len, s64 now);
+static s32 a_server__gray_load_bin_check(struct a_pg *pgp, char const *dat, u32 len, boole cksum);
+static char const *a_server__gray_load_bin_ptr(char const *dat, u64 const **fppp,
+		struct a_gray_bin_rec const **gbrpp);
+static s32 a_server__gray_load_bin_rec(struct a_pg *pgp, char const *dat, u32 no, struct a_gray_lazy *glp);
+static s32 a_server__gray_load_base(struct a_pg *pgp, s64 base, s64 now, boole quiet);
+static boole a_server__gray_load_key(struct a_pg *pgp, char key[a_BUF_SIZE], char const *base, uz len);
+static s32 a_server__gray_load_ent(struct a_pg *pgp, char const *base, uz len, u64 fp, up d, s64 epoch,
+		struct a_gray_lazy *glp);
+static void a_server__gray_load_del(struct a_pg *pgp, char const *key, u64 fp, struct a_gray_lazy *glp);
+/* --gray-lazy-load: _open() maps all sources (pre-sandbox), returns whether a_GRAY_JNL_OLD_NAME exists;
+ * _step() loads a_GRAY_LAZY_STEP records per event loop round, and calls _done() at the end */
+static boole a_server__gray_lazy_open(struct a_pg *pgp);
+static void a_server__gray_lazy_step(struct a_pg *pgp);
+static void a_server__gray_lazy_done(struct a_pg *pgp);
+/* bg: with --gray-save-background fork(2) a child that only writes the snapshot (skipped while one runs),
+ * otherwise synchronous; _file(): write the DB (--gray-save-background: a_GRAY_DB_TMP_NAME, then rename(2)d into
+ * place), no logging; _reap(): of background child; _data(): rebase *dp of gp to .go_epoch, false if expired */
+static boole a_server__gray_save(struct a_pg *pgp, boole bg);
+static boole a_server__gray_save_file(struct a_pg *pgp, struct a_gray_out *gop, uz *cntp);
+static void a_server__gray_save_reap(struct a_pg *pgp, boole wait);
+static boole a_server__gray_save_data(struct a_pg *pgp, struct a_gray const *gp, struct a_gray_out const *gop,
+		up *dp);
+/* Return entry count or UZ_MAX on error; (may run in background child: no logging) */
+static uz a_server__gray_save_text(struct a_pg *pgp, struct a_gray_out *gop);
+static uz a_server__gray_save_bin(struct a_pg *pgp, struct a_gray_out *gop);
+static uz a_server__gray_save_bin_fp(struct a_pg *pgp, struct a_gray_out *gop);
+/* Buffered write; len==0 flushes */
+static boole a_server__gray_out(struct a_gray_out *gop, void const *dat, uz len);
+/* Journal: _replay() after _gray_load() (false if no such file), _add() with shard locked (epoch<0: deletion),
+ * _write() with journal locked; _sync() writes and fsync(2)s, returns whether a checkpoint is due;
+ * _rotate() before background save, _checkpoint() by _gray_save() (or its reaper) */
+static boole a_server__gray_jnl_replay(struct a_pg *pgp, char const *name);
+/* One record from base to end (a newline), like _gray_load_ent() */
+static s32 a_server__gray_jnl_replay_rec(struct a_pg *pgp, char *base, char const *end, struct a_gray_lazy *glp);
+static void a_server__gray_jnl_add(struct a_pg *pgp, char const *key, up d, s64 epoch);
+/* Record format (also --peer): _rec() writes one at cp (room for len + su_IENC_BUFFER_SIZE*2 +4), returns end;
+ * _parse() "EPOCH BITMASK " after the plus at *basep (up to end, a newline), *basep then is the key */
+static char *a_server__gray_jnl_rec(char *cp, char const *key, uz len, up d, s64 epoch);
+static boole a_server__gray_jnl_parse(char const **basep, char const *end, s64 *epochp, up *dp);
+static void a_server__gray_jnl_write(struct a_pg *pgp);
+static boole a_server__gray_jnl_sync(struct a_pg *pgp);
+static boole a_server__gray_jnl_due(struct a_pg *pgp);
+static boole a_server__gray_jnl_rotate(struct a_pg *pgp);
+static void a_server__gray_jnl_checkpoint(struct a_pg *pgp, boole ok, boole bg, u32 cnt);
+/* xlimit: if 0, only minimal housekeeping (deletions), otherwise try reach this target.
+ * tsp_or_nil: "now" as of caller, otherwise queried.  Shard must be locked */
+static void a_server__gray_maintenance(struct a_pg *pgp, struct a_gray *gp, boole only_time_tick, u32 xlimit,
 		struct su_timespec *tsp_or_nil);
-static char a_server__gray_lookup(struct a_pg *pgp, char const *key);
+/* Timing wheels of a shard (see struct a_gray_wheel): _tick() advances them to .g_epoch_min, _reset() zeroes
+ * counts, _add() and _del() account data word d.  _count(): entries older than age minutes (certain: the
+ * entire bucket is), _cutoff(): age from which on the oldest entries make up need, 0 if they do not */
+static void a_server__gray_wheel_tick(struct a_gray *gp);
+static void a_server__gray_wheel_reset(struct a_gray *gp);
+static void a_server__gray_wheel_add(struct a_gray *gp, up d);
+static void a_server__gray_wheel_del(struct a_gray *gp, up d);
+static u32 a_server__gray_wheel_count(struct a_gray_wheel const *gwp, s32 age, boole certain);
+static s16 a_server__gray_wheel_cutoff(struct a_gray_wheel const *gwp, u32 need);
+static u32 *a_server__gray_wheel__slot(struct a_gray *gp, up d);
+/* Bucket no of the wheel, oldest first: false if there is none */
+static boole a_server__gray_wheel__bucket(struct a_gray_wheel const *gwp, u32 no, u32 *cntp, s64 *lop, s64 *hip);
+/* Incremental expiry: _due() if wheels show expirable entries, _sweep() visits a_GRAY_SWEEP_BATCH ones */
+static boole a_server__gray_sweep_due(struct a_pg *pgp, struct a_gray *gp);
+static void a_server__gray_sweep(struct a_pg *pgp, struct a_gray *gp);
+/* Expiry sweeps, garbage collection and dictionary growth checks for unlocked shards */
+static void a_server__gray_afterwork(struct a_pg *pgp);
+/* Start growth when due, otherwise step an incremental one by no entries; shard must be locked */
+static void a_server__gray_grow(struct a_pg *pgp, struct a_gray *gp, u32 no);
+/* Entry limit of gp, --limit, or (delay) --limit-delay (0: none); --memory-limit* lower that to what fits at the
+ * current average memory per entry */
+static u32 a_server__gray_limit(struct a_pg *pgp, struct a_gray const *gp, boole delay);
+static char a_server__gray_lookup(struct a_pg *pgp, char const *key, u32 khash);
+
+/* VAL_GRAY_BENCH: gray DB micro benchmark instead of client; argv: entry counts.
+ * _create() creates shards (loads the DB), without journal; _key() formats key of no, with prefix pre */
+#if VAL_GRAY_BENCH
+static s32 a_bench(struct a_pg *pgp, u32 argc, char const *const *argv);
+static s32 a_bench__run(struct a_pg *pgp, u32 entries);
+static void a_bench__create(struct a_pg *pgp);
+static void a_bench__gut(struct a_pg *pgp);
+static void a_bench__key(char key[a_BUF_SIZE], char pre, u32 no);
+static void a_bench__out(char const *op, u32 entries, u32 ops, struct su_timespec const *tsp);
+#endif
+
+/* --compile-lists: parse the white/blacklists like the server does, and write their image.
+ * _put() appends len zeroed bytes, 4-byte aligned, and returns their offset; the others return image offsets */
+static s32 a_compile(struct a_pg *pgp);
+static uz a_compile__put(struct a_compile *cp, uz len);
+static u32 a_compile__ca(struct a_compile *cp, struct su_cs_dict *dictp, u32 *maskp);
+static u32 a_compile__srch(struct a_compile *cp, struct a_srch const *sp);
+static u32 a_compile__dom(struct a_compile *cp, struct a_dom const *dp);
 
 /* conf; _conf__(arg|A|a)() return a negative exit status on error */
 static void a_conf_setup(struct a_pg *pgp, BITENUM(u32,a_avo_flags) f);
@@ -556,7 +1477,18 @@ static void a_conf_list_values(struct a_pg *pgp);
 static s32 a_conf_arg(struct a_pg *pgp, s32 o, char const *arg, BITENUM(u32,a_avo_flags) f);
 
 static s32 a_conf__AB(struct a_pg *pgp, char const *path, struct a_wb *wbp);
+#ifdef a_HAVE_MT
+/* Parse a large file in up to pg_server_threads chunks of at least a_CONF_AB_PAR_MIN in threads, return whether
+ * done so (with *rvp) */
+static boole a_conf__AB_par(struct a_pg *pgp, s32 fd, struct a_wb *wbp, s32 *rvp);
+static void *a_conf__AB_par_worker(void *vp);
+#endif
 static s32 a_conf__ab(struct a_pg *pgp, char *entry, struct a_wb *wbp);
+/* _parse() stages records for entry and is thread-safe, _apply() inserts (or prints) and resets staged records */
+static void a_conf__ab_parse(struct a_pg const *pgp, char *entry, struct a_compile *stp);
+static s32 a_conf__ab_apply(struct a_pg *pgp, struct a_compile *stp, struct a_wb *wbp);
+static struct a_conf_ab_rec *a_conf__ab_rec(struct a_compile *stp, enum a_conf_ab_type type, char const *msg,
+		char const *s1, char const *s2, char const *s3);
 static s32 a_conf__R(struct a_pg *pgp, char const *path, BITENUM(u32,a_avo_flags) f);
 static void a_conf__err(struct a_pg *pgp, char const *msg, ...);
 
@@ -567,6 +1499,8 @@ static boole a_norm_triple_r(struct a_pg *pgp);
 static boole a_norm_triple_s(struct a_pg *pgp);
 static boole a_norm_triple_ca(struct a_pg *pgp);
 static boole a_norm_triple_cname(struct a_pg *pgp);
+/* Normalize cn in place and return start, or NIL (thread-safe) */
+static char *a_norm_cname(char *cn);
 
 /* misc */
 
@@ -576,7 +1510,31 @@ static boole a_misc_os_resource_delay(s32 err);
 /* Open RDONLY a (possibly sandbox-enabled) file */
 static s32 a_misc_open(struct a_pg *pgp, char const *path);
 
-/* getline(3) replacement (-1, or size of space-normalized and trimmed line) */
+/* --list-image: map path read-only and check its header; report errors and return a negative exit status */
+static s32 a_misc_lim_open(struct a_pg *pgp, char const *path, char const **limp);
+static void a_misc_lim_close(char const *lim);
+
+/* write(2) all of dat, restart on EINTR */
+static boole a_misc_write_all(s32 fd, void const *dat, uz len);
+
+/* postfix policy delegation protocol: _block() collects one attribute block from fd into .pg_buf;
+ * _answer() writes action (via .pg_buf); _addr(): parse --policy-listen, return sockaddr length, 0 if invalid
+ * (peer: --peer or --peer-listen, then ADDR:PORT only, but any address) */
+static enum a_policy a_misc_policy_block(struct a_pg *pgp, s32 fd, struct a_line *lp);
+static boole a_misc_policy_answer(struct a_pg *pgp, s32 fd, char const *action);
+/* Whether (at least) one complete block is buffered in lp */
+static boole a_misc_policy_pending(struct a_line const *lp);
+static u32 a_misc_policy_addr(char const *spec, union a_sockaddr *sap, boole peer);
+
+/* FNV-1a 32-bit, chainable */
+#define a_MISC_CKSUM_INIT 0x811C9DC5u
+static u32 a_misc_cksum(u32 h, void const *dat, uz len);
+
+/* --gray-fingerprint: SipHash-1-3 keyed 64-bit hash, never 0; _hex(): 16 digits, no NUL */
+static u64 a_misc_fprint(u64 const key[2], void const *dat, uz len);
+static void a_misc_fprint_hex(char buf[16], u64 fp);
+
+/* getline(3) replacement (-1, or size of space-normalized and trimmed line); fd -1: struct a_line_mem */
 static sz a_misc_line_get(struct a_pg *pgp, s32 fd, struct a_line *lp);
 static s32 a_misc_line__uflow(s32 fd, struct a_line *lp);
 
@@ -601,15 +1559,19 @@ static void a_sandbox_server(struct a_pg *pgp);
 #define a_sandbox_path_reset(PGP,ISEXIT) do{}while(0)
 #define a_sandbox_open(PGP,SP,P,F,M) open(P, (F | a_O_NOFOLLOW | a_O_NOCTTY), M)
 #define a_sandbox_rm_in_store_path(PGP,P) su_path_rm(P)
+#define a_sandbox_rename_in_store_path(PGP,F,T) (rename(F, T) != -1)
 #define a_sandbox_sock_accepted(PGP,SFD) (TRU1)
 #if VAL_OS_SANDBOX > 0
 # if su_OS_FREEBSD
 #  undef a_sandbox_open
 #  undef a_sandbox_sock_accepted
 #  undef a_sandbox_rm_in_store_path
+#  undef a_sandbox_rename_in_store_path
 static int a_sandbox_open(struct a_pg *pgp, boole store_path, char const *path, int flags, int mode);
 static boole a_sandbox_sock_accepted(struct a_pg *pgp, s32 sockfd);
 #  define a_sandbox_rm_in_store_path(PGP,P) su_path_rm_at((PGP)->pg_store_path_fd, P, su_IOPF_AT_NONE)
+#  define a_sandbox_rename_in_store_path(PGP,F,T) \
+	(renameat((PGP)->pg_store_path_fd, F, (PGP)->pg_store_path_fd, T) != -1)
 
   /* On OpenBSD paths are unveil(2)-fixed on startup */
 # elif su_OS_OPENBSD
@@ -705,8 +1667,8 @@ jretry_all:
 			rv = su_EX_ERR;
 			goto jleave;
 		}
-		if(pgp->pg_flags & a_F_MODE_SHUTDOWN){
-			a_DBG(su_log_write(su_LOG_DEBUG, "--shutdown could acquire write lock: no server");)
+		if(pgp->pg_flags & (a_F_MODE_SHUTDOWN | a_F_MODE_STATS)){
+			a_DBG(su_log_write(su_LOG_DEBUG, "--shutdown/--stats could acquire write lock: no server");)
 			rv = su_EX_TEMPFAIL;
 			goto jleave;
 		}
@@ -769,7 +1731,7 @@ jretry_bind:
 			goto jleave;
 		}
 	}else{
-		ASSERT(!(pgp->pg_flags & a_F_MODE_SHUTDOWN));
+		ASSERT(!(pgp->pg_flags & (a_F_MODE_SHUTDOWN | a_F_MODE_STATS)));
 		/* If we were here already something is borked, fail fast, leave even cleanup to next invocation */
 		if(isstartup){
 			rv = su_EX_SOFTWARE;
@@ -801,7 +1763,7 @@ jretry_bind:
 		goto jleave;
 	}
 
-	if(pgp->pg_flags & (a_F_MODE_STARTUP | a_F_MODE_SHUTDOWN))
+	if(pgp->pg_flags & (a_F_MODE_STARTUP | a_F_MODE_SHUTDOWN | a_F_MODE_STATS))
 		goto jstartup_shutdown;
 
 	close(reafd);
@@ -833,7 +1795,7 @@ jstartup_shutdown:/* C99 */{
 	a_sandbox_client(pgp); /* (sec overkill) */
 
 	xb[1] = xb[2] = '\0';
-	xb[0] = (pgp->pg_flags & a_F_MODE_STARTUP) ? '\05' : '\04';
+	xb[0] = (pgp->pg_flags & a_F_MODE_STARTUP) ? '\05' : (pgp->pg_flags & a_F_MODE_STATS) ? '\06' : '\04';
 	xl = 0;
 	do{
 		ssize_t y;
@@ -847,9 +1809,9 @@ jstartup_shutdown:/* C99 */{
 		xl += y;
 	}while(xl != 3);
 
-	/* Blocks until descriptor goes away, or reads ENQ again */
+	/* Blocks until descriptor goes away, or reads ENQ again; statistics are copied to standard output */
 	for(;;){
-		xl = read(pgp->pg_clima_fd, &soaun, 1);
+		xl = read(pgp->pg_clima_fd, pgp->pg_buf, ((pgp->pg_flags & a_F_MODE_STATS) ? sizeof(pgp->pg_buf) : 1));
 		if(xl == -1){
 			if(su_err_by_errno() == su_ERR_INTR)
 				continue;
@@ -857,6 +1819,10 @@ jstartup_shutdown:/* C99 */{
 			goto jleave;
 		}else if(xl == 0 || (pgp->pg_flags & a_F_MODE_STARTUP))
 			break;
+		else if((pgp->pg_flags & a_F_MODE_STATS) && !a_misc_write_all(STDOUT_FILENO, pgp->pg_buf, S(uz,xl))){
+			rv = su_EX_IOERR;
+			goto jleave;
+		}
 	}
 
 	rv = su_EX_OK;
@@ -865,11 +1831,10 @@ jstartup_shutdown:/* C99 */{
 
 static s32
 a_client__loop(struct a_pg *pgp){
+	struct a_client_batch cb;
 	struct a_line line;
-	char *bp;
-	ssize_t lnr;
-	boole use_this, seen_any;
 	s32 rv;
+	boole eof;
 	NYD_IN;
 
 	/* Ignore signals that may happen (beside a possible SIGCHLD that is ignored per se) */
@@ -879,261 +1844,439 @@ a_client__loop(struct a_pg *pgp){
 
 	if((rv = a_misc_log_open(pgp, TRU1, FAL0)) != su_EX_OK)
 		goto jleave;
+#ifdef a_HAVE_GRAY_SHM
+	if(pgp->pg_flags & a_F_GRAY_SHM)
+		a_client__shm_open(pgp);
+#endif
+	if(pgp->pg_client_cache > 0 && !(pgp->pg_flags & a_F_CLIENT_ONCE))
+		pgp->pg_cc = su_TCALLOC(struct a_client_cache, a_CLIENT_CACHE_SLOTS);
 	a_sandbox_client(pgp);
 
 	/* Main loop: while we receive policy queries, collect the triple(s) we are looking for, ask our server what he
-	 * thinks about that, act accordingly */
+	 * thinks about that, act accordingly.  All complete blocks already buffered are asked for in one batch */
 	a_LINE_SETUP(&line);
-jblock:
-	bp = pgp->pg_buf;
-	pgp->pg_r = pgp->pg_s = pgp->pg_ca = pgp->pg_cname = NIL;
-	use_this = TRU1;
-	seen_any = FAL0;
-
-	while((lnr = a_misc_line_get(pgp, STDIN_FILENO, &line)) != -1){
-		/* Until an empty line ends one block, collect data */
-		if(lnr == 0){
-			/* Query complete?  Normalize data and ask server about triple */
-			if(use_this && ((pgp->pg_flags & a_F_FOCUS_SENDER) || pgp->pg_r != NIL) &&
-					pgp->pg_s != NIL && pgp->pg_ca != NIL && pgp->pg_cname != NIL){
-				if((rv = a_client__req(pgp)) != su_EX_OK)
-					break;
-			}else if(seen_any){
-				static char const asw[] = "action=" a_MSG_NODEFER "\n\n";
-
-				sz c;
-				char const *cp;
-
-				ASSERT(rv == su_EX_OK);
-				a_DBG(su_log_write(su_LOG_DEBUG, "answer incomplete block end %s", asw);)
-				for(cp = asw, c = sizeof(asw) -1; c > 0;){
-					lnr = write(STDOUT_FILENO, cp, S(uz,c));
-					if(lnr == -1){
-						if(su_err_by_errno() == su_ERR_INTR)/* XXX no more in client */
-							continue;
-						rv = su_EX_IOERR;
-						goto jleave;
-					}
-					cp += lnr;
-					c -= lnr;
-				}
-			}
+	STRUCT_ZERO(struct a_req_cnt, &cb.cb_cnt);
+	cb.cb_cnt.rc_magic = a_REQ_CNT_MAGIC;
+	for(eof = FAL0; !eof;){
+		cb.cb_req_no = cb.cb_ans_no = 0;
+		cb.cb_len = 0;
 
-			if(pgp->pg_flags & a_F_CLIENT_ONCE)
+		do{
+			struct a_req_hdr rh;
+			struct iovec iov[5];
+			char const *cp;
+			uz i, off;
+
+			switch(a_misc_policy_block(pgp, STDIN_FILENO, &line)){
+			case a_POLICY_EOF:
+				eof = TRU1;
 				break;
-			goto jblock;
-		}else{
-			/* We assume no WS at BOL and EOL, nor in between key, =, and value.  We use the first value
-			 * shall an attribute appear multiple times; this also aids in bp handling simplicity */
-			uz i;
-			char *cp, *xcp;
-
-			seen_any = TRU1;
-
-			if(!use_this)
-				continue;
-
-			cp = line.l_buf;
-
-			if((xcp = su_cs_find_c(cp, '=')) == NIL){
+			case a_POLICY_PROTO:
 				rv = su_EX_PROTOCOL;
 				goto jleave;
-			}
-
-			i = P2UZ(xcp++ - cp);
-			lnr -= i + 1;
-
-			/* An empty sender= we dig; rest fails later upon normalization */
-			/*if(lnr == 0)
-			 *	continue;*/
-
-			if(i == sizeof("request") -1 && !su_mem_cmp(cp, "request", sizeof("request") -1)){
-				if(lnr != sizeof("smtpd_access_policy") -1 || su_mem_cmp(xcp, "smtpd_access_policy",
-							sizeof("smtpd_access_policy") -1)){
-					/* We are the wrong policy server for this -- log? */
-					a_DBG(su_log_write(su_LOG_DEBUG, "client got wrong request=%s (=DUNNO)", xcp);)
-					use_this = FAL0;
-					continue;
+			case a_POLICY_EMPTY:
+				break;
+			case a_POLICY_DUNNO:
+				a_DBG(su_log_write(su_LOG_DEBUG, "incomplete block end, " a_MSG_NODEFER);)
+				cb.cb_ans[cb.cb_ans_no++] = a_MSG_NODEFER;
+				break;
+			case a_POLICY_TRIPLE:
+				/* Query complete: normalize data and queue request for triple */
+				if(!a_client__req_prep(pgp, &rh, iov)){
+					cb.cb_ans[cb.cb_ans_no++] = a_MSG_NODEFER;
+					break;
 				}
-			}else if(i == sizeof("recipient") -1 && !(pgp->pg_flags & a_F_FOCUS_SENDER) &&
-					!su_mem_cmp(cp, "recipient", sizeof("recipient") -1)){
-				if(pgp->pg_r != NIL)
-					continue;
-				pgp->pg_r = bp;
-			}else if(i == sizeof("sender") -1 && !su_mem_cmp(cp, "sender", sizeof("sender") -1)){
-				if(pgp->pg_s != NIL)
-					continue;
-				pgp->pg_s = bp;
-			}else if(i == sizeof("client_address") -1 &&
-					!su_mem_cmp(cp, "client_address", sizeof("client_address") -1)){
-				if(pgp->pg_ca != NIL)
-					continue;
-				pgp->pg_ca = bp;
-			}else if(i == sizeof("client_name") -1 &&
-					!su_mem_cmp(cp, "client_name", sizeof("client_name") -1)){
-				if(pgp->pg_cname != NIL)
-					continue;
-				pgp->pg_cname = bp;
-			}else
-				continue;
-
-			/* XXX We do have no control over inet_ntop(3) formatting, so in order
-			 * XXX to be able, reserve INET6_A8N bytes! -> SU ip_addr */
-			if(UCMP(z, lnr, >=, P2UZ(&pgp->pg_buf[sizeof(pgp->pg_buf) - ALIGN_Z(INET6_ADDRSTRLEN+1) -1
-					] - bp))){
-				a_DBG(su_log_write(su_LOG_DEBUG, "client buffer too small!!!");)
-				use_this = FAL0;
-			}else{
-				char *top;
-
-				top = (pgp->pg_ca == bp) ? &bp[ALIGN_Z(INET6_ADDRSTRLEN +1)] : NIL;
-				bp = &su_cs_pcopy(bp, xcp)[1];
-				if(top != NIL){
-					ASSERT(bp <= top);
-					bp = top;
+				for(off = cb.cb_len, i = 0; i < NELEM(iov); ++i){
+					ASSERT(cb.cb_len + iov[i].iov_len <= sizeof(cb.cb_buf) - sizeof(cb.cb_cnt));
+					su_mem_copy(&cb.cb_buf[cb.cb_len], iov[i].iov_base, iov[i].iov_len);
+					cb.cb_len += iov[i].iov_len;
 				}
+				if((cp = a_client__local(pgp, &cb, off)) != NIL){
+					cb.cb_len = off;
+					cb.cb_ans[cb.cb_ans_no++] = cp;
+					break;
+				}
+				cb.cb_ans[cb.cb_ans_no++] = NIL;
+				cb.cb_req_off[cb.cb_req_no++] = S(u32,off);
+				break;
 			}
-		}
+		}while(!eof && !(pgp->pg_flags & a_F_CLIENT_ONCE) && cb.cb_ans_no < a_REQ_BATCH &&
+			a_misc_policy_pending(&line));
+
+		if(cb.cb_ans_no > 0 && (rv = a_client__req(pgp, &cb)) != su_EX_OK)
+			goto jleave;
+
+		if(pgp->pg_flags & a_F_CLIENT_ONCE)
+			break;
 	}
-	if(rv == su_EX_OK && line.l_err != su_ERR_NONE && !(pgp->pg_flags & a_F_CLIENT_ONCE))
+
+	if(line.l_err != su_ERR_NONE && !(pgp->pg_flags & a_F_CLIENT_ONCE))
 		rv = su_EX_IOERR;
 
+	/* Report what the last batches answered themselves; best-effort */
+	if((cb.cb_cnt.rc_allow | cb.cb_cnt.rc_block | cb.cb_cnt.rc_pass) != 0)
+		(void)a_misc_write_all(pgp->pg_clima_fd, &cb.cb_cnt, sizeof(cb.cb_cnt));
+
 jleave:
 	NYD_OU;
 	return rv;
 }
 
 static s32
-a_client__req(struct a_pg *pgp){
-	struct iovec iov[5], *iovp;
+a_client__req(struct a_pg *pgp, struct a_client_batch *cbp){
+	u8 resp[a_REQ_BATCH];
 	char const *cp;
-	u8 resp;
 	ssize_t srvx;
-	s32 rv, c;
+	u32 i, j;
+	s32 rv;
+	boole nodefer;
 	NYD_IN;
 
 	rv = su_EX_OK;
+	nodefer = FAL0;
+
+	/* Send all requests (and pending counts), then get all server response bytes */
+	if(cbp->cb_req_no > 0){
+		if((cbp->cb_cnt.rc_allow | cbp->cb_cnt.rc_block | cbp->cb_cnt.rc_pass) != 0){
+			su_mem_copy(&cbp->cb_buf[cbp->cb_len], &cbp->cb_cnt, sizeof(cbp->cb_cnt));
+			cbp->cb_len += sizeof(cbp->cb_cnt);
+			cbp->cb_cnt.rc_allow = cbp->cb_cnt.rc_block = cbp->cb_cnt.rc_pass = 0;
+		}
 
-	if(!(pgp->pg_flags & a_F_FOCUS_SENDER) && !a_norm_triple_r(pgp))
-		goto jex_nodefer;
-	/* xxx We explicitly allow empty from=<>, seen for automated responses */
-	if(*pgp->pg_s != '\0' && !a_norm_triple_s(pgp))
-		goto jex_nodefer;
-	if(!a_norm_triple_ca(pgp))
-		goto jex_nodefer;
-	if(!a_norm_triple_cname(pgp))
-		goto jex_nodefer;
-
-	/* Requests are terminated with \0\0 */
-	if(pgp->pg_flags & a_F_FOCUS_SENDER){
-		iov[0].iov_base = UNCONST(char*,su_empty);
-		iov[0].iov_len = sizeof(su_empty[0]);
-	}else{
-		iov[0].iov_base = pgp->pg_r;
-		iov[0].iov_len = su_cs_len(pgp->pg_r) +1;
-	}
-	iov[1].iov_base = pgp->pg_s;
-	iov[1].iov_len = su_cs_len(pgp->pg_s) +1;
-	iov[2].iov_base = pgp->pg_ca;
-	iov[2].iov_len = su_cs_len(pgp->pg_ca) +1;
-	iov[3].iov_base = pgp->pg_cname;
-	iov[3].iov_len = su_cs_len(pgp->pg_cname) +1;
-	iov[4].iov_base = UNCONST(char*,su_empty);
-	iov[4].iov_len = sizeof(su_empty[0]);
+		if(!a_misc_write_all(pgp->pg_clima_fd, cbp->cb_buf, cbp->cb_len)){
+			rv = su_err();
+			goto jioerr;
+		}
 
-	if(pgp->pg_flags & a_F_VV)
-		su_log_write(su_LOG_INFO, "asking R=%u<%s> S=%u<%s> CA=%u<%s> CNAME=%u<%s>",
-			iov[0].iov_len -1, iov[0].iov_base, iov[1].iov_len -1, iov[1].iov_base,
-			iov[2].iov_len -1, iov[2].iov_base, iov[3].iov_len -1, iov[3].iov_base);
-
-	iovp = iov;
-	c = NELEM(iov);
-jredo_write:
-	srvx = writev(pgp->pg_clima_fd, iovp, c);
-	if(srvx == -1){
-		if((rv = su_err_by_errno()) == su_ERR_INTR)/* XXX no more in client */
-			goto jredo_write;
-		goto jioerr;
-	}else{
-		for(; c > 0; ++iovp, --c){
-			if(UCMP(z, srvx, <, iovp->iov_len)){
-				iovp->iov_base = S(char*,iovp->iov_base) + srvx;
-				iovp->iov_len -= S(uz,srvx);
-				goto jredo_write;
+		for(i = 0; i < cbp->cb_req_no; i += S(u32,srvx)){
+			srvx = read(pgp->pg_clima_fd, &resp[i], cbp->cb_req_no - i);
+			if(srvx == -1){
+				if((rv = su_err_by_errno()) == su_ERR_INTR){/* XXX no more in client */
+					srvx = 0;
+					continue;
+				}
+				goto jioerr;
+			}else if(srvx == 0){
+				/* This cannot happen here */
+				rv = su_ERR_AGAIN;
+jioerr:
+				su_log_write(su_LOG_ERR, _("I/O error in server communication: %s"), V_(su_err_doc(rv)));
+				/* If the server is gone, then restart cycle from our point of view */
+				rv = (rv == su_ERR_PIPE) ? -su_EX_IOERR : su_EX_IOERR;
+				nodefer = TRU1;
+				break;
 			}
-			srvx -= iovp->iov_len;
 		}
-		/* We do not care whether OS wrote more than we */
 	}
 
-	/* Get server response byte */
-jredo_read:
-	srvx = read(pgp->pg_clima_fd, &resp, sizeof(resp));
-	if(srvx == -1){
-		if((rv = su_err_by_errno()) == su_ERR_INTR)/* XXX no more in client */
-			goto jredo_read;
-jioerr:
-		su_log_write(su_LOG_ERR, _("I/O error in server communication: %s"), V_(su_err_doc(rv)));
-		/* If the server is gone, then restart cycle from our point of view */
-		rv = (rv == su_ERR_PIPE) ? -su_EX_IOERR : su_EX_IOERR;
-		goto jex_nodefer;
-	}else if(UCMP(z, srvx, !=, sizeof(resp))){
-		/* This cannot happen here */
-		rv = su_ERR_AGAIN;
-		goto jioerr;
+	/* Remember cachable answers (before .cb_buf is reused for output) */
+	if(pgp->pg_cc != NIL && !nodefer){
+		char key[a_BUF_SIZE];
+		struct timespec ts;
+		struct a_client_cache *ccp;
+		uz l;
+		u32 h;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		for(j = 0; j < cbp->cb_req_no; ++j){
+			if(resp[j] != a_ANSWER_ALLOW && resp[j] != a_ANSWER_BLOCK && resp[j] != a_ANSWER_NODEFER)
+				continue;
+			l = a_client__key(key, &cbp->cb_buf[cbp->cb_req_off[j]]);
+			h = a_misc_cksum(a_MISC_CKSUM_INIT, key, l);
+			ccp = &pgp->pg_cc[h & (a_CLIENT_CACHE_SLOTS - 1)];
+			ccp->cc_hash = h;
+			ccp->cc_len = S(u32,l);
+			ccp->cc_time = ts.tv_sec;
+			ccp->cc_ans = resp[j];
+			su_mem_copy(ccp->cc_key, key, l);
+		}
 	}
 
-	rv = su_EX_OK;
+	cbp->cb_len = 0;
 
-	switch(resp){
-	case a_ANSWER_ALLOW:
-		cp = pgp->pg_msg_allow;
-		break;
-	case a_ANSWER_BLOCK:
-		cp = pgp->pg_msg_block;
-		break;
-	case a_ANSWER_DEFER_SLEEP:
-		su_time_msleep(a_LIMIT_DELAY_SECS * su_TIMESPEC_SEC_MILLIS, TRU1);
-		FALLTHRU
-	case a_ANSWER_DEFER:
-		cp = pgp->pg_msg_defer;
-		break;
-	default:
-	case a_ANSWER_NODEFER:
-jex_nodefer:
-		cp = a_MSG_NODEFER;
-		break;
+	for(i = j = 0; i < cbp->cb_ans_no; ++i){
+		if((cp = cbp->cb_ans[i]) == NIL){
+			switch(nodefer ? a_ANSWER_NODEFER : resp[j++]){
+			case a_ANSWER_ALLOW:
+				cp = pgp->pg_msg_allow;
+				break;
+			case a_ANSWER_BLOCK:
+				cp = pgp->pg_msg_block;
+				break;
+			case a_ANSWER_DEFER_SLEEP: /* (Older servers only: it is held back by __cli_park() now) */
+				su_time_msleep(pgp->pg_limit_delay_time, TRU1);
+				FALLTHRU
+			case a_ANSWER_DEFER:
+				cp = pgp->pg_msg_defer;
+				break;
+			default:
+			case a_ANSWER_NODEFER:
+				cp = a_MSG_NODEFER;
+				break;
+			}
+		}
+
+		a_DBG(su_log_write(su_LOG_DEBUG, "answer %s", cp);)
+		if(!a_client__out(cbp, "action=", sizeof("action=") -1) || !a_client__out(cbp, cp, su_cs_len(cp)) ||
+				!a_client__out(cbp, "\n\n", sizeof("\n\n") -1))
+			goto jeout;
 	}
 
-	a_DBG(su_log_write(su_LOG_DEBUG, "answer %s", cp);)
-	/* C99 */{
-		char *xp;
-
-		xp = pgp->pg_buf;
-		xp = su_cs_pcopy(xp, "action=");
-		xp = su_cs_pcopy(xp, cp);
-		xp[0] = '\n';
-		xp[1] = '\n';
-		xp[2] = '\0'; /* hmm */
-		xp += 2;
-		cp = pgp->pg_buf;
-		c = S(s32,xp - cp);
+	if(!a_misc_write_all(STDOUT_FILENO, cbp->cb_buf, cbp->cb_len)){
+jeout:
+		if(rv == su_EX_OK)
+			rv = su_EX_IOERR;
 	}
-	while(c > 0){
-		srvx = write(STDOUT_FILENO, cp, S(u32,c));
-		if(srvx == -1){
-			if(su_err_by_errno() == su_ERR_INTR)/* XXX no more in client */
-				continue;
-			rv = su_EX_IOERR;
+
+	NYD_OU;
+	return rv;
+}
+
+static boole
+a_client__out(struct a_client_batch *cbp, void const *dat, uz len){
+	boole rv;
+	NYD2_IN;
+
+	rv = TRU1;
+
+	if(len > sizeof(cbp->cb_buf) - cbp->cb_len){
+		rv = a_misc_write_all(STDOUT_FILENO, cbp->cb_buf, cbp->cb_len);
+		cbp->cb_len = 0;
+		if(rv && len > sizeof(cbp->cb_buf)){
+			rv = a_misc_write_all(STDOUT_FILENO, dat, len);
+			goto jleave;
+		}
+	}
+
+	su_mem_copy(&cbp->cb_buf[cbp->cb_len], dat, len);
+	cbp->cb_len += len;
+
+jleave:
+	NYD2_OU;
+	return rv;
+}
+
+static boole
+a_client__req_prep(struct a_pg *pgp, struct a_req_hdr *rhp, struct iovec iov[5]){
+	boole rv;
+	NYD_IN;
+
+	rv = FAL0;
+
+	if(!(pgp->pg_flags & a_F_FOCUS_SENDER) && !a_norm_triple_r(pgp))
+		goto jleave;
+	/* xxx We explicitly allow empty from=<>, seen for automated responses */
+	if(*pgp->pg_s != '\0' && !a_norm_triple_s(pgp))
+		goto jleave;
+	if(!a_norm_triple_ca(pgp))
+		goto jleave;
+	if(!a_norm_triple_cname(pgp))
+		goto jleave;
+
+	/* Protocol v2: server can index the strings */
+	STRUCT_ZERO(struct a_req_hdr, rhp);
+	rhp->rh_magic = a_REQ_MAGIC;
+
+	iov[0].iov_base = rhp;
+	iov[0].iov_len = sizeof(*rhp);
+	if(pgp->pg_flags & a_F_FOCUS_SENDER){
+		iov[1].iov_base = UNCONST(char*,su_empty);
+		iov[1].iov_len = sizeof(su_empty[0]);
+	}else{
+		iov[1].iov_base = pgp->pg_r;
+		iov[1].iov_len = su_cs_len(pgp->pg_r) +1;
+	}
+	iov[2].iov_base = pgp->pg_s;
+	iov[2].iov_len = su_cs_len(pgp->pg_s) +1;
+	iov[3].iov_base = pgp->pg_ca;
+	iov[3].iov_len = su_cs_len(pgp->pg_ca) +1;
+	iov[4].iov_base = pgp->pg_cname;
+	iov[4].iov_len = su_cs_len(pgp->pg_cname) +1;
+
+	rhp->rh_r_len = S(u16,iov[1].iov_len -1);
+	rhp->rh_s_len = S(u16,iov[2].iov_len -1);
+	rhp->rh_ca_len = S(u16,iov[3].iov_len -1);
+	rhp->rh_cn_len = S(u16,iov[4].iov_len -1);
+
+	if(pgp->pg_flags & a_F_VV)
+		su_log_write(su_LOG_INFO, "asking R=%u<%s> S=%u<%s> CA=%u<%s> CNAME=%u<%s>",
+			rhp->rh_r_len, iov[1].iov_base, rhp->rh_s_len, iov[2].iov_base,
+			rhp->rh_ca_len, iov[3].iov_base, rhp->rh_cn_len, iov[4].iov_base);
+
+	rv = TRU1;
+jleave:
+	NYD_OU;
+	return rv;
+}
+
+static uz
+a_client__key(char buf[a_BUF_SIZE], char const *req){
+	struct a_req_hdr rh;
+	uz l;
+	NYD2_IN;
+
+	su_mem_copy(&rh, req, sizeof(rh));
+	l = S(uz,rh.rh_r_len) + rh.rh_s_len + rh.rh_ca_len + rh.rh_cn_len + 3;
+	ASSERT(l < a_BUF_SIZE);
+	su_mem_copy(buf, &req[sizeof(rh)], l);
+	buf[rh.rh_r_len] = '/';
+	buf[rh.rh_r_len + 1 + rh.rh_s_len] = '/';
+
+	NYD2_OU;
+	return l;
+}
+
+static char const *
+a_client__local(struct a_pg *pgp, struct a_client_batch *cbp, uz off){
+	char key[a_BUF_SIZE];
+	struct timespec ts;
+	uz l;
+	u32 h;
+	struct a_client_cache *ccp;
+	char const *rv;
+	NYD2_IN;
+
+	rv = NIL;
+
+	if(pgp->pg_cc == NIL && pgp->pg_shm == NIL)
+		goto jleave;
+
+	l = a_client__key(key, &cbp->cb_buf[off]);
+
+#ifdef a_HAVE_GRAY_SHM
+	if(pgp->pg_shm != NIL && a_client__shm_find(pgp, key, l)){
+		++cbp->cb_cnt.rc_pass;
+		rv = a_MSG_NODEFER;
+		goto jleave;
+	}
+#endif
+
+	if(pgp->pg_cc != NIL){
+		h = a_misc_cksum(a_MISC_CKSUM_INIT, key, l);
+		ccp = &pgp->pg_cc[h & (a_CLIENT_CACHE_SLOTS - 1)];
+		if(ccp->cc_len != l || ccp->cc_hash != h || su_mem_cmp(ccp->cc_key, key, l))
+			goto jleave;
+
+		/* (Wall clock steps must not extend the lifetime) */
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		if(S(s64,ts.tv_sec) - ccp->cc_time >= pgp->pg_client_cache){
+			ccp->cc_len = 0;
+			goto jleave;
+		}
+
+		switch(ccp->cc_ans){
+		case a_ANSWER_ALLOW:
+			++cbp->cb_cnt.rc_allow;
+			rv = pgp->pg_msg_allow;
+			break;
+		case a_ANSWER_BLOCK:
+			++cbp->cb_cnt.rc_block;
+			rv = pgp->pg_msg_block;
+			break;
+		default:
+			++cbp->cb_cnt.rc_pass;
+			rv = a_MSG_NODEFER;
 			break;
 		}
-		cp += srvx;
-		c -= srvx;
+
+		if(pgp->pg_flags & a_F_VV)
+			su_log_write(su_LOG_INFO, "--client-cache: %s", rv);
+	}
+
+jleave:
+	NYD2_OU;
+	return rv;
+}
+
+#ifdef a_HAVE_GRAY_SHM
+static void
+a_client__shm_open(struct a_pg *pgp){
+	struct stat st;
+	void *vp;
+	struct a_gray_shm *gsp;
+	s32 fd;
+	NYD_IN;
+
+	while((fd = open(a_GRAY_SHM_NAME, (O_RDONLY | a_O_NOFOLLOW | a_O_NOCTTY))) == -1){
+		if((fd = su_err_by_errno()) == su_ERR_INTR)
+			continue;
+		/* Server (re)starting, or option not in its configuration */
+		if(fd != su_ERR_NOENT)
+			goto jerr;
+		goto jleave;
+	}
+
+	vp = MAP_FAILED;
+	if(fstat(fd, &st) == -1)
+		su_err_by_errno();
+	else if(S(uz,st.st_size) < su_VSTRUCT_SIZEOF(struct a_gray_shm,gs_slot))
+		su_err_set(su_ERR_INVAL);
+	else if((vp = mmap(NIL, S(uz,st.st_size), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		su_err_by_errno();
+	close(fd);
+
+	if(vp == MAP_FAILED)
+		goto jerr;
+
+	/* Magic is written last: a half-initialized mapping is simply ignored */
+	gsp = S(struct a_gray_shm*,vp);
+	if(su_mem_cmp(gsp->gs_magic, a_GRAY_SHM_MAGIC, sizeof(a_GRAY_SHM_MAGIC)) || gsp->gs_bom != a_GRAY_BIN_BOM ||
+			gsp->gs_version != a_GRAY_SHM_VERSION ||
+			S(uz,st.st_size) != su_VSTRUCT_SIZEOF(struct a_gray_shm,gs_slot) +
+				sizeof(struct a_gray_shm_slot) * (S(uz,gsp->gs_mask) + 1)){
+		munmap(vp, S(uz,st.st_size));
+		su_err_set(su_ERR_INVAL);
+		goto jerr;
 	}
 
+	pgp->pg_shm = gsp;
+jleave:
 	NYD_OU;
+	return;
+
+jerr:
+	su_log_write(su_LOG_WARN, _("--gray-shared: cannot use %s/%s, asking server: %s"),
+		pgp->pg_store_path, a_GRAY_SHM_NAME, V_(su_err_doc(-1)));
+	goto jleave;
+}
+
+static boole
+a_client__shm_find(struct a_pg *pgp, char const *key, uz len){
+	struct su_timespec ts;
+	u64 fp;
+	u32 seq, t;
+	struct a_gray_shm_slot const *gssp;
+	struct a_gray_shm const *gsp;
+	boole rv;
+	NYD2_IN;
+
+	rv = FAL0;
+	gsp = pgp->pg_shm;
+
+	fp = a_misc_fprint(gsp->gs_key, key, len);
+	gssp = &gsp->gs_slot[fp & gsp->gs_mask];
+
+	seq = a_SHM_LOAD(&gssp->gss_seq);
+	if(seq & 1)
+		goto jleave;
+	rv = (a_SHM_LOAD_RLX(&gssp->gss_fp) == fp);
+	t = a_SHM_LOAD_RLX(&gssp->gss_time);
+	a_SHM_FENCE_ACQ();
+	if(!rv || a_SHM_LOAD_RLX(&gssp->gss_seq) != seq){
+		rv = FAL0;
+		goto jleave;
+	}
+
+	su_timespec_current(&ts);
+	if((rv = (S(u32,ts.ts_sec) - t < a_SHM_LOAD_RLX(&gsp->gs_ttl))) && (pgp->pg_flags & a_F_VV))
+		su_log_write(su_LOG_INFO, "--gray-shared: %s", a_MSG_NODEFER);
+
+jleave:
+	NYD2_OU;
 	return rv;
 }
+#endif /* a_HAVE_GRAY_SHM */
+
 /* }}} */
 
 /* server {{{ */
@@ -1430,6 +2573,10 @@ a_server__setup(struct a_pg *pgp){
 	NYD_IN;
 
 	mp = pgp->pg_master;
+	mp->m_ev.ev_fd = -1;
+	mp->m_jnl.gj_fd = -1;
+	mp->m_polfd = -1;
+	mp->m_peer_fd = -1;
 
 	while(ftruncate(mp->m_reafd, 0) == -1){
 		if((rv = su_err_by_errno()) != su_ERR_INTR)
@@ -1454,21 +2601,48 @@ a_server__setup(struct a_pg *pgp){
 		}
 	}
 
-	mp->m_cli_fds = su_TALLOC(s32, pgp->pg_server_queue);
+	pgp->pg_cnt = &mp->m_cnt;
+	pgp->pg_ev = &mp->m_ev;
+	pgp->pg_cli_fds = su_TALLOC(s32, pgp->pg_server_queue);
+	pgp->pg_park = su_TCALLOC(struct a_park, pgp->pg_server_queue);
+	mp->m_gray_no = MAX(1, pgp->pg_server_threads);
 
 	su_cs_dict_create(&mp->m_white.wb_ca, a_WB_CA_FLAGS, NIL);
-	su_cs_dict_create(&mp->m_white.wb_cname, a_WB_CNAME_FLAGS, NIL);
 	su_cs_dict_create(&mp->m_black.wb_ca, a_WB_CA_FLAGS, NIL);
-	su_cs_dict_create(&mp->m_black.wb_cname, a_WB_CNAME_FLAGS, NIL);
 	if((rv = a_server__wb_setup(pgp, FAL0)) != su_EX_OK)
 		goto jleave;
 
+	/* The accept(2) queue is drained until EAGAIN */
+	if(!a_server__ev_open(&mp->m_ev, TRU1))
+		goto jeev;
+	if(fcntl(pgp->pg_clima_fd, F_SETFL, O_NONBLOCK) == -1){
+		su_err_by_errno();
+		goto jeev;
+	}
+
+	if((rv = a_server__policy_open(pgp)) != su_EX_OK)
+		goto jleave;
+	if((rv = a_server__peer_open(pgp)) != su_EX_OK)
+		goto jleave;
+
 	a_server__gray_create(pgp);
 
+#ifdef a_HAVE_GRAY_SHM
+	a_server__gray_shm_open(pgp);
+#else
+	if(pgp->pg_flags & a_F_GRAY_SHM)
+		su_log_write(su_LOG_ERR, _("--gray-shared: not supported by this compiler, continuing without"));
+#endif
+
 jleave:
 	NYD_OU;
 	return rv;
 
+jeev:
+	su_log_write(su_LOG_CRIT, _("cannot prepare server socket event handling: %s"), V_(su_err_doc(-1)));
+	rv = su_EX_OSERR;
+	goto jleave;
+
 jepid:
 	su_log_write(su_LOG_CRIT, _("cannot update server PID to reassurance lock %s/%s: %s"),
 		pgp->pg_store_path, a_REA_NAME, V_(su_err_doc(rv)));
@@ -1493,16 +2667,66 @@ a_server__reset(struct a_pg *pgp){
 
 	mp = pgp->pg_master;
 
+	a_server__ev_close(&mp->m_ev);
+
+	if(mp->m_jnl.gj_fd >= 0)
+		close(mp->m_jnl.gj_fd);
+
+	if(mp->m_peer_fd >= 0)
+		close(mp->m_peer_fd);
+	while(mp->m_peer_no > 0)
+		close(mp->m_peers[--mp->m_peer_no].p_fd);
+
 #if a_DBGIF
-	su_cs_dict_gut(&mp->m_gray);
+	if(mp->m_peers != NIL){
+		su_FREE(mp->m_peers);
+		su_FREE(mp->m_peer_buf);
+		a_MT( pthread_mutex_destroy(&mp->m_peer_mtx); )
+	}
+
+	if(mp->m_jnl.gj_buf != NIL){
+		su_FREE(mp->m_jnl.gj_buf);
+		a_MT( pthread_mutex_destroy(&mp->m_jnl.gj_mtx); )
+	}
+
+	if(mp->m_lazy != NIL){
+		u32 i;
+
+		for(i = 0; i < a_GRAY_LAZY_SRC__MAX; ++i)
+			if(mp->m_lazy->gl_map[i] != NIL)
+				munmap(mp->m_lazy->gl_map[i], mp->m_lazy->gl_len[i]);
+		su_cs_dict_gut(&mp->m_lazy->gl_dead);
+		su_FREE(mp->m_lazy);
+	}
+
+	if(mp->m_grays != NIL){
+		u32 i;
+
+		for(i = 0; i < mp->m_gray_no; ++i){
+			a_server__gray_st_gut(&mp->m_grays[i]);
+# ifdef a_HAVE_MT
+			pthread_mutex_destroy(&mp->m_grays[i].g_mtx);
+# endif
+		}
+		su_FREE(mp->m_grays);
+	}
 
 	a_server__wb_reset(mp);
 	su_cs_dict_gut(&mp->m_black.wb_ca);
-	su_cs_dict_gut(&mp->m_black.wb_cname);
 	su_cs_dict_gut(&mp->m_white.wb_ca);
-	su_cs_dict_gut(&mp->m_white.wb_cname);
 
-	su_FREE(mp->m_cli_fds);
+	/* C99 */{
+		u32 i;
+
+		for(i = 0; i < pgp->pg_cli_no; ++i){
+			if(pgp->pg_park[i].p_buf != NIL)
+				su_FREE(pgp->pg_park[i].p_buf);
+			if(pgp->pg_park[i].p_line != NIL)
+				su_FREE(pgp->pg_park[i].p_line);
+		}
+	}
+	su_FREE(pgp->pg_park);
+	su_FREE(pgp->pg_cli_fds);
 #endif
 
 	rv = su_EX_OK;
@@ -1520,6 +2744,25 @@ a_server__reset(struct a_pg *pgp){
 		rv = su_EX_OSERR;
 	}
 
+	/* (Clients of a next server shall not see our answers) */
+	if(pgp->pg_shm != NIL && !a_sandbox_rm_in_store_path(pgp, a_GRAY_SHM_NAME)){
+		su_log_write(su_LOG_CRIT, _("cannot remove --gray-shared table %s/%s: %s"),
+			pgp->pg_store_path, a_GRAY_SHM_NAME, V_(su_err_doc(-1)));
+		rv = su_EX_OSERR;
+	}
+
+	if(mp->m_polfd >= 0){
+		close(mp->m_polfd);
+
+		/* A socket name within --store-path */
+		if(su_cs_find_c(pgp->pg_policy_listen, ':') == NIL &&
+				!a_sandbox_rm_in_store_path(pgp, pgp->pg_policy_listen)){
+			su_log_write(su_LOG_CRIT, _("cannot remove --policy-listen socket %s/%s: %s"),
+				pgp->pg_store_path, pgp->pg_policy_listen, V_(su_err_doc(-1)));
+			rv = su_EX_OSERR;
+		}
+	}
+
 #if a_DBGIF
 # if defined a_HAVE_LOG_FIFO && su_OS_FREEBSD
 	if(pgp->pg_store_path_fd >= 0)
@@ -1537,12 +2780,86 @@ a_server__reset(struct a_pg *pgp){
 	return rv;
 }
 
+static s32
+a_server__policy_open(struct a_pg *pgp){
+	union a_sockaddr sa;
+	u32 salen;
+	s32 fd, rv;
+	NYD_IN;
+
+	rv = su_EX_OK;
+
+	if(pgp->pg_policy_listen == NIL)
+		goto jleave;
+
+	salen = a_misc_policy_addr(pgp->pg_policy_listen, &sa, FAL0);
+	ASSERT(salen != 0);
+
+	while((fd = socket(sa.sa.sa_family, SOCK_STREAM, 0)) == -1){
+		if((rv = su_err_by_errno()) == su_ERR_INTR)
+			continue;
+		if(a_misc_os_resource_delay(rv))
+			continue;
+		goto jerr;
+	}
+
+	if(sa.sa.sa_family == AF_UNIX){
+		struct su_pathinfo pi;
+
+		/* We own the reassurance lock: a socket left over is stale */
+		if(su_pathinfo_lstat(&pi, sa.un.sun_path)){
+			if(!su_pathinfo_is_sock(&pi)){
+				su_log_write(su_LOG_CRIT, _("will not remove non-socket --policy-listen %s/%s"),
+					pgp->pg_store_path, sa.un.sun_path);
+				close(fd);
+				rv = su_EX_SOFTWARE;
+				goto jleave;
+			}
+			if(!su_path_rm(sa.un.sun_path)){
+				rv = su_err();
+				goto jerr_close;
+			}
+		}
+	}else{
+		int one;
+
+		one = 1;
+		(void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	}
+
+	for(;;){
+		if(!bind(fd, &sa.sa, salen))
+			break;
+		if((rv = su_err_by_errno()) != su_ERR_INTR)
+			goto jerr_close;
+	}
+
+	/* Like the client/server socket the accept(2) queue is drained until EAGAIN */
+	if(listen(fd, a_SERVER_LISTEN) || fcntl(fd, F_SETFL, O_NONBLOCK) == -1){
+		rv = su_err_by_errno();
+		pgp->pg_master->m_polfd = fd;
+		goto jerr;
+	}
+
+	pgp->pg_master->m_polfd = fd;
+	rv = su_EX_OK;
+jleave:
+	NYD_OU;
+	return rv;
+
+jerr_close:
+	close(fd);
+jerr:
+	su_log_write(su_LOG_CRIT, _("cannot create --policy-listen socket %s: %s"),
+		pgp->pg_policy_listen, V_(su_err_doc(rv)));
+	rv = su_EX_IOERR;
+	goto jleave;
+}
+
 static s32
 a_server__wb_setup(struct a_pg *pgp, boole reset){
 	sigset_t ssn, sso;
-	struct su_avopt avo;
 	s32 rv;
-	BITENUM(u32,a_avo_flags) f;
 	struct a_master *mp;
 	NYD_IN;
 
@@ -1555,14 +2872,43 @@ a_server__wb_setup(struct a_pg *pgp, boole reset){
 #endif
 		sigprocmask(SIG_BLOCK, &ssn, &sso);
 
+#ifdef a_HAVE_MT
+		if(mp->m_thr_no > 0)
+			pthread_rwlock_wrlock(&mp->m_wb_rwl);
+#endif
+
 		a_sandbox_path_reset(pgp, FAL0);
 		a_server__wb_reset(mp);
 	}
 
+	rv = a_server__wb_parse(pgp, reset);
+
+	if(reset){
+#ifdef a_HAVE_MT
+		if(mp->m_thr_no > 0){
+			++mp->m_conf_gen;
+			pthread_rwlock_unlock(&mp->m_wb_rwl);
+		}
+#endif
+		sigprocmask(SIG_SETMASK, &sso, NIL);
+	}
+
+	NYD_OU;
+	return rv;
+}
+
+static s32
+a_server__wb_parse(struct a_pg *pgp, boole reset){
+	struct su_avopt avo;
+	s32 rv;
+	BITENUM(u32,a_avo_flags) f;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
 	su_cs_dict_add_flags(&mp->m_white.wb_ca, su_CS_DICT_FROZEN);
-	su_cs_dict_add_flags(&mp->m_white.wb_cname, su_CS_DICT_FROZEN);
 	su_cs_dict_add_flags(&mp->m_black.wb_ca, su_CS_DICT_FROZEN);
-	su_cs_dict_add_flags(&mp->m_black.wb_cname, su_CS_DICT_FROZEN);
 
 	if(reset){
 		a_conf_setup(pgp, a_AVO_RELOAD);
@@ -1597,11 +2943,12 @@ jreavo:
 		a_DBG(su_log_write(su_LOG_DEBUG, "--startup server, setting --server-timeout=0");)
 		pgp->pg_server_timeout = 0;
 	}
+	/* postfix talks to us directly then, nobody would restart us; peers neither */
+	if(pgp->pg_policy_listen != NIL || pgp->pg_peer_listen != NIL)
+		pgp->pg_server_timeout = 0;
 
 	su_cs_dict_balance(&mp->m_white.wb_ca);
-	su_cs_dict_balance(&mp->m_white.wb_cname);
 	su_cs_dict_balance(&mp->m_black.wb_ca);
-	su_cs_dict_balance(&mp->m_black.wb_cname);
 
 	if(reset && (pgp->pg_flags & a_F_VV))
 		su_log_write(su_LOG_INFO, "reloaded configuration");
@@ -1610,34 +2957,59 @@ jreavo:
 jleave:
 	pgp->pg_flags &= ~S(uz,a_F_MASTER_IN_SETUP);
 
-	if(reset)
-		sigprocmask(SIG_SETMASK, &sso, NIL);
-
 	NYD_OU;
 	return rv;
 }
 
+static void
+a_server__wb_reloaded(struct a_pg *pgp){
+	u32 i;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call after config reload");)
+	for(i = 0; i < mp->m_gray_no; ++i){
+		a_MT( pthread_mutex_lock(&mp->m_grays[i].g_mtx); )
+		a_server__gray_maintenance(pgp, &mp->m_grays[i], FAL0, 0, NIL);
+		a_MT( pthread_mutex_unlock(&mp->m_grays[i].g_mtx); )
+	}
+
+#ifdef a_HAVE_GRAY_SHM
+	/* Answers may differ now */
+	if(pgp->pg_shm != NIL)
+		a_server__gray_shm_clear(pgp);
+#endif
+
+	NYD_OU;
+}
+
 static void
 a_server__wb_reset(struct a_master *mp){
-	struct a_srch *pgsp;
+	u32 i;
 	NYD_IN;
 
 	su_cs_dict_clear(&mp->m_black.wb_ca);
-	su_cs_dict_clear(&mp->m_black.wb_cname);
 	su_cs_dict_clear(&mp->m_white.wb_ca);
-	su_cs_dict_clear(&mp->m_white.wb_cname);
 
-	while((pgsp = mp->m_white.wb_srch) != NIL){
-		mp->m_white.wb_srch = pgsp->s_next;
-		su_FREE(pgsp);
+	for(i = 0; i < a_SRCH_TYPE__MAX; ++i){
+		a_server__srch_free(mp->m_white.wb_srch[i]);
+		mp->m_white.wb_srch[i] = NIL;
+		a_server__srch_free(mp->m_black.wb_srch[i]);
+		mp->m_black.wb_srch[i] = NIL;
 	}
-	mp->m_white.wb_srch_tail = NIL;
+	mp->m_white.wb_srch_cnt = mp->m_black.wb_srch_cnt = 0;
 
-	while((pgsp = mp->m_black.wb_srch) != NIL){
-		mp->m_black.wb_srch = pgsp->s_next;
-		su_FREE(pgsp);
+	a_server__dom_free(mp->m_dom);
+	mp->m_dom = NIL;
+	mp->m_dom_no = 0;
+	mp->m_white.wb_cname_cnt = mp->m_black.wb_cname_cnt = 0;
+
+	if(mp->m_lim != NIL){
+		a_misc_lim_close(mp->m_lim);
+		mp->m_lim = NIL;
 	}
-	mp->m_black.wb_srch_tail = NIL;
 
 	NYD_OU;
 }
@@ -1645,58 +3017,94 @@ a_server__wb_reset(struct a_master *mp){
 
 static s32
 a_server__loop(struct a_pg *pgp){ /* {{{ */
-	fd_set rfds;
 	sigset_t psigset, psigseto;
 	struct timespec tos;
-	u32 ograycnt;
 	struct a_master *mp;
 	s32 rv;
+	boole lwatch;
 	NYD_IN;
 
 	rv = su_EX_OK;
 	mp = pgp->pg_master;
-	ograycnt = su_cs_dict_count(&mp->m_gray) + a_GRAY_MIN_LIMIT;
-	ASSERT(su_cs_dict_flags(&mp->m_gray) & su_CS_DICT_FROZEN);
+	lwatch = FAL0;
+	a_server_chld = FAL0;
 
+	signal(SIGCHLD, &a_server__on_sig);
 	signal(SIGHUP, &a_server__on_sig);
 	signal(SIGTERM, &a_server__on_sig);
 	signal(SIGUSR1, &a_server__on_sig);
 	signal(SIGUSR2, &a_server__on_sig);
 
 	sigemptyset(&psigset);
+	sigaddset(&psigset, SIGCHLD);
 	sigaddset(&psigset, SIGHUP);
 	sigaddset(&psigset, SIGTERM);
 	sigaddset(&psigset, SIGUSR1);
 	sigaddset(&psigset, SIGUSR2);
 	sigprocmask(SIG_BLOCK, &psigset, &psigseto);
 
-	a_sandbox_server(pgp);
-
-	while(!a_server_term){
-		u32 i;
-		s32 maxfd, x, e;
-		struct timespec *tosp;
-		fd_set *rfdsp;
+	/* Workers inherit the signal mask: signals are only handled by us */
+#ifdef a_HAVE_MT
+	if(pgp->pg_server_threads > 0){
+		sigset_t ssn, sso;
 
-		/* Recreate w/b lists? */
-		if(UNLIKELY(a_server_hup)){
-			a_server_hup = FAL0;
-#ifdef a_HAVE_CONF_RELOAD_UNTAMED
-			if(!(pgp->pg_flags & a_F_UNTAMED))
-				su_log_write(su_LOG_ERR, _("reloading configuration via SIGHUP needs --untamed"));
-			else
+		sigfillset(&ssn);
+		sigprocmask(SIG_BLOCK, &ssn, &sso);
+		rv = a_server__mt_start(pgp);
+		sigprocmask(SIG_SETMASK, &sso, NIL);
+		if(rv != su_EX_OK)
+			goto jleave;
+	}
 #endif
-			     if((rv = a_server__wb_setup(pgp, TRU1)) != su_EX_OK)
+
+	a_sandbox_server(pgp);
+
+	while(!a_SERVER_TERM()){
+		u32 i, j, cli_no;
+		s32 x, e;
+		struct timespec *tosp;
+		boole lwant, lready, pready;
+
+		/* Recreate w/b lists?  With server threads a helper does, and we swap them in once it is done; workers
+		 * answer with the old ones meanwhile, and another SIGHUP is pending until then */
+#ifdef a_HAVE_MT
+		if(mp->m_thr_no > 0 && UNLIKELY((x = a_server__mt_reload_swap(pgp)) != -1)){
+			if((rv = x) != su_EX_OK)
 				goto jleave;
-			else{
-				a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call after config reload");)
-				a_server__gray_maintenance(pgp, FAL0, 0, NIL);
+			a_server__wb_reloaded(pgp);
+		}
+#endif
+		if(UNLIKELY(a_server_hup)){
+#ifdef a_HAVE_CONF_RELOAD_UNTAMED
+			if(!(pgp->pg_flags & a_F_UNTAMED)){
+				a_server_hup = FAL0;
+				su_log_write(su_LOG_ERR, _("reloading configuration via SIGHUP needs --untamed"));
+			}else
+#endif
+#ifdef a_HAVE_MT
+			     if(mp->m_thr_no > 0){
+				if(a_server__mt_reload(pgp))
+					a_server_hup = FAL0;
+			}else
+#endif
+			     {
+				a_server_hup = FAL0;
+				if((rv = a_server__wb_setup(pgp, TRU1)) != su_EX_OK)
+					goto jleave;
+				a_server__wb_reloaded(pgp);
 			}
 		}
 
-		if(UNLIKELY(a_server_usr2)){
+		/* Background gray DB save finished? */
+		if(UNLIKELY(a_server_chld)){
+			a_server_chld = FAL0;
+			a_server__gray_save_reap(pgp, FAL0);
+		}
+
+		/* (Journal checkpoint) */
+		if(UNLIKELY(a_server_usr2) || UNLIKELY(a_server__gray_jnl_due(pgp))){
 			a_server_usr2 = FAL0;
-			a_server__gray_save(pgp);
+			a_server__gray_save(pgp, TRU1);
 		}
 
 		if(UNLIKELY(a_server_usr1)){
@@ -1704,129 +3112,208 @@ a_server__loop(struct a_pg *pgp){ /* {{{ */
 			a_server__log_stat(pgp);
 		}
 
-		FD_ZERO(rfdsp = &rfds);
+		/* --gray-lazy-load: a chunk per round, clients are only looked at in between */
+		if(UNLIKELY(mp->m_lazy != NIL))
+			a_server__gray_lazy_step(pgp);
+
 		tosp = NIL;
-		maxfd = -1;
 
-		for(i = 0; i < mp->m_cli_no; ++i){
-			x = mp->m_cli_fds[i];
-			FD_SET(x, rfdsp);
-			maxfd = MAX(maxfd, x);
-		}
+		/* Workers serve clients, we only see wakeups when client count changes "interestingly" */
+#ifdef a_HAVE_MT
+		if(mp->m_thr_no > 0){
+			pthread_mutex_lock(&mp->m_mt_mtx);
+			cli_no = mp->m_cli_no;
+			pthread_mutex_unlock(&mp->m_mt_mtx);
+		}else
+#endif
+			cli_no = mp->m_cli_no;
 
+		/* Watch the accept(2) socket only if we can take clients */
 		if(pgp->pg_flags & a_F_MASTER_ACCEPT_SUSPENDED){
+			/* Had accept(2) failure: only sleep a bit */
 			tos.tv_sec = 2;
 			tos.tv_nsec = 0;
 			tosp = &tos;
-			/* Had accept(2) failure, have no clients: only sleep a bit */
-			if(maxfd < 0){
-				rfdsp = NIL;
-				a_DBG2(su_log_write(su_LOG_DEBUG, "select: suspend,sleep");)
-			}else{
-				a_DBG2(su_log_write(su_LOG_DEBUG, "select: suspend,maxfd=%d", maxfd);)
-			}
-		}else if(mp->m_cli_no < pgp->pg_server_queue){
-			if(maxfd < 0 && pgp->pg_server_timeout != 0){
+			a_DBG2(su_log_write(su_LOG_DEBUG, "wait: suspend, clients=%u", cli_no);)
+			lwant = FAL0;
+		}else if(cli_no < pgp->pg_server_queue){
+			if(cli_no == 0 && pgp->pg_server_timeout != 0){
 				tos.tv_sec = pgp->pg_server_timeout;
 				if(LIKELY(!su_state_has(su_STATE_REPRODUCIBLE)))
 					tos.tv_sec *= su_TIME_MIN_SECS;
 				tos.tv_nsec = 0;
 				tosp = &tos;
 			}
+			a_DBG2(su_log_write(su_LOG_DEBUG, "wait: clients=%u timeout=%d (%lu)",
+				cli_no, (tosp != NIL), (tosp != NIL ? S(ul,tosp->tv_sec) : 0));)
+			lwant = TRU1;
+		}else{
+			a_DBG(su_log_write(su_LOG_DEBUG, "wait: reached server_queue=%u, no accept-waiting", cli_no);)
+			lwant = FAL0;
+		}
 
-			x = pgp->pg_clima_fd;
-			FD_SET(x, rfdsp);
-			maxfd = MAX(maxfd, x);
+		if(lwant != lwatch){
+			if(!lwant){
+				a_server__ev_del(&mp->m_ev, pgp->pg_clima_fd, FAL0);
+				if(mp->m_polfd >= 0)
+					a_server__ev_del(&mp->m_ev, mp->m_polfd, FAL0);
+			}else if(!a_server__ev_add(&mp->m_ev, pgp->pg_clima_fd, a_EV_COOKIE_LISTEN, FAL0, FAL0) ||
+					(mp->m_polfd >= 0 &&
+					 !a_server__ev_add(&mp->m_ev, mp->m_polfd, a_EV_COOKIE_POLICY, FAL0, FAL0))){
+				su_log_write(su_LOG_CRIT, _("cannot watch server socket: %s"), V_(su_err_doc(-1)));
+				rv = su_EX_OSERR;
+				goto jleave;
+			}
+			lwatch = lwant;
+		}
 
-			a_DBG2(su_log_write(su_LOG_DEBUG, "select: maxfd=%d timeout=%d (%lu)",
-				maxfd, (tosp != NIL), (tosp != NIL ? S(ul,tosp->tv_sec) : 0));)
-		}else{
-			a_DBG(su_log_write(su_LOG_DEBUG, "select: reached server_queue=%d, no accept-waiting", maxfd);)
+		if(UNLIKELY(mp->m_lazy != NIL) && !(pgp->pg_flags & a_F_MASTER_ACCEPT_SUSPENDED)){
+			tos.tv_sec = 0;
+			tos.tv_nsec = 0;
+			tosp = &tos;
 		}
 
-		/* Poll descriptors interruptably */
-		if((x = pselect(maxfd + 1, rfdsp, NIL, NIL, tosp, &psigseto)) == -1){
-			if((e = su_err_by_errno()) == su_ERR_INTR)
+		/* Poll descriptors interruptably; parked clients become ready when due */
+		tosp = a_server__cli_park_tos(pgp, &tos, tosp);
+		if((x = a_server__ev_wait(&mp->m_ev, tosp, &psigseto)) == -1){
+			if((e = su_err()) == su_ERR_INTR)
 				continue;
 			su_log_write(su_LOG_CRIT, _("select failed: %s"), V_(su_err_doc(e)));
 			rv = su_EX_IOERR;
 			goto jleave;
-		}else if(x == 0){
+		}else if((x += S(s32,a_server__cli_park_due(pgp))) == 0){
 			if(pgp->pg_flags & a_F_MASTER_ACCEPT_SUSPENDED){
 				pgp->pg_flags &= ~S(uz,a_F_MASTER_ACCEPT_SUSPENDED);
-				a_DBG(su_log_write(su_LOG_DEBUG, "select: un-suspend");)
+				a_DBG(su_log_write(su_LOG_DEBUG, "wait: un-suspend");)
 				continue;
 			}
+			if(pgp->pg_park_no > 0 || mp->m_lazy != NIL)
+				continue;
 
-			ASSERT(mp->m_cli_no == 0);
+			ASSERT(cli_no == 0);
 			a_DBG(su_log_write(su_LOG_DEBUG, "no clients, timeout: bye!");)
 			break;
 		}
 
-		for(x = i = 0; i < mp->m_cli_no; ++i){
-			if(FD_ISSET(mp->m_cli_fds[i], &rfds)){
-				/* epoch housekeeping */
-				if(!x){
-					x = TRU1;
-					a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call by event loop");)
-					a_server__gray_maintenance(pgp, TRU1, 0, NIL);
+		for(lready = pready = FAL0, i = 0; i < mp->m_ev.ev_no; ++i){
+			u32 c;
+
+			if((c = mp->m_ev.ev_ready[i]) == a_EV_COOKIE_LISTEN)
+				lready = TRU1;
+			else if(c == a_EV_COOKIE_POLICY)
+				pready = TRU1;
+			else if(c == a_EV_COOKIE_PEER)
+				a_server__peer_ready(pgp);
+#ifdef a_HAVE_MT
+			else if(c == a_EV_COOKIE_PIPE){
+				while(read(mp->m_mt_wake[0], pgp->pg_buf, sizeof(pgp->pg_buf)) == -1 &&
+						su_err_by_errno() == su_ERR_INTR){
 				}
-
-				a_server__cli_ready(pgp, i);
-				if(a_server_term)
+			}
+#endif
+			else{
+				a_server__cli_ready(pgp, c);
+				if(a_SERVER_TERM())
 					goto jleave;
 			}
 		}
+		a_server__cli_compact(pgp);
 
-		if(a_server_term)
+		if(a_SERVER_TERM())
 			goto jleave;
 
-		/* */
-		if(FD_ISSET(pgp->pg_clima_fd, &rfds)){
-			if((x = accept(pgp->pg_clima_fd, NIL, NIL)) == -1){
-				/* Just skip this mess for now, and pause accept(2) */
-				pgp->pg_flags |= a_F_MASTER_ACCEPT_SUSPENDED;
-				a_DBG(su_log_write(su_LOG_DEBUG, "accept: suspended for a bit: %s", V_(su_err_doc(x)));)
-			}else if(!a_sandbox_sock_accepted(pgp, x)){
-				rv = su_EX_OSERR;
-				goto jleave;
-			}else{
-				mp->m_cli_fds[mp->m_cli_no++] = x;
-				a_DBG2(su_log_write(su_LOG_DEBUG, "accepted client=%u fd=%d", mp->m_cli_no, x);)
-			}
-			/* XXX non-empty accept queue MUST cause more select(2) wakes */
-		}
+		/* Drain the accept(2) queue(s) */
+		for(j = 0; j < 2; ++j){
+			s32 lfd;
 
-		/* Check for DB cleanup (xxx too excessive, too often, etc); need to recalculate */
-		ASSERT(mp->m_epoch_min == S(u16,(mp->m_epoch - mp->m_base_epoch) /
-				(su_state_has(su_STATE_REPRODUCIBLE) ? 1 : su_TIME_MIN_SECS)));
-		if(pgp->pg_gc_timeout != 0){
-			i = S(u16,mp->m_epoch_min);
-			if(i >= pgp->pg_gc_timeout >> 1 || (i >= su_TIME_DAY_MINS && /* xxx magic */
-						su_cs_dict_count(&mp->m_gray) >= pgp->pg_limit - (pgp->pg_limit >> 3))){
-				a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call by event loop, afterwork");)
-				a_server__gray_maintenance(pgp, FAL0, 0, NIL);
+			if(!(j == 0 ? lready : pready))
 				continue;
+			lfd = (j == 0) ? pgp->pg_clima_fd : mp->m_polfd;
+
+			while(cli_no < pgp->pg_server_queue){
+#ifdef SOCK_NONBLOCK
+				if((x = accept4(lfd, NIL, NIL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+					e = su_err_by_errno();
+#else
+				if((x = accept(lfd, NIL, NIL)) == -1)
+					e = su_err_by_errno();
+				else if(fcntl(x, F_SETFL, O_NONBLOCK) == -1){
+					e = su_err_by_errno();
+					close(x);
+					x = -1;
+				}
+#endif
+				if(x == -1){
+					if(e == su_ERR_INTR)
+						continue;
+					if(e == su_ERR_AGAIN || e == su_ERR_WOULDBLOCK)
+						break;
+					/* Just skip this mess for now, and pause accept(2) */
+					pgp->pg_flags |= a_F_MASTER_ACCEPT_SUSPENDED;
+					a_DBG(su_log_write(su_LOG_DEBUG, "accept: suspended for a bit: %s", V_(su_err_doc(e)));)
+					break;
+				}else if(!a_sandbox_sock_accepted(pgp, x)){
+					rv = su_EX_OSERR;
+					goto jleave;
+				}
+
+				if(j != 0)
+					x |= a_CLI_POLICY;
+#ifdef a_HAVE_MT
+				if(mp->m_thr_no > 0){
+					struct a_mt_worker *wp;
+
+					/* Pass to least loaded worker */
+					pthread_mutex_lock(&mp->m_mt_mtx);
+					for(wp = &mp->m_thrs[0], i = 1; i < mp->m_thr_no; ++i)
+						if(mp->m_thrs[i].w_cli_no < wp->w_cli_no)
+							wp = &mp->m_thrs[i];
+					++wp->w_cli_no;
+					cli_no = ++mp->m_cli_no;
+					pthread_mutex_unlock(&mp->m_mt_mtx);
+
+					while(write(wp->w_pipe[1], &x, sizeof(x)) == -1){
+						if((e = su_err_by_errno()) != su_ERR_INTR){
+							su_log_write(su_LOG_CRIT, _("cannot pass client to server thread: %s"),
+								V_(su_err_doc(e)));
+							close(a_CLI_FD(x));
+							rv = su_EX_IOERR;
+							goto jleave;
+						}
+					}
+					a_DBG2(su_log_write(su_LOG_DEBUG, "accepted client=%u fd=%d, thread %lu",
+						cli_no, a_CLI_FD(x), S(ul,P2UZ(wp - mp->m_thrs)));)
+					continue;
+				}
+#endif
+
+				++mp->m_cli_no;
+				if(a_server__cli_add(pgp, x)){
+					a_DBG2(su_log_write(su_LOG_DEBUG, "accepted client=%u fd=%d", mp->m_cli_no, a_CLI_FD(x));)
+				}
+				cli_no = mp->m_cli_no;
 			}
 		}
 
-		/* Otherwise we may need to allow the dict to grow; it is frozen all the
-		 * time to move expensive growing out of the way of waiting clients.
-		 * (Of course some may wait now, too.)  Misuse MIN_LIMIT for that! */
-		if(su_cs_dict_count(&mp->m_gray) > ograycnt){
-			ograycnt = su_cs_dict_count(&mp->m_gray) + a_GRAY_MIN_LIMIT;
-			mp->m_cleanup_cnt = 0;
-			su_cs_dict_add_flags(su_cs_dict_balance(&mp->m_gray), su_CS_DICT_FROZEN);
-		}
+		/* With workers they do this after serving their clients */
+		if(mp->m_thr_no == 0)
+			a_server__gray_afterwork(pgp);
 	}
 
 jleave:
-	if(!a_server__gray_save(pgp) && rv == su_EX_OK)
+#ifdef a_HAVE_MT
+	if(mp->m_thr_no > 0)
+		a_server__mt_stop(pgp);
+#endif
+
+	/* (Awaits a running background save) */
+	if(!a_server__gray_save(pgp, FAL0) && rv == su_EX_OK)
 		rv = su_EX_CANTCREAT;
 
 	sigprocmask(SIG_SETMASK, &psigseto, NIL);
 
 	/*
+	signal(SIGCHLD, SIG_DFL);
 	signal(SIGHUP, SIG_DFL);
 	signal(SIGTERM, SIG_DFL);
 	signal(SIGUSR1, SIG_DFL);
@@ -1839,8 +3326,9 @@ jleave:
 
 static void
 a_server__log_stat(struct a_pg *pgp){ /* {{{ */
-	struct a_srch *pgsp;
-	ul i1, i2;
+	struct a_cnt c;
+	u64 gm;
+	ul i1, i2, gc, gs, gcc, eb[2], en[2], em[2];
 	enum su_log_level olvl;
 	struct a_master *mp;
 	NYD2_IN;
@@ -1850,48 +3338,93 @@ a_server__log_stat(struct a_pg *pgp){ /* {{{ */
 
 	mp = pgp->pg_master;
 
-	for(i1 = 0, pgsp = mp->m_white.wb_srch; pgsp != NIL; ++i1, pgsp = pgsp->s_next){
-	}
-	for(i2 = 0, pgsp = mp->m_black.wb_srch; pgsp != NIL; ++i2, pgsp = pgsp->s_next){
+	i1 = mp->m_white.wb_srch_cnt;
+	i2 = mp->m_black.wb_srch_cnt;
+
+	/* C99 */{
+		u32 i;
+		struct a_gray *gp;
+
+		/* Shards tick on their own: sum cleanups, give epoch ranges */
+		eb[0] = eb[1] = en[0] = en[1] = em[0] = em[1] = 0;
+		for(gm = 0, gc = gs = gcc = 0, i = 0; i < mp->m_gray_no; ++i){
+			gp = &mp->m_grays[i];
+			a_MT( pthread_mutex_lock(&gp->g_mtx); )
+			gc += a_server__gray_st_count(gp);
+			gs += a_server__gray_st_size(gp);
+			gm += a_server__gray_st_mem(gp);
+			gcc += S(ul,gp->g_cleanup_cnt);
+			if(i == 0){
+				eb[0] = eb[1] = S(ul,gp->g_base_epoch);
+				en[0] = en[1] = S(ul,gp->g_epoch);
+				em[0] = em[1] = S(ul,gp->g_epoch_min);
+			}else{
+				eb[0] = MIN(eb[0], S(ul,gp->g_base_epoch));
+				eb[1] = MAX(eb[1], S(ul,gp->g_base_epoch));
+				en[0] = MIN(en[0], S(ul,gp->g_epoch));
+				en[1] = MAX(en[1], S(ul,gp->g_epoch));
+				em[0] = MIN(em[0], S(ul,gp->g_epoch_min));
+				em[1] = MAX(em[1], S(ul,gp->g_epoch_min));
+			}
+			a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+		}
+
+		/* Worker counters are not locked: snapshot */
+		c = mp->m_cnt;
+#ifdef a_HAVE_MT
+		for(i = 0; i < mp->m_thr_no; ++i)
+			a_server__cnt_add(&c, &mp->m_thrs[i].w_cnt);
+#endif
 	}
 
 	su_log_write(su_LOG_INFO,
-		_("clients %lu of %lu; below: exact/wildcard counts [(size)]\n"
+		_("clients %lu of %lu, threads %lu; below: exact/wildcard counts [(size)]\n"
 		  "white: CA %lu (%lu) / %lu, CNAME %lu (%lu) [/?]\n"
 		  "-hits: CA %lu/%lu, CNAME %lu/%lu\n"
 		  "black: CA %lu (%lu) / %lu, CNAME %lu (%lu) [/?]\n"
 		  "-hits: CA %lu/%lu, CNAME %lu/%lu\n"
-		  "gray: %lu (%lu), gc_cnt %lu; epoch: base %lu, now %lu, minutes %lu\n"
-		  "-hits: new %lu, defer %lu, pass %lu"),
-		S(ul,mp->m_cli_no), S(ul,pgp->pg_server_queue),
+		  "gray: %lu (%lu) in %lu shards, %lu bytes (limit %lu, delay %lu MiB), gc_cnt %lu; "
+			"epoch: base %lu-%lu, now %lu-%lu, minutes %lu-%lu\n"
+		  "-hits: new %lu, defer %lu, pass %lu, delay %lu\n"
+		  "client answers: allow %lu, block %lu, pass %lu\n"
+		  "peers: %lu, sent %lu, merged %lu, ignored %lu"),
+		S(ul,mp->m_cli_no), S(ul,pgp->pg_server_queue), S(ul,mp->m_thr_no),
 		S(ul,su_cs_dict_count(&mp->m_white.wb_ca)), S(ul,su_cs_dict_size(&mp->m_white.wb_ca)), i1,
-				S(ul,su_cs_dict_count(&mp->m_white.wb_cname)),
-					S(ul,su_cs_dict_size(&mp->m_white.wb_cname)),
-			mp->m_cnt_white.wbc_ca, mp->m_cnt_white.wbc_ca_fuzzy,
-				mp->m_cnt_white.wbc_cname, mp->m_cnt_white.wbc_cname_fuzzy,
+				S(ul,mp->m_white.wb_cname_cnt), S(ul,mp->m_dom_no),
+			c.c_white.wbc_ca, c.c_white.wbc_ca_fuzzy, c.c_white.wbc_cname, c.c_white.wbc_cname_fuzzy,
 		S(ul,su_cs_dict_count(&mp->m_black.wb_ca)), S(ul,su_cs_dict_size(&mp->m_black.wb_ca)), i2,
-				S(ul,su_cs_dict_count(&mp->m_black.wb_cname)),
-					S(ul,su_cs_dict_size(&mp->m_black.wb_cname)),
-			mp->m_cnt_black.wbc_ca, mp->m_cnt_black.wbc_ca_fuzzy,
-				mp->m_cnt_black.wbc_cname, mp->m_cnt_black.wbc_cname_fuzzy,
-		S(ul,su_cs_dict_count(&mp->m_gray)), S(ul,su_cs_dict_size(&mp->m_gray)),
-			S(ul,mp->m_cleanup_cnt), S(ul,mp->m_base_epoch), S(ul,mp->m_epoch),
-			S(ul,mp->m_epoch_min),
-		mp->m_cnt_gray_new, mp->m_cnt_gray_defer, mp->m_cnt_gray_pass
+				S(ul,mp->m_black.wb_cname_cnt), S(ul,mp->m_dom_no),
+			c.c_black.wbc_ca, c.c_black.wbc_ca_fuzzy, c.c_black.wbc_cname, c.c_black.wbc_cname_fuzzy,
+		gc, gs, S(ul,mp->m_gray_no), S(ul,gm), S(ul,pgp->pg_mem_limit), S(ul,pgp->pg_mem_limit_delay),
+			gcc, eb[0], eb[1], en[0], en[1], em[0], em[1],
+		c.c_gray_new, c.c_gray_defer, c.c_gray_pass, c.c_gray_delay,
+		c.c_client_allow, c.c_client_block, c.c_client_pass,
+		S(ul,mp->m_peer_no), c.c_peer_sent, c.c_peer_merged, c.c_peer_ignored
 		);
 
+	if(mp->m_lim != NIL){
+		struct a_lim_hdr const *lhp;
+
+		lhp = R(struct a_lim_hdr const*,mp->m_lim);
+		su_log_write(su_LOG_INFO,
+			_("list image: %lu bytes, %lu domain nodes\n"
+			  "white: CA %lu / %lu, CNAME %lu\n"
+			  "black: CA %lu / %lu, CNAME %lu"),
+			S(ul,lhp->lh_size), S(ul,lhp->lh_dom_no),
+			S(ul,lhp->lh_wb[0].lw_ca_no), S(ul,lhp->lh_wb[0].lw_srch_no), S(ul,lhp->lh_wb[0].lw_cname_no),
+			S(ul,lhp->lh_wb[1].lw_ca_no), S(ul,lhp->lh_wb[1].lw_srch_no), S(ul,lhp->lh_wb[1].lw_cname_no));
+	}
+
 #if DVLDBGOR(1, 0)
 	a_DBG2(
 		su_log_write(su_LOG_INFO, "WHITE CA:");
 		su_cs_dict_statistics(&mp->m_white.wb_ca);
-		su_log_write(su_LOG_INFO, "WHITE CNAME:");
-		su_cs_dict_statistics(&mp->m_white.wb_cname);
 		su_log_write(su_LOG_INFO, "BLACK CA:");
 		su_cs_dict_statistics(&mp->m_black.wb_ca);
-		su_log_write(su_LOG_INFO, "BLACK CNAME:");
-		su_cs_dict_statistics(&mp->m_black.wb_cname);
-		su_log_write(su_LOG_INFO, "GRAY:");
-		su_cs_dict_statistics(&mp->m_gray);
+		if(!a_GRAY_IS_FP(&mp->m_grays[0])){
+			su_log_write(su_LOG_INFO, "GRAY (first shard):");
+			su_cs_dict_statistics(&mp->m_grays[0].g_dict);
+		}
 	)
 #endif
 
@@ -1900,632 +3433,5095 @@ a_server__log_stat(struct a_pg *pgp){ /* {{{ */
 	NYD2_OU;
 } /* }}} */
 
+static boole
+a_server__cli_add(struct a_pg *pgp, s32 fd){
+	u32 i;
+	boole rv;
+	NYD_IN;
+
+	pgp->pg_cli_fds[i = pgp->pg_cli_no++] = fd;
+	STRUCT_ZERO(struct a_park, &pgp->pg_park[i]);
+	if(fd & a_CLI_POLICY){
+		pgp->pg_park[i].p_line = su_TALLOC(struct a_line, 1);
+		a_LINE_SETUP(pgp->pg_park[i].p_line);
+	}
+
+	if(!(rv = a_server__ev_add(pgp->pg_ev, a_CLI_FD(fd), i, TRU1, FAL0))){
+		su_log_write(su_LOG_CRIT, _("cannot watch client fd=%d, dropping client: %s"),
+			a_CLI_FD(fd), V_(su_err_doc(-1)));
+		a_server__cli_del(pgp, i);
+		--pgp->pg_cli_no;
+	}
+
+	NYD_OU;
+	return rv;
+}
+
 static void
 a_server__cli_ready(struct a_pg *pgp, u32 client){ /* {{{ */
-	/* xxx should use FIONREAD nonetheless, or O_NONBLOCK. (On the other hand .. clear postfix protocol etc etc) */
-	ssize_t all, osx;
-	uz rem;
-	struct a_master *mp;
+	/* O_NONBLOCK: drain until EAGAIN.  All complete requests of a read are answered with one write, in order;
+	 * a request split over several reads is kept in .p_buf until the next readiness.  A --limit-delay excess
+	 * parks the client: pending answers and unserved requests are kept, and we are called again by
+	 * __cli_park_due() */
+	char rbuf[sizeof(struct a_req_cnt) + a_REQ_BATCH * ALIGN_Z(a_BUF_SIZE)], ans[a_REQ_BATCH];
+	ssize_t osx;
+	uz all, off, i;
+	u32 ans_no;
+	s32 fd, e;
+	struct a_park *pp;
 	NYD_IN;
 
-	mp = pgp->pg_master;
-	rem = sizeof(pgp->pg_buf);
-	all = 0;
+	if((fd = pgp->pg_cli_fds[client]) & a_CLI_POLICY){
+		a_server__cli_policy(pgp, client);
+		goto jleave;
+	}
+
+	/* Unserved requests of a parked client, or a partial one */
+	pp = &pgp->pg_park[client];
+	if((all = pp->p_len) > 0){
+		su_mem_copy(rbuf, pp->p_buf, all);
+		su_FREE(pp->p_buf);
+		pp->p_buf = NIL;
+		pp->p_len = 0;
+	}
+
+	if(UNLIKELY(pp->p_due != 0)){
+		pp->p_due = 0;
+		--pgp->pg_park_no;
+		if(!a_misc_write_all(fd, pp->p_ans, pp->p_ans_no))
+			goto jcli_err;
+		if(!a_server__ev_add(pgp->pg_ev, fd, client, TRU1, FAL0)){
+			su_log_write(su_LOG_CRIT, _("cannot watch client fd=%d, dropping client: %s"), fd, V_(su_err_doc(-1)));
+			a_server__cli_del(pgp, client);
+			goto jleave;
+		}
+		if(all > 0)
+			goto jserve;
+	}
 jredo:
-	osx = read(mp->m_cli_fds[client], &pgp->pg_buf[S(uz,all)], rem);
+	osx = read(fd, &rbuf[all], sizeof(rbuf) - all);
 	if(osx == -1){
-		if(su_err_by_errno() == su_ERR_INTR)
+		if((e = su_err_by_errno()) == su_ERR_INTR)
 			goto jredo;
+		if(e == su_ERR_AGAIN || e == su_ERR_WOULDBLOCK){
+			if(all > 0){
+				pp->p_buf = su_TALLOC(char, all);
+				su_mem_copy(pp->p_buf, rbuf, pp->p_len = S(u32,all));
+			}
+			goto jleave;
+		}
 
 jcli_err:
-		su_log_write(su_LOG_CRIT, _("client fd=%d read() failed, dropping client: %s"),
-			mp->m_cli_fds[client], V_(su_err_doc(-1)));
-		close(mp->m_cli_fds[client]);
-		goto jcli_del;
+		su_log_write(su_LOG_CRIT, _("client fd=%d read() failed, dropping client: %s"), fd, V_(su_err_doc(-1)));
+		a_server__cli_del(pgp, client);
+		goto jleave;
 	}else if(osx == 0){
-		a_DBG2(su_log_write(su_LOG_DEBUG, "client fd=%d disconnected, %u remain",
-			mp->m_cli_fds[client], mp->m_cli_no - 1);)
-jcli_del:
-		close(mp->m_cli_fds[client]);
-		/* _copy() */
-		su_mem_move(&mp->m_cli_fds[client], &mp->m_cli_fds[client + 1],
-			(--mp->m_cli_no - client) * sizeof(mp->m_cli_fds[0]));
-	}else{
-		all += osx;
-		rem -= S(uz,osx);
+		a_DBG2(su_log_write(su_LOG_DEBUG, "client fd=%d disconnected", fd);)
+		a_server__cli_del(pgp, client);
+		goto jleave;
+	}
+	all += S(uz,osx);
 
-		/* Buffer is always sufficiently spaced, unless bogus */
-		if(rem == 0){
-			su_err_set(su_ERR_MSGSIZE);
-			goto jcli_err;
+jserve:
+	for(off = 0, ans_no = 0; off < all; off += i){
+		char *cp;
+		uz avail;
+
+		cp = &rbuf[off];
+		avail = all - off;
+
+		/* Answers the client gave itself */
+		if(cp[0] == a_REQ_CNT_MAGIC){
+			struct a_req_cnt rc;
+
+			if(avail < (i = sizeof(rc)))
+				break;
+			su_mem_copy(&rc, cp, sizeof(rc));
+			pgp->pg_cnt->c_client_allow += rc.rc_allow;
+			pgp->pg_cnt->c_client_block += rc.rc_block;
+			pgp->pg_cnt->c_client_pass += rc.rc_pass;
+			continue;
 		}
+		/* Protocol v2 requests are framed by header */
+		else if(cp[0] == a_REQ_MAGIC){
+			struct a_req_hdr rh;
 
-		/* Client requests are terminated with \0\0, at least one byte payload */
-		if(all < 3 || pgp->pg_buf[all - 1] != '\0' || pgp->pg_buf[all - 2] != '\0')
-			goto jredo;
+			if(avail < sizeof(rh))
+				break;
+			su_mem_copy(&rh, cp, sizeof(rh));
+			i = sizeof(rh) + rh.rh_r_len + rh.rh_s_len + rh.rh_ca_len + rh.rh_cn_len + 4;
+			if(i >= sizeof(pgp->pg_buf)){
+				su_err_set(su_ERR_MSGSIZE);
+				goto jcli_err;
+			}
+			if(avail < i)
+				break;
+			if(cp[i - 1] != '\0' || !a_server__cli_req_hdr(cp)){
+				su_err_set(su_ERR_INVAL);
+				goto jcli_err;
+			}
+		}
+		/* v1 client requests (never pipelined) are terminated with \0\0, at least one byte payload */
+		else{
+			/* Buffer is always sufficiently spaced, unless bogus */
+			if(avail >= sizeof(pgp->pg_buf)){
+				su_err_set(su_ERR_MSGSIZE);
+				goto jcli_err;
+			}
+			if(avail < 3 || cp[avail - 1] != '\0' || cp[avail - 2] != '\0')
+				break;
+			i = avail;
+		}
+
+		su_mem_copy(pgp->pg_buf, cp, i);
 
 		/* Is it a special payload? */
-		if(all == 3){
-			/* ENQ: startup acknowledge, EOT: shutdown request */
-			ASSERT(pgp->pg_buf[0] == '\05' || pgp->pg_buf[0] == '\04');
-			if(pgp->pg_buf[0] == '\05'){
-				a_DBG2(su_log_write(su_LOG_DEBUG, "client fd=%d startup acknowledge request",
-					mp->m_cli_fds[client]);)
+		if(i == 3 && cp[0] != a_REQ_MAGIC){
+			/* ENQ: startup acknowledge, ACK: statistics, EOT: shutdown request */
+			ASSERT(cp[0] == '\05' || cp[0] == '\06' || cp[0] == '\04');
+			if(cp[0] == '\05'){
+				a_DBG2(su_log_write(su_LOG_DEBUG, "client fd=%d startup acknowledge request", fd);)
+				ans[ans_no++] = cp[0];
+			}else if(cp[0] == '\06'){
+				a_DBG2(su_log_write(su_LOG_DEBUG, "client fd=%d statistics request", fd);)
+				if(ans_no > 0 && !a_misc_write_all(fd, ans, ans_no))
+					goto jcli_err;
+				/* Answered blocking, whereafter the client is done */
+				if(fcntl(fd, F_SETFL, 0) == -1){
+					su_err_by_errno();
+					goto jcli_err;
+				}
+				if(!a_server__stats(pgp, fd))
+					goto jcli_err;
+				a_server__cli_del(pgp, client);
+				goto jleave;
 			}else{
-				a_DBG2(su_log_write(su_LOG_DEBUG, "client fd=%d shutdown request",
-					mp->m_cli_fds[client]);)
-				a_server_term = TRU1;
+				a_DBG2(su_log_write(su_LOG_DEBUG, "client fd=%d shutdown request", fd);)
+				a_SERVER_TERM_SET();
+#ifdef a_HAVE_MT
+				if(pgp->pg_master->m_thr_no > 0)
+					a_server__mt_wake(pgp->pg_master);
+#endif
+				if(ans_no > 0)
+					(void)a_misc_write_all(fd, ans, ans_no);
 				goto jleave;
 			}
-		}else
-			pgp->pg_buf[0] = a_server__cli_req(pgp, client, S(uz,all));
+		}else if((ans[ans_no++] = a_server__cli_req(pgp, client, i)) != a_ANSWER_DEFER_SLEEP)
+			pp->p_cnt = 0;
+		else{
+			ans[ans_no - 1] = a_ANSWER_DEFER;
+			if(pgp->pg_limit_delay_time > 0){
+				off += i;
+				a_server__cli_park(pgp, client, ans, ans_no, &rbuf[off], all - off);
+				goto jleave;
+			}
+		}
 
-		for(;;){
-			if(write(mp->m_cli_fds[client], pgp->pg_buf, sizeof(pgp->pg_buf[0])) == -1){
-				if(su_err_by_errno() == su_ERR_INTR)
-					continue;
+		if(ans_no == NELEM(ans)){
+			if(!a_misc_write_all(fd, ans, ans_no))
 				goto jcli_err;
-			}
-			break;
+			ans_no = 0;
 		}
 	}
 
+	if(ans_no > 0 && !a_misc_write_all(fd, ans, ans_no))
+		goto jcli_err;
+
+	/* A partial request is completed by what follows (or kept until EAGAIN) */
+	if((all -= off) > 0 && off > 0)
+		su_mem_move(rbuf, &rbuf[off], all);
+	if(all == sizeof(rbuf)){
+		su_err_set(su_ERR_MSGSIZE);
+		goto jcli_err;
+	}
+	goto jredo;
+
 jleave:
 	NYD_OU;
 } /* }}} */
 
-static char
-a_server__cli_req(struct a_pg *pgp, u32 client, uz len){ /* {{{ */
-	char rv;
-	u32 r_l, s_l, ca_l, cn_l;
+static void
+a_server__cli_del(struct a_pg *pgp, u32 client){
 	struct a_master *mp;
+	s32 fd;
 	NYD_IN;
-	ASSERT(len > 0);
-	ASSERT(pgp->pg_buf[len -1] == '\0');
-	UNUSED(client);
-	UNUSED(len);
 
 	mp = pgp->pg_master;
 
-	/* C99 */{
-		char *cp;
+	fd = a_CLI_FD(pgp->pg_cli_fds[client]);
+	a_server__ev_del(pgp->pg_ev, fd, TRU1);
+	close(fd);
+	pgp->pg_cli_fds[client] = -1;
+
+	if(pgp->pg_park[client].p_due != 0)
+		--pgp->pg_park_no;
+	if(pgp->pg_park[client].p_buf != NIL)
+		su_FREE(pgp->pg_park[client].p_buf);
+	if(pgp->pg_park[client].p_line != NIL)
+		su_FREE(pgp->pg_park[client].p_line);
+	STRUCT_ZERO(struct a_park, &pgp->pg_park[client]);
+
+#ifdef a_HAVE_MT
+	/* Master needs to know when accept(2) is possible again, or server-timeout starts */
+	if(mp->m_thr_no > 0){
+		boole wake;
+
+		pthread_mutex_lock(&mp->m_mt_mtx);
+		--a_MT_WORKER(pgp)->w_cli_no;
+		wake = (mp->m_cli_no-- == pgp->pg_server_queue || mp->m_cli_no == 0);
+		pthread_mutex_unlock(&mp->m_mt_mtx);
+
+		if(wake)
+			a_server__mt_wake(mp);
+	}else
+#endif
+		--mp->m_cli_no;
 
-		cp = pgp->pg_buf;
+	NYD_OU;
+}
 
-		pgp->pg_r = cp;
-		for(r_l = 0; *cp != '\0'; ++r_l, ++cp){
-			ASSERT(cp != &pgp->pg_buf[len -1]);
-		}
+static void
+a_server__cli_compact(struct a_pg *pgp){
+	s32 fd;
+	u32 i, c;
+	struct a_ev *evp;
+	NYD_IN;
 
-		pgp->pg_s = ++cp;
-		for(s_l = 0; *cp != '\0'; ++s_l, ++cp){
-			ASSERT(cp != &pgp->pg_buf[len -1]);
-		}
+	evp = pgp->pg_ev;
 
-		pgp->pg_ca = ++cp;
-		for(ca_l = 0; *cp != '\0'; ++ca_l, ++cp){
-			ASSERT(cp != &pgp->pg_buf[len -1]);
-		}
+	/* Holes can only be in slots just reported ready; fill them from the end */
+	for(i = 0; i < evp->ev_no; ++i){
+		if((c = evp->ev_ready[i]) >= pgp->pg_cli_no || pgp->pg_cli_fds[c] != -1)
+			continue;
 
-		pgp->pg_cname = ++cp;
-		for(cn_l = 0; *cp != '\0'; ++cn_l, ++cp){
-			ASSERT(cp != &pgp->pg_buf[len -1]);
-		}
+		while(pgp->pg_cli_no > c && pgp->pg_cli_fds[pgp->pg_cli_no - 1] == -1)
+			--pgp->pg_cli_no;
+		if(c >= pgp->pg_cli_no)
+			continue;
 
-		ASSERT(cp == &pgp->pg_buf[len -2]);
+		pgp->pg_cli_fds[c] = fd = pgp->pg_cli_fds[--pgp->pg_cli_no];
+		pgp->pg_park[c] = pgp->pg_park[pgp->pg_cli_no];
+		fd = a_CLI_FD(fd);
+		/* (Parked ones are watched again, with their cookie, by __cli_ready()) */
+		if(pgp->pg_park[c].p_due != 0){
+		}else if(!a_server__ev_add(evp, fd, c, TRU1, TRU1)){
+			su_log_write(su_LOG_CRIT, _("cannot watch client fd=%d, dropping client: %s"), fd, V_(su_err_doc(-1)));
+			a_server__cli_del(pgp, c);
+			--i;
+		}
 	}
 
-	if(pgp->pg_flags & a_F_VV)
-		su_log_write(su_LOG_INFO, "client fd=%d bytes=%lu R=%u<%s> S=%u<%s> CA=%u<%s> CNAME=%u<%s>",
-			mp->m_cli_fds[client], S(ul,len), r_l, pgp->pg_r, s_l, pgp->pg_s,
-			ca_l, pgp->pg_ca, cn_l, pgp->pg_cname);
-
-	rv = a_ANSWER_ALLOW;
-	if(a_server__cli_lookup(pgp, &mp->m_white, &mp->m_cnt_white))
-		goto jleave;
-
-	rv = a_ANSWER_BLOCK;
-	if(a_server__cli_lookup(pgp, &mp->m_black, &mp->m_cnt_black))
-		goto jleave;
-
-	pgp->pg_s[-1] = '/';
-	pgp->pg_ca[-1] = '/';
-	rv = a_server__gray_lookup(pgp, pgp->pg_buf);
-
-jleave:
 	NYD_OU;
-	return rv;
-} /* }}} */
+}
 
-static boole
-a_server__cli_lookup(struct a_pg *pgp, struct a_wb *wbp, struct a_wb_cnt *wbcp){ /* {{{ */
-	char const *me;
-	boole rv;
+static void
+a_server__cli_park(struct a_pg *pgp, u32 client, char const *ans, u32 ans_no, char const *buf, uz len){
+	struct su_timespec ts;
+	u32 d, i;
+	struct a_park *pp;
 	NYD_IN;
 
-	rv = TRU1;
-	me = (wbp == &pgp->pg_master->m_white) ? "allow" : "block";
+	pp = &pgp->pg_park[client];
 
-	/* */
-	if(su_cs_dict_has_key(&wbp->wb_ca, pgp->pg_ca)){
-		++wbcp->wbc_ca;
-		if(pgp->pg_flags & a_F_V)
-			su_log_write(su_LOG_INFO, "### %s address: %s", me, pgp->pg_ca);
-		goto jleave;
+	/* Double per excess in a row, up to the maximum */
+	for(d = pgp->pg_limit_delay_time, i = pp->p_cnt++; i > 0 && d < pgp->pg_limit_delay_time_max; --i)
+		d <<= 1;
+	d = MIN(d, pgp->pg_limit_delay_time_max);
+
+	su_timespec_current(&ts);
+	pp->p_due = S(s64,ts.ts_sec) * su_TIMESPEC_SEC_MILLIS + ts.ts_nano / 1000000 + d;
+
+	su_mem_copy(pp->p_ans, ans, pp->p_ans_no = ans_no);
+	if((pp->p_len = S(u32,len)) > 0){
+		pp->p_buf = su_TALLOC(char, len);
+		su_mem_copy(pp->p_buf, buf, len);
 	}
 
-	/* C99 */{
-		char const *cp;
-		boole first;
+	a_server__ev_del(pgp->pg_ev, a_CLI_FD(pgp->pg_cli_fds[client]), FAL0);
+	++pgp->pg_park_no;
+	++pgp->pg_cnt->c_gray_delay;
 
-		for(first = TRU1, cp = pgp->pg_cname;; first = FAL0){
-			union {void *p; up v;} u;
+	a_DBG2(su_log_write(su_LOG_DEBUG, "client fd=%d parked for %lu ms (excess %lu)",
+		a_CLI_FD(pgp->pg_cli_fds[client]), S(ul,d), S(ul,pp->p_cnt));)
 
-			if((u.p = su_cs_dict_lookup(&wbp->wb_cname, cp)) != NIL && (first || u.v != TRU1)){
-				if(first)
-					++wbcp->wbc_cname;
-				else
-					++wbcp->wbc_cname_fuzzy;
-				if(pgp->pg_flags & a_F_V)
-					su_log_write(su_LOG_INFO, "### %s %sdomain: %s",
-						me, (first ? su_empty : _("wildcard ")), cp);
-				goto jleave;
-			}
+	NYD_OU;
+}
 
-			if((cp = su_cs_find_c(cp, '.')) == NIL || *++cp == '\0')
-				break;
+static struct timespec *
+a_server__cli_park_tos(struct a_pg *pgp, struct timespec *tosp, struct timespec *tosp_or_nil){
+	struct su_timespec ts;
+	s64 due, x;
+	u32 i;
+	NYD2_IN;
+
+	if(pgp->pg_park_no > 0){
+		for(due = 0, i = 0; i < pgp->pg_cli_no; ++i)
+			if((x = pgp->pg_park[i].p_due) != 0 && (due == 0 || x < due))
+				due = x;
+
+		su_timespec_current(&ts);
+		due -= S(s64,ts.ts_sec) * su_TIMESPEC_SEC_MILLIS + ts.ts_nano / 1000000;
+		/* (Clock jumps do not hold clients back longer than the maximum) */
+		if(due < 0)
+			due = 0;
+		else if(due > pgp->pg_limit_delay_time_max)
+			due = pgp->pg_limit_delay_time_max;
+
+		if(tosp_or_nil == NIL ||
+				S(s64,tosp_or_nil->tv_sec) * su_TIMESPEC_SEC_MILLIS + tosp_or_nil->tv_nsec / 1000000 > due){
+			tosp->tv_sec = S(time_t,due / su_TIMESPEC_SEC_MILLIS);
+			tosp->tv_nsec = S(long,(due % su_TIMESPEC_SEC_MILLIS) * 1000000);
+			tosp_or_nil = tosp;
 		}
 	}
 
-	/* Fuzzy IP search */{
-		union a_srch_ip c_sip;
-		struct a_srch *pgsp;
-		u32 *c_ip;
-		int c_af;
+	NYD2_OU;
+	return tosp_or_nil;
+}
 
-		/* xxx Client had this already, simply binary pass it, too? */
-		c_af = (su_cs_find_c(pgp->pg_ca, ':') != NIL) ? AF_INET6 : AF_INET;
-		if(inet_pton(c_af, pgp->pg_ca, (c_af == AF_INET ? S(void*,&c_sip.v4) : S(void*,&c_sip.v6))) != 1){
-			su_log_write(su_LOG_CRIT, _("Cannot re-parse an already prepared IP address?: "), pgp->pg_ca);
-			goto jleave0;
-		}
-		c_ip = (c_af == AF_INET) ? R(u32*,&c_sip.v4.s_addr) : R(u32*,c_sip.v6.s6_addr);
+static u32
+a_server__cli_park_due(struct a_pg *pgp){
+	struct su_timespec ts;
+	s64 now, x;
+	u32 rv, i;
+	struct a_ev *evp;
+	NYD2_IN;
 
-		for(pgsp = wbp->wb_srch; pgsp != NIL; pgsp = pgsp->s_next){
-			u32 *ip, max, m, xm, i;
+	rv = 0;
 
-			if(c_af == AF_INET){
-				if(pgsp->s_type != a_SRCH_TYPE_IPV4)
-					continue;
-				ip = R(u32*,&pgsp->s_ip.v4.s_addr);
-				max = 1;
-			}else if(pgsp->s_type != a_SRCH_TYPE_IPV6)
-				continue;
-			else{
-				ip = S(u32*,R(void*,pgsp->s_ip.v6.s6_addr));
-				max = 4;
+	if(pgp->pg_park_no > 0){
+		su_timespec_current(&ts);
+		now = S(s64,ts.ts_sec) * su_TIMESPEC_SEC_MILLIS + ts.ts_nano / 1000000;
+
+		/* Parked ones are not watched, so cannot be in there already; if full, next round */
+		evp = pgp->pg_ev;
+		for(i = 0; i < pgp->pg_cli_no && evp->ev_no < a_EV_BATCH; ++i)
+			if((x = pgp->pg_park[i].p_due) != 0 && (x <= now || x - now > pgp->pg_limit_delay_time_max)){
+				evp->ev_ready[evp->ev_no++] = i;
+				++rv;
 			}
+	}
 
-			for(m = pgsp->s_mask, i = 0;;){
-				/* If mask worked, quickshot */
-				if(m == 0)
-					goto jleave;
+	NYD2_OU;
+	return rv;
+}
 
-				xm = 0xFFFFFFFFu;
-				if((i + 1) << 5 >= m){
-					if((m &= 31))
-						xm <<= (32 - m);
-					m = 0;
-				}
-				xm = su_boswap_net_32(xm);
+static void
+a_server__cli_policy(struct a_pg *pgp, u32 client){ /* {{{ */
+	/* O_NONBLOCK: input is collected in the client's own .p_line until EAGAIN, and each complete block is served;
+	 * an incomplete one awaits the next readiness.  A --limit-delay excess parks the client as in _cli_ready(),
+	 * its answer is held back, unserved blocks remain in .p_line */
+	char buf[ALIGN_Z(a_BUF_SIZE)];
+	struct a_req_hdr rh;
+	struct iovec iov[5];
+	ssize_t r;
+	uz i, len;
+	s32 fd, e;
+	char ans;
+	struct a_line *lp;
+	struct a_park *pp;
+	NYD_IN;
 
-				ASSERT((ip[i] & xm) == ip[i]);
-				if(ip[i] != (c_ip[i] & xm))
-					break;
+	fd = a_CLI_FD(pgp->pg_cli_fds[client]);
+	pp = &pgp->pg_park[client];
+	lp = pp->p_line;
 
-				if(++i == max){
-					++wbcp->wbc_ca_fuzzy;
-					if(pgp->pg_flags & a_F_V)
-						su_log_write(su_LOG_INFO, "### %s wildcard address: %s", me, pgp->pg_ca);
-					goto jleave;
-				}
-			}
+	if(UNLIKELY(pp->p_due != 0)){
+		pp->p_due = 0;
+		--pgp->pg_park_no;
+		ASSERT(pp->p_ans_no == 1);
+		if(!a_misc_policy_answer(pgp, fd, a_server__cli_policy_msg(pgp, pp->p_ans[0]))){
+			e = su_err();
+			goto jcli_err;
+		}
+		if(!a_server__ev_add(pgp->pg_ev, fd, client, TRU1, FAL0)){
+			su_log_write(su_LOG_CRIT, _("cannot watch client fd=%d, dropping client: %s"), fd, V_(su_err_doc(-1)));
+			goto jcli_del;
 		}
+		goto jserve;
 	}
 
-jleave0:
+	for(;;){
+		/* Move the unparsed rest to the front of the a_misc_line__uflow() window, and fill it up */
+		i = a_BUF_SIZE + 1;
+		if(lp->l_curr >= lp->l_fill)
+			lp->l_curr = lp->l_fill = S(u32,i);
+		else if(lp->l_curr > i){
+			len = lp->l_fill - lp->l_curr;
+			su_mem_move(&lp->l_buf[i], &lp->l_buf[lp->l_curr], len);
+			lp->l_curr = S(u32,i);
+			lp->l_fill = S(u32,i + len);
+		}
+		if((len = FIELD_SIZEOF(struct a_line,l_buf) - 1 - lp->l_fill) == 0){
+			e = su_ERR_MSGSIZE;
+			goto jcli_err;
+		}
+
+		if((r = read(fd, &lp->l_buf[lp->l_fill], len)) == -1){
+			if((e = su_err_by_errno()) == su_ERR_INTR)
+				continue;
+			if(e == su_ERR_AGAIN || e == su_ERR_WOULDBLOCK)
+				break;
+			goto jcli_err;
+		}else if(r == 0){
+			a_DBG2(su_log_write(su_LOG_DEBUG, "policy client fd=%d disconnected", fd);)
+			goto jcli_del;
+		}
+		lp->l_fill += S(u32,r);
+
+jserve:
+		/* With a block end buffered a_misc_line_get() does not read(2) */
+		while(a_misc_policy_pending(lp)){
+			ans = a_ANSWER_NODEFER;
+			switch(a_misc_policy_block(pgp, fd, lp)){
+			case a_POLICY_EOF:
+				if((e = lp->l_err) == su_ERR_NONE)
+					e = su_ERR_PROTO;
+				goto jcli_err;
+			case a_POLICY_PROTO:
+				e = su_ERR_PROTO;
+				goto jcli_err;
+			case a_POLICY_EMPTY:
+				continue;
+			case a_POLICY_DUNNO:
+				break;
+			case a_POLICY_TRIPLE:
+				/* Normalize like the client does, and pass an according v2 request to _cli_req() */
+				if(!a_client__req_prep(pgp, &rh, iov))
+					break;
+				for(len = 0, i = 0; i < NELEM(iov); len += iov[i].iov_len, ++i){
+					if(len + iov[i].iov_len >= sizeof(pgp->pg_buf))
+						break;
+					su_mem_copy(&buf[len], iov[i].iov_base, iov[i].iov_len);
+				}
+				if(i != NELEM(iov))
+					break;
+				su_mem_copy(pgp->pg_buf, buf, len);
+
+				if((ans = a_server__cli_req(pgp, client, len)) == a_ANSWER_DEFER_SLEEP){
+					ans = a_ANSWER_DEFER;
+					if(pgp->pg_limit_delay_time > 0){
+						a_server__cli_park(pgp, client, &ans, 1, NIL, 0);
+						goto jleave;
+					}
+				}
+				break;
+			}
+
+			a_DBG(su_log_write(su_LOG_DEBUG, "policy client fd=%d answer %s",
+				fd, a_server__cli_policy_msg(pgp, ans));)
+			if(!a_misc_policy_answer(pgp, fd, a_server__cli_policy_msg(pgp, ans))){
+				e = su_err();
+				goto jcli_err;
+			}
+		}
+	}
+
+jleave:
+	NYD_OU;
+	return;
+
+jcli_err:
+	su_log_write(su_LOG_CRIT, _("policy client fd=%d failed, dropping client: %s"), fd, V_(su_err_doc(e)));
+jcli_del:
+	a_server__cli_del(pgp, client);
+	goto jleave;
+} /* }}} */
+
+static char const *
+a_server__cli_policy_msg(struct a_pg const *pgp, char ans){
+	char const *rv;
+	NYD2_IN;
+
+	switch(ans){
+	case a_ANSWER_ALLOW:
+		rv = pgp->pg_msg_allow;
+		break;
+	case a_ANSWER_BLOCK:
+		rv = pgp->pg_msg_block;
+		break;
+	case a_ANSWER_DEFER_SLEEP:
+	case a_ANSWER_DEFER:
+		rv = pgp->pg_msg_defer;
+		break;
+	default:
+		rv = a_MSG_NODEFER;
+		break;
+	}
+
+	NYD2_OU;
+	return rv;
+}
+
+static char
+a_server__cli_req(struct a_pg *pgp, u32 client, uz len){ /* {{{ */
+	struct su_timespec ts;
+	char rv;
+	u32 r_l, s_l, ca_l, cn_l;
+	struct a_master *mp;
+	NYD_IN;
+	ASSERT(len > 0);
+	ASSERT(pgp->pg_buf[len -1] == '\0');
+	UNUSED(client);
+	UNUSED(len);
+
+	su_timespec_current(&ts);
+	mp = pgp->pg_master;
+
+	if(pgp->pg_buf[0] == a_REQ_MAGIC){
+		struct a_req_hdr rh;
+		char *cp;
+
+		/* Framing and header verified by _ready(), index the strings */
+		su_mem_copy(&rh, pgp->pg_buf, sizeof(rh));
+		r_l = rh.rh_r_len;
+		s_l = rh.rh_s_len;
+		ca_l = rh.rh_ca_len;
+		cn_l = rh.rh_cn_len;
+
+		cp = &pgp->pg_buf[sizeof(rh)];
+		pgp->pg_r = cp;
+		cp += r_l + 1;
+		pgp->pg_s = cp;
+		cp += s_l + 1;
+		pgp->pg_ca = cp;
+		cp += ca_l + 1;
+		pgp->pg_cname = cp;
+		ASSERT(&cp[cn_l] == &pgp->pg_buf[len -1]);
+
+	}else{
+		char *cp;
+
+		cp = pgp->pg_buf;
+
+		pgp->pg_r = cp;
+		for(r_l = 0; *cp != '\0'; ++r_l, ++cp){
+			ASSERT(cp != &pgp->pg_buf[len -1]);
+		}
+
+		pgp->pg_s = ++cp;
+		for(s_l = 0; *cp != '\0'; ++s_l, ++cp){
+			ASSERT(cp != &pgp->pg_buf[len -1]);
+		}
+
+		pgp->pg_ca = ++cp;
+		for(ca_l = 0; *cp != '\0'; ++ca_l, ++cp){
+			ASSERT(cp != &pgp->pg_buf[len -1]);
+		}
+
+		pgp->pg_cname = ++cp;
+		for(cn_l = 0; *cp != '\0'; ++cn_l, ++cp){
+			ASSERT(cp != &pgp->pg_buf[len -1]);
+		}
+
+		ASSERT(cp == &pgp->pg_buf[len -2]);
+	}
+
+	/* Shard and list entries are selected by what we derive ourselves */
+	pgp->pg_key_len = r_l + s_l + ca_l + cn_l + 3;
+	pgp->pg_key_hash = 0;
+	if(mp->m_gray_no > 1){
+		pgp->pg_s[-1] = '/';
+		pgp->pg_ca[-1] = '/';
+		pgp->pg_key_hash = a_GRAY_KEY_HASH(pgp->pg_r);
+		pgp->pg_s[-1] = pgp->pg_ca[-1] = '\0';
+	}
+
+	/* C99 */{
+		int af;
+
+		if(su_cs_find_c(pgp->pg_ca, ':') != NIL){
+			af = AF_INET6;
+			pgp->pg_ca_type = a_SRCH_TYPE_IPV6;
+		}else{
+			af = AF_INET;
+			pgp->pg_ca_type = a_SRCH_TYPE_IPV4;
+		}
+		if(inet_pton(af, pgp->pg_ca, pgp->pg_ca_ip) != 1){
+			su_log_write(su_LOG_CRIT, _("Cannot re-parse an already prepared IP address?: %s"), pgp->pg_ca);
+			rv = a_ANSWER_NODEFER;
+			goto jleave;
+		}
+	}
+
+	if(pgp->pg_flags & a_F_VV)
+		su_log_write(su_LOG_INFO, "client fd=%d bytes=%lu R=%u<%s> S=%u<%s> CA=%u<%s> CNAME=%u<%s>",
+			a_CLI_FD(pgp->pg_cli_fds[client]), S(ul,len), r_l, pgp->pg_r, s_l, pgp->pg_s,
+			ca_l, pgp->pg_ca, cn_l, pgp->pg_cname);
+
+	/* C99 */{
+		char const *wcp, *bcp;
+		boole x;
+
+		a_MT( if(mp->m_thr_no > 0) pthread_rwlock_rdlock(&mp->m_wb_rwl); )
+		a_server__dom_lookup(mp->m_dom, pgp->pg_cname, &wcp, &bcp);
+		if(mp->m_lim != NIL)
+			a_server__lim_dom(mp->m_lim, pgp->pg_cname, &wcp, &bcp);
+		rv = a_ANSWER_ALLOW;
+		if(!(x = a_server__cli_lookup(pgp, &mp->m_white, &pgp->pg_cnt->c_white, wcp))){
+			rv = a_ANSWER_BLOCK;
+			x = a_server__cli_lookup(pgp, &mp->m_black, &pgp->pg_cnt->c_black, bcp);
+		}
+		a_MT( if(mp->m_thr_no > 0) pthread_rwlock_unlock(&mp->m_wb_rwl); )
+
+		if(x)
+			goto jleave;
+	}
+
+	pgp->pg_s[-1] = '/';
+	pgp->pg_ca[-1] = '/';
+	rv = a_server__gray_lookup(pgp, pgp->pg_r, pgp->pg_key_hash);
+
+jleave:
+	a_server__hist_usec(&pgp->pg_cnt->c_hist_req, &ts);
+
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static boole
+a_server__cli_req_hdr(char const *cp){
+	struct a_req_hdr rh;
+	char const *r, *s, *ca;
+	boole rv;
+	NYD2_IN;
+
+	/* The strings must end where the lengths say (the last one is checked by the caller) */
+	su_mem_copy(&rh, cp, sizeof(rh));
+	r = &cp[sizeof(rh)];
+	s = &r[rh.rh_r_len + 1];
+	ca = &s[rh.rh_s_len + 1];
+
+	rv = (s[-1] == '\0' && ca[-1] == '\0' && ca[rh.rh_ca_len] == '\0');
+
+	NYD2_OU;
+	return rv;
+}
+
+static boole
+a_server__cli_lookup(struct a_pg *pgp, struct a_wb *wbp, struct a_wb_cnt *wbcp, char const *cname_or_nil){ /* {{{ */
+	struct a_lim_wb const *lwp;
+	char const *me, *lim;
+	boole rv;
+	NYD_IN;
+
+	rv = TRU1;
+	me = (wbp == &pgp->pg_master->m_white) ? "allow" : "block";
+	if((lim = pgp->pg_master->m_lim) != NIL)
+		lwp = &R(struct a_lim_hdr const*,lim)->lh_wb[wbp != &pgp->pg_master->m_white];
+	else
+		lwp = NIL;
+
+	/* */
+	if(su_cs_dict_has_key(&wbp->wb_ca, pgp->pg_ca) || (lwp != NIL && a_server__lim_ca(lim, lwp, pgp->pg_ca))){
+		++wbcp->wbc_ca;
+		if(pgp->pg_flags & a_F_V)
+			su_log_write(su_LOG_INFO, "### %s address: %s", me, pgp->pg_ca);
+		goto jleave;
+	}
+
+	if(cname_or_nil != NIL){
+		boole first;
+
+		if((first = (cname_or_nil == pgp->pg_cname)))
+			++wbcp->wbc_cname;
+		else
+			++wbcp->wbc_cname_fuzzy;
+		if(pgp->pg_flags & a_F_V)
+			su_log_write(su_LOG_INFO, "### %s %sdomain: %s",
+				me, (first ? su_empty : _("wildcard ")), cname_or_nil);
+		goto jleave;
+	}
+
+	/* Fuzzy IP search */
+	if(a_server__srch_lookup(wbp->wb_srch[pgp->pg_ca_type], pgp->pg_ca_ip,
+				(pgp->pg_ca_type == a_SRCH_TYPE_IPV4 ? 32 : 128)) != NIL ||
+			(lwp != NIL && a_server__lim_srch(lim, lwp->lw_srch[pgp->pg_ca_type], pgp->pg_ca_ip,
+				(pgp->pg_ca_type == a_SRCH_TYPE_IPV4 ? 32 : 128)))){
+		++wbcp->wbc_ca_fuzzy;
+		if(pgp->pg_flags & a_F_V)
+			su_log_write(su_LOG_INFO, "### %s wildcard address: %s", me, pgp->pg_ca);
+		goto jleave;
+	}
+
+	rv = FAL0;
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static void
+a_server__on_sig(int sig){
+	if(sig == SIGCHLD)
+		a_server_chld = TRU1;
+	else if(sig == SIGHUP)
+		a_server_hup = TRU1;
+	else if(sig == SIGTERM)
+		a_SERVER_TERM_SET();
+	else if(sig == SIGUSR1)
+		a_server_usr1 = TRU1;
+	else if(sig == SIGUSR2)
+		a_server_usr2 = TRU1;
+}
+
+/* __cnt_*(), __hist_*(), __stats*() {{{ */
+#ifdef a_HAVE_MT
+static void
+a_server__cnt_add(struct a_cnt *cp, struct a_cnt const *xcp){
+	NYD2_IN;
+
+	cp->c_white.wbc_ca += xcp->c_white.wbc_ca;
+	cp->c_white.wbc_ca_fuzzy += xcp->c_white.wbc_ca_fuzzy;
+	cp->c_white.wbc_cname += xcp->c_white.wbc_cname;
+	cp->c_white.wbc_cname_fuzzy += xcp->c_white.wbc_cname_fuzzy;
+	cp->c_black.wbc_ca += xcp->c_black.wbc_ca;
+	cp->c_black.wbc_ca_fuzzy += xcp->c_black.wbc_ca_fuzzy;
+	cp->c_black.wbc_cname += xcp->c_black.wbc_cname;
+	cp->c_black.wbc_cname_fuzzy += xcp->c_black.wbc_cname_fuzzy;
+	cp->c_gray_new += xcp->c_gray_new;
+	cp->c_gray_defer += xcp->c_gray_defer;
+	cp->c_gray_pass += xcp->c_gray_pass;
+	cp->c_gray_delay += xcp->c_gray_delay;
+	cp->c_client_allow += xcp->c_client_allow;
+	cp->c_client_block += xcp->c_client_block;
+	cp->c_client_pass += xcp->c_client_pass;
+	cp->c_peer_sent += xcp->c_peer_sent;
+	cp->c_peer_merged += xcp->c_peer_merged;
+	cp->c_peer_ignored += xcp->c_peer_ignored;
+	a_server__hist_merge(&cp->c_hist_req, &xcp->c_hist_req);
+
+	NYD2_OU;
+}
+#endif /* a_HAVE_MT */
+
+static void
+a_server__hist_add(struct a_hist *hp, u64 v){
+	u64 x;
+	u32 i;
+	NYD2_IN;
+
+	++hp->h_cnt;
+	hp->h_sum += v;
+	if(v > hp->h_max)
+		hp->h_max = v;
+
+	for(x = v, i = 0; x != 0 && i < a_HIST_BUCKETS - 1; ++i)
+		x >>= 1;
+	++hp->h_bkt[i];
+
+	NYD2_OU;
+}
+
+static void
+a_server__hist_usec(struct a_hist *hp, struct su_timespec const *tsp){
+	struct su_timespec ts;
+	NYD2_IN;
+
+	/* (Clock jumps backward count as 0) */
+	su_timespec_sub(su_timespec_current(&ts), tsp);
+	a_server__hist_add(hp, (ts.ts_sec < 0) ? 0
+		: S(u64,ts.ts_sec) * su_TIMESPEC_SEC_MILLIS * 1000u + S(u64,ts.ts_nano) / 1000u);
+
+	NYD2_OU;
+}
+
+static void
+a_server__hist_merge(struct a_hist *hp, struct a_hist const *xhp){
+	u32 i;
+	NYD2_IN;
+
+	hp->h_cnt += xhp->h_cnt;
+	hp->h_sum += xhp->h_sum;
+	if(xhp->h_max > hp->h_max)
+		hp->h_max = xhp->h_max;
+	for(i = 0; i < a_HIST_BUCKETS; ++i)
+		hp->h_bkt[i] += xhp->h_bkt[i];
+
+	NYD2_OU;
+}
+
+static boole
+a_server__stats(struct a_pg *pgp, s32 fd){ /* {{{ */
+	struct a_gray_out go;
+	struct a_hist hmain5ce, hcount, hmem;
+	struct a_cnt c;
+	struct a_lim_hdr lh;
+	u64 gc, gs, gm;
+	u32 i;
+	struct a_master *mp;
+	boole rv;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	/* Like for _log_stat(): worker counters are not locked: snapshot */
+	c = mp->m_cnt;
+#ifdef a_HAVE_MT
+	for(i = 0; i < mp->m_thr_no; ++i)
+		a_server__cnt_add(&c, &mp->m_thrs[i].w_cnt);
+#endif
+
+	/* Configuration reload unmaps the image */
+	a_MT( if(mp->m_thr_no > 0) pthread_rwlock_rdlock(&mp->m_wb_rwl); )
+	if(mp->m_lim != NIL)
+		lh = *R(struct a_lim_hdr const*,mp->m_lim);
+	else
+		STRUCT_ZERO(struct a_lim_hdr, &lh);
+	a_MT( if(mp->m_thr_no > 0) pthread_rwlock_unlock(&mp->m_wb_rwl); )
+
+	STRUCT_ZERO(struct a_hist, &hmain5ce);
+	STRUCT_ZERO(struct a_hist, &hcount);
+	STRUCT_ZERO(struct a_hist, &hmem);
+	for(gc = gs = gm = 0, i = 0; i < mp->m_gray_no; ++i){
+		struct a_gray *gp;
+
+		gp = &mp->m_grays[i];
+		a_MT( pthread_mutex_lock(&gp->g_mtx); )
+		gc += a_server__gray_st_count(gp);
+		gs += a_server__gray_st_size(gp);
+		gm += a_server__gray_st_mem(gp);
+		a_server__hist_merge(&hmain5ce, &gp->g_hist_main5ce);
+		a_server__hist_merge(&hcount, &gp->g_hist_count);
+		a_server__hist_merge(&hmem, &gp->g_hist_mem);
+		a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+	}
+
+	go.go_buf = su_TALLOC(char, a_GRAY_WBUF_SIZE);
+	go.go_len = 0;
+	go.go_fd = fd;
+	go.go_err = su_ERR_NONE;
+	go.go_trunc = FAL0;
+	go.go_epoch = 0;
+
+	rv = (a_server__stats__kv(&go, "version", su_empty, a_STATS_VERSION) &&
+			a_server__stats__kv(&go, "clients", su_empty, mp->m_cli_no) &&
+			a_server__stats__kv(&go, "server_queue", su_empty, pgp->pg_server_queue) &&
+			a_server__stats__kv(&go, "server_threads", su_empty, mp->m_thr_no) &&
+			a_server__stats__kv(&go, "domain_nodes", su_empty, mp->m_dom_no) &&
+			a_server__stats__kv(&go, "image_size", su_empty, lh.lh_size) &&
+			a_server__stats__kv(&go, "image_domain_nodes", su_empty, lh.lh_dom_no));
+
+	for(i = 0; rv && i < 2; ++i){
+		struct a_lim_wb const *lwp;
+		struct a_wb const *wbp;
+		struct a_wb_cnt const *wbcp;
+		char const *me;
+
+		wbp = (i == 0) ? &mp->m_white : &mp->m_black;
+		wbcp = (i == 0) ? &c.c_white : &c.c_black;
+		me = (i == 0) ? "white" : "black";
+		lwp = &lh.lh_wb[i];
+
+		rv = (a_server__stats__kv(&go, me, "_ca", su_cs_dict_count(&wbp->wb_ca)) &&
+				a_server__stats__kv(&go, me, "_ca_size", su_cs_dict_size(&wbp->wb_ca)) &&
+				a_server__stats__kv(&go, me, "_ca_fuzzy", wbp->wb_srch_cnt) &&
+				a_server__stats__kv(&go, me, "_cname", wbp->wb_cname_cnt) &&
+				a_server__stats__kv(&go, me, "_image_ca", lwp->lw_ca_no) &&
+				a_server__stats__kv(&go, me, "_image_ca_fuzzy", lwp->lw_srch_no) &&
+				a_server__stats__kv(&go, me, "_image_cname", lwp->lw_cname_no) &&
+				a_server__stats__kv(&go, me, "_hits_ca", wbcp->wbc_ca) &&
+				a_server__stats__kv(&go, me, "_hits_ca_fuzzy", wbcp->wbc_ca_fuzzy) &&
+				a_server__stats__kv(&go, me, "_hits_cname", wbcp->wbc_cname) &&
+				a_server__stats__kv(&go, me, "_hits_cname_fuzzy", wbcp->wbc_cname_fuzzy));
+	}
+
+	/* (First shard is representative for time) */
+	rv = (rv &&
+			a_server__stats__kv(&go, "gray_shards", su_empty, mp->m_gray_no) &&
+			a_server__stats__kv(&go, "gray_count", su_empty, gc) &&
+			a_server__stats__kv(&go, "gray_size", su_empty, gs) &&
+			a_server__stats__kv(&go, "gray_mem", su_empty, gm) &&
+			a_server__stats__kv(&go, "gray_epoch_min", su_empty, S(u16,mp->m_grays[0].g_epoch_min)) &&
+			a_server__stats__kv(&go, "gray_loading", su_empty, (mp->m_lazy != NIL)) &&
+			a_server__stats__kv(&go, "gray_hits_new", su_empty, c.c_gray_new) &&
+			a_server__stats__kv(&go, "gray_hits_defer", su_empty, c.c_gray_defer) &&
+			a_server__stats__kv(&go, "gray_hits_pass", su_empty, c.c_gray_pass) &&
+			a_server__stats__kv(&go, "gray_hits_delay", su_empty, c.c_gray_delay) &&
+			a_server__stats__kv(&go, "client_hits_allow", su_empty, c.c_client_allow) &&
+			a_server__stats__kv(&go, "client_hits_block", su_empty, c.c_client_block) &&
+			a_server__stats__kv(&go, "client_hits_pass", su_empty, c.c_client_pass) &&
+			a_server__stats__kv(&go, "peers", su_empty, mp->m_peer_no) &&
+			a_server__stats__kv(&go, "peer_sent", su_empty, c.c_peer_sent) &&
+			a_server__stats__kv(&go, "peer_merged", su_empty, c.c_peer_merged) &&
+			a_server__stats__kv(&go, "peer_ignored", su_empty, c.c_peer_ignored) &&
+			a_server__stats__hist(&go, "request_usec", &c.c_hist_req) &&
+			a_server__stats__hist(&go, "maintenance_usec", &hmain5ce) &&
+			a_server__stats__hist(&go, "save_usec", &mp->m_hist_save) &&
+			a_server__stats__hist(&go, "gray_count", &hcount) &&
+			a_server__stats__hist(&go, "gray_mem", &hmem) &&
+			a_server__gray_out(&go, NIL, 0));
+
+	su_FREE(go.go_buf);
+
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static boole
+a_server__stats__kv(struct a_gray_out *gop, char const *key, char const *key2, u64 v){
+	char ieb[su_IENC_BUFFER_SIZE], buf[64 + su_IENC_BUFFER_SIZE], *cp;
+	boole rv;
+	NYD2_IN;
+	ASSERT(su_cs_len(key) + su_cs_len(key2) < 64 - 2);
+
+	cp = su_cs_pcopy(su_cs_pcopy(buf, key), key2);
+	*cp++ = '=';
+	cp = su_cs_pcopy(cp, su_ienc_u64(ieb, v, 10));
+	*cp++ = '\n';
+	rv = a_server__gray_out(gop, buf, P2UZ(cp - buf));
+
+	NYD2_OU;
+	return rv;
+}
+
+static boole
+a_server__stats__hist(struct a_gray_out *gop, char const *key, struct a_hist const *hp){
+	char ieb[su_IENC_BUFFER_SIZE], kb[64], *cp;
+	u64 c;
+	u32 i, j;
+	boole rv;
+	NYD2_IN;
+
+	cp = su_cs_pcopy(su_cs_pcopy(kb, "hist_"), key);
+	rv = (a_server__stats__kv(gop, kb, "_count", hp->h_cnt) &&
+			a_server__stats__kv(gop, kb, "_sum", hp->h_sum) &&
+			a_server__stats__kv(gop, kb, "_max", hp->h_max));
+
+	/* Cumulative, up to the last used bucket; bucket I ends with 2**I - 1 */
+	for(j = a_HIST_BUCKETS; j > 0 && hp->h_bkt[j - 1] == 0; --j){
+	}
+	for(c = 0, i = 0; rv && i < j; ++i){
+		c += hp->h_bkt[i];
+		su_cs_pcopy(cp, "_le_");
+		if(i == a_HIST_BUCKETS - 1)
+			su_cs_pcopy(&cp[sizeof("_le_") -1], "inf");
+		else
+			su_cs_pcopy(&cp[sizeof("_le_") -1], su_ienc_u64(ieb, (S(u64,1) << i) - 1, 10));
+		rv = a_server__stats__kv(gop, kb, su_empty, c);
+	}
+
+	NYD2_OU;
+	return rv;
+}
+/* }}} */
+
+#ifdef a_HAVE_GRAY_SHM /* __gray_shm_*() {{{ */
+static void
+a_server__gray_shm_open(struct a_pg *pgp){
+	struct a_gray_shm *gsp;
+	void *vp;
+	uz len;
+	u32 i;
+	s32 fd;
+	NYD_IN;
+
+	/* Clients which still map a former table keep their copy */
+	if(!su_path_rm(a_GRAY_SHM_NAME) && su_err() != su_ERR_NOENT){
+		su_log_write(su_LOG_ERR, _("--gray-shared: cannot remove %s/%s: %s"),
+			pgp->pg_store_path, a_GRAY_SHM_NAME, V_(su_err_doc(-1)));
+		goto jleave;
+	}
+	if(!(pgp->pg_flags & a_F_GRAY_SHM))
+		goto jleave;
+
+	for(i = a_GRAY_SHM_MIN; i < a_GRAY_SHM_MAX && i < (pgp->pg_limit >> 1);)
+		i <<= 1;
+	len = su_VSTRUCT_SIZEOF(struct a_gray_shm,gs_slot) + sizeof(struct a_gray_shm_slot) * i;
+
+	while((fd = a_sandbox_open(pgp, TRU1, a_GRAY_SHM_NAME, (O_RDWR | O_CREAT | O_EXCL), S_IRUSR | S_IWUSR)
+			) == -1){
+		if((fd = su_err_by_errno()) == su_ERR_INTR)
+			continue;
+		if(a_misc_os_resource_delay(fd))
+			continue;
+		goto jerr;
+	}
+
+	gsp = NIL;
+	if(ftruncate(fd, S(off_t,len)) == -1 ||
+			(vp = mmap(NIL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		su_err_by_errno();
+	else
+		gsp = S(struct a_gray_shm*,vp);
+	close(fd);
+
+	if(gsp == NIL){
+		su_path_rm(a_GRAY_SHM_NAME);
+jerr:
+		su_log_write(su_LOG_CRIT, _("--gray-shared: cannot create %s/%s, continuing without: %s"),
+			pgp->pg_store_path, a_GRAY_SHM_NAME, V_(su_err_doc(-1)));
+		goto jleave;
+	}
+
+	/* (Zero-filled) */
+	if(su_state_has(su_STATE_REPRODUCIBLE))
+		gsp->gs_key[0] = gsp->gs_key[1] = 0;
+	else
+		su_random_builtin_generate(gsp->gs_key, sizeof(gsp->gs_key), su_STATE_ERR_NOPASS);
+	gsp->gs_bom = a_GRAY_BIN_BOM;
+	gsp->gs_version = a_GRAY_SHM_VERSION;
+	gsp->gs_mask = i - 1;
+	pgp->pg_shm = gsp;
+	a_server__gray_shm_clear(pgp);
+	/* Last, clients check it */
+	su_mem_copy(gsp->gs_magic, a_GRAY_SHM_MAGIC, sizeof(a_GRAY_SHM_MAGIC));
+
+	if(a_DBGIF || (pgp->pg_flags & a_F_V))
+		su_log_write(su_LOG_INFO, _("--gray-shared: %lu slots, answers valid for %lu seconds"),
+			S(ul,i), S(ul,gsp->gs_ttl));
+
+jleave:
+	NYD_OU;
+}
+
+static void
+a_server__gray_shm_put(struct a_pg *pgp, char const *key, uz len, s64 now){
+	struct a_gray_shm_slot *gssp;
+	u64 fp;
+	u32 seq;
+	struct a_gray_shm *gsp;
+	NYD2_IN;
+
+	gsp = pgp->pg_shm;
+	fp = a_misc_fprint(gsp->gs_key, key, len);
+	gssp = &gsp->gs_slot[fp & gsp->gs_mask];
+
+	/* Another thread updates it: it is only a cache */
+	seq = a_SHM_LOAD_RLX(&gssp->gss_seq);
+	if(!(seq & 1) && a_SHM_CAS(&gssp->gss_seq, &seq, seq + 1)){
+		a_SHM_STORE_RLX(&gssp->gss_fp, fp);
+		a_SHM_STORE_RLX(&gssp->gss_time, S(u32,now));
+		a_SHM_STORE(&gssp->gss_seq, seq + 2);
+	}
+
+	NYD2_OU;
+}
+
+static void
+a_server__gray_shm_clear(struct a_pg *pgp){
+	struct a_gray_shm_slot *gssp;
+	u32 i, seq;
+	struct a_gray_shm *gsp;
+	NYD_IN;
+
+	gsp = pgp->pg_shm;
+
+	/* Clients should pass accepted triples unasked only while the server still knows them */
+	i = MIN(pgp->pg_gray_shared_time, pgp->pg_gc_timeout >> 1);
+	if(LIKELY(!su_state_has(su_STATE_REPRODUCIBLE)))
+		i *= su_TIME_MIN_SECS;
+	a_SHM_STORE(&gsp->gs_ttl, i);
+
+	for(i = 0; i <= gsp->gs_mask; ++i){
+		gssp = &gsp->gs_slot[i];
+		for(;;){
+			seq = a_SHM_LOAD_RLX(&gssp->gss_seq);
+			if(!(seq & 1) && a_SHM_CAS(&gssp->gss_seq, &seq, seq + 1))
+				break;
+		}
+		a_SHM_STORE_RLX(&gssp->gss_fp, 0);
+		a_SHM_STORE(&gssp->gss_seq, seq + 2);
+	}
+
+	NYD_OU;
+}
+#endif /* a_HAVE_GRAY_SHM }}} */
+
+/* __peer_*() {{{ */
+static s32
+a_server__peer_open(struct a_pg *pgp){
+	union a_sockaddr sa;
+	char const *emsg;
+	u32 i, salen;
+	s32 fd, rv;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	rv = su_EX_OK;
+
+	/* Any record fits a datagram */
+	LCTAV(a_PEER_HDR_SIZE + a_BUF_SIZE + su_IENC_BUFFER_SIZE * 2 +4 + a_PEER_MAC_SIZE <= a_PEER_DGRAM_SIZE);
+
+	/* MAC key: the secret hashed twice (conf_finish() ensures it is there) */
+	if(pgp->pg_peer_no > 0 || pgp->pg_peer_listen != NIL){
+		u64 k[2];
+
+		ASSERT(pgp->pg_peer_key != NIL);
+		k[0] = k[1] = 0;
+		k[0] = mp->m_peer_key[0] = a_misc_fprint(k, pgp->pg_peer_key, su_cs_len(pgp->pg_peer_key));
+		mp->m_peer_key[1] = a_misc_fprint(k, pgp->pg_peer_key, su_cs_len(pgp->pg_peer_key));
+	}
+
+	if(pgp->pg_peer_no > 0){
+		mp->m_peers = su_TCALLOC(struct a_peer, pgp->pg_peer_no);
+		mp->m_peer_buf = su_TALLOC(char, a_PEER_DGRAM_SIZE);
+		su_mem_copy(mp->m_peer_buf, a_PEER_MAGIC, sizeof(a_PEER_MAGIC));
+		mp->m_peer_buf[a_PEER_HDR_SIZE - 1] = '\n';
+		mp->m_peer_len = a_PEER_HDR_SIZE;
+		a_MT( pthread_mutex_init(&mp->m_peer_mtx, NIL); )
+	}
+
+	/* Datagrams are sent via connect(2)ed sockets: also works in capability mode */
+	for(i = 0; i < pgp->pg_peer_no; ++i){
+		struct a_peer *pp;
+
+		pp = &mp->m_peers[i];
+		emsg = pgp->pg_peers[i];
+		pp->p_salen = a_misc_policy_addr(emsg, &pp->p_sa, TRU1);
+		ASSERT(pp->p_salen != 0);
+
+		while((fd = socket(pp->p_sa.sa.sa_family, SOCK_DGRAM, 0)) == -1){
+			if((rv = su_err_by_errno()) == su_ERR_INTR)
+				continue;
+			if(a_misc_os_resource_delay(rv))
+				continue;
+			goto jerr;
+		}
+
+		while(connect(fd, &pp->p_sa.sa, pp->p_salen) == -1){
+			if((rv = su_err_by_errno()) != su_ERR_INTR)
+				goto jerr_close;
+		}
+		if(fcntl(fd, F_SETFL, O_NONBLOCK) == -1){
+			rv = su_err_by_errno();
+			goto jerr_close;
+		}
+
+		pp->p_fd = fd;
+		++mp->m_peer_no;
+	}
+
+	if((emsg = pgp->pg_peer_listen) != NIL){
+		int one;
+
+		salen = a_misc_policy_addr(emsg, &sa, TRU1);
+		ASSERT(salen != 0);
+
+		while((fd = socket(sa.sa.sa_family, SOCK_DGRAM, 0)) == -1){
+			if((rv = su_err_by_errno()) == su_ERR_INTR)
+				continue;
+			if(a_misc_os_resource_delay(rv))
+				continue;
+			goto jerr;
+		}
+
+		one = 1;
+		(void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		while(bind(fd, &sa.sa, salen) == -1){
+			if((rv = su_err_by_errno()) != su_ERR_INTR)
+				goto jerr_close;
+		}
+		if(fcntl(fd, F_SETFL, O_NONBLOCK) == -1){
+			rv = su_err_by_errno();
+			goto jerr_close;
+		}
+
+		/* Level-triggered: _ready() takes a batch per round */
+		mp->m_peer_fd = fd;
+		if(!a_server__ev_add(&mp->m_ev, fd, a_EV_COOKIE_PEER, FAL0, FAL0)){
+			rv = su_err();
+			goto jerr;
+		}
+	}
+
+	rv = su_EX_OK;
+jleave:
+	NYD_OU;
+	return rv;
+
+jerr_close:
+	close(fd);
+jerr:
+	su_log_write(su_LOG_CRIT, _("cannot create --peer%s socket %s: %s"),
+		(emsg == pgp->pg_peer_listen ? "-listen" : su_empty), emsg, V_(su_err_doc(rv)));
+	rv = su_EX_IOERR;
+	goto jleave;
+}
+
+static void
+a_server__peer_add(struct a_pg *pgp, char const *key, up d, s64 epoch){
+	uz i;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	i = su_cs_len(key);
+	ASSERT(i < a_BUF_SIZE);
+
+	a_MT( pthread_mutex_lock(&mp->m_peer_mtx); )
+
+	if(a_PEER_DGRAM_SIZE - a_PEER_MAC_SIZE - mp->m_peer_len < i + su_IENC_BUFFER_SIZE * 2 +4)
+		a_server__peer__send(mp);
+
+	/* (Minute of time base is meaningless to others) */
+	mp->m_peer_len = P2UZ(a_server__gray_jnl_rec(&mp->m_peer_buf[mp->m_peer_len], key, i, (d & 0xFFFF0000u), epoch)
+			- mp->m_peer_buf);
+	++pgp->pg_cnt->c_peer_sent;
+
+	a_MT( pthread_mutex_unlock(&mp->m_peer_mtx); )
+
+	NYD_OU;
+}
+
+static void
+a_server__peer_flush(struct a_pg *pgp){
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	a_MT( pthread_mutex_lock(&mp->m_peer_mtx); )
+	a_server__peer__send(mp);
+	a_MT( pthread_mutex_unlock(&mp->m_peer_mtx); )
+
+	NYD_OU;
+}
+
+static void
+a_server__peer__send(struct a_master *mp){
+	struct su_timespec ts;
+	u64 seq;
+	u32 i;
+	NYD2_IN;
+
+	if(mp->m_peer_len > a_PEER_HDR_SIZE){
+		/* Strictly increasing, also over restarts (unless the clock goes back) */
+		su_timespec_current(&ts);
+		seq = S(u64,ts.ts_sec) << 20;
+		mp->m_peer_seq = seq = MAX(seq, mp->m_peer_seq + 1);
+		a_misc_fprint_hex(&mp->m_peer_buf[sizeof(a_PEER_MAGIC)], seq);
+
+		a_misc_fprint_hex(&mp->m_peer_buf[mp->m_peer_len],
+			a_misc_fprint(mp->m_peer_key, mp->m_peer_buf, mp->m_peer_len));
+		mp->m_peer_len += a_PEER_MAC_SIZE;
+
+		/* Datagrams may get lost anyway: do not wait, nor retry */
+		for(i = 0; i < mp->m_peer_no; ++i)
+			while(write(mp->m_peers[i].p_fd, mp->m_peer_buf, mp->m_peer_len) == -1 &&
+					su_err_by_errno() == su_ERR_INTR){
+			}
+		mp->m_peer_len = a_PEER_HDR_SIZE;
+	}
+
+	NYD2_OU;
+}
+
+static void
+a_server__peer_ready(struct a_pg *pgp){ /* {{{ */
+	char buf[a_PEER_DGRAM_SIZE +1], mac[a_PEER_MAC_SIZE];
+	struct su_timespec ts;
+	union a_sockaddr sa;
+	socklen_t salen;
+	ssize_t l;
+	s64 epoch;
+	u64 seq;
+	up d;
+	char const *base, *cp, *top;
+	u32 i, no;
+	struct a_peer *pp;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	su_timespec_current(&ts);
+
+	for(no = 0; no < a_PEER_BATCH; ++no){
+		salen = sizeof(sa);
+		if((l = recvfrom(mp->m_peer_fd, buf, sizeof(buf), 0, &sa.sa, &salen)) == -1){
+			if(su_err_by_errno() == su_ERR_INTR)
+				continue;
+			break;
+		}
+
+		/* Only from --peer addresses (port is ephemeral: the MAC authenticates) */
+		for(pp = mp->m_peers, i = 0; i < mp->m_peer_no; ++pp, ++i){
+			if(sa.sa.sa_family != pp->p_sa.sa.sa_family)
+				continue;
+			if(sa.sa.sa_family == AF_INET
+					? (sa.in.sin_addr.s_addr == pp->p_sa.in.sin_addr.s_addr)
+					: !su_mem_cmp(&sa.in6.sin6_addr, &pp->p_sa.in6.sin6_addr, sizeof(sa.in6.sin6_addr)))
+				break;
+		}
+
+		if(i == mp->m_peer_no || S(uz,l) <= a_PEER_HDR_SIZE + a_PEER_MAC_SIZE || S(uz,l) > a_PEER_DGRAM_SIZE ||
+				su_mem_cmp(buf, a_PEER_MAGIC, sizeof(a_PEER_MAGIC)) || buf[a_PEER_HDR_SIZE - 1] != '\n' ||
+				buf[l - a_PEER_MAC_SIZE - 1] != '\n')
+			goto jbogus;
+
+		l -= a_PEER_MAC_SIZE;
+		a_misc_fprint_hex(mac, a_misc_fprint(mp->m_peer_key, buf, S(uz,l)));
+		if(su_mem_cmp(mac, &buf[l], sizeof(mac)))
+			goto jbogus;
+
+		/* Replays, and stale ones */
+		if((su_idec_u64(&seq, &buf[sizeof(a_PEER_MAGIC)], 16, 16, NIL) &
+					(su_IDEC_STATE_EMASK | su_IDEC_STATE_CONSUMED)) != su_IDEC_STATE_CONSUMED ||
+				seq <= pp->p_seq ||
+				S(s64,seq >> 20) < ts.ts_sec - a_PEER_WINDOW_SECS ||
+				S(s64,seq >> 20) > ts.ts_sec + a_PEER_WINDOW_SECS)
+			goto jbogus;
+		pp->p_seq = seq;
+
+		/* +EPOCH BITMASK KEY: journal records, first bogus one ends datagram */
+		top = &buf[l];
+		for(base = &buf[a_PEER_HDR_SIZE]; base < top; base = &cp[1]){
+			for(cp = base; *cp != '\n'; ++cp){
+			}
+
+			if(*base++ != '+' || !a_server__gray_jnl_parse(&base, cp, &epoch, &d) ||
+					!a_server__peer_merge(pgp, base, P2UZ(cp - base), epoch, d))
+				++pgp->pg_cnt->c_peer_ignored;
+			else
+				++pgp->pg_cnt->c_peer_merged;
+		}
+		continue;
+
+jbogus:
+		++pgp->pg_cnt->c_peer_ignored;
+		if(a_DBGIF || (pgp->pg_flags & a_F_VV))
+			su_log_write(su_LOG_INFO, _("--peer-listen: ignoring bogus, replayed or forged datagram, "
+				"or one of non-peer"));
+	}
+
+	NYD_OU;
+} /* }}} */
+
+static boole
+a_server__peer_merge(struct a_pg *pgp, char const *base, uz len, s64 epoch, up d){ /* {{{ */
+	char key[a_BUF_SIZE];
+	struct a_gray_view gv;
+	u64 fp;
+	s64 ago;
+	s16 nmin;
+	up od;
+	struct a_gray *gp;
+	boole rv;
+	NYD_IN;
+
+	rv = FAL0;
+
+	if(!a_server__gray_load_key(pgp, key, base, len))
+		goto jleave;
+
+	fp = 0;
+	gp = a_server__gray_shard(pgp, key, &fp);
+	a_MT( pthread_mutex_lock(&gp->g_mtx); )
+
+	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call by peer merge");)
+	a_server__gray_maintenance(pgp, gp, TRU1, 0, NIL);
+
+	/* Minute of the change on our clock (peers have synchronized ones), unless it is stale for us */
+	if((ago = gp->g_epoch - epoch) < 0)
+		ago = 0;
+	else if(LIKELY(!su_state_has(su_STATE_REPRODUCIBLE)))
+		ago /= su_TIME_MIN_SECS;
+	if(ago >= ((d & 0x80000000u) ? pgp->pg_gc_timeout : pgp->pg_delay_max) ||
+			gp->g_epoch_min - ago <= S16_MIN)
+		goto junlock;
+	nmin = S(s16,gp->g_epoch_min - ago);
+	d |= S(u16,nmin);
+
+	if(a_server__gray_st_view_find(a_server__gray_st_view(&gv, gp), key, fp)){
+		od = a_server__gray_st_view_data(&gv);
+
+		/* Last writer wins; within the same minute the more advanced state */
+		if(S(s16,od & U16_MAX) > nmin ||
+				(S(s16,od & U16_MAX) == nmin && (od & 0xFFFF0000u) >= (d & 0xFFFF0000u)))
+			goto junlock;
+
+		a_server__gray_st_view_set_data(&gv, d);
+		a_server__gray_wheel_del(gp, od);
+	}else if(a_server__gray_st_count(gp) >= a_server__gray_limit(pgp, gp, FAL0) ||
+			a_server__gray_st_insert(gp, key, fp, d) > su_ERR_NONE)
+		goto junlock;
+
+	a_server__gray_wheel_add(gp, d);
+	/* (Replay takes that as time of the change) */
+	a_server__gray_jnl_add(pgp, key, d, MIN(epoch, gp->g_epoch));
+
+	a_DBG(su_log_write(su_LOG_DEBUG, "peer merged gray=%d count=%lu min=%hd: %s",
+		!(d & 0x80000000u), S(ul,(d >> 16) & S16_MAX), nmin, key);)
+	rv = TRU1;
+
+junlock:
+	a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
+/* }}} */
+
+/* __dom_*() {{{ */
+static boole
+a_server__dom_insert(struct a_master *mp, char const *name, BITENUM(u32,a_dom_flags) f){ /* {{{ */
+	struct a_dom **dpp, *dp, *np;
+	uz i, j;
+	boole rv;
+	NYD2_IN;
+
+	rv = FAL0;
+	i = su_cs_len(name);
+	ASSERT(i > 0);
+
+	for(dpp = &mp->m_dom;; dpp = &dp->d_kid){
+		char c;
+
+		c = name[i - 1];
+		while((dp = *dpp) != NIL && S(u8,dp->d_edge[0]) < S(u8,c))
+			dpp = &dp->d_sib;
+
+		/* New leaf takes all the rest */
+		if(dp == NIL || dp->d_edge[0] != c){
+			np = S(struct a_dom*,su_ALLOC(su_VSTRUCT_SIZEOF(struct a_dom,d_edge) + i));
+			np->d_kid = NIL;
+			np->d_sib = dp;
+			np->d_len = S(u32,i);
+			np->d_flags = f;
+			for(j = 0; j < i; ++j)
+				np->d_edge[j] = name[i - 1 - j];
+			*dpp = np;
+			++mp->m_dom_no;
+			rv = TRU1;
+			break;
+		}
+
+		for(j = 1; j < dp->d_len && j < i && dp->d_edge[j] == name[i - 1 - j]; ++j){
+		}
+
+		/* Split edge: tail becomes only child, dp is shortened in place */
+		if(j < dp->d_len){
+			np = S(struct a_dom*,su_ALLOC(su_VSTRUCT_SIZEOF(struct a_dom,d_edge) + (dp->d_len - j)));
+			np->d_kid = dp->d_kid;
+			np->d_sib = NIL;
+			np->d_len = dp->d_len - S(u32,j);
+			np->d_flags = dp->d_flags;
+			su_mem_copy(np->d_edge, &dp->d_edge[j], np->d_len);
+			dp->d_kid = np;
+			dp->d_len = S(u32,j);
+			dp->d_flags = a_DOM_NONE;
+			++mp->m_dom_no;
+		}
+
+		if((i -= j) == 0){
+			rv = ((dp->d_flags & f) != f);
+			dp->d_flags |= f;
+			break;
+		}
+	}
+
+	NYD2_OU;
+	return rv;
+} /* }}} */
+
+static void
+a_server__dom_lookup(struct a_dom const *dp, char const *name, char const **wcpp, char const **bcpp){ /* {{{ */
+	BITENUM(u32,a_dom_flags) f;
+	uz i, j;
+	NYD2_IN;
+
+	*wcpp = *bcpp = NIL;
+
+	/* Going from the TLD on, later matches are longer ones */
+	for(i = su_cs_len(name); i > 0; dp = dp->d_kid){
+		char c;
+
+		c = name[i - 1];
+		while(dp != NIL && S(u8,dp->d_edge[0]) < S(u8,c))
+			dp = dp->d_sib;
+		if(dp == NIL || dp->d_edge[0] != c || dp->d_len > i)
+			break;
+
+		for(j = 1; j < dp->d_len; ++j)
+			if(dp->d_edge[j] != name[i - 1 - j])
+				goto jleave;
+		i -= j;
+
+		if((f = dp->d_flags) != a_DOM_NONE){
+			if(i == 0){
+				if(f & (a_DOM_ALLOW | a_DOM_ALLOW_WILD))
+					*wcpp = name;
+				if(f & (a_DOM_BLOCK | a_DOM_BLOCK_WILD))
+					*bcpp = name;
+			}else if(name[i - 1] == '.'){
+				if(f & a_DOM_ALLOW_WILD)
+					*wcpp = &name[i];
+				if(f & a_DOM_BLOCK_WILD)
+					*bcpp = &name[i];
+			}
+		}
+	}
+
+jleave:
+	NYD2_OU;
+} /* }}} */
+
+static void
+a_server__dom_free(struct a_dom *dp){
+	struct a_dom *np;
+	NYD2_IN;
+
+	for(; dp != NIL; dp = np){
+		np = dp->d_sib;
+		a_server__dom_free(dp->d_kid);
+		su_FREE(dp);
+	}
+
+	NYD2_OU;
+}
+/* }}} */
+
+/* __srch_*() {{{ */
+static boole
+a_server__srch_insert(struct a_srch **rootp, u8 const *key, u32 plen){ /* {{{ */
+	struct a_srch *sp, *np, *fp;
+	u32 cl, i;
+	boole rv;
+	NYD2_IN;
+
+	ASSERT(plen <= 128);
+	rv = FAL0;
+
+	for(; (sp = *rootp) != NIL; rootp = &sp->s_kid[(key[sp->s_plen >> 3] >> (7 - (sp->s_plen & 7))) & 1]){
+		/* Common prefix length */
+		for(cl = 0, i = MIN(sp->s_plen, plen); cl < i; cl += 8){
+			u8 x;
+
+			if((x = sp->s_key[cl >> 3] ^ key[cl >> 3]) != 0){
+				for(; !(x & 0x80); x <<= 1)
+					++cl;
+				break;
+			}
+		}
+		cl = MIN(cl, i);
+
+		if(cl == sp->s_plen){
+			if(cl == plen){
+				if(!sp->s_term)
+					rv = sp->s_term = TRU1;
+				goto jleave;
+			}
+			continue;
+		}
+
+		/* Need to split: new entry becomes parent of sp, or both hang off a new fork node */
+		np = su_TCALLOC(struct a_srch, 1);
+		np->s_plen = S(u8,plen);
+		np->s_term = TRU1;
+		su_mem_copy(np->s_key, key, (plen + 7) >> 3);
+
+		if(cl == plen){
+			np->s_kid[(sp->s_key[cl >> 3] >> (7 - (cl & 7))) & 1] = sp;
+			*rootp = np;
+		}else{
+			fp = su_TCALLOC(struct a_srch, 1);
+			fp->s_plen = S(u8,cl);
+			su_mem_copy(fp->s_key, key, (cl + 7) >> 3);
+			if(cl & 7)
+				fp->s_key[cl >> 3] &= S(u8,0xFFu << (8 - (cl & 7)));
+			fp->s_kid[(key[cl >> 3] >> (7 - (cl & 7))) & 1] = np;
+			fp->s_kid[(sp->s_key[cl >> 3] >> (7 - (cl & 7))) & 1] = sp;
+			*rootp = fp;
+		}
+		rv = TRU1;
+		goto jleave;
+	}
+
+	np = su_TCALLOC(struct a_srch, 1);
+	np->s_plen = S(u8,plen);
+	np->s_term = TRU1;
+	su_mem_copy(np->s_key, key, (plen + 7) >> 3);
+	*rootp = np;
+	rv = TRU1;
+
+jleave:
+	NYD2_OU;
+	return rv;
+} /* }}} */
+
+static struct a_srch const *
+a_server__srch_lookup(struct a_srch const *sp, u8 const *key, u32 bits){
+	struct a_srch const *rv;
+	u32 o, i, n;
+	NYD2_IN;
+
+	/* Only compare the bits skipped since the parent */
+	for(rv = NIL, o = 0; sp != NIL; o = sp->s_plen, sp = sp->s_kid[(key[o >> 3] >> (7 - (o & 7))) & 1]){
+		for(; o < sp->s_plen; o += n){
+			i = o & 7;
+			n = MIN(8 - i, sp->s_plen - o);
+			if((sp->s_key[o >> 3] ^ key[o >> 3]) & (0xFFu >> i) & ~(0xFFu >> (i + n)))
+				goto jleave;
+		}
+
+		if(sp->s_term)
+			rv = sp;
+		if(sp->s_plen == bits)
+			break;
+	}
+
+jleave:
+	NYD2_OU;
+	return rv;
+}
+
+static void
+a_server__srch_free(struct a_srch *sp){
+	NYD2_IN;
+
+	if(sp != NIL){
+		a_server__srch_free(sp->s_kid[0]);
+		a_server__srch_free(sp->s_kid[1]);
+		su_FREE(sp);
+	}
+
+	NYD2_OU;
+}
+/* }}} */
+
+/* __lim_*() {{{ */
+static void const *
+a_server__lim_at(char const *lim, u32 off, uz len){
+	u32 size;
+	void const *rv;
+	NYD2_IN;
+
+	size = R(struct a_lim_hdr const*,lim)->lh_size;
+	rv = (off != 0 && !(off & 3) && off < size && len <= size - off) ? &lim[off] : NIL;
+
+	NYD2_OU;
+	return rv;
+}
+
+static boole
+a_server__lim_ca(char const *lim, struct a_lim_wb const *lwp, char const *ca){
+	char const *cp;
+	u32 const *tp;
+	u32 m, i, j;
+	boole rv;
+	NYD2_IN;
+
+	rv = FAL0;
+	m = lwp->lw_ca_mask;
+
+	if(lwp->lw_ca_no > 0 && (tp = a_server__lim_at(lim, lwp->lw_ca, (S(uz,m) + 1) << 2)) != NIL){
+		/* Strings end before the NUL that terminates the image */
+		for(i = a_misc_cksum(a_MISC_CKSUM_INIT, ca, su_cs_len(ca)) & m, j = 0; j <= m; i = (i + 1) & m, ++j){
+			if(tp[i] == 0)
+				break;
+			if((cp = a_server__lim_at(lim, tp[i], 1)) != NIL && !su_cs_cmp(cp, ca)){
+				rv = TRU1;
+				break;
+			}
+		}
+	}
+
+	NYD2_OU;
+	return rv;
+}
+
+static boole
+a_server__lim_srch(char const *lim, u32 off, u8 const *key, u32 bits){
+	struct a_lim_srch const *sp;
+	u32 o, i, n, x;
+	boole rv;
+	NYD2_IN;
+
+	/* As __srch_lookup(), but without trusting the image */
+	for(rv = FAL0, o = 0; (sp = a_server__lim_at(lim, off, sizeof(*sp))) != NIL && sp->ls_plen <= bits; off = x){
+		for(; o < sp->ls_plen; o += n){
+			i = o & 7;
+			n = MIN(8 - i, sp->ls_plen - o);
+			if((sp->ls_key[o >> 3] ^ key[o >> 3]) & (0xFFu >> i) & ~(0xFFu >> (i + n)))
+				goto jleave;
+		}
+
+		if(sp->ls_term){
+			rv = TRU1;
+			break;
+		}
+		if((o = sp->ls_plen) == bits || (x = sp->ls_kid[(key[o >> 3] >> (7 - (o & 7))) & 1]) <= off)
+			break;
+	}
+
+jleave:
+	NYD2_OU;
+	return rv;
+}
+
+static void
+a_server__lim_dom(char const *lim, char const *name, char const **wcpp, char const **bcpp){ /* {{{ */
+	struct a_lim_dom const *dp;
+	BITENUM(u32,a_dom_flags) f;
+	char const *wcp, *bcp;
+	u32 off, x;
+	uz i, j;
+	NYD2_IN;
+
+	wcp = bcp = NIL;
+
+	/* As __dom_lookup(), but without trusting the image */
+	for(i = su_cs_len(name), off = R(struct a_lim_hdr const*,lim)->lh_dom; i > 0; off = x){
+		char c;
+
+		c = name[i - 1];
+		for(;;){
+			if((dp = a_server__lim_at(lim, off, su_VSTRUCT_SIZEOF(struct a_lim_dom,ld_edge))) == NIL ||
+					dp->ld_len == 0 || a_server__lim_at(lim, off,
+						su_VSTRUCT_SIZEOF(struct a_lim_dom,ld_edge) + dp->ld_len) == NIL)
+				goto jleave;
+			if(S(u8,dp->ld_edge[0]) >= S(u8,c))
+				break;
+			if((x = dp->ld_sib) <= off)
+				goto jleave;
+			off = x;
+		}
+		if(dp->ld_edge[0] != c || dp->ld_len > i)
+			break;
+
+		for(j = 1; j < dp->ld_len; ++j)
+			if(dp->ld_edge[j] != name[i - 1 - j])
+				goto jleave;
+		i -= j;
+
+		if((f = dp->ld_flags) != a_DOM_NONE){
+			if(i == 0){
+				if(f & (a_DOM_ALLOW | a_DOM_ALLOW_WILD))
+					wcp = name;
+				if(f & (a_DOM_BLOCK | a_DOM_BLOCK_WILD))
+					bcp = name;
+			}else if(name[i - 1] == '.'){
+				if(f & a_DOM_ALLOW_WILD)
+					wcp = &name[i];
+				if(f & a_DOM_BLOCK_WILD)
+					bcp = &name[i];
+			}
+		}
+
+		if((x = dp->ld_kid) <= off)
+			break;
+	}
+
+jleave:
+	/* Longer matches start earlier */
+	if(wcp != NIL && (*wcpp == NIL || wcp < *wcpp))
+		*wcpp = wcp;
+	if(bcp != NIL && (*bcpp == NIL || bcp < *bcpp))
+		*bcpp = bcp;
+
+	NYD2_OU;
+} /* }}} */
+/* }}} */
+
+/* __ev_*() {{{ */
+static boole
+a_server__ev_open(struct a_ev *evp, boole sigs){
+	boole rv;
+	NYD_IN;
+	UNUSED(sigs);
+
+	evp->ev_no = 0;
+
+#ifdef a_HAVE_EV_EPOLL
+	rv = ((evp->ev_fd = epoll_create1(EPOLL_CLOEXEC)) != -1);
+	if(!rv)
+		su_err_by_errno();
+
+#elif defined a_HAVE_EV_KQUEUE
+	if((rv = ((evp->ev_fd = kqueue()) != -1)) && sigs){
+		static int const sa[] = {SIGCHLD, SIGHUP, SIGTERM, SIGUSR1, SIGUSR2};
+		struct kevent kev[NELEM(sa)];
+		uz i;
+
+		/* Also recorded when blocked: __ev_wait() then briefly unblocks, so that handlers run */
+		for(i = 0; i < NELEM(sa); ++i)
+			EV_SET(&kev[i], sa[i], EVFILT_SIGNAL, EV_ADD, 0, 0, R(void*,S(up,a_EV_COOKIE_SIG)));
+		if(kevent(evp->ev_fd, kev, S(int,NELEM(kev)), NIL, 0, NIL) == -1){
+			su_err_by_errno();
+			close(evp->ev_fd);
+			evp->ev_fd = -1;
+			rv = FAL0;
+		}
+	}else if(!rv)
+		su_err_by_errno();
+
+#else
+	evp->ev_fd = evp->ev_maxfd = -1;
+	FD_ZERO(&evp->ev_set);
+	rv = TRU1;
+#endif
+
+	NYD_OU;
+	return rv;
+}
+
+static void
+a_server__ev_close(struct a_ev *evp){
+	NYD_IN;
+
+	if(evp->ev_fd != -1){
+		close(evp->ev_fd);
+		evp->ev_fd = -1;
+	}
+	evp->ev_no = 0;
+
+	NYD_OU;
+}
+
+static boole
+a_server__ev_add(struct a_ev *evp, s32 fd, u32 cookie, boole edge, boole mod){
+	boole rv;
+	NYD2_IN;
+
+#ifdef a_HAVE_EV_EPOLL
+	/* C99 */{
+		struct epoll_event ee;
+
+		STRUCT_ZERO(struct epoll_event, &ee);
+		ee.events = EPOLLIN | (edge ? EPOLLET : 0);
+		ee.data.u64 = cookie;
+		if(!(rv = (epoll_ctl(evp->ev_fd, (mod ? EPOLL_CTL_MOD : EPOLL_CTL_ADD), fd, &ee) != -1)))
+			su_err_by_errno();
+	}
+
+#elif defined a_HAVE_EV_KQUEUE
+	/* C99 */{
+		struct kevent kev;
+
+		UNUSED(mod); /* EV_ADD updates */
+		EV_SET(&kev, fd, EVFILT_READ, EV_ADD | (edge ? EV_CLEAR : 0), 0, 0, R(void*,S(up,cookie)));
+		if(!(rv = (kevent(evp->ev_fd, &kev, 1, NIL, 0, NIL) != -1)))
+			su_err_by_errno();
+	}
+
+#else
+	UNUSED(edge);
+	UNUSED(mod);
+	if(!(rv = (fd < FD_SETSIZE)))
+		su_err_set(su_ERR_MFILE);
+	else{
+		FD_SET(fd, &evp->ev_set);
+		evp->ev_cookie[fd] = cookie;
+		evp->ev_maxfd = MAX(evp->ev_maxfd, fd);
+	}
+#endif
+
+	NYD2_OU;
+	return rv;
+}
+
+static void
+a_server__ev_del(struct a_ev *evp, s32 fd, boole closing){
+	NYD2_IN;
+
+#ifdef a_HAVE_EV_EPOLL
+	/* close(2) removes it */
+	if(!closing){
+		struct epoll_event ee;
+
+		STRUCT_ZERO(struct epoll_event, &ee);
+		epoll_ctl(evp->ev_fd, EPOLL_CTL_DEL, fd, &ee);
+	}
+
+#elif defined a_HAVE_EV_KQUEUE
+	if(!closing){
+		struct kevent kev;
+
+		EV_SET(&kev, fd, EVFILT_READ, EV_DELETE, 0, 0, NIL);
+		kevent(evp->ev_fd, &kev, 1, NIL, 0, NIL);
+	}
+
+#else
+	UNUSED(closing);
+	FD_CLR(fd, &evp->ev_set);
+	if(fd == evp->ev_maxfd)
+		while(--evp->ev_maxfd >= 0 && !FD_ISSET(evp->ev_maxfd, &evp->ev_set)){
+		}
+#endif
+
+	NYD2_OU;
+}
+
+static s32
+a_server__ev_wait(struct a_ev *evp, struct timespec const *tosp_or_nil, sigset_t const *sigmask_or_nil){
+	s32 rv;
+	NYD2_IN;
+
+	evp->ev_no = 0;
+
+#ifdef a_HAVE_EV_EPOLL
+	/* C99 */{
+		struct epoll_event ees[a_EV_BATCH];
+		s64 ms;
+
+		if(tosp_or_nil == NIL)
+			ms = -1;
+		else{
+			ms = S(s64,tosp_or_nil->tv_sec) * su_TIMESPEC_SEC_MILLIS + tosp_or_nil->tv_nsec / 1000000;
+			ms = MIN(ms, S32_MAX);
+		}
+
+		if((rv = epoll_pwait(evp->ev_fd, ees, a_EV_BATCH, S(int,ms), sigmask_or_nil)) == -1)
+			su_err_by_errno();
+		else{
+			for(; evp->ev_no < S(u32,rv); ++evp->ev_no)
+				evp->ev_ready[evp->ev_no] = S(u32,ees[evp->ev_no].data.u64);
+		}
+	}
+
+#elif defined a_HAVE_EV_KQUEUE
+	/* C99 */{
+		struct kevent kevs[a_EV_BATCH];
+		s32 i;
+		boole sig;
+
+		if((rv = kevent(evp->ev_fd, NIL, 0, kevs, a_EV_BATCH, tosp_or_nil)) == -1)
+			su_err_by_errno();
+		else{
+			for(sig = FAL0, i = 0; i < rv; ++i){
+				if(kevs[i].filter == EVFILT_SIGNAL)
+					sig = TRU1;
+				else
+					evp->ev_ready[evp->ev_no++] = S(u32,R(up,kevs[i].udata));
+			}
+
+			if(sig && (rv = S(s32,evp->ev_no)) == 0){
+				su_err_set(su_ERR_INTR);
+				rv = -1;
+			}
+		}
+
+		/* Let pending signals be delivered */
+		if(sigmask_or_nil != NIL){
+			sigset_t sso;
+
+			sigprocmask(SIG_SETMASK, sigmask_or_nil, &sso);
+			sigprocmask(SIG_SETMASK, &sso, NIL);
+		}
+	}
+
+#else
+	/* C99 */{
+		fd_set rfds;
+
+		rfds = evp->ev_set;
+		if((rv = pselect(evp->ev_maxfd + 1, &rfds, NIL, NIL, tosp_or_nil, sigmask_or_nil)) == -1)
+			su_err_by_errno();
+		else if(rv > 0){
+			s32 fd;
+
+			for(fd = 0; fd <= evp->ev_maxfd && evp->ev_no < a_EV_BATCH; ++fd)
+				if(FD_ISSET(fd, &rfds))
+					evp->ev_ready[evp->ev_no++] = evp->ev_cookie[fd];
+			rv = S(s32,evp->ev_no);
+		}
+	}
+#endif
+
+	NYD2_OU;
+	return rv;
+}
+/* }}} */
+
+#ifdef a_HAVE_MT /* {{{ */
+static s32
+a_server__mt_start(struct a_pg *pgp){
+	struct a_mt_worker *wp;
+	u32 i;
+	s32 rv;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	mp->m_pg = pgp;
+
+	pthread_mutex_init(&mp->m_mt_mtx, NIL);
+	pthread_rwlock_init(&mp->m_wb_rwl, NIL);
+
+	if(pipe(mp->m_mt_wake) == -1)
+		goto jepipe;
+	/* Master only needs to see one wakeup */
+	fcntl(mp->m_mt_wake[1], F_SETFL, O_NONBLOCK);
+	if(!a_server__ev_add(&mp->m_ev, mp->m_mt_wake[0], a_EV_COOKIE_PIPE, FAL0, FAL0))
+		goto jeev;
+
+	mp->m_thrs = su_TCALLOC(struct a_mt_worker, pgp->pg_server_threads);
+
+	for(i = 0; i < pgp->pg_server_threads; ++i){
+		wp = &mp->m_thrs[i];
+
+		if(pipe(wp->w_pipe) == -1)
+			goto jepipe;
+		if(!a_server__ev_open(&wp->w_ev, FAL0) ||
+				!a_server__ev_add(&wp->w_ev, wp->w_pipe[0], a_EV_COOKIE_PIPE, FAL0, FAL0)){
+			a_server__ev_close(&wp->w_ev);
+			close(wp->w_pipe[0]);
+			close(wp->w_pipe[1]);
+			goto jeev;
+		}
+
+		su_mem_copy(&wp->w_pg, pgp, FIELD_OFFSETOF(struct a_pg,pg_cnt));
+		wp->w_pg.pg_cnt = &wp->w_cnt;
+		wp->w_pg.pg_ev = &wp->w_ev;
+		wp->w_pg.pg_cli_fds = su_TALLOC(s32, pgp->pg_server_queue);
+		wp->w_pg.pg_park = su_TCALLOC(struct a_park, pgp->pg_server_queue);
+		wp->w_pg.pg_conf_gen = mp->m_conf_gen;
+
+		if((rv = pthread_create(&wp->w_tid, NIL, &a_server__mt_worker, wp)) != 0){
+			errno = rv;
+			su_log_write(su_LOG_CRIT, _("cannot create server thread: %s"), V_(su_err_doc(su_err_by_errno())));
+			su_FREE(wp->w_pg.pg_park);
+			su_FREE(wp->w_pg.pg_cli_fds);
+			a_server__ev_close(&wp->w_ev);
+			close(wp->w_pipe[0]);
+			close(wp->w_pipe[1]);
+			rv = su_EX_OSERR;
+			goto jleave;
+		}
+		mp->m_thr_no = i + 1;
+	}
+
+	/* Configuration reload helper, parses into lists of its own */
+	/* C99 */{
+		struct a_pg *rpgp;
+		struct a_master *rmp;
+
+		rpgp = su_TCALLOC(struct a_pg, 1);
+		rpgp->pg_master = rmp = su_TCALLOC(struct a_master, 1);
+		rpgp->pg_cnt = &rmp->m_cnt;
+		su_cs_dict_create(&rmp->m_white.wb_ca, a_WB_CA_FLAGS, NIL);
+		su_cs_dict_create(&rmp->m_black.wb_ca, a_WB_CA_FLAGS, NIL);
+
+		pthread_cond_init(&mp->m_rld_cnd, NIL);
+		mp->m_rld_state = a_MT_RELOAD_NONE;
+
+		if((rv = pthread_create(&mp->m_rld_tid, NIL, &a_server__mt_reloader, mp)) != 0){
+			errno = rv;
+			su_log_write(su_LOG_CRIT, _("cannot create server thread: %s"), V_(su_err_doc(su_err_by_errno())));
+			pthread_cond_destroy(&mp->m_rld_cnd);
+			su_cs_dict_gut(&rmp->m_black.wb_ca);
+			su_cs_dict_gut(&rmp->m_white.wb_ca);
+			su_FREE(rmp);
+			su_FREE(rpgp);
+			rv = su_EX_OSERR;
+			goto jleave;
+		}
+		mp->m_rld_pg = rpgp;
+	}
+
+	if(pgp->pg_flags & a_F_VV)
+		su_log_write(su_LOG_INFO, "started %lu server threads", S(ul,mp->m_thr_no));
+	rv = su_EX_OK;
+jleave:
+	NYD_OU;
+	return rv;
+
+jepipe:
+	su_err_by_errno();
+jeev:
+	su_log_write(su_LOG_CRIT, _("cannot create server thread pipe: %s"), V_(su_err_doc(-1)));
+	rv = su_EX_OSERR;
+	goto jleave;
+}
+
+static void
+a_server__mt_stop(struct a_pg *pgp){
+	struct a_mt_worker *wp;
+	u32 i;
+	s32 x;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	if(mp->m_rld_pg != NIL){
+		struct a_master *rmp;
+
+		pthread_mutex_lock(&mp->m_mt_mtx);
+		mp->m_rld_state = a_MT_RELOAD_EXIT;
+		pthread_cond_signal(&mp->m_rld_cnd);
+		pthread_mutex_unlock(&mp->m_mt_mtx);
+		pthread_join(mp->m_rld_tid, NIL);
+		pthread_cond_destroy(&mp->m_rld_cnd);
+
+		rmp = mp->m_rld_pg->pg_master;
+		a_server__wb_reset(rmp);
+		su_cs_dict_gut(&rmp->m_black.wb_ca);
+		su_cs_dict_gut(&rmp->m_white.wb_ca);
+		su_FREE(rmp);
+		su_FREE(mp->m_rld_pg);
+		mp->m_rld_pg = NIL;
+	}
+
+	for(x = -1, i = 0; i < mp->m_thr_no; ++i){
+		wp = &mp->m_thrs[i];
+		while(write(wp->w_pipe[1], &x, sizeof(x)) == -1 && su_err_by_errno() == su_ERR_INTR){
+		}
+	}
+
+	for(i = 0; i < mp->m_thr_no; ++i){
+		wp = &mp->m_thrs[i];
+		pthread_join(wp->w_tid, NIL);
+		a_server__ev_close(&wp->w_ev);
+		close(wp->w_pipe[0]);
+		close(wp->w_pipe[1]);
+		su_FREE(wp->w_pg.pg_park);
+		su_FREE(wp->w_pg.pg_cli_fds);
+	}
+
+	/* Keep statistics */
+	for(i = 0; i < mp->m_thr_no; ++i)
+		a_server__cnt_add(&mp->m_cnt, &mp->m_thrs[i].w_cnt);
+
+	su_FREE(mp->m_thrs);
+	mp->m_thrs = NIL;
+	mp->m_thr_no = 0;
+
+	a_server__ev_del(&mp->m_ev, mp->m_mt_wake[0], TRU1);
+	close(mp->m_mt_wake[0]);
+	close(mp->m_mt_wake[1]);
+	pthread_rwlock_destroy(&mp->m_wb_rwl);
+	pthread_mutex_destroy(&mp->m_mt_mtx);
+
+	NYD_OU;
+}
+
+static void
+a_server__mt_wake(struct a_master *mp){
+	NYD2_IN;
+
+	/* O_NONBLOCK: if the pipe is full master will wake up anyhow */
+	while(write(mp->m_mt_wake[1], su_empty, sizeof(su_empty[0])) == -1 && su_err_by_errno() == su_ERR_INTR){
+	}
+
+	NYD2_OU;
+}
+
+static void *
+a_server__mt_worker(void *vp){
+	struct timespec tos;
+	u32 i;
+	s32 x;
+	boole pready;
+	struct a_master *mp;
+	struct a_pg *pgp;
+	struct a_mt_worker *wp;
+	NYD_IN;
+
+	wp = S(struct a_mt_worker*,vp);
+	pgp = &wp->w_pg;
+	mp = pgp->pg_master;
+
+	for(;;){
+		/* Configuration reloaded?  Keep our "logged once" state */
+		pthread_rwlock_rdlock(&mp->m_wb_rwl);
+		if(UNLIKELY(pgp->pg_conf_gen != mp->m_conf_gen)){
+			uz f;
+
+			f = pgp->pg_flags & (a_F_MASTER_LIMIT_EXCESS_LOGGED | a_F_MASTER_NOMEM_LOGGED);
+			su_mem_copy(pgp, mp->m_pg, FIELD_OFFSETOF(struct a_pg,pg_cnt));
+			pgp->pg_flags &= ~S(uz,a_F_MASTER_ACCEPT_SUSPENDED |
+					a_F_MASTER_LIMIT_EXCESS_LOGGED | a_F_MASTER_NOMEM_LOGGED);
+			pgp->pg_flags |= f;
+			pgp->pg_conf_gen = mp->m_conf_gen;
+		}
+		pthread_rwlock_unlock(&mp->m_wb_rwl);
+
+		/* (All signals are blocked) */
+		if(a_server__ev_wait(&wp->w_ev, a_server__cli_park_tos(pgp, &tos, NIL), NIL) == -1){
+			if((x = su_err()) == su_ERR_INTR)
+				continue;
+			su_log_write(su_LOG_CRIT, _("server thread select failed: %s"), V_(su_err_doc(x)));
+			a_SERVER_TERM_SET();
+			a_server__mt_wake(mp);
+			/* Wait for master to ask for exit */
+		}else
+			a_server__cli_park_due(pgp);
+
+		for(pready = FAL0, i = 0; i < wp->w_ev.ev_no; ++i){
+			if((x = S(s32,wp->w_ev.ev_ready[i])) == S(s32,a_EV_COOKIE_PIPE))
+				pready = TRU1;
+			else
+				a_server__cli_ready(pgp, S(u32,x));
+		}
+		a_server__cli_compact(pgp);
+
+		if(a_SERVER_TERM() || pready){
+			/* Master gives new clients, or -1 to exit */
+			for(;;){
+				ssize_t r;
+
+				if((r = read(wp->w_pipe[0], &x, sizeof(x))) == sizeof(x))
+					break;
+				if(r == -1 && su_err_by_errno() == su_ERR_INTR)
+					continue;
+				x = -1;
+				break;
+			}
+			if(x == -1)
+				break;
+			if(a_server__cli_add(pgp, x)){
+				a_DBG2(su_log_write(su_LOG_DEBUG, "thread %lu: client fd=%d, now %u",
+					S(ul,P2UZ(wp - mp->m_thrs)), a_CLI_FD(x), pgp->pg_cli_no);)
+			}
+		}
+
+		a_server__gray_afterwork(pgp);
+	}
+
+	while(pgp->pg_cli_no > 0){
+		close(a_CLI_FD(pgp->pg_cli_fds[--pgp->pg_cli_no]));
+		if(pgp->pg_park[pgp->pg_cli_no].p_buf != NIL)
+			su_FREE(pgp->pg_park[pgp->pg_cli_no].p_buf);
+		if(pgp->pg_park[pgp->pg_cli_no].p_line != NIL)
+			su_FREE(pgp->pg_park[pgp->pg_cli_no].p_line);
+	}
+
+	NYD_OU;
+	return NIL;
+}
+
+static boole
+a_server__mt_reload(struct a_pg *pgp){
+	struct a_pg *rpgp;
+	struct a_master *mp, *rmp;
+	boole rv;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	pthread_mutex_lock(&mp->m_mt_mtx);
+	if((rv = (mp->m_rld_state == a_MT_RELOAD_NONE))){
+		/* Helper starts with a copy of our configuration */
+		rpgp = mp->m_rld_pg;
+		rmp = rpgp->pg_master;
+		su_mem_copy(rpgp, pgp, FIELD_OFFSETOF(struct a_pg,pg_cnt));
+		rpgp->pg_master = rmp;
+		mp->m_rld_state = a_MT_RELOAD_WANT;
+		pthread_cond_signal(&mp->m_rld_cnd);
+	}
+	pthread_mutex_unlock(&mp->m_mt_mtx);
+
+	NYD_OU;
+	return rv;
+}
+
+static s32
+a_server__mt_reload_swap(struct a_pg *pgp){
+	struct a_wb wb;
+	struct a_dom *dp;
+	char const *lim;
+	uz f;
+	ul i;
+	s32 rv;
+	struct a_pg *rpgp;
+	struct a_master *mp, *rmp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	pthread_mutex_lock(&mp->m_mt_mtx);
+	if(mp->m_rld_state != a_MT_RELOAD_DONE)
+		rv = -1;
+	else{
+		rv = mp->m_rld_rv;
+		mp->m_rld_state = a_MT_RELOAD_NONE;
+	}
+	pthread_mutex_unlock(&mp->m_mt_mtx);
+
+	if(rv == -1)
+		goto jleave;
+
+	rpgp = mp->m_rld_pg;
+	rmp = rpgp->pg_master;
+
+	if(rv == su_EX_OK){
+		pthread_rwlock_wrlock(&mp->m_wb_rwl);
+
+		wb = mp->m_white;
+		mp->m_white = rmp->m_white;
+		rmp->m_white = wb;
+		wb = mp->m_black;
+		mp->m_black = rmp->m_black;
+		rmp->m_black = wb;
+		dp = mp->m_dom;
+		mp->m_dom = rmp->m_dom;
+		rmp->m_dom = dp;
+		i = mp->m_dom_no;
+		mp->m_dom_no = rmp->m_dom_no;
+		rmp->m_dom_no = i;
+		lim = mp->m_lim;
+		mp->m_lim = rmp->m_lim;
+		rmp->m_lim = lim;
+
+		/* Keep our "logged once" and accept(2) state */
+		f = pgp->pg_flags & (a_F_MASTER_ACCEPT_SUSPENDED | a_F_MASTER_LIMIT_EXCESS_LOGGED |
+				a_F_MASTER_NOMEM_LOGGED);
+		su_mem_copy(pgp, rpgp, FIELD_OFFSETOF(struct a_pg,pg_cnt));
+		pgp->pg_master = mp;
+		pgp->pg_flags &= ~S(uz,a_F_MASTER_ACCEPT_SUSPENDED | a_F_MASTER_LIMIT_EXCESS_LOGGED |
+				a_F_MASTER_NOMEM_LOGGED);
+		pgp->pg_flags |= f;
+
+		++mp->m_conf_gen;
+		pthread_rwlock_unlock(&mp->m_wb_rwl);
+	}
+
+	/* The old lists, or those of a failed attempt */
+	a_server__wb_reset(rmp);
+
+jleave:
+	NYD_OU;
+	return rv;
+}
+
+static void *
+a_server__mt_reloader(void *vp){
+	s32 rv;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = S(struct a_master*,vp);
+
+	pthread_mutex_lock(&mp->m_mt_mtx);
+	while(mp->m_rld_state != a_MT_RELOAD_EXIT){
+		if(mp->m_rld_state != a_MT_RELOAD_WANT){
+			pthread_cond_wait(&mp->m_rld_cnd, &mp->m_mt_mtx);
+			continue;
+		}
+		pthread_mutex_unlock(&mp->m_mt_mtx);
+
+		rv = a_server__wb_parse(mp->m_rld_pg, TRU1);
+
+		pthread_mutex_lock(&mp->m_mt_mtx);
+		mp->m_rld_rv = rv;
+		if(mp->m_rld_state == a_MT_RELOAD_WANT){
+			mp->m_rld_state = a_MT_RELOAD_DONE;
+			a_server__mt_wake(mp);
+		}
+	}
+	pthread_mutex_unlock(&mp->m_mt_mtx);
+
+	NYD_OU;
+	return NIL;
+}
+#endif /* a_HAVE_MT }}} */
+
+/* gray store {{{ */
+static void
+a_server__gray_st_create(struct a_gray *gp, boole fp, u32 min){
+	NYD_IN;
+
+	gp->g_min = min;
+
+	if(!fp){
+		su_cs_dict_balance(su_cs_dict_set_min_size(su_cs_dict_set_threshold(
+					su_cs_dict_create(&gp->g_dict, a_GRAY_FLAGS, NIL), a_GRAY_THRESH), min));
+		gp->g_sweep_key = su_TALLOC(char, a_BUF_SIZE);
+		gp->g_sweep_key[0] = '\0';
+	}else{
+		a_server__gray_st_fp_resize(gp, a_GRAY_FP_MIN, FAL0);
+		a_server__gray_st_balance(gp);
+	}
+
+	NYD_OU;
+}
+
+static void
+a_server__gray_st_gut(struct a_gray *gp){
+	NYD_IN;
+
+	if(gp->g_rh != NIL)
+		a_server__gray_st_rehash__end(gp);
+
+	if(!a_GRAY_IS_FP(gp)){
+		su_cs_dict_gut(&gp->g_dict);
+		su_FREE(gp->g_sweep_key);
+		gp->g_sweep_key = NIL;
+		gp->g_key_mem = 0;
+	}else{
+		su_FREE(gp->g_fp_slot);
+		gp->g_fp_slot = NIL;
+		gp->g_fp_data = NIL;
+		gp->g_fp_size = gp->g_fp_count = 0;
+	}
+
+	NYD_OU;
+}
+
+static u32
+a_server__gray_st_count(struct a_gray const *gp){
+	/* (A key is in one store only, see _insert()) */
+	return (a_GRAY_IS_FP(gp) ? gp->g_fp_count : su_cs_dict_count(&gp->g_dict)) +
+		(gp->g_rh != NIL ? a_server__gray_st_count(&gp->g_rh->rh_old) : 0);
+}
+
+static u32
+a_server__gray_st_size(struct a_gray const *gp){
+	return a_GRAY_IS_FP(gp) ? gp->g_fp_size : su_cs_dict_size(&gp->g_dict);
+}
+
+static u64
+a_server__gray_st_mem(struct a_gray const *gp){
+	u64 rv;
+	NYD2_IN;
+
+	/* Dictionary nodes: link, data, key length and hash, and the key */
+	if(a_GRAY_IS_FP(gp))
+		rv = S(u64,gp->g_fp_size) * (sizeof(*gp->g_fp_slot) + sizeof(*gp->g_fp_data));
+	else
+		rv = S(u64,su_cs_dict_size(&gp->g_dict)) * sizeof(void*) +
+				S(u64,su_cs_dict_count(&gp->g_dict)) * (sizeof(void*) * 2 + sizeof(u32) * 2) +
+				gp->g_key_mem;
+
+	if(gp->g_rh != NIL)
+		rv += sizeof(*gp->g_rh) + a_server__gray_st_mem(&gp->g_rh->rh_old);
+
+	NYD2_OU;
+	return rv;
+}
+
+static void
+a_server__gray_st_min_size(struct a_gray *gp, u32 min){
+	NYD_IN;
+
+	gp->g_min = min;
+	if(!a_GRAY_IS_FP(gp))
+		su_cs_dict_set_min_size(&gp->g_dict, min);
+
+	NYD_OU;
+}
+
+static void
+a_server__gray_st_balance(struct a_gray *gp){
+	NYD_IN;
+
+	a_server__gray_st_rehash_finish(gp);
+
+	if(!a_GRAY_IS_FP(gp)){
+		u32 f;
+
+		f = su_cs_dict_flags(&gp->g_dict) & su_CS_DICT_FROZEN;
+		su_cs_dict_add_flags(su_cs_dict_balance(&gp->g_dict), f);
+	}else{
+		u32 t;
+
+		/* Load of one third to two thirds, whereafter _insert() grows as necessary */
+		t = gp->g_fp_count;
+		t += t >> 1;
+		a_server__gray_st_fp_resize(gp, a_server__gray_st_fp__size(MAX(t, gp->g_min)), TRU1);
+	}
+
+	NYD_OU;
+}
+
+static void
+a_server__gray_st_clear(struct a_gray *gp){
+	NYD_IN;
+
+	if(gp->g_rh != NIL)
+		a_server__gray_st_rehash__end(gp);
+
+	if(!a_GRAY_IS_FP(gp)){
+		su_cs_dict_clear_elems(&gp->g_dict);
+		gp->g_key_mem = 0;
+	}else{
+		su_mem_set(gp->g_fp_slot, 0, sizeof(*gp->g_fp_slot) * gp->g_fp_size);
+		gp->g_fp_count = 0;
+	}
+
+	NYD_OU;
+}
+
+static s32
+a_server__gray_st_insert(struct a_gray *gp, char const *key, u64 fp, up d){
+	struct a_gray_view gv;
+	u32 i;
+	s32 rv;
+	NYD_IN;
+
+	/* During growth a key lives in one store only: update those yet to be migrated in place */
+	if(gp->g_rh != NIL && a_server__gray_st_view_find(a_server__gray_st_view(&gv, &gp->g_rh->rh_old), key, fp)){
+		a_server__gray_st_view_set_data(&gv, d);
+		rv = -1;
+	}else if(!a_GRAY_IS_FP(gp)){
+		if((rv = su_cs_dict_replace(&gp->g_dict, key, R(void*,d))) == su_ERR_NONE)
+			gp->g_key_mem += su_cs_len(key) +1;
+	}else if((i = a_server__gray_st_fp_find(gp, fp)) != U32_MAX){
+		gp->g_fp_data[i] = S(u32,d);
+		rv = -1;
+	}else if(gp->g_fp_count >= a_GRAY_FP_LOAD(gp->g_fp_size) && (gp->g_fp_size == 0x80000000u ||
+			(a_server__gray_st_rehash_finish(gp), gp->g_rh != NIL) ||
+			!a_server__gray_st_rehash_start(gp, a_GRAY_FP_LOAD(gp->g_fp_size << 1))))
+		rv = su_ERR_NOMEM;
+	else{
+		a_server__gray_st_fp_put(gp->g_fp_slot, gp->g_fp_data, gp->g_fp_size - 1, fp, S(u32,d));
+		++gp->g_fp_count;
+		rv = su_ERR_NONE;
+	}
+
+	NYD_OU;
+	return rv;
+}
+
+static void
+a_server__gray_st_remove(struct a_gray *gp, char const *key, u64 fp){
+	u32 i;
+	NYD_IN;
+
+	if(!a_GRAY_IS_FP(gp)){
+		if(su_cs_dict_remove(&gp->g_dict, key))
+			gp->g_key_mem -= su_cs_len(key) +1;
+	}else if((i = a_server__gray_st_fp_find(gp, fp)) != U32_MAX)
+		a_server__gray_st_fp_del(gp, i);
+
+	/* (Not at the migration position, it starts over) */
+	if(gp->g_rh != NIL){
+		gp->g_rh->rh_begun = FAL0;
+		a_server__gray_st_remove(&gp->g_rh->rh_old, key, fp);
+	}
+
+	NYD_OU;
+}
+
+static void
+a_server__gray_st_grow(struct a_gray *gp){
+	u32 t;
+	NYD_IN;
+
+	/* Targets are like those of _balance(); dictionaries grow where they would if they were not frozen */
+	if(gp->g_rh == NIL){
+		t = a_server__gray_st_count(gp);
+		t += t >> 1;
+		t = MAX(t, gp->g_min);
+
+		if(!a_GRAY_IS_FP(gp) ? (su_cs_dict_count(&gp->g_dict) / a_GRAY_THRESH > su_cs_dict_size(&gp->g_dict))
+				: (a_GRAY_FP_LOAD(gp->g_fp_size) < t))
+			a_server__gray_st_rehash_start(gp, t);
+	}
+
+	NYD_OU;
+}
+
+static boole
+a_server__gray_st_rehash_start(struct a_gray *gp, u32 min){
+	struct a_gray_rehash *rhp;
+	struct a_gray *ogp;
+	boole rv;
+	NYD_IN;
+	ASSERT(gp->g_rh == NIL);
+
+	rv = FAL0;
+
+	rhp = S(struct a_gray_rehash*,su_ALLOCATE(sizeof(*rhp), 1, (su_MEM_ALLOC_ZERO | su_MEM_ALLOC_MAYFAIL)));
+	if(rhp == NIL)
+		goto jleave;
+	ogp = &rhp->rh_old;
+
+	if(!a_GRAY_IS_FP(gp)){
+		su_cs_dict_balance(su_cs_dict_set_min_size(su_cs_dict_set_threshold(su_cs_dict_create(&ogp->g_dict,
+				(a_GRAY_FLAGS | su_CS_DICT_ERR_PASS), NIL), a_GRAY_THRESH), min));
+		su_cs_dict_add_flags(su_cs_dict_set_min_size(&ogp->g_dict, gp->g_min), su_CS_DICT_FROZEN);
+		su_cs_dict_swap(&gp->g_dict, &ogp->g_dict);
+		ogp->g_key_mem = gp->g_key_mem;
+		gp->g_key_mem = 0;
+		/* Lookups must not resort the old one behind the migration position */
+		su_cs_dict_clear_flags(&ogp->g_dict, su_CS_DICT_HEAD_RESORT);
+	}else{
+		ogp->g_fp_slot = gp->g_fp_slot;
+		ogp->g_fp_data = gp->g_fp_data;
+		ogp->g_fp_size = gp->g_fp_size;
+		ogp->g_fp_count = gp->g_fp_count;
+		gp->g_fp_slot = NIL;
+		gp->g_fp_size = gp->g_fp_count = 0;
+
+		if(!a_server__gray_st_fp_resize(gp, a_server__gray_st_fp__size(min), TRU1)){
+			gp->g_fp_slot = ogp->g_fp_slot;
+			gp->g_fp_size = ogp->g_fp_size;
+			gp->g_fp_count = ogp->g_fp_count;
+			su_FREE(rhp);
+			goto jleave;
+		}
+	}
+
+	a_server__gray_st_view(&rhp->rh_view, ogp);
+	gp->g_rh = rhp;
+	rv = TRU1;
+
+jleave:
+	NYD_OU;
+	return rv;
+}
+
+static boole
+a_server__gray_st_rehash_step(struct a_gray *gp, u32 no){
+	struct a_gray_view *gvp;
+	struct a_gray *ogp;
+	struct a_gray_rehash *rhp;
+	u64 fp;
+	up d;
+	NYD_IN;
+
+	if((rhp = gp->g_rh) == NIL)
+		goto jleave;
+	ogp = &rhp->rh_old;
+	gvp = &rhp->rh_view;
+
+	while(no > 0){
+		if(a_server__gray_st_count(ogp) == 0){
+			a_server__gray_st_rehash__end(gp);
+			break;
+		}
+
+		/* (Removals may have emptied the position, or moved entries before it) */
+		if(rhp->rh_begun && a_GRAY_IS_FP(ogp))
+			a_server__gray_st_view__skip(gvp);
+		if(!rhp->rh_begun || !a_server__gray_st_view_is_valid(gvp)){
+			rhp->rh_begun = TRU1;
+			a_server__gray_st_view_begin(gvp);
+			continue;
+		}
+
+		/* Entries that are present already have been inserted anew meanwhile */
+		d = a_server__gray_st_view_data(gvp);
+		if(!a_GRAY_IS_FP(gp)){
+			char const *key;
+			s32 e;
+
+			key = su_cs_dict_view_key(&gvp->gv_dv);
+			if((e = su_cs_dict_insert(&gp->g_dict, key, R(void*,d))) > su_ERR_NONE)
+				break;
+			if(e == su_ERR_NONE)
+				gp->g_key_mem += su_cs_len(key) +1;
+		}else if(a_server__gray_st_fp_find(gp, fp = ogp->g_fp_slot[gvp->gv_idx]) == U32_MAX){
+			if(gp->g_fp_count >= a_GRAY_FP_LOAD(gp->g_fp_size) && (gp->g_fp_size == 0x80000000u ||
+					!a_server__gray_st_fp_resize(gp, gp->g_fp_size << 1, TRU1)))
+				break;
+			a_server__gray_st_fp_put(gp->g_fp_slot, gp->g_fp_data, gp->g_fp_size - 1, fp, S(u32,d));
+			++gp->g_fp_count;
+		}
+		a_server__gray_st_view_remove(gvp);
+		--no;
+	}
+
+jleave:
+	NYD_OU;
+	return (gp->g_rh != NIL);
+}
+
+static void
+a_server__gray_st_rehash_finish(struct a_gray *gp){
+	u32 i;
+	NYD_IN;
+
+	/* Out of memory: wait a bit, finally leave the remains to later steps; both stores stay usable */
+	for(i = 0; a_server__gray_st_rehash_step(gp, U32_MAX); ++i){
+		if(i == 3){
+			su_log_write(su_LOG_CRIT, _("out-of-memory, gray DB growth delayed, %u entries to migrate"),
+				a_server__gray_st_count(&gp->g_rh->rh_old));
+			break;
+		}
+		su_time_msleep(250, TRU1);
+	}
+
+	NYD_OU;
+}
+
+static void
+a_server__gray_st_rehash__end(struct a_gray *gp){
+	NYD_IN;
+
+	a_server__gray_st_gut(&gp->g_rh->rh_old);
+	su_FREE(gp->g_rh);
+	gp->g_rh = NIL;
+
+	NYD_OU;
+}
+
+static u32
+a_server__gray_st_fp__size(u32 min){
+	u32 size;
+	NYD2_IN;
+
+	for(size = a_GRAY_FP_MIN; size < 0x80000000u && a_GRAY_FP_LOAD(size) < min;)
+		size <<= 1;
+
+	NYD2_OU;
+	return size;
+}
+
+static boole
+a_server__gray_st_fp_resize(struct a_gray *gp, u32 size, boole mayfail){
+	u64 *slot;
+	u32 *data, i;
+	boole rv;
+	NYD_IN;
+	ASSERT(size >= a_GRAY_FP_MIN && (size & (size - 1)) == 0);
+	ASSERT(a_GRAY_FP_LOAD(size) > gp->g_fp_count);
+
+	rv = TRU1;
+
+	if(size == gp->g_fp_size)
+		goto jleave;
+
+	slot = S(u64*,su_ALLOCATE(sizeof(*slot) + sizeof(*data), size,
+			(su_MEM_ALLOC_ZERO | (mayfail ? su_MEM_ALLOC_MAYFAIL : su_MEM_ALLOC_NONE))));
+	if(slot == NIL){
+		rv = FAL0;
+		goto jleave;
+	}
+	data = R(u32*,&slot[size]);
+
+	if(gp->g_fp_slot != NIL){
+		for(i = 0; i < gp->g_fp_size; ++i)
+			if(gp->g_fp_slot[i] != 0)
+				a_server__gray_st_fp_put(slot, data, size - 1, gp->g_fp_slot[i], gp->g_fp_data[i]);
+		su_FREE(gp->g_fp_slot);
+	}
+
+	gp->g_fp_slot = slot;
+	gp->g_fp_data = data;
+	gp->g_fp_size = size;
+
+jleave:
+	NYD_OU;
+	return rv;
+}
+
+static void
+a_server__gray_st_fp_put(u64 *slot, u32 *data, u32 mask, u64 fp, u32 d){
+	/* Robin Hood: whoever is farther away from home keeps the slot */
+	u64 xfp;
+	u32 i, dist, xdist, xd;
+	NYD2_IN;
+
+	for(dist = 0, i = S(u32,fp) & mask;; ++dist, i = (i + 1) & mask){
+		if((xfp = slot[i]) == 0){
+			slot[i] = fp;
+			data[i] = d;
+			break;
+		}
+
+		if((xdist = (i - S(u32,xfp)) & mask) < dist){
+			slot[i] = fp;
+			fp = xfp;
+			xd = data[i];
+			data[i] = d;
+			d = xd;
+			dist = xdist;
+		}
+	}
+
+	NYD2_OU;
+}
+
+static u32
+a_server__gray_st_fp_find(struct a_gray const *gp, u64 fp){
+	u64 xfp;
+	u32 mask, i, dist;
+	NYD2_IN;
+
+	/* No entry is farther away from home than one that takes its slot */
+	mask = gp->g_fp_size - 1;
+	for(dist = 0, i = S(u32,fp) & mask;; ++dist, i = (i + 1) & mask){
+		if((xfp = gp->g_fp_slot[i]) == fp)
+			break;
+		if(xfp == 0 || ((i - S(u32,xfp)) & mask) < dist){
+			i = U32_MAX;
+			break;
+		}
+	}
+
+	NYD2_OU;
+	return i;
+}
+
+static void
+a_server__gray_st_fp_del(struct a_gray *gp, u32 i){
+	/* Backward shift, no tombstones */
+	u64 fp;
+	u32 mask, j;
+	NYD2_IN;
+
+	mask = gp->g_fp_size - 1;
+	for(;; i = j){
+		j = (i + 1) & mask;
+		fp = gp->g_fp_slot[j];
+		if(fp == 0 || ((j - S(u32,fp)) & mask) == 0)
+			break;
+		gp->g_fp_slot[i] = fp;
+		gp->g_fp_data[i] = gp->g_fp_data[j];
+	}
+	gp->g_fp_slot[i] = 0;
+	--gp->g_fp_count;
+
+	NYD2_OU;
+}
+
+static struct a_gray_view *
+a_server__gray_st_view(struct a_gray_view *gvp, struct a_gray *gp){
+	NYD2_IN;
+
+	gvp->gv_gp = gp;
+	gvp->gv_left = 0;
+	if(!a_GRAY_IS_FP(gp))
+		su_cs_dict_view_setup(&gvp->gv_dv, &gp->g_dict);
+
+	NYD2_OU;
+	return gvp;
+}
+
+static boole
+a_server__gray_st_view_find(struct a_gray_view *gvp, char const *key, u64 fp){
+	boole rv;
+	NYD2_IN;
+
+	if(!a_GRAY_IS_FP(gvp->gv_gp))
+		rv = su_cs_dict_view_find(&gvp->gv_dv, key);
+	else{
+		gvp->gv_idx = a_server__gray_st_fp_find(gvp->gv_gp, fp);
+		rv = (gvp->gv_idx != U32_MAX);
+		gvp->gv_left = rv;
+	}
+
+	if(!rv && gvp->gv_gp->g_rh != NIL)
+		rv = a_server__gray_st_view_find(a_server__gray_st_view(gvp, &gvp->gv_gp->g_rh->rh_old), key, fp);
+
+	NYD2_OU;
+	return rv;
+}
+
+static void
+a_server__gray_st_view_begin(struct a_gray_view *gvp){
+	struct a_gray *gp;
+	u64 fp;
+	u32 i;
+	NYD2_IN;
+
+	/* (Only this store: the old one of a growth follows via a_GRAY_ST_NEXT()) */
+	gp = gvp->gv_gp;
+
+	if(!a_GRAY_IS_FP(gp))
+		su_cs_dict_view_begin(&gvp->gv_dv);
+	else{
+		/* (Load is below 1: terminates) */
+		for(i = 0;; ++i)
+			if((fp = gp->g_fp_slot[i]) == 0 || (S(u32,fp) & (gp->g_fp_size - 1)) == i)
+				break;
+		gvp->gv_idx = i;
+		gvp->gv_left = gp->g_fp_size;
+		a_server__gray_st_view__skip(gvp);
+	}
+
+	NYD2_OU;
+}
+
+static boole
+a_server__gray_st_view_is_valid(struct a_gray_view const *gvp){
+	return a_GRAY_IS_FP(gvp->gv_gp) ? (gvp->gv_left > 0) : su_cs_dict_view_is_valid(&gvp->gv_dv);
+}
+
+static void
+a_server__gray_st_view_next(struct a_gray_view *gvp){
+	NYD2_IN;
+
+	if(!a_GRAY_IS_FP(gvp->gv_gp))
+		su_cs_dict_view_next(&gvp->gv_dv);
+	else{
+		ASSERT(gvp->gv_left > 0);
+		--gvp->gv_left;
+		gvp->gv_idx = (gvp->gv_idx + 1) & (gvp->gv_gp->g_fp_size - 1);
+		a_server__gray_st_view__skip(gvp);
+	}
+
+	NYD2_OU;
+}
+
+static up
+a_server__gray_st_view_data(struct a_gray_view const *gvp){
+	return a_GRAY_IS_FP(gvp->gv_gp) ? gvp->gv_gp->g_fp_data[gvp->gv_idx] : R(up,su_cs_dict_view_data(&gvp->gv_dv));
+}
+
+static void
+a_server__gray_st_view_set_data(struct a_gray_view *gvp, up d){
+	NYD2_IN;
+
+	if(!a_GRAY_IS_FP(gvp->gv_gp))
+		su_cs_dict_view_set_data(&gvp->gv_dv, R(void*,d));
+	else
+		gvp->gv_gp->g_fp_data[gvp->gv_idx] = S(u32,d);
+
+	NYD2_OU;
+}
+
+static void
+a_server__gray_st_view_remove(struct a_gray_view *gvp){
+	NYD2_IN;
+
+	if(!a_GRAY_IS_FP(gvp->gv_gp)){
+		gvp->gv_gp->g_key_mem -= su_cs_len(su_cs_dict_view_key(&gvp->gv_dv)) +1;
+		su_cs_dict_view_remove(&gvp->gv_dv);
+	}else{
+		/* The slot now holds the unvisited successor, if any */
+		a_server__gray_st_fp_del(gvp->gv_gp, gvp->gv_idx);
+		a_server__gray_st_view__skip(gvp);
+	}
+
+	NYD2_OU;
+}
+
+static char const *
+a_server__gray_st_view_key(struct a_gray_view *gvp){
+	char const *rv;
+	NYD2_IN;
+
+	if(!a_GRAY_IS_FP(gvp->gv_gp))
+		rv = su_cs_dict_view_key(&gvp->gv_dv);
+	else{
+		gvp->gv_key[0] = '~';
+		a_misc_fprint_hex(&gvp->gv_key[1], gvp->gv_gp->g_fp_slot[gvp->gv_idx]);
+		gvp->gv_key[1 + 16] = '\0';
+		rv = gvp->gv_key;
+	}
+
+	NYD2_OU;
+	return rv;
+}
+
+static void
+a_server__gray_st_view__skip(struct a_gray_view *gvp){
+	struct a_gray *gp;
+	NYD2_IN;
+
+	gp = gvp->gv_gp;
+	while(gvp->gv_left > 0 && gp->g_fp_slot[gvp->gv_idx] == 0){
+		--gvp->gv_left;
+		gvp->gv_idx = (gvp->gv_idx + 1) & (gp->g_fp_size - 1);
+	}
+
+	NYD2_OU;
+}
+
+static void
+a_server__gray_st_view_resume(struct a_gray_view *gvp){
+	struct a_gray *gp;
+	NYD2_IN;
+
+	gp = gvp->gv_gp;
+
+	/* Dictionary positions do not survive modifications; the key does, unless it was removed meanwhile */
+	if(!a_GRAY_IS_FP(gp)){
+		if(gp->g_sweep_key[0] == '\0' || !su_cs_dict_view_find(&gvp->gv_dv, gp->g_sweep_key))
+			su_cs_dict_view_begin(&gvp->gv_dv);
+	}else if(gp->g_sweep_left == 0 || gp->g_sweep_idx >= gp->g_fp_size)
+		a_server__gray_st_view_begin(gvp);
+	else{
+		gvp->gv_idx = gp->g_sweep_idx;
+		gvp->gv_left = MIN(gp->g_sweep_left, gp->g_fp_size);
+		a_server__gray_st_view__skip(gvp);
+	}
+
+	NYD2_OU;
+}
+
+static boole
+a_server__gray_st_view_pause(struct a_gray_view *gvp){
+	struct a_gray *gp;
+	char const *cp;
+	boole rv;
+	NYD2_IN;
+
+	gp = gvp->gv_gp;
+	rv = a_server__gray_st_view_is_valid(gvp);
+
+	if(!a_GRAY_IS_FP(gp)){
+		if(!rv)
+			gp->g_sweep_key[0] = '\0';
+		else{
+			cp = su_cs_dict_view_key(&gvp->gv_dv);
+			su_mem_copy(gp->g_sweep_key, cp, su_cs_len(cp) +1);
+		}
+	}else{
+		gp->g_sweep_idx = gvp->gv_idx;
+		gp->g_sweep_left = gvp->gv_left;
+	}
+
+	NYD2_OU;
+	return rv;
+}
+
+static struct a_gray *
+a_server__gray_shard(struct a_pg *pgp, char const *key, u64 *fpp){
+	struct a_gray *gp;
+	struct a_master *mp;
+	NYD2_IN;
+
+	mp = pgp->pg_master;
+
+	if(!a_GRAY_IS_FP(&mp->m_grays[0]))
+		gp = a_GRAY_SHARD(mp, key);
+	else{
+		if(key != NIL)
+			*fpp = a_misc_fprint(mp->m_gray_fp_key, key, su_cs_len(key));
+		gp = a_GRAY_SHARD_FP(mp, *fpp);
+	}
+
+	NYD2_OU;
+	return gp;
+}
+/* }}} */
+
+/* gray {{{ */
+static void
+a_server__gray_create(struct a_pg *pgp){
+	struct su_timespec ts;
+	struct a_gray_view gv;
+	struct a_gray_jnl *gjp;
+	struct a_gray *gp, *sgp;
+	u32 i, j;
+	struct a_master *mp;
+	NYD_IN;
+
+	LCTAV(VAL_GRAY_REHASH_STEP > 0);
+
+	mp = pgp->pg_master;
+	/* all zeroed xxx check via some kind of mem_not_of?? */
+
+	mp->m_grays = su_TCALLOC(struct a_gray, mp->m_gray_no);
+
+	/* Perform the initial allocation without _ERR_PASS so that we panic if we
+	 * cannot create it, then set _ERR_PASS to handle (ignore) errors.  Entries are relative to startup */
+	su_timespec_current(&ts);
+	for(i = 0; i < mp->m_gray_no; ++i){
+		gp = &mp->m_grays[i];
+		a_MT( pthread_mutex_init(&gp->g_mtx, NIL); )
+		a_server__gray_st_create(gp, ((pgp->pg_flags & a_F_GRAY_FPRINT) != 0),
+			a_GRAY_SHARE(mp, a_GRAY_MIN_LIMIT));
+		gp->g_wheel_base = gp->g_wheel[0].gw_now = gp->g_wheel[1].gw_now = a_GRAY_WHEEL_BASE;
+		gp->g_epoch = gp->g_base_epoch = ts.ts_sec;
+	}
+
+	/* A fingerprint DB brings its key along (_load_bin(), _lazy_open()) */
+	if(pgp->pg_flags & a_F_GRAY_FPRINT){
+		if(su_state_has(su_STATE_REPRODUCIBLE))
+			mp->m_gray_fp_key[0] = mp->m_gray_fp_key[1] = 0;
+		else
+			su_random_builtin_generate(mp->m_gray_fp_key, sizeof(mp->m_gray_fp_key), su_STATE_ERR_NOPASS);
+	}
+
+	/* A journal rotated by an unfinished background save precedes the current one */
+	if(pgp->pg_flags & a_F_GRAY_LAZY)
+		mp->m_jnl.gj_jno = a_server__gray_lazy_open(pgp);
+	else{
+		a_server__gray_load(pgp);
+		mp->m_jnl.gj_jno = a_server__gray_jnl_replay(pgp, a_GRAY_JNL_OLD_NAME);
+		a_server__gray_jnl_replay(pgp, a_GRAY_JNL_NAME);
+	}
+
+	/* Enable automatic memory management, balance as necessary */
+	for(j = 0, i = 0; i < mp->m_gray_no; ++i){
+		gp = &mp->m_grays[i];
+		if(!a_GRAY_IS_FP(gp))
+			su_cs_dict_add_flags(&gp->g_dict, su_CS_DICT_ERR_PASS | su_CS_DICT_FROZEN);
+
+		if(a_server__gray_st_count(gp) > a_GRAY_SHARE(mp, a_GRAY_MIN_LIMIT))
+			a_server__gray_st_balance(gp);
+
+		for(sgp = gp; sgp != NIL; sgp = a_GRAY_ST_NEXT(gp, sgp))
+			for(a_server__gray_st_view_begin(a_server__gray_st_view(&gv, sgp));
+					a_server__gray_st_view_is_valid(&gv); a_server__gray_st_view_next(&gv))
+				a_server__gray_wheel_add(gp, a_server__gray_st_view_data(&gv));
+
+		gp->g_ograycnt = a_server__gray_st_count(gp) + a_GRAY_SHARE(mp, a_GRAY_MIN_LIMIT);
+		j += a_server__gray_st_count(gp);
+	}
+
+	/* Continue the (replayed) journal */
+	gjp = &mp->m_jnl;
+	a_MT( pthread_mutex_init(&gjp->gj_mtx, NIL); )
+	gjp->gj_buf = su_TALLOC(char, a_GRAY_WBUF_SIZE);
+	gjp->gj_ckpt_recs = MAX(a_GRAY_JNL_CKPT_MIN, j);
+	gjp->gj_ckpt_want = (gjp->gj_jno || gjp->gj_recs >= gjp->gj_ckpt_recs);
+	while((gjp->gj_fd = a_sandbox_open(pgp, TRU1, a_GRAY_JNL_NAME, (O_WRONLY | O_CREAT | O_APPEND),
+			S_IRUSR | S_IWUSR)) == -1){
+		if((i = su_err_by_errno()) == su_ERR_INTR)
+			continue;
+		if(a_misc_os_resource_delay(S(s32,i)))
+			continue;
+		su_log_write(su_LOG_CRIT, _("gray DB journal cannot be created in %s, continuing without: %s"),
+			pgp->pg_store_path, V_(su_err_doc(-1)));
+		break;
+	}
+
+	NYD_OU;
+}
+
+static boole
+a_server__gray_map(struct a_pg *pgp, char const *name, boole jnl, char **mapp, u32 *lenp){ /* {{{ */
+	struct su_pathinfo pi;
+	char const *what;
+	void *vp;
+	s32 fd;
+	boole rv;
+	NYD_IN;
+
+	*mapp = NIL;
+	*lenp = 0;
+	rv = FAL0;
+	what = jnl ? "gray DB journal" : "gray DB";
+
+	while((fd = open(name, O_RDONLY | a_O_NOFOLLOW | a_O_NOCTTY)) == -1){
+		if((fd = su_err_by_errno()) == su_ERR_INTR)
+			continue;
+		if(a_misc_os_resource_delay(fd))
+			continue;
+		if(fd != su_ERR_NOENT)
+			su_log_write(su_LOG_ERR, _("%s cannot load in %s: %s"),
+				what, pgp->pg_store_path, V_(su_err_doc(-1)));
+		goto jleave;
+	}
+	rv = TRU1;
+
+	if(!su_pathinfo_fstat(&pi, fd))
+		su_log_write(su_LOG_ERR, _("%s cannot fstat(2) in %s: %s"),
+			what, pgp->pg_store_path, V_(su_err_doc(-1)));
+	else if(pi.pi_size > S(u32,S32_MAX))
+		su_log_write(su_LOG_ERR, _("%s corrupt (too large) in %s"), what, pgp->pg_store_path);
+	else if(pi.pi_size > 0){
+		if((vp = mmap(NIL, S(u32,pi.pi_size), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+			su_log_write(su_LOG_ERR, _("%s cannot mmap(2), skip in %s: %s"),
+				what, pgp->pg_store_path, V_(su_err_doc(su_err_by_errno())));
+		else{
+			*mapp = S(char*,vp);
+			*lenp = S(u32,pi.pi_size);
+		}
+	}
+
+	close(fd);
+
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static void
+a_server__gray_load(struct a_pg *pgp){ /* {{{ */
+	struct su_timespec ts;
+	char *dat;
+	u32 len, i;
+	boole bin;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	/* Obtain a memory map on the DB storage (only called once on server startup, note: pre-sandbox!) */
+	if(!a_server__gray_map(pgp, a_GRAY_DB_NAME, FAL0, &dat, &len) || dat == NIL)
+		goto jleave;
+
+	su_timespec_current(&ts);
+	bin = (len >= sizeof(a_GRAY_BIN_MAGIC) && !su_mem_cmp(dat, a_GRAY_BIN_MAGIC, sizeof(a_GRAY_BIN_MAGIC)));
+
+	if((bin ? a_server__gray_load_bin(pgp, dat, len, ts.ts_sec) : a_server__gray_load_text(pgp, dat, len, ts.ts_sec)
+			) && (a_DBGIF || (pgp->pg_flags & a_F_V))){
+		struct su_timespec ts2;
+		ul cnt;
+
+		for(cnt = 0, i = 0; i < mp->m_gray_no; ++i)
+			cnt += a_server__gray_st_count(&mp->m_grays[i]);
+		su_timespec_sub(su_timespec_current(&ts2), &ts);
+		su_log_write(su_LOG_INFO, _("gray DB loaded %lu entries (%s) in %lu:%09lu seconds in %s"),
+			cnt, (bin ? "binary" : "text"), S(ul,ts2.ts_sec), S(ul,ts2.ts_nano), pgp->pg_store_path);
+	}
+
+	munmap(dat, len);
+
+jleave:
+	NYD_OU;
+} /* }}} */
+
+static boole
+a_server__gray_load_text(struct a_pg *pgp, char *dat, u32 len, s64 now){ /* {{{ */
+	char *base;
+	s64 be;
+	s32 x;
+	boole have_be;
+	NYD_IN;
+
+	UNINIT(be, 0);
+	for(have_be = FAL0, base = dat; len > 0; ++dat, --len){
+		/* Complete a line first */
+		if(*dat != '\n')
+			continue;
+
+		if((x = a_server__gray_load_text_line(pgp, base, dat, &be, have_be, NIL)) < 0)
+			goto jerr;
+
+		/* The first line is base epoch */
+		if(!have_be){
+			have_be = TRU1;
+			if(a_server__gray_load_base(pgp, be, now, FAL0) == S32_MIN)
+				goto jleave;
+		}else if(x == 2)
+			goto jleave;
+
+		base = &dat[1];
+	}
+	if(base != dat)
+jerr:
+		su_log_write(su_LOG_WARN, _("gray DB corrupt in %s"), pgp->pg_store_path);
+
+	have_be = TRU1;
+jleave:
+	NYD_OU;
+	return have_be;
+} /* }}} */
+
+static s32
+a_server__gray_load_text_line(struct a_pg *pgp, char *base, char const *end, s64 *bep, boole ent,
+		struct a_gray_lazy *glp){
+	s64 ibuf;
+	u32 f;
+	s32 rv;
+	NYD_IN;
+
+	rv = -1;
+
+	if(&base[2] >= end)
+		goto jleave;
+
+	f = su_idec(&ibuf, base, P2UZ(end - base), 10, 0, C(char const**,&base));
+	if((f & su_IDEC_STATE_EMASK) || UCMP(64, ibuf, >=, su_TIME_EPOCH_MAX))
+		goto jleave;
+
+	if(!ent){
+		if(*base == '\n'){
+			*bep = ibuf;
+			rv = 1;
+		}
+	}
+	/* [recipient]/s[ender]/c[lient address] */
+	else if(*base++ == ' ')
+		rv = a_server__gray_load_ent(pgp, base, P2UZ(end - base), 0, S(up,ibuf), *bep, glp);
+
+jleave:
+	NYD_OU;
+	return rv;
+}
+
+static boole
+a_server__gray_load_bin(struct a_pg *pgp, char *dat, u32 len, s64 now){ /* {{{ */
+	struct a_gray_bin_hdr const *gbhp;
+	u32 i;
+	s32 x;
+	boole rv;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	rv = FAL0;
+	gbhp = R(struct a_gray_bin_hdr const*,dat);
+
+	if((x = a_server__gray_load_bin_check(pgp, dat, len, TRU1)) == 0)
+		goto jleave;
+	if(x < 0)
+		goto jerr;
+
+	if(a_server__gray_load_base(pgp, gbhp->gbh_base_epoch, now, FAL0) == S32_MIN){
+		rv = TRU1;
+		goto jleave;
+	}
+
+	/* The journal is replayed with the key of the fingerprints */
+	if(gbhp->gbh_version == a_GRAY_BIN_VERSION_FP)
+		su_mem_copy(mp->m_gray_fp_key, &gbhp[1], sizeof(mp->m_gray_fp_key));
+
+	/* Bulk insertion: size shards once, then restore usual minimum */
+	for(i = 0; i < mp->m_gray_no; ++i){
+		a_server__gray_st_min_size(&mp->m_grays[i],
+			MAX(a_GRAY_SHARE(mp, gbhp->gbh_count), a_GRAY_SHARE(mp, a_GRAY_MIN_LIMIT)));
+		a_server__gray_st_balance(&mp->m_grays[i]);
+	}
+
+	for(rv = TRU1, i = 0; i < gbhp->gbh_count; ++i){
+		if((x = a_server__gray_load_bin_rec(pgp, dat, i, NIL)) < 0){
+			rv = FAL0;
+			break;
+		}
+		if(x == 2)
+			break;
+	}
+
+	for(i = 0; i < mp->m_gray_no; ++i)
+		a_server__gray_st_min_size(&mp->m_grays[i], a_GRAY_SHARE(mp, a_GRAY_MIN_LIMIT));
+
+	if(!rv)
+jerr:
+		su_log_write(su_LOG_WARN, _("gray DB corrupt in %s"), pgp->pg_store_path);
+	rv = TRU1;
+
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static s32
+a_server__gray_load_bin_check(struct a_pg *pgp, char const *dat, u32 len, boole cksum){ /* {{{ */
+	struct a_gray_bin_hdr const *gbhp;
+	struct a_gray_bin_rec const *gbrp;
+	u64 const *fpp;
+	char const *arena;
+	s32 rv;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	rv = -1;
+	gbhp = R(struct a_gray_bin_hdr const*,dat);
+
+	if(len < sizeof(*gbhp))
+		goto jleave;
+	if(gbhp->gbh_bom != a_GRAY_BIN_BOM || (gbhp->gbh_version != a_GRAY_BIN_VERSION &&
+			gbhp->gbh_version != a_GRAY_BIN_VERSION_FP)){
+		su_log_write(su_LOG_ERR, _("gray DB of foreign byte order or unsupported version %lu, skip in %s"),
+			S(ul,gbhp->gbh_version), pgp->pg_store_path);
+		rv = 0;
+		goto jleave;
+	}
+
+	/* Fingerprint DB: SipHash key, then fingerprints, then their data words as the "arena" */
+	if(gbhp->gbh_version == a_GRAY_BIN_VERSION_FP){
+		if(!a_GRAY_IS_FP(&mp->m_grays[0])){
+			su_log_write(su_LOG_ERR, _("gray DB stores fingerprints only (--gray-fingerprint), skip in %s"),
+				pgp->pg_store_path);
+			rv = 0;
+			goto jleave;
+		}
+		if(len - sizeof(*gbhp) < sizeof(mp->m_gray_fp_key) ||
+				S(u64,gbhp->gbh_count) * (sizeof(*fpp) + sizeof(u32)) + sizeof(mp->m_gray_fp_key) !=
+					len - sizeof(*gbhp) ||
+				S(u64,gbhp->gbh_count) * sizeof(u32) != gbhp->gbh_arena_len)
+			goto jleave;
+	}else if(S(u64,gbhp->gbh_count) * sizeof(*gbrp) + gbhp->gbh_arena_len != len - sizeof(*gbhp) ||
+			(gbhp->gbh_count == 0) != (gbhp->gbh_arena_len == 0))
+		goto jleave;
+
+	arena = a_server__gray_load_bin_ptr(dat, &fpp, &gbrp);
+	if(gbrp != NIL && gbhp->gbh_arena_len > 0 && arena[gbhp->gbh_arena_len - 1] != '\0')
+		goto jleave;
+
+	/* (Records checksum includes the SipHash key) */
+	if(cksum && (a_misc_cksum(a_MISC_CKSUM_INIT, &gbhp[1], P2UZ(arena - R(char const*,&gbhp[1]))
+				) != gbhp->gbh_cksum_rec ||
+			a_misc_cksum(a_MISC_CKSUM_INIT, arena, gbhp->gbh_arena_len) != gbhp->gbh_cksum_arena))
+		goto jleave;
+
+	if(UCMP(64, gbhp->gbh_base_epoch, >=, su_TIME_EPOCH_MAX))
+		goto jleave;
+
+	rv = 1;
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static char const *
+a_server__gray_load_bin_ptr(char const *dat, u64 const **fppp, struct a_gray_bin_rec const **gbrpp){
+	struct a_gray_bin_hdr const *gbhp;
+	char const *rv;
+	NYD2_IN;
+
+	gbhp = R(struct a_gray_bin_hdr const*,dat);
+
+	if(gbhp->gbh_version == a_GRAY_BIN_VERSION_FP){
+		*gbrpp = NIL;
+		*fppp = &R(u64 const*,&gbhp[1])[2];
+		rv = R(char const*,&(*fppp)[gbhp->gbh_count]);
+	}else{
+		*fppp = NIL;
+		*gbrpp = R(struct a_gray_bin_rec const*,&gbhp[1]);
+		rv = R(char const*,&(*gbrpp)[gbhp->gbh_count]);
+	}
+
+	NYD2_OU;
+	return rv;
+}
+
+static s32
+a_server__gray_load_bin_rec(struct a_pg *pgp, char const *dat, u32 no, struct a_gray_lazy *glp){
+	struct a_gray_bin_hdr const *gbhp;
+	struct a_gray_bin_rec const *gbrp;
+	u64 const *fpp;
+	char const *arena;
+	s32 rv;
+	NYD2_IN;
+
+	gbhp = R(struct a_gray_bin_hdr const*,dat);
+	arena = a_server__gray_load_bin_ptr(dat, &fpp, &gbrp);
+
+	if(fpp != NIL)
+		rv = a_server__gray_load_ent(pgp, NIL, 0, fpp[no], R(u32 const*,arena)[no], gbhp->gbh_base_epoch, glp);
+	else if(gbrp[no].gbr_key_off >= gbhp->gbh_arena_len)
+		rv = -1;
+	else{
+		char const *key;
+
+		/* (Arena is NUL terminated) */
+		key = &arena[gbrp[no].gbr_key_off];
+		rv = a_server__gray_load_ent(pgp, key, su_cs_len(key), 0, gbrp[no].gbr_data, gbhp->gbh_base_epoch, glp);
+	}
+
+	NYD2_OU;
+	return rv;
+}
+
+static s32
+a_server__gray_load_base(struct a_pg *pgp, s64 base, s64 now, boole quiet){
+	s64 xbe;
+	NYD_IN;
+
+	xbe = now - base;
+	if(xbe > 0){
+		if(LIKELY(!su_state_has(su_STATE_REPRODUCIBLE)))
+			xbe /= su_TIME_MIN_SECS;
+		if(xbe >= pgp->pg_gc_timeout){
+			if(!(pgp->pg_flags & a_F_GC_LINGER)){
+				if(!quiet && (a_DBGIF || (pgp->pg_flags & a_F_V)))
+					su_log_write(su_LOG_INFO, _("gray DB load: skip timed out content in %s"),
+						pgp->pg_store_path);
+				xbe = S32_MIN;
+				goto jleave;
+			}
+			xbe = -1;
+		}
+	}else{
+		if(!quiet && (a_DBGIF || (pgp->pg_flags & a_F_V)))
+			su_log_write(su_LOG_INFO, _("gray DB ignoring future timestamp in %s"), pgp->pg_store_path);
+		xbe = 0;
+	}
+
+	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load base time oe_ne_min=%hd", S(s16,xbe)));
+jleave:
+	NYD_OU;
+	return S(s32,xbe);
+}
+
+static boole
+a_server__gray_load_key(struct a_pg *pgp, char key[a_BUF_SIZE], char const *base, uz len){ /* {{{ */
+	boole rv;
+	NYD_IN;
+
+	rv = FAL0;
+
+	if(len >= a_BUF_SIZE || len <= 2+2)
+		goto jleave;
+
+	if(!(pgp->pg_flags & (a_F_FOCUS_DOMAIN | a_F_FOCUS_SENDER))){
+		su_mem_copy(key, base, len);
+		key[len] = '\0';
+	}else{
+		char *kp, *xkp, c;
+		s8 i;
+
+		kp = key;
+		i = ((pgp->pg_flags & a_F_FOCUS_SENDER) == 0);
+
+		/* skip a possible recipient */
+		if(i == 0){
+			for(;;){
+				if(len-- == 0)
+					goto jleave;
+				if(*base++ == '/')
+					break;
+			}
+			*kp++ = '/';
+		}
+
+		/* possibly trim local-part(s), and ensure we have a sender */
+		while(i-- >= 0){
+			c = '\0';
+			if(pgp->pg_flags & a_F_FOCUS_DOMAIN){
+				for(xkp = kp;;){
+					if(len-- == 0)
+						goto jleave;
+					if((*xkp++ = c = *base++) == '@')
+						break;
+					if(c == '/'){
+						if(i < 0 && ++kp == xkp)
+							goto jleave;
+						kp = xkp;
+						break;
+					}
+				}
+			}
+			if(c != '/')
+				for(xkp = kp;;){
+					if(len-- == 0)
+						goto jleave;
+					if((*kp++ = *base++) == '/'){
+						if(i < 0 && ++xkp == kp)
+							goto jleave;
+						break;
+					}
+				}
+		}
+
+		if(len > 0)
+			su_mem_copy(kp, base, len);
+		kp[len] = '\0';
+	}
+
+	rv = TRU1;
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static s32
+a_server__gray_load_ent(struct a_pg *pgp, char const *base, uz len, u64 fp, up d, s64 epoch,
+		struct a_gray_lazy *glp){ /* {{{ */
+	char key[a_BUF_SIZE];
+	struct a_gray_view gv;
+	struct a_gray *gp;
+	s32 rv;
+	s16 oe_ne_min, nmin, t;
+	NYD_IN;
+
+	gp = NIL;
+	t = pgp->pg_gc_timeout;
+	rv = -1;
+
+	/* (A fingerprint record is "~HEX" for logging purposes) */
+	if(base == NIL){
+		key[0] = '~';
+		a_misc_fprint_hex(&key[1], fp);
+		key[1 + 16] = '\0';
+	}else if(!a_server__gray_load_key(pgp, key, base, len))
+		goto jleave;
+
+	rv = 0;
+	gp = a_server__gray_shard(pgp, (base != NIL ? key : NIL), &fp);
+
+	/* Lazy: shards serve meanwhile; the snapshot is older than the journals, and what they deleted */
+	if(glp != NIL){
+		a_MT( pthread_mutex_lock(&gp->g_mtx); )
+		if(glp->gl_src == a_GRAY_LAZY_SRC_DB){
+			char const *dk;
+			char dkb[1 + 16 +1];
+
+			dk = key;
+			if(a_GRAY_IS_FP(gp)){
+				dkb[0] = '~';
+				a_misc_fprint_hex(&dkb[1], fp);
+				dkb[1 + 16] = '\0';
+				dk = dkb;
+			}
+			if(a_server__gray_st_view_find(a_server__gray_st_view(&gv, gp), key, fp) ||
+					su_cs_dict_has_key(&glp->gl_dead, dk))
+				goto jleave;
+		}
+	}
+
+	/* (Shard base epochs may differ once maintenance ran) */
+	if((rv = a_server__gray_load_base(pgp, epoch, gp->g_base_epoch, TRU1)) == S32_MIN){
+		rv = 0;
+		goto jleave;
+	}
+	oe_ne_min = S(s16,rv);
+	rv = 0;
+
+	nmin = S(s16,d & U16_MAX);
+	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load: gray=%d nmin=%hd count=%d: %s",
+		!(d & 0x80000000), nmin, S(int,(d & 0x7FFF0000) >> 16), key);)
+	/* Corrupted database? */
+	if(UNLIKELY(nmin > 0)){
+		nmin = -nmin;
+		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load: (pre-0.8.3?) entry corrupt nmin->%hd: %s", nmin, key);)
+	}
+
+	if(UNLIKELY(oe_ne_min < 0)){
+		ASSERT(pgp->pg_flags & a_F_GC_LINGER);
+		if(!(d & 0x80000000)){
+			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load: timeout gray: %s", key));
+			goto jleave;
+		}
+		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load: timeout but gc-linger: %s", key));
+		nmin = S16_MIN;
+	}else if(LIKELY(oe_ne_min > 0)){
+		if(nmin < 0 && S16_MIN + 1 + oe_ne_min >= nmin){
+			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load: timeout 1 min=%hd/%hd: %s", nmin, t, key);)
+			if(!(d & 0x80000000) || !(pgp->pg_flags & a_F_GC_LINGER))
+				goto jleave;
+			nmin = S16_MIN;
+		}else{
+			nmin -= oe_ne_min;
+			ASSERT(nmin <= 0);
+			if(d & 0x80000000){
+				if(-nmin >= t){
+					a_DBGM9E(su_log_write(su_LOG_DEBUG,
+						"gray DB load: timeout 2 min=%hd/%hd: %s", nmin, t, key);)
+					if(!(pgp->pg_flags & a_F_GC_LINGER))
+						goto jleave;
+					nmin = S16_MIN;
+				}
+			}else if(-nmin >= pgp->pg_delay_max){
+				a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load: gray >delay-max: %s", key);)
+				goto jleave;
+			}
+		}
+	}
+
+	d = (d & 0xFFFF0000u) | S(u16,nmin);
+	/* Lazy journal records replace, and the timing wheels account what is present */
+	if(glp != NIL && glp->gl_src != a_GRAY_LAZY_SRC_DB &&
+			a_server__gray_st_view_find(a_server__gray_st_view(&gv, gp), key, fp)){
+		a_server__gray_wheel_del(gp, a_server__gray_st_view_data(&gv));
+		a_server__gray_st_view_set_data(&gv, d);
+		rv = -1;
+	}else if((rv = a_server__gray_st_insert(gp, key, fp, d)) > su_ERR_NONE){
+		su_log_write(su_LOG_ERR, _("gray DB load: skip rest after out of memory in %s"), pgp->pg_store_path);
+		rv = 2;
+		goto jleave;
+	}
+	if(glp != NIL)
+		a_server__gray_wheel_add(gp, d);
+	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load%s: new min=%hd: %s",
+		(rv == -1 ? " -> replace" : su_empty), nmin, key);)
+	rv = 1;
+
+jleave:
+	if(glp != NIL && gp != NIL){
+		a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+	}
+
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static void
+a_server__gray_load_del(struct a_pg *pgp, char const *key, u64 fp, struct a_gray_lazy *glp){
+	struct a_gray_view gv;
+	struct a_gray *gp;
+	NYD_IN;
+
+	gp = a_server__gray_shard(pgp, key, &fp);
+
+	if(glp == NIL)
+		a_server__gray_st_remove(gp, key, fp);
+	else{
+		char dkb[1 + 16 +1];
+
+		a_MT( pthread_mutex_lock(&gp->g_mtx); )
+		if(a_server__gray_st_view_find(a_server__gray_st_view(&gv, gp), key, fp)){
+			a_server__gray_wheel_del(gp, a_server__gray_st_view_data(&gv));
+			a_server__gray_st_remove(gp, key, fp);
+		}
+		a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+
+		/* The snapshot must not bring it back */
+		if(a_GRAY_IS_FP(gp)){
+			dkb[0] = '~';
+			a_misc_fprint_hex(&dkb[1], fp);
+			dkb[1 + 16] = '\0';
+			key = dkb;
+		}
+		su_cs_dict_insert(&glp->gl_dead, key, NIL);
+	}
+
+	NYD_OU;
+}
+
+static boole
+a_server__gray_lazy_open(struct a_pg *pgp){ /* {{{ */
+	static char const *const a_names[a_GRAY_LAZY_SRC__MAX] =
+		{a_GRAY_JNL_OLD_NAME, a_GRAY_JNL_NAME, a_GRAY_DB_NAME};
+
+	struct a_gray_bin_hdr const *gbhp;
+	struct a_gray_lazy *glp;
+	char *dat;
+	u32 i, len;
+	s32 x;
+	boole rv;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	mp->m_lazy = glp = su_TCALLOC(struct a_gray_lazy, 1);
+	su_cs_dict_create(&glp->gl_dead, (a_WB_CA_FLAGS | su_CS_DICT_ERR_PASS), NIL);
+	su_timespec_current(&glp->gl_ts);
+
+	/* (Journal growing meanwhile is not seen: the mapping is of startup size) */
+	for(rv = FAL0, i = 0; i < a_GRAY_LAZY_SRC__MAX; ++i)
+		if(a_server__gray_map(pgp, a_names[i], (i != a_GRAY_LAZY_SRC_DB), &glp->gl_map[i], &glp->gl_len[i]) &&
+				i == a_GRAY_LAZY_SRC_JNO)
+			rv = TRU1;
+
+	/* A binary DB is checked now (its checksums later), since a fingerprint one brings the key of the journals */
+	if((dat = glp->gl_map[a_GRAY_LAZY_SRC_DB]) != NIL){
+		len = glp->gl_len[a_GRAY_LAZY_SRC_DB];
+		if(len >= sizeof(a_GRAY_BIN_MAGIC) && !su_mem_cmp(dat, a_GRAY_BIN_MAGIC, sizeof(a_GRAY_BIN_MAGIC))){
+			glp->gl_bin = TRU1;
+			gbhp = R(struct a_gray_bin_hdr const*,dat);
+
+			if((x = a_server__gray_load_bin_check(pgp, dat, len, FAL0)) > 0 &&
+					a_server__gray_load_base(pgp, gbhp->gbh_base_epoch, glp->gl_ts.ts_sec, FAL0) != S32_MIN){
+				if(gbhp->gbh_version == a_GRAY_BIN_VERSION_FP)
+					su_mem_copy(mp->m_gray_fp_key, &gbhp[1], sizeof(mp->m_gray_fp_key));
+			}else{
+				if(x < 0)
+					su_log_write(su_LOG_WARN, _("gray DB corrupt in %s"), pgp->pg_store_path);
+				munmap(dat, len);
+				glp->gl_map[a_GRAY_LAZY_SRC_DB] = NIL;
+			}
+		}
+	}
+
+	for(i = 0; i < mp->m_gray_no; ++i)
+		mp->m_grays[i].g_lazy = a_GRAY_LAZY_JNL;
+
+	if(a_DBGIF || (pgp->pg_flags & a_F_V))
+		su_log_write(su_LOG_INFO, _("gray DB loads lazily while serving in %s"), pgp->pg_store_path);
+
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static void
+a_server__gray_lazy_step(struct a_pg *pgp){ /* {{{ */
+	struct a_gray_bin_hdr const *gbhp;
+	struct a_gray_bin_rec const *gbrp;
+	u64 const *fpp;
+	char const *arena, *cp;
+	char *dat;
+	u32 src, n, i, l;
+	s32 x;
+	struct a_gray *gp;
+	struct a_gray_lazy *glp;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	glp = mp->m_lazy;
+
+	for(n = a_GRAY_LAZY_STEP; n > 0; --n){
+		src = glp->gl_src;
+
+		/* Source done: continue with the next, entries are trusted once the journals are */
+		if((dat = glp->gl_map[src]) == NIL || glp->gl_off == U32_MAX){
+			if(dat != NIL){
+				munmap(dat, glp->gl_len[src]);
+				glp->gl_map[src] = NIL;
+			}
+			glp->gl_off = 0;
+
+			if(++glp->gl_src == a_GRAY_LAZY_SRC__MAX){
+				a_server__gray_lazy_done(pgp);
+				goto jleave;
+			}
+			if(glp->gl_src == a_GRAY_LAZY_SRC_DB){
+				for(i = 0; i < mp->m_gray_no; ++i){
+					gp = &mp->m_grays[i];
+					a_MT( pthread_mutex_lock(&gp->g_mtx); )
+					gp->g_lazy = a_GRAY_LAZY_DB;
+					a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+				}
+				glp->gl_ck_rec = glp->gl_ck_arena = a_MISC_CKSUM_INIT;
+			}
+			continue;
+		}
+
+		if(src == a_GRAY_LAZY_SRC_DB && glp->gl_bin){
+			gbhp = R(struct a_gray_bin_hdr const*,dat);
+			arena = a_server__gray_load_bin_ptr(dat, &fpp, &gbrp);
+			l = S(u32,P2UZ(arena - R(char const*,&gbhp[1])));
+
+			/* Checksums are verified in chunks of their own before any record is trusted */
+			if(glp->gl_ck_off < l + gbhp->gbh_arena_len){
+				if(glp->gl_ck_off < l){
+					i = MIN(l - glp->gl_ck_off, a_GRAY_LAZY_STEP << 8);
+					glp->gl_ck_rec = a_misc_cksum(glp->gl_ck_rec, &R(char const*,&gbhp[1])[glp->gl_ck_off], i);
+				}else{
+					i = MIN(l + gbhp->gbh_arena_len - glp->gl_ck_off, a_GRAY_LAZY_STEP << 8);
+					glp->gl_ck_arena = a_misc_cksum(glp->gl_ck_arena, &arena[glp->gl_ck_off - l], i);
+				}
+				n = 1;
+				x = 0;
+
+				if((glp->gl_ck_off += i) == l + gbhp->gbh_arena_len){
+					if(glp->gl_ck_rec != gbhp->gbh_cksum_rec || glp->gl_ck_arena != gbhp->gbh_cksum_arena)
+						x = -1;
+					/* Bulk insertion: size shards once, _done() restores usual minimum */
+					else for(i = 0; i < mp->m_gray_no; ++i){
+						gp = &mp->m_grays[i];
+						a_MT( pthread_mutex_lock(&gp->g_mtx); )
+						a_server__gray_st_min_size(gp, a_server__gray_st_count(gp) +
+							MAX(a_GRAY_SHARE(mp, gbhp->gbh_count), a_GRAY_SHARE(mp, a_GRAY_MIN_LIMIT)));
+						a_server__gray_st_balance(gp);
+						gp->g_ograycnt = gp->g_min;
+						a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+					}
+				}
+			}else if(glp->gl_off < gbhp->gbh_count){
+				x = a_server__gray_load_bin_rec(pgp, dat, glp->gl_off, glp);
+				if(++glp->gl_off == gbhp->gbh_count)
+					glp->gl_off = U32_MAX;
+			}else{
+				glp->gl_off = U32_MAX;
+				continue;
+			}
+		}else if(glp->gl_off >= glp->gl_len[src]){
+			glp->gl_off = U32_MAX;
+			continue;
+		}else{
+			/* Complete a line first; a torn last journal record is silently ignored */
+			for(cp = &dat[glp->gl_off], l = glp->gl_len[src] - glp->gl_off; *cp != '\n'; ++cp)
+				if(--l == 0)
+					break;
+
+			if(l == 0){
+				x = (src == a_GRAY_LAZY_SRC_DB) ? -1 : 0;
+				glp->gl_off = U32_MAX;
+			}else if(src != a_GRAY_LAZY_SRC_DB){
+				if((x = a_server__gray_jnl_replay_rec(pgp, &dat[glp->gl_off], cp, glp)) >= 0 && x != 2)
+					++glp->gl_recs;
+				glp->gl_off = S(u32,P2UZ(&cp[1] - dat));
+			}else{
+				x = a_server__gray_load_text_line(pgp, &dat[glp->gl_off], cp, &glp->gl_base, glp->gl_have_be,
+						glp);
+				glp->gl_off = S(u32,P2UZ(&cp[1] - dat));
+
+				/* The first line is base epoch */
+				if(x >= 0 && !glp->gl_have_be){
+					glp->gl_have_be = TRU1;
+					if(a_server__gray_load_base(pgp, glp->gl_base, glp->gl_ts.ts_sec, FAL0) == S32_MIN)
+						glp->gl_off = U32_MAX;
+				}
+			}
+		}
+
+		if(x < 0)
+			su_log_write(su_LOG_WARN, (src == a_GRAY_LAZY_SRC_DB ? _("gray DB corrupt in %s")
+				: _("gray DB journal corrupt in %s")), pgp->pg_store_path);
+		if(x < 0 || x == 2)
+			glp->gl_off = U32_MAX;
+	}
+
+	/* Growth must keep pace with insertion */
+	for(i = 0; i < mp->m_gray_no; ++i){
+		gp = &mp->m_grays[i];
+		a_MT( pthread_mutex_lock(&gp->g_mtx); )
+		a_server__gray_grow(pgp, gp, a_GRAY_LAZY_STEP);
+		a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+	}
+
+jleave:
+	NYD_OU;
+} /* }}} */
+
+static void
+a_server__gray_lazy_done(struct a_pg *pgp){ /* {{{ */
+	struct a_gray_jnl *gjp;
+	struct a_gray *gp;
+	struct a_gray_lazy *glp;
+	u32 i, j;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	glp = mp->m_lazy;
+
+	for(j = 0, i = 0; i < mp->m_gray_no; ++i){
+		gp = &mp->m_grays[i];
+		a_MT( pthread_mutex_lock(&gp->g_mtx); )
+		gp->g_lazy = a_GRAY_LAZY_NONE;
+		a_server__gray_st_min_size(gp, a_GRAY_SHARE(mp, a_GRAY_MIN_LIMIT));
+		gp->g_ograycnt = a_server__gray_st_count(gp) + a_GRAY_SHARE(mp, a_GRAY_MIN_LIMIT);
+		j += a_server__gray_st_count(gp);
+		a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+	}
+
+	/* Checkpoint schedule as if it were loaded at startup */
+	gjp = &mp->m_jnl;
+	a_MT( pthread_mutex_lock(&gjp->gj_mtx); )
+	gjp->gj_recs += glp->gl_recs;
+	gjp->gj_ckpt_recs = MAX(a_GRAY_JNL_CKPT_MIN, j);
+	if(gjp->gj_recs >= gjp->gj_ckpt_recs)
+		gjp->gj_ckpt_want = TRU1;
+	a_MT( pthread_mutex_unlock(&gjp->gj_mtx); )
+
+	if(a_DBGIF || (pgp->pg_flags & a_F_V)){
+		struct su_timespec ts;
+
+		su_timespec_sub(su_timespec_current(&ts), &glp->gl_ts);
+		su_log_write(su_LOG_INFO, _("gray DB loaded %lu entries lazily (%lu journal records) "
+				"in %lu:%09lu seconds in %s"),
+			S(ul,j), S(ul,glp->gl_recs), S(ul,ts.ts_sec), S(ul,ts.ts_nano), pgp->pg_store_path);
+	}
+
+	for(i = 0; i < a_GRAY_LAZY_SRC__MAX; ++i)
+		if(glp->gl_map[i] != NIL)
+			munmap(glp->gl_map[i], glp->gl_len[i]);
+	su_cs_dict_gut(&glp->gl_dead);
+	su_FREE(glp);
+	mp->m_lazy = NIL;
+
+	NYD_OU;
+} /* }}} */
+
+static boole
+a_server__gray_save(struct a_pg *pgp, boole bg){ /* {{{ */
+	/* Signals are blocked */
+	struct su_timespec ts;
+	struct a_gray_out go;
+	uz cnt;
+	u32 gi;
+	struct a_master *mp;
+	s32 pid;
+	boole rv;
+	NYD_IN;
+
+	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB save enter, background=%d", bg);)
+	rv = TRU1;
+	mp = pgp->pg_master;
+	if(!(pgp->pg_flags & a_F_GRAY_SAVE_BG))
+		bg = FAL0;
+
+	/* A partial snapshot must not replace the DB: until loaded the journal holds what changed */
+	if(mp->m_lazy != NIL){
+		if(!bg)
+			a_server__gray_jnl_sync(pgp);
+		goto jleave;
+	}
+
+	/* One snapshot at a time */
+	if(mp->m_save_pid != 0){
+		if(bg)
+			goto jleave;
+		a_server__gray_save_reap(pgp, TRU1);
+	}
+
+	go.go_buf = su_TALLOC(char, a_GRAY_WBUF_SIZE);
+	go.go_len = 0;
+	go.go_fd = -1;
+	go.go_err = su_ERR_NONE;
+	go.go_trunc = FAL0;
+	cnt = 0;
+
+	/* All shards are locked in order for a consistent snapshot */
+	for(gi = 0; gi < mp->m_gray_no; ++gi){
+		a_MT( pthread_mutex_lock(&mp->m_grays[gi].g_mtx); )
+	}
+
+	/* Shards share one time base */
+	su_timespec_current(&ts);
+	go.go_epoch = ts.ts_sec;
+
+	/* We only rotate the journal and fork(2): the child serializes its copy-on-write view while we go on
+	 * serving, expiry is up to our wheels and sweeps.  The rotated journal covers the time until its snapshot is
+	 * in place; if that still exists (failed predecessor), go synchronous */
+	pid = -1;
+	if(bg && a_server__gray_jnl_rotate(pgp)){
+		/* (Including expired ones, only used as a checkpoint distance) */
+		for(gi = 0; gi < mp->m_gray_no; ++gi)
+			cnt += a_server__gray_st_count(&mp->m_grays[gi]);
+
+		if((pid = fork()) == 0){
+			/* Other threads are gone, their locks are not: a pure writer, which neither expires nor rebalances,
+			 * nor allocates or logs; expired entries are only skipped, and the others rebased, as written */
+			mp->m_jnl.gj_fd = -1;
+			pgp->pg_flags &= ~S(uz,a_F_V_MASK);
+			su_log_set_level(su_LOG_EMERG);
+
+			rv = a_server__gray_save_file(pgp, &go, &cnt);
+			_exit(rv ? (go.go_trunc ? 1 : 0) : 2 + MIN(su_err(), 252));
+		}else if(pid != -1){
+			mp->m_save_pid = pid;
+			mp->m_save_cnt = S(u32,cnt);
+			mp->m_save_ts = ts;
+			goto junlock;
+		}else{
+			su_log_write(su_LOG_ERR, _("gray DB cannot fork(2) background save, saving synchronously: %s"),
+				V_(su_err_doc(su_err_by_errno())));
+			cnt = 0;
+		}
+	}
+
+	for(gi = 0; gi < mp->m_gray_no; ++gi){
+		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call by DB save");)
+		a_server__gray_maintenance(pgp, &mp->m_grays[gi], FAL0, 0, &ts);
+		ASSERT(mp->m_grays[gi].g_base_epoch == mp->m_grays[gi].g_epoch);
+	}
+
+	if(!(rv = a_server__gray_save_file(pgp, &go, &cnt))){
+		su_log_write(su_LOG_CRIT, _("gray DB cannot be saved in %s: %s"),
+			pgp->pg_store_path, V_(su_err_doc(-1)));
+		cnt = 0;
+	}else{
+		if(go.go_trunc)
+			su_log_write(su_LOG_WARN, _("gray DB truncation near 2GB size in %s"), pgp->pg_store_path);
+
+		a_server__hist_usec(&mp->m_hist_save, &ts);
+
+		if(a_DBGIF || (pgp->pg_flags & a_F_V)){
+			struct su_timespec ts2;
+
+			su_timespec_sub(su_timespec_current(&ts2), &ts);
+			su_log_write(su_LOG_INFO, _("gray DB saved %lu entries (%s) in %lu:%09lu seconds in %s"),
+				S(ul,cnt), (a_GRAY_SAVE_TEXT(pgp) ? "text" : "binary"),
+				S(ul,ts2.ts_sec), S(ul,ts2.ts_nano), pgp->pg_store_path);
+		}
+	}
+
+	a_server__gray_jnl_checkpoint(pgp, rv, FAL0, S(u32,cnt));
+
+junlock:
+	for(gi = mp->m_gray_no; gi-- > 0;){
+		a_MT( pthread_mutex_unlock(&mp->m_grays[gi].g_mtx); )
+	}
+
+	su_FREE(go.go_buf);
+
+jleave:
+	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB save leave");)
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static boole
+a_server__gray_save_file(struct a_pg *pgp, struct a_gray_out *gop, uz *cntp){ /* {{{ */
+	s32 e;
+	boole bg, rv;
+	NYD_IN;
+
+	rv = FAL0;
+	bg = ((pgp->pg_flags & a_F_GRAY_SAVE_BG) != 0);
+
+	while((gop->go_fd = a_sandbox_open(pgp, TRU1, (bg ? a_GRAY_DB_TMP_NAME : a_GRAY_DB_NAME),
+			(O_WRONLY | O_CREAT | O_TRUNC), S_IRUSR | S_IWUSR)) == -1){
+		if((e = su_err_by_errno()) == su_ERR_INTR)
+			continue;
+		if(a_misc_os_resource_delay(e))
+			continue;
+		goto jleave;
+	}
+
+	*cntp = a_GRAY_SAVE_TEXT(pgp) ? a_server__gray_save_text(pgp, gop)
+			: a_GRAY_IS_FP(&pgp->pg_master->m_grays[0]) ? a_server__gray_save_bin_fp(pgp, gop)
+			: a_server__gray_save_bin(pgp, gop);
+	if(*cntp == UZ_MAX || !a_server__gray_out(gop, NIL, 0))
+		su_err_set(gop->go_err);
+	else if(fsync(gop->go_fd) != -1)
+		rv = TRU1;
+	else
+		su_err_by_errno();
+
+	close(gop->go_fd);
+	gop->go_fd = -1;
+
+	/* With --gray-save-background the old DB remains intact unless we succeed */
+	if(bg){
+		if(rv && !a_sandbox_rename_in_store_path(pgp, a_GRAY_DB_TMP_NAME, a_GRAY_DB_NAME)){
+			su_err_by_errno();
+			rv = FAL0;
+		}
+
+		if(!rv){
+			e = su_err();
+			a_sandbox_rm_in_store_path(pgp, a_GRAY_DB_TMP_NAME);
+			su_err_set(e);
+		}
+	}
+
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static void
+a_server__gray_save_reap(struct a_pg *pgp, boole wait){ /* {{{ */
+	struct su_timespec ts;
+	s32 pid, status, fd;
+	boole rv;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	if(mp->m_save_pid == 0)
+		goto jleave;
+
+	while((pid = waitpid(mp->m_save_pid, &status, (wait ? 0 : WNOHANG))) == -1){
+		if(su_err_by_errno() != su_ERR_INTR){
+			su_log_write(su_LOG_CRIT, _("gray DB background save cannot be waited for: %s"),
+				V_(su_err_doc(-1)));
+			status = 0xFF << 8;
+			pid = mp->m_save_pid;
+			break;
+		}
+	}
+	if(pid == 0)
+		goto jleave;
+	mp->m_save_pid = 0;
+
+	if(!(rv = (WIFEXITED(status) && WEXITSTATUS(status) < 2))){
+		if(WIFSIGNALED(status))
+			su_log_write(su_LOG_CRIT, _("gray DB background save in %s terminated by signal %d"),
+				pgp->pg_store_path, S(int,WTERMSIG(status)));
+		else if(WIFEXITED(status) && WEXITSTATUS(status) != 0xFF)
+			su_log_write(su_LOG_CRIT, _("gray DB cannot be saved in %s: %s"),
+				pgp->pg_store_path, V_(su_err_doc(WEXITSTATUS(status) - 2)));
+	}else{
+		if(WEXITSTATUS(status) == 1)
+			su_log_write(su_LOG_WARN, _("gray DB truncation near 2GB size in %s"), pgp->pg_store_path);
+
+		a_server__hist_usec(&mp->m_hist_save, &mp->m_save_ts);
+
+		if(a_DBGIF || (pgp->pg_flags & a_F_V)){
+			struct su_pathinfo pi;
+
+			su_timespec_sub(su_timespec_current(&ts), &mp->m_save_ts);
+
+			pi.pi_size = 0;
+			while((fd = a_sandbox_open(pgp, TRU1, a_GRAY_DB_NAME, O_RDONLY, 0)) == -1 &&
+					su_err_by_errno() == su_ERR_INTR){
+			}
+			if(fd != -1){
+				if(!su_pathinfo_fstat(&pi, fd))
+					pi.pi_size = 0;
+				close(fd);
+			}
+
+			su_log_write(su_LOG_INFO, _("gray DB saved %lu entries (%s, %lu bytes) in background "
+					"in %lu:%09lu seconds in %s"),
+				S(ul,mp->m_save_cnt), (a_GRAY_SAVE_TEXT(pgp) ? "text" : "binary"),
+				S(ul,pi.pi_size), S(ul,ts.ts_sec), S(ul,ts.ts_nano), pgp->pg_store_path);
+		}
+	}
+
+	a_server__gray_jnl_checkpoint(pgp, rv, TRU1, mp->m_save_cnt);
+
+jleave:
+	NYD_OU;
+} /* }}} */
+
+static boole
+a_server__gray_save_data(struct a_pg *pgp, struct a_gray const *gp, struct a_gray_out const *gop, up *dp){
+	/* As round 1 of main5ce() does, but the entry is not touched; (after main5ce() xe is 0) */
+	s64 xe;
+	s32 nmin;
+	up d;
+	boole rv;
+	NYD2_IN;
+
+	rv = TRU1;
+	d = *dp;
+
+	if((xe = gop->go_epoch - gp->g_base_epoch) < 0)
+		xe = 0;
+	else if(LIKELY(!su_state_has(su_STATE_REPRODUCIBLE)))
+		xe /= su_TIME_MIN_SECS;
+	if(xe > S16_MAX)
+		xe = S16_MAX;
+
+	if((nmin = S(s16,d & U16_MAX)) == S16_MIN)
+		rv = ((d & 0x80000000u) && (pgp->pg_flags & a_F_GC_LINGER));
+	else if(-(nmin -= S(s32,xe)) >= ((d & 0x80000000u) ? pgp->pg_gc_timeout : pgp->pg_delay_max)){
+		if((d & 0x80000000u) && (pgp->pg_flags & a_F_GC_LINGER))
+			nmin = S16_MIN;
+		else
+			rv = FAL0;
+	}
+
+	*dp = (d & 0xFFFF0000u) | S(u16,S(s16,nmin));
+
+	NYD2_OU;
+	return rv;
+}
+
+static uz
+a_server__gray_save_text(struct a_pg *pgp, struct a_gray_out *gop){ /* {{{ */
+	struct su_cs_dict_view dv;
+	char const *kp;
+	char *cp;
+	uz cnt, xlen;
+	u32 gi;
+	struct a_gray *gp;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+	cnt = 0;
+
+	cp = su_ienc_s64(pgp->pg_buf, gop->go_epoch, 10);
+	xlen = su_cs_len(cp);
+	cp[xlen++] = '\n';
+	if(!a_server__gray_out(gop, cp, xlen))
+		goto jerr;
+
+	for(gi = 0; gi < mp->m_gray_no; ++gi){
+		for(gp = &mp->m_grays[gi]; gp != NIL; gp = a_GRAY_ST_NEXT(&mp->m_grays[gi], gp)){
+			su_CS_DICT_FOREACH(&gp->g_dict, &dv){
+				/* (see cleanup() for comments) */
+				uz i, j;
+				up d;
+
+				d = R(up,su_cs_dict_view_data(&dv));
+				if(!a_server__gray_save_data(pgp, gp, gop, &d))
+					continue;
+				kp = su_cs_dict_view_key(&dv);
+
+				cp = su_ienc_up(pgp->pg_buf, d, 10);
+				i = su_cs_len(cp);
+				cp[i++] = ' ';
+				j = su_cs_len(kp);
+				su_mem_copy(&cp[i], kp, j);
+				i += j;
+				cp[i++] = '\n';
+
+				/* (setrlimit(2) sandbox up to that size(, too)) */
+				if(UNLIKELY(S(uz,S32_MAX) - i < xlen)){
+					gop->go_trunc = TRU1;
+					goto jleave;
+				}
+
+				if(!a_server__gray_out(gop, cp, i))
+					goto jerr;
+				xlen += i;
+				++cnt;
+
+				a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB save: gray=%d (count=%lu) nmin=%hd: %s",
+					!(d & 0x80000000), S(ul,(d & 0x7FFF0000) >> 16), S(s16,d & 0xFFFF), kp);)
+			}
+		}
+	}
+
+jleave:
+	NYD_OU;
+	return cnt;
+jerr:
+	cnt = UZ_MAX;
+	goto jleave;
+} /* }}} */
+
+static uz
+a_server__gray_save_bin(struct a_pg *pgp, struct a_gray_out *gop){ /* {{{ */
+	/* Header, records and NUL terminated key arena are written in three sweeps, the first of which only
+	 * calculates sizes and checksums so that the header can be written first */
+	struct a_gray_bin_hdr gbh;
+	struct a_gray_bin_rec gbr;
+	struct su_cs_dict_view dv;
+	char const *kp;
+	uz cnt, i, xlen;
+	u32 gi, pass;
+	struct a_gray *gp;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	STRUCT_ZERO(struct a_gray_bin_hdr, &gbh);
+	su_mem_copy(gbh.gbh_magic, a_GRAY_BIN_MAGIC, sizeof(a_GRAY_BIN_MAGIC));
+	gbh.gbh_bom = a_GRAY_BIN_BOM;
+	gbh.gbh_version = a_GRAY_BIN_VERSION;
+	gbh.gbh_base_epoch = gop->go_epoch;
+	gbh.gbh_cksum_rec = gbh.gbh_cksum_arena = a_MISC_CKSUM_INIT;
+
+	for(pass = 0; pass < 3; ++pass){
+		if(pass == 1 && !a_server__gray_out(gop, &gbh, sizeof(gbh)))
+			goto jerr;
+
+		cnt = 0;
+		xlen = sizeof(gbh);
+		gbr.gbr_key_off = 0;
+
+		for(gi = 0; gi < mp->m_gray_no; ++gi){
+			for(gp = &mp->m_grays[gi]; gp != NIL; gp = a_GRAY_ST_NEXT(&mp->m_grays[gi], gp)){
+				su_CS_DICT_FOREACH(&gp->g_dict, &dv){
+					up d;
+
+					if(pass > 0 && cnt == gbh.gbh_count)
+						goto jpass;
+
+					d = R(up,su_cs_dict_view_data(&dv));
+					if(!a_server__gray_save_data(pgp, gp, gop, &d))
+						continue;
+					gbr.gbr_data = S(u32,d);
+					kp = su_cs_dict_view_key(&dv);
+					i = su_cs_len(kp) +1;
+
+					switch(pass){
+					case 0:
+						/* (setrlimit(2) sandbox up to that size(, too)) */
+						if(UNLIKELY(S(uz,S32_MAX) - sizeof(gbr) - i < xlen)){
+							gop->go_trunc = TRU1;
+							goto jpass;
+						}
+						xlen += sizeof(gbr) + i;
+						gbh.gbh_cksum_rec = a_misc_cksum(gbh.gbh_cksum_rec, &gbr, sizeof(gbr));
+						gbh.gbh_cksum_arena = a_misc_cksum(gbh.gbh_cksum_arena, kp, i);
+						++gbh.gbh_count;
+						break;
+					case 1:
+						if(!a_server__gray_out(gop, &gbr, sizeof(gbr)))
+							goto jerr;
+						break;
+					default:
+						if(!a_server__gray_out(gop, kp, i))
+							goto jerr;
+						break;
+					}
+
+					gbr.gbr_key_off += S(u32,i);
+					++cnt;
+				}
+			}
+		}
+
+jpass:
+		if(pass == 0)
+			gbh.gbh_arena_len = gbr.gbr_key_off;
+	}
+
+	cnt = gbh.gbh_count;
+jleave:
+	NYD_OU;
+	return cnt;
+jerr:
+	cnt = UZ_MAX;
+	goto jleave;
+} /* }}} */
+
+static uz
+a_server__gray_save_bin_fp(struct a_pg *pgp, struct a_gray_out *gop){ /* {{{ */
+	/* As _save_bin(), but for the SipHash key, fingerprints, and their data words as the "arena" */
+	struct a_gray_bin_hdr gbh;
+	struct a_gray const *gp;
+	uz cnt, xlen;
+	u32 gi, i, pass;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	STRUCT_ZERO(struct a_gray_bin_hdr, &gbh);
+	su_mem_copy(gbh.gbh_magic, a_GRAY_BIN_MAGIC, sizeof(a_GRAY_BIN_MAGIC));
+	gbh.gbh_bom = a_GRAY_BIN_BOM;
+	gbh.gbh_version = a_GRAY_BIN_VERSION_FP;
+	gbh.gbh_base_epoch = gop->go_epoch;
+	gbh.gbh_cksum_rec = a_misc_cksum(a_MISC_CKSUM_INIT, mp->m_gray_fp_key, sizeof(mp->m_gray_fp_key));
+	gbh.gbh_cksum_arena = a_MISC_CKSUM_INIT;
+
+	for(pass = 0; pass < 3; ++pass){
+		if(pass == 1 && (!a_server__gray_out(gop, &gbh, sizeof(gbh)) ||
+				!a_server__gray_out(gop, mp->m_gray_fp_key, sizeof(mp->m_gray_fp_key))))
+			goto jerr;
+
+		cnt = 0;
+		xlen = sizeof(gbh) + sizeof(mp->m_gray_fp_key);
+
+		for(gi = 0; gi < mp->m_gray_no; ++gi){
+			for(gp = &mp->m_grays[gi]; gp != NIL; gp = a_GRAY_ST_NEXT(&mp->m_grays[gi], gp)){
+				for(i = 0; i < gp->g_fp_size; ++i){
+					up d;
+					u32 dw;
+
+					if(gp->g_fp_slot[i] == 0)
+						continue;
+					if(pass > 0 && cnt == gbh.gbh_count)
+						goto jpass;
+
+					d = gp->g_fp_data[i];
+					if(!a_server__gray_save_data(pgp, gp, gop, &d))
+						continue;
+					dw = S(u32,d);
+
+					switch(pass){
+					case 0:
+						/* (setrlimit(2) sandbox up to that size(, too)) */
+						if(UNLIKELY(S(uz,S32_MAX) - sizeof(*gp->g_fp_slot) - sizeof(*gp->g_fp_data) < xlen)){
+							gop->go_trunc = TRU1;
+							goto jpass;
+						}
+						xlen += sizeof(*gp->g_fp_slot) + sizeof(*gp->g_fp_data);
+						gbh.gbh_cksum_rec = a_misc_cksum(gbh.gbh_cksum_rec, &gp->g_fp_slot[i],
+								sizeof(*gp->g_fp_slot));
+						gbh.gbh_cksum_arena = a_misc_cksum(gbh.gbh_cksum_arena, &dw, sizeof(dw));
+						++gbh.gbh_count;
+						break;
+					case 1:
+						if(!a_server__gray_out(gop, &gp->g_fp_slot[i], sizeof(*gp->g_fp_slot)))
+							goto jerr;
+						break;
+					default:
+						if(!a_server__gray_out(gop, &dw, sizeof(dw)))
+							goto jerr;
+						break;
+					}
+
+					++cnt;
+				}
+			}
+		}
+
+jpass:
+		if(pass == 0)
+			gbh.gbh_arena_len = gbh.gbh_count * S(u32,sizeof(u32));
+	}
+
+	cnt = gbh.gbh_count;
+jleave:
+	NYD_OU;
+	return cnt;
+jerr:
+	cnt = UZ_MAX;
+	goto jleave;
+} /* }}} */
+
+static boole
+a_server__gray_out(struct a_gray_out *gop, void const *dat, uz len){ /* {{{ */
+	boole rv;
+	NYD_IN;
+
+	rv = TRU1;
+
+	if(len > 0 && a_GRAY_WBUF_SIZE - gop->go_len >= len){
+		su_mem_copy(&gop->go_buf[gop->go_len], dat, len);
+		gop->go_len += len;
+		goto jleave;
+	}
+
+	/* Flush, then either buffer or write directly */
+	if(gop->go_len > 0){
+		if(!a_misc_write_all(gop->go_fd, gop->go_buf, gop->go_len))
+			goto jerr;
+		gop->go_len = 0;
+	}
+
+	if(len >= a_GRAY_WBUF_SIZE){
+		if(!a_misc_write_all(gop->go_fd, dat, len))
+			goto jerr;
+	}else if(len > 0){
+		su_mem_copy(gop->go_buf, dat, len);
+		gop->go_len = len;
+	}
+
+jleave:
+	NYD_OU;
+	return rv;
+jerr:
+	/* (Callers may do more I/O before reporting it) */
+	gop->go_err = su_err();
+	rv = FAL0;
+	goto jleave;
+} /* }}} */
+
+static boole
+a_server__gray_jnl_replay(struct a_pg *pgp, char const *name){ /* {{{ */
+	struct su_timespec ts;
+	char *dat, *base, *cp;
+	u32 len, i, recs;
+	s32 x;
+	boole rv;
+	NYD_IN;
+
+	/* (Pre-sandbox, like _gray_load()) */
+	if(!(rv = a_server__gray_map(pgp, name, TRU1, &dat, &len)) || dat == NIL)
+		goto jleave;
+
+	su_timespec_current(&ts);
+
+	/* A torn last record is silently ignored */
+	for(recs = 0, base = cp = dat, i = len; i > 0; ++cp, --i){
+		if(*cp != '\n')
+			continue;
+
+		if((x = a_server__gray_jnl_replay_rec(pgp, base, cp, NIL)) < 0){
+			su_log_write(su_LOG_WARN, _("gray DB journal corrupt in %s"), pgp->pg_store_path);
+			break;
+		}
+		if(x == 2)
+			break;
+
+		++recs;
+		base = &cp[1];
+	}
+
+	if(i == 0 && base != cp){
+		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB journal: torn last record");)
+	}
+
+	pgp->pg_master->m_jnl.gj_recs += recs;
+
+	if(a_DBGIF || (pgp->pg_flags & a_F_V)){
+		struct su_timespec ts2;
+
+		su_timespec_sub(su_timespec_current(&ts2), &ts);
+		su_log_write(su_LOG_INFO, _("gray DB journal %s replayed %lu records in %lu:%09lu seconds in %s"),
+			name, S(ul,recs), S(ul,ts2.ts_sec), S(ul,ts2.ts_nano), pgp->pg_store_path);
+	}
+
+	munmap(dat, len);
+
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static s32
+a_server__gray_jnl_replay_rec(struct a_pg *pgp, char *base, char const *end, struct a_gray_lazy *glp){ /* {{{ */
+	char key[a_BUF_SIZE];
+	s64 ibuf;
+	u64 fp;
+	up d;
+	s32 rv;
+	NYD_IN;
+
+	rv = -1;
+
+	if(&base[2] >= end)
+		goto jleave;
+
+	/* +EPOCH BITMASK KEY, or -KEY (-~HEX fingerprint) */
+	if(*base == '-'){
+		++base;
+		/* (Keys always contain slashes: no ambiguity; without --gray-fingerprint unusable) */
+		if(*base == '~' && P2UZ(end - base) == 1 + 16){
+			if((su_idec_u64(&fp, &base[1], 16, 16, NIL) &
+					(su_IDEC_STATE_EMASK | su_IDEC_STATE_CONSUMED)) != su_IDEC_STATE_CONSUMED)
+				goto jleave;
+			if(a_GRAY_IS_FP(&pgp->pg_master->m_grays[0]))
+				a_server__gray_load_del(pgp, NIL, fp, glp);
+		}else if(!a_server__gray_load_key(pgp, key, base, P2UZ(end - base)))
+			goto jleave;
+		else
+			a_server__gray_load_del(pgp, key, 0, glp);
+		rv = 1;
+	}else if(*base++ == '+'){
+		if(!a_server__gray_jnl_parse(C(char const**,&base), end, &ibuf, &d))
+			goto jleave;
+		rv = a_server__gray_load_ent(pgp, base, P2UZ(end - base), 0, d, ibuf, glp);
+	}
+
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static void
+a_server__gray_jnl_add(struct a_pg *pgp, char const *key, up d, s64 epoch){ /* {{{ */
+	char *cp;
+	uz i;
+	struct a_gray_jnl *gjp;
+	NYD_IN;
+
+	gjp = &pgp->pg_master->m_jnl;
+	if(gjp->gj_fd < 0)
+		goto jleave;
+
+	i = su_cs_len(key);
+	ASSERT(i < a_BUF_SIZE);
+
+	a_MT( pthread_mutex_lock(&gjp->gj_mtx); )
+
+	if(a_GRAY_WBUF_SIZE - gjp->gj_len < i + su_IENC_BUFFER_SIZE * 2 +4)
+		a_server__gray_jnl_write(pgp);
+
+	cp = a_server__gray_jnl_rec(&gjp->gj_buf[gjp->gj_len], key, i, d, epoch);
+	gjp->gj_len = P2UZ(cp - gjp->gj_buf);
+
+	if(++gjp->gj_recs >= gjp->gj_ckpt_recs)
+		gjp->gj_ckpt_want = TRU1;
+
+	a_MT( pthread_mutex_unlock(&gjp->gj_mtx); )
+
+jleave:
+	NYD_OU;
+} /* }}} */
+
+static char *
+a_server__gray_jnl_rec(char *cp, char const *key, uz len, up d, s64 epoch){
+	NYD2_IN;
+
+	if(epoch < 0)
+		*cp++ = '-';
+	else{
+		char *xcp;
+		uz j;
+
+		*cp++ = '+';
+		xcp = su_ienc_s64(cp, epoch, 10);
+		j = su_cs_len(xcp);
+		su_mem_move(cp, xcp, j);
+		cp += j;
+		*cp++ = ' ';
+		xcp = su_ienc_up(cp, d, 10);
+		j = su_cs_len(xcp);
+		su_mem_move(cp, xcp, j);
+		cp += j;
+		*cp++ = ' ';
+	}
+	su_mem_copy(cp, key, len);
+	cp += len;
+	*cp++ = '\n';
+
+	NYD2_OU;
+	return cp;
+}
+
+static boole
+a_server__gray_jnl_parse(char const **basep, char const *end, s64 *epochp, up *dp){
+	s64 ibuf;
+	boole rv;
+	NYD2_IN;
+
+	rv = FAL0;
+
+	if((su_idec(&ibuf, *basep, P2UZ(end - *basep), 10, 0, basep) & su_IDEC_STATE_EMASK) ||
+			UCMP(64, ibuf, >=, su_TIME_EPOCH_MAX) || *(*basep)++ != ' ')
+		goto jleave;
+	*epochp = ibuf;
+
+	if((su_idec(&ibuf, *basep, P2UZ(end - *basep), 10, 0, basep) & su_IDEC_STATE_EMASK) ||
+			UCMP(64, ibuf, >, U32_MAX) || *(*basep)++ != ' ')
+		goto jleave;
+	*dp = S(up,ibuf) & 0xFFFF0000u;
+
+	rv = TRU1;
+jleave:
+	NYD2_OU;
+	return rv;
+}
+
+static void
+a_server__gray_jnl_write(struct a_pg *pgp){
+	struct a_gray_jnl *gjp;
+	NYD_IN;
+
+	gjp = &pgp->pg_master->m_jnl;
+
+	if(gjp->gj_len > 0){
+		if(a_misc_write_all(gjp->gj_fd, gjp->gj_buf, gjp->gj_len))
+			gjp->gj_unsynced = TRU1;
+		else{
+			/* A checkpoint restores durability */
+			if(!gjp->gj_err_logged){
+				gjp->gj_err_logged = TRU1;
+				su_log_write(su_LOG_CRIT, _("gray DB journal cannot be written in %s: %s"),
+					pgp->pg_store_path, V_(su_err_doc(su_err_by_errno())));
+			}
+			gjp->gj_ckpt_want = TRU1;
+		}
+		gjp->gj_len = 0;
+	}
+
+	NYD_OU;
+}
+
+static boole
+a_server__gray_jnl_sync(struct a_pg *pgp){ /* {{{ */
+	s32 fd;
+	boole rv;
+	struct a_gray_jnl *gjp;
+	NYD_IN;
+
+	gjp = &pgp->pg_master->m_jnl;
+	fd = -1;
+
+	a_MT( pthread_mutex_lock(&gjp->gj_mtx); )
+	if(gjp->gj_fd >= 0){
+		a_server__gray_jnl_write(pgp);
+		if(gjp->gj_unsynced){
+			gjp->gj_unsynced = FAL0;
+			fd = gjp->gj_fd;
+		}
+	}
+	rv = gjp->gj_ckpt_want;
+	a_MT( pthread_mutex_unlock(&gjp->gj_mtx); )
+
+	/* One fsync(2) for all records of this round; the descriptor is not closed while we run */
+	if(fd != -1)
+		fsync(fd);
+
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static boole
+a_server__gray_jnl_due(struct a_pg *pgp){
+	boole rv;
+	struct a_gray_jnl *gjp;
+	NYD_IN;
+
+	gjp = &pgp->pg_master->m_jnl;
+
+	a_MT( pthread_mutex_lock(&gjp->gj_mtx); )
+	rv = gjp->gj_ckpt_want;
+	a_MT( pthread_mutex_unlock(&gjp->gj_mtx); )
+
+	NYD_OU;
+	return rv;
+}
+
+static boole
+a_server__gray_jnl_rotate(struct a_pg *pgp){ /* {{{ */
+	s32 fd;
+	boole rv;
+	struct a_gray_jnl *gjp;
+	NYD_IN;
+
+	gjp = &pgp->pg_master->m_jnl;
 	rv = FAL0;
+
+	a_MT( pthread_mutex_lock(&gjp->gj_mtx); )
+
+	if(gjp->gj_jno)
+		goto jleave;
+	rv = TRU1;
+	gjp->gj_ckpt_want = FAL0;
+
+	if(gjp->gj_fd < 0)
+		goto jleave;
+
+	/* (Unconditionally: a _sync() may not yet have done its fsync(2)) */
+	a_server__gray_jnl_write(pgp);
+	gjp->gj_unsynced = FAL0;
+	fsync(gjp->gj_fd);
+
+	if(!a_sandbox_rename_in_store_path(pgp, a_GRAY_JNL_NAME, a_GRAY_JNL_OLD_NAME)){
+		su_log_write(su_LOG_ERR, _("gray DB journal cannot be rotated in %s: %s"),
+			pgp->pg_store_path, V_(su_err_doc(su_err_by_errno())));
+		rv = FAL0;
+		goto jleave;
+	}
+	gjp->gj_jno = TRU1;
+
+	/* A late _sync() fsync(2) of the old descriptor number, reused by now, is harmless */
+	close(gjp->gj_fd);
+	while((fd = a_sandbox_open(pgp, TRU1, a_GRAY_JNL_NAME, (O_WRONLY | O_CREAT | O_TRUNC | O_APPEND),
+			S_IRUSR | S_IWUSR)) == -1){
+		if((fd = su_err_by_errno()) == su_ERR_INTR)
+			continue;
+		if(a_misc_os_resource_delay(fd))
+			continue;
+		su_log_write(su_LOG_CRIT, _("gray DB journal cannot be created in %s, continuing without: %s"),
+			pgp->pg_store_path, V_(su_err_doc(-1)));
+		fd = -1;
+		break;
+	}
+	gjp->gj_fd = fd;
+	gjp->gj_recs = 0;
+
 jleave:
+	a_MT( pthread_mutex_unlock(&gjp->gj_mtx); )
+
 	NYD_OU;
 	return rv;
 } /* }}} */
 
 static void
-a_server__on_sig(int sig){
-#ifdef a_HAVE_LOG_FIFO
-	if(sig == SIGCHLD)
-		a_server_chld = TRU1;
-	else
-#endif
-	     if(sig == SIGHUP)
-		a_server_hup = TRU1;
-	else if(sig == SIGTERM)
-		a_server_term = TRU1;
-	else if(sig == SIGUSR1)
-		a_server_usr1 = TRU1;
-	else if(sig == SIGUSR2)
-		a_server_usr2 = TRU1;
-}
-
-/* gray {{{ */
-static void
-a_server__gray_create(struct a_pg *pgp){
-	struct a_master *mp;
+a_server__gray_jnl_checkpoint(struct a_pg *pgp, boole ok, boole bg, u32 cnt){ /* {{{ */
+	struct a_gray_jnl *gjp;
 	NYD_IN;
 
-	mp = pgp->pg_master;
-	/* all zeroed xxx check via some kind of mem_not_of?? */
+	gjp = &pgp->pg_master->m_jnl;
 
-	/* Perform the initial allocation without _ERR_PASS so that we panic if we
-	 * cannot create it, then set _ERR_PASS to handle (ignore) errors */
-	su_cs_dict_balance(su_cs_dict_set_min_size(su_cs_dict_set_threshold(
-				su_cs_dict_create(&mp->m_gray, a_GRAY_FLAGS, NIL), a_GRAY_THRESH), a_GRAY_MIN_LIMIT));
+	a_MT( pthread_mutex_lock(&gjp->gj_mtx); )
 
-	a_server__gray_load(pgp);
+	if(!ok){
+		/* Keep journal(s), retry later */
+		if(gjp->gj_fd >= 0){
+			a_server__gray_jnl_write(pgp);
+			if(gjp->gj_unsynced){
+				gjp->gj_unsynced = FAL0;
+				fsync(gjp->gj_fd);
+			}
+		}
+		gjp->gj_ckpt_recs = gjp->gj_recs + MAX(a_GRAY_JNL_CKPT_MIN, cnt);
+	}else{
+		/* Snapshot covers the rotated journal, and, unless taken in background, also the current */
+		if(!bg && gjp->gj_fd >= 0){
+			gjp->gj_len = 0;
+			gjp->gj_unsynced = FAL0;
+			while(ftruncate(gjp->gj_fd, 0) == -1){
+				if(su_err_by_errno() != su_ERR_INTR){
+					su_log_write(su_LOG_CRIT, _("gray DB journal cannot be truncated in %s: %s"),
+						pgp->pg_store_path, V_(su_err_doc(-1)));
+					break;
+				}
+			}
+			gjp->gj_recs = 0;
+		}
 
-	/* Enable automatic memory management, balance as necessary */
-	su_cs_dict_add_flags(&mp->m_gray, su_CS_DICT_ERR_PASS | su_CS_DICT_FROZEN);
+		if(gjp->gj_jno){
+			if(!a_sandbox_rm_in_store_path(pgp, a_GRAY_JNL_OLD_NAME))
+				su_log_write(su_LOG_ERR, _("gray DB journal %s cannot be removed in %s: %s"),
+					a_GRAY_JNL_OLD_NAME, pgp->pg_store_path, V_(su_err_doc(-1)));
+			gjp->gj_jno = FAL0;
+		}
 
-	if(su_cs_dict_count(&mp->m_gray) > a_GRAY_MIN_LIMIT)
-		su_cs_dict_add_flags(su_cs_dict_balance(&mp->m_gray), su_CS_DICT_FROZEN);
+		gjp->gj_ckpt_recs = gjp->gj_recs + MAX(a_GRAY_JNL_CKPT_MIN, cnt);
+		gjp->gj_err_logged = FAL0;
+	}
+	gjp->gj_ckpt_want = FAL0;
+
+	a_MT( pthread_mutex_unlock(&gjp->gj_mtx); )
 
 	NYD_OU;
-}
+} /* }}} */
 
 static void
-a_server__gray_load(struct a_pg *pgp){ /* {{{ */
-	struct su_timespec ts;
-	struct su_pathinfo pi;
-	char *base;
-	s16 oe_ne_min, t;
-	boole have_be;
-	s32 i;
-	union {sz l; void *v; char *c;} p;
-	void *mbase;
-	struct a_master *mp;
-	NYD_IN;
+a_server__gray_wheel_tick(struct a_gray *gp){ /* {{{ */
+	struct a_gray_wheel *gwp;
+	s64 n, n2, sb;
+	u32 c, i, k;
+	NYD2_IN;
 
-	mp = pgp->pg_master;
+	n2 = gp->g_wheel_base + gp->g_epoch_min;
 
-	/* Obtain a memory map on the DB storage (only called once on server startup, note: pre-sandbox!) */
-	mbase = NIL;
-	while((i = open(a_GRAY_DB_NAME, O_RDONLY | a_O_NOFOLLOW | a_O_NOCTTY)) == -1){
-		if((i = su_err_by_errno()) == su_ERR_INTR)
-			continue;
-		if(a_misc_os_resource_delay(i))
+	for(k = 0; k < NELEM(gp->g_wheel); ++k){
+		gwp = &gp->g_wheel[k];
+		if((n = gwp->gw_now) >= n2)
 			continue;
-		if(i != su_ERR_NOENT)
-			su_log_write(su_LOG_ERR, _("gray DB cannot load in %s: %s"),
-				pgp->pg_store_path, V_(su_err_doc(-1)));
-		goto jleave;
-	}
-
-	if(!su_pathinfo_fstat(&pi, i)){
-		su_log_write(su_LOG_ERR, _("gray DB cannot fstat(2) in %s: %s"),
-			pgp->pg_store_path, V_(su_err_doc(-1)));
-		p.l = -1;
-	}else if(pi.pi_size > S(u32,S32_MAX)){
-		su_log_write(su_LOG_ERR, _("gray DB corrupt (too large) in %s"), pgp->pg_store_path);
-		p.l = -1;
-	}else{
-		p.v = mmap(NIL, S(u32,pi.pi_size), PROT_READ, MAP_SHARED, i, 0);
-		if(p.l == -1)
-			su_log_write(su_LOG_ERR, _("gray DB cannot mmap(2), skip in %s: %s"),
-				pgp->pg_store_path, V_(su_err_doc(su_err_by_errno())));
-	}
+		gwp->gw_now = n2;
 
-	close(i);
+		/* Cascade the finished block, and with a finished superblock also its blocks; superblocks which
+		 * fall off the end join the oldest */
+		if((n >> 6) == (n2 >> 6))
+			continue;
+		for(c = 0, i = 0; i < a_GRAY_WHEEL_SLOTS; ++i){
+			c += gwp->gw_l0[i];
+			gwp->gw_l0[i] = 0;
+		}
 
-	if(p.l == -1)
-		goto jleave;
-	mbase = p.v;
+		if((n >> 12) == (n2 >> 12)){
+			gwp->gw_l1[(n >> 6) & (a_GRAY_WHEEL_SLOTS - 1)] += c;
+			continue;
+		}
+		for(i = 0; i < a_GRAY_WHEEL_SLOTS; ++i){
+			c += gwp->gw_l1[i];
+			gwp->gw_l1[i] = 0;
+		}
 
-	mp->m_epoch = mp->m_base_epoch = su_timespec_current(&ts)->ts_sec;
+		for(i = 0; i < a_GRAY_WHEEL_L2; ++i){
+			sb = (n >> 12) - 1 - (((n >> 12) - 1 - i) & (a_GRAY_WHEEL_L2 - 1));
+			if(sb < (n2 >> 12) - (a_GRAY_WHEEL_L2 - 1)){
+				gwp->gw_old += gwp->gw_l2[i];
+				gwp->gw_l2[i] = 0;
+			}
+		}
+		if((n >> 12) >= (n2 >> 12) - (a_GRAY_WHEEL_L2 - 1))
+			gwp->gw_l2[(n >> 12) & (a_GRAY_WHEEL_L2 - 1)] += c;
+		else
+			gwp->gw_old += c;
+	}
 
-	UNINIT(oe_ne_min, 0);
-	t = pgp->pg_gc_timeout;
-	for(have_be = FAL0, base = p.c, i = S(s32,pi.pi_size); i > 0; ++p.c, --i){
-		s64 ibuf;
-		union {u32 f; uz z;} u;
+	NYD2_OU;
+} /* }}} */
 
-		/* Complete a line first */
-		if(*p.c != '\n')
-			continue;
+static void
+a_server__gray_wheel_reset(struct a_gray *gp){
+	struct a_gray_wheel *gwp;
+	u32 k;
+	NYD2_IN;
 
-		if(&base[2] >= p.c)
-			goto jerr;
+	for(k = 0; k < NELEM(gp->g_wheel); ++k){
+		gwp = &gp->g_wheel[k];
+		gwp->gw_old = 0;
+		su_mem_set(gwp->gw_l2, 0, sizeof(gwp->gw_l2));
+		su_mem_set(gwp->gw_l1, 0, sizeof(gwp->gw_l1));
+		su_mem_set(gwp->gw_l0, 0, sizeof(gwp->gw_l0));
+	}
 
-		u.f = su_idec(&ibuf, base, P2UZ(p.c - base), 10, 0, C(char const**,&base));
-		if((u.f & su_IDEC_STATE_EMASK) || UCMP(64, ibuf, >=, su_TIME_EPOCH_MAX))
-			goto jerr;
+	NYD2_OU;
+}
 
-		/* The first line is base epoch */
-		if(!have_be){
-			s64 xbe;
+static void
+a_server__gray_wheel_add(struct a_gray *gp, up d){
+	NYD2_IN;
 
-			have_be = TRU1;
-			if(*base != '\n')
-				goto jerr;
+	++*a_server__gray_wheel__slot(gp, d);
 
-			xbe = mp->m_base_epoch;
-			xbe -= ibuf;
-			if(xbe > 0){
-				if(LIKELY(!su_state_has(su_STATE_REPRODUCIBLE)))
-					xbe /= su_TIME_MIN_SECS;
-				if(xbe >= t){
-					if(!(pgp->pg_flags & a_F_GC_LINGER)){
-						if(a_DBGIF || (pgp->pg_flags & a_F_V))
-							su_log_write(su_LOG_INFO,
-								_("gray DB load: skip timed out content in %s"),
-								pgp->pg_store_path);
-						goto jleave;
-					}
-					xbe = -1;
-				}
-			}else{
-				if(a_DBGIF || (pgp->pg_flags & a_F_V))
-					su_log_write(su_LOG_INFO, _("gray DB ignoring future timestamp in %s"),
-						pgp->pg_store_path);
-				xbe = 0;
-			}
+	NYD2_OU;
+}
 
-			oe_ne_min = S(s16,xbe);
-			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load base time oe_ne_min=%hd", oe_ne_min));
-		}else if(*base++ != ' ')
-			goto jerr;
-		/* [recipient]/s[ender]/c[lient address] */
-		else if((u.z = P2UZ(p.c - base)) >= a_BUF_SIZE || u.z <= 2+2)
-			goto jerr;
-		else{
-			char key[a_BUF_SIZE];
-			s32 insrv;
-			s16 nmin;
-			up d;
-
-			if(!(pgp->pg_flags & (a_F_FOCUS_DOMAIN | a_F_FOCUS_SENDER))){
-				su_mem_copy(key, base, u.z);
-				key[u.z] = '\0';
-			}else{
-				char *kp, *xkp, c;
+static void
+a_server__gray_wheel_del(struct a_gray *gp, up d){
+	u32 *cntp;
+	NYD2_IN;
 
-				kp = key;
-				nmin = ((pgp->pg_flags & a_F_FOCUS_SENDER) == 0);
+	cntp = a_server__gray_wheel__slot(gp, d);
+	ASSERT(*cntp > 0);
+	if(LIKELY(*cntp > 0))
+		--*cntp;
 
-				/* skip a possible recipient */
-				if(nmin == 0){
-					for(;;){
-						if(u.z-- == 0)
-							goto jerr;
-						if(*base++ == '/')
-							break;
-					}
-					*kp++ = '/';
-				}
+	NYD2_OU;
+}
 
-				/* possibly trim local-part(s), and ensure we have a sender */
-				while(nmin-- >= 0){
-					c = '\0';
-					if(pgp->pg_flags & a_F_FOCUS_DOMAIN){
-						for(xkp = kp;;){
-							if(u.z-- == 0)
-								goto jerr;
-							if((*xkp++ = c = *base++) == '@')
-								break;
-							if(c == '/'){
-								if(nmin < 0 && ++kp == xkp)
-									goto jerr;
-								kp = xkp;
-								break;
-							}
-						}
-					}
-					if(c != '/')
-						for(xkp = kp;;){
-							if(u.z-- == 0)
-								goto jerr;
-							if((*kp++ = *base++) == '/'){
-								if(nmin < 0 && ++xkp == kp)
-									goto jerr;
-								break;
-							}
-						}
-				}
+static u32
+a_server__gray_wheel_count(struct a_gray_wheel const *gwp, s32 age, boole certain){
+	s64 lo, hi, w;
+	u32 rv, no, c;
+	NYD2_IN;
 
-				if(u.z > 0)
-					su_mem_copy(kp, base, u.z);
-				kp[u.z] = '\0';
-			}
+	w = gwp->gw_now - age;
+	for(rv = 0, no = 0; a_server__gray_wheel__bucket(gwp, no, &c, &lo, &hi); ++no){
+		if((certain ? hi : lo) > w)
+			break;
+		rv += c;
+	}
 
-			d = S(up,ibuf);
-			nmin = S(s16,d & U16_MAX);
-			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load: gray=%d nmin=%hd count=%d: %s",
-				!(d & 0x80000000), nmin, S(int,(d & 0x7FFF0000) >> 16), key);)
-			/* Corrupted database? */
-			if(UNLIKELY(nmin > 0)){
-				nmin = -nmin;
-				a_DBGM9E(su_log_write(su_LOG_DEBUG,
-					"gray DB load: (pre-0.8.3?) entry corrupt nmin->%hd: %s",
-					nmin, key);)
-			}
+	NYD2_OU;
+	return rv;
+}
 
-			if(UNLIKELY(oe_ne_min < 0)){
-				ASSERT(pgp->pg_flags & a_F_GC_LINGER);
-				if(!(d & 0x80000000)){
-					a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load: timeout gray: %s", key));
-					goto jskip;
-				}
-				a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load: timeout but gc-linger: %s", key));
-				nmin = S16_MIN;
-			}else if(LIKELY(oe_ne_min > 0)){
-				if(nmin < 0 && S16_MIN + 1 + oe_ne_min >= nmin){
-					a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load: timeout 1 min=%hd/%hd: %s",
-						nmin, t, key);)
-					if(!(d & 0x80000000) || !(pgp->pg_flags & a_F_GC_LINGER))
-						goto jskip;
-					nmin = S16_MIN;
-				}else{
-					nmin -= oe_ne_min;
-					ASSERT(nmin <= 0);
-					if(d & 0x80000000){
-						if(-nmin >= t){
-							a_DBGM9E(su_log_write(su_LOG_DEBUG,
-								"gray DB load: timeout 2 min=%hd/%hd: %s", nmin, t, key);)
-							if(!(pgp->pg_flags & a_F_GC_LINGER))
-								goto jskip;
-							nmin = S16_MIN;
-						}
-					}else if(-nmin >= pgp->pg_delay_max){
-						a_DBGM9E(su_log_write(su_LOG_DEBUG,
-							"gray DB load: gray >delay-max: %s", key);)
-						goto jskip;
-					}
-				}
-			}
+static s16
+a_server__gray_wheel_cutoff(struct a_gray_wheel const *gwp, u32 need){
+	s64 lo, hi;
+	u32 no, c;
+	s16 rv;
+	NYD2_IN;
 
-			d = (d & 0xFFFF0000u) | S(u16,nmin);
-			insrv = su_cs_dict_insert(&mp->m_gray, key, R(void*,d));
-			if(insrv > su_ERR_NONE){
-				su_log_write(su_LOG_ERR, _("gray DB load: skip rest after out of memory in %s"),
-					pgp->pg_store_path);
-				goto jleave;
-			}
-			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB load%s: new min=%hd: %s",
-				(insrv == -1 ? " -> replace" : su_empty), nmin, key);)
+	for(rv = 0, no = 0; need > 0 && a_server__gray_wheel__bucket(gwp, no, &c, &lo, &hi); ++no){
+		if(c >= need){
+			hi = gwp->gw_now - hi;
+			rv = (hi > S16_MAX) ? S16_MAX : S(s16,hi);
+			break;
 		}
-
-jskip:
-		base = &p.c[1];
+		need -= c;
 	}
-	if(base != p.c)
-jerr:
-		su_log_write(su_LOG_WARN, _("gray DB corrupt in %s"), pgp->pg_store_path);
 
-	if(a_DBGIF || (pgp->pg_flags & a_F_V)){
-		struct su_timespec ts2;
+	NYD2_OU;
+	return rv;
+}
 
-		su_timespec_sub(su_timespec_current(&ts2), &ts);
-		su_log_write(su_LOG_INFO, _("gray DB loaded %lu entries in %lu:%09lu seconds in %s"),
-			S(ul,su_cs_dict_count(&mp->m_gray)),
-			S(ul,ts2.ts_sec), S(ul,ts2.ts_nano), pgp->pg_store_path);
-	}
+static u32 *
+a_server__gray_wheel__slot(struct a_gray *gp, up d){
+	struct a_gray_wheel *gwp;
+	s64 n, w;
+	u32 *rv;
+	NYD2_IN;
 
-jleave:
-	if(mbase != NIL)
-		munmap(mbase, S(u32,pi.pi_size));
+	gwp = &gp->g_wheel[(d & 0x80000000u) != 0];
+	n = gwp->gw_now;
+	w = gp->g_wheel_base + S(s16,d & U16_MAX);
+	ASSERT(w <= n);
+
+	if((w >> 6) == (n >> 6))
+		rv = &gwp->gw_l0[w & (a_GRAY_WHEEL_SLOTS - 1)];
+	else if((w >> 12) == (n >> 12))
+		rv = &gwp->gw_l1[(w >> 6) & (a_GRAY_WHEEL_SLOTS - 1)];
+	else if((n >> 12) - (w >> 12) < a_GRAY_WHEEL_L2)
+		rv = &gwp->gw_l2[(w >> 12) & (a_GRAY_WHEEL_L2 - 1)];
+	else
+		rv = &gwp->gw_old;
 
-	NYD_OU;
-} /* }}} */
+	NYD2_OU;
+	return rv;
+}
 
 static boole
-a_server__gray_save(struct a_pg *pgp){ /* {{{ */
-	/* Signals are blocked */
-	struct su_timespec ts;
-	struct su_cs_dict_view dv;
-	char *cp;
-	uz cnt, xlen;
-	struct a_master *mp;
-	s32 fd;
+a_server__gray_wheel__bucket(struct a_gray_wheel const *gwp, u32 no, u32 *cntp, s64 *lop, s64 *hip){
+	s64 n, x;
 	boole rv;
-	NYD_IN;
+	NYD2_IN;
 
-	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB save enter\n");)
+	n = gwp->gw_now;
 	rv = TRU1;
 
-	while((fd = a_sandbox_open(pgp, TRU1, a_GRAY_DB_NAME, (O_WRONLY | O_CREAT | O_TRUNC),
-			S_IRUSR | S_IWUSR)) == -1){
-		if((fd = su_err_by_errno()) == su_ERR_INTR)
-			continue;
-		if(a_misc_os_resource_delay(fd))
-			continue;
-		su_log_write(su_LOG_CRIT, _("gray DB cannot be created in %s: %s"),
-			pgp->pg_store_path, V_(su_err_doc(su_err_by_errno())));
+	if(no == 0){
+		*cntp = gwp->gw_old;
+		*lop = 0;
+		*hip = (((n >> 12) - (a_GRAY_WHEEL_L2 - 1)) << 12) - 1;
+	}else if(--no < a_GRAY_WHEEL_L2 - 1){
+		x = (n >> 12) - (a_GRAY_WHEEL_L2 - 1) + no;
+		*cntp = gwp->gw_l2[x & (a_GRAY_WHEEL_L2 - 1)];
+		*lop = x << 12;
+		*hip = *lop + (1 << 12) - 1;
+	}else if((no -= a_GRAY_WHEEL_L2 - 1) < ((n >> 6) & (a_GRAY_WHEEL_SLOTS - 1))){
+		x = ((n >> 12) << 6) + no;
+		*cntp = gwp->gw_l1[x & (a_GRAY_WHEEL_SLOTS - 1)];
+		*lop = x << 6;
+		*hip = *lop + (1 << 6) - 1;
+	}else if((no -= S(u32,(n >> 6) & (a_GRAY_WHEEL_SLOTS - 1))) <= (n & (a_GRAY_WHEEL_SLOTS - 1))){
+		x = ((n >> 6) << 6) + no;
+		*cntp = gwp->gw_l0[x & (a_GRAY_WHEEL_SLOTS - 1)];
+		*lop = *hip = x;
+	}else
 		rv = FAL0;
-		goto jleave;
-	}
-
-	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call by DB save");)
-	a_server__gray_maintenance(pgp, FAL0, 0, &ts);
-	mp = pgp->pg_master;
-	ASSERT(mp->m_base_epoch == mp->m_epoch);
-	cnt = 0;
-
-	cp = su_ienc_s64(pgp->pg_buf, mp->m_base_epoch, 10);
-	xlen = su_cs_len(cp);
-	cp[xlen++] = '\n';
-	if(UCMP(z, write(fd, cp, xlen), !=, xlen))
-		goto jerr;
 
-	su_CS_DICT_FOREACH(&mp->m_gray, &dv){
-		/* (see cleanup() for comments) */
-		uz i, j;
-		up d;
+	NYD2_OU;
+	return rv;
+}
 
-		d = R(up,su_cs_dict_view_data(&dv));
+static boole
+a_server__gray_sweep_due(struct a_pg *pgp, struct a_gray *gp){
+	boole rv;
+	NYD2_IN;
 
-		cp = su_ienc_up(pgp->pg_buf, d, 10);
-		i = su_cs_len(cp);
-		cp[i++] = ' ';
-		j = su_cs_len(su_cs_dict_view_key(&dv));
-		su_mem_copy(&cp[i], su_cs_dict_view_key(&dv), j);
-		i += j;
-		cp[i++] = '\n';
+	/* Not while growing, it is on its way */
+	if(gp->g_rh != NIL)
+		rv = FAL0;
+	else if(!(rv = gp->g_sweep_on) && gp->g_wheel[0].gw_now >= gp->g_sweep_next){
+		rv = (a_server__gray_wheel_count(&gp->g_wheel[0], pgp->pg_delay_max, FAL0) > 0 ||
+				(!(pgp->pg_flags & a_F_GC_LINGER) &&
+				 a_server__gray_wheel_count(&gp->g_wheel[1], pgp->pg_gc_timeout, FAL0) > 0));
+		gp->g_sweep_on = rv;
+	}
 
-		/* (setrlimit(2) sandbox up to that size(, too)) */
-		if(UNLIKELY(S(uz,S32_MAX) - i < xlen)){
-			su_log_write(su_LOG_WARN, _("gray DB truncation near 2GB size in %s"), pgp->pg_store_path);
-			break;
-		}
+	NYD2_OU;
+	return rv;
+}
 
-		if(UCMP(z, write(fd, cp, i), !=, i))
-			goto jerr;
-		xlen += i;
-		++cnt;
+static void
+a_server__gray_sweep(struct a_pg *pgp, struct a_gray *gp){ /* {{{ */
+	struct a_gray_view gv;
+	s32 age;
+	s16 nmin;
+	u32 i;
+	up d;
+	NYD_IN;
+	ASSERT(gp->g_sweep_on);
 
-		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB save: gray=%d (count=%lu) nmin=%hd: %s",
-			!(d & 0x80000000), S(ul,(d & 0x7FFF0000) >> 16), S(s16,d & 0xFFFF), su_cs_dict_view_key(&dv));)
+	/* Time base is not updated, ages are relative to the last tick; --gc-linger keeps accepted entries */
+	for(i = a_GRAY_SWEEP_BATCH, a_server__gray_st_view_resume(a_server__gray_st_view(&gv, gp));
+			i > 0 && a_server__gray_st_view_is_valid(&gv); --i){
+		d = a_server__gray_st_view_data(&gv);
+		nmin = S(s16,d & U16_MAX);
+		age = (nmin == S16_MIN) ? S32_MAX : gp->g_epoch_min - nmin;
+
+		if(!(d & 0x80000000u) ? (age >= pgp->pg_delay_max)
+				: (!(pgp->pg_flags & a_F_GC_LINGER) && age >= pgp->pg_gc_timeout)){
+			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB sweep delete: gray=%d age=%d: %s",
+				!(d & 0x80000000u), age, a_server__gray_st_view_key(&gv));)
+			a_server__gray_jnl_add(pgp, a_server__gray_st_view_key(&gv), 0, -1);
+			a_server__gray_wheel_del(gp, d);
+			a_server__gray_st_view_remove(&gv);
+		}else
+			a_server__gray_st_view_next(&gv);
 	}
 
-jclose:
-	fsync(fd);
-	close(fd);
+	/* Cycle completed: rest for an eighth of the shorter timeout, rebalance like main5ce does */
+	if(!a_server__gray_st_view_pause(&gv)){
+		gp->g_sweep_on = FAL0;
+		gp->g_sweep_next = gp->g_wheel[0].gw_now + MAX(1, MIN(pgp->pg_delay_max, pgp->pg_gc_timeout) >> 3);
 
-	if(a_DBGIF || (pgp->pg_flags & a_F_V)){
-		struct su_timespec ts2;
+		if(gp->g_cleanup_cnt < S16_MAX)
+			++gp->g_cleanup_cnt;
+		if(gp->g_cleanup_cnt >= pgp->pg_gc_rebalance && pgp->pg_gc_rebalance != 0 && gp->g_rh == NIL){
+			a_server__gray_st_balance(gp);
+			gp->g_cleanup_cnt = 0;
+		}
 
-		su_timespec_sub(su_timespec_current(&ts2), &ts);
-		su_log_write(su_LOG_INFO, _("gray DB saved %lu entries in %lu:%09lu seconds in %s"),
-			S(ul,cnt), S(ul,ts2.ts_sec), S(ul,ts2.ts_nano), pgp->pg_store_path);
+		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB sweep cycle done: count=%u size=%u",
+			a_server__gray_st_count(gp), a_server__gray_st_size(gp));)
 	}
 
-jleave:
-	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB save leave\n");)
 	NYD_OU;
-	return rv;
-
-jerr:
-	su_log_write(su_LOG_CRIT, _("gray DB cannot be written in %s: %s"),
-		pgp->pg_store_path, V_(su_err_doc(su_err_by_errno())));
-
-	if(!a_sandbox_rm_in_store_path(pgp, a_GRAY_DB_NAME))
-		su_log_write(su_LOG_CRIT, _("gray DB cannot even be unlinked in %s %s"),
-			pgp->pg_store_path, V_(su_err_doc(-1)));
-
-	rv = FAL0;
-	goto jclose;
 } /* }}} */
 
 static void
-a_server__gray_maintenance(struct a_pg *pgp, boole only_time_tick, u32 xlimit, struct su_timespec *tsp_or_nil){ /*{{{*/
+a_server__gray_maintenance(struct a_pg *pgp, struct a_gray *gp, boole only_time_tick, u32 xlimit,
+		struct su_timespec *tsp_or_nil){ /*{{{*/
 	enum{
 		a_NONE,
 		a_XLIMIT = 1u<<0,
@@ -2547,58 +8543,62 @@ a_server__gray_maintenance(struct a_pg *pgp, boole only_time_tick, u32 xlimit, s
 		a_GC_BALANCED = 1u<<25
 	};
 
-	struct su_timespec ts;
-	struct su_cs_dict_view dv;
-	s16 t, oe_ne_min, t_50, t_75, t_88;
-	u32 f, c_gray, c_gray_c1, c_linger, c_50, c_75, c_88, c;
-	struct a_master *mp;
+	struct su_timespec ts, tsb;
+	struct a_gray_view gv;
+	struct a_gray *sgp;
+	s16 t, oe_ne_min;
+	u32 f, c_gray, c_gray_c1, c_linger, c;
 	NYD_IN;
 	ASSERT(!only_time_tick || xlimit == 0);
 
 	if(tsp_or_nil == NIL)
-		tsp_or_nil = &ts;
+		su_timespec_current(tsp_or_nil = &ts);
 
-	mp = pgp->pg_master;
 	f = (xlimit != 0) ? a_XLIMIT : a_NONE;
 	if(pgp->pg_flags & a_F_GC_LINGER)
 		f |= a_GC_LINGER;
 
 	a_DBGM9E(su_log_write(su_LOG_DEBUG,
 		"gray DB main5ce enter: only_time_tick=%d xlimit=%u linger=%d count=%u\n",
-		only_time_tick, xlimit, !!(f & a_GC_LINGER), su_cs_dict_count(&mp->m_gray));)
+		only_time_tick, xlimit, !!(f & a_GC_LINGER), a_server__gray_st_count(gp));)
 
 	/* Update our epoch XXX-MONO */
 	/* C99 */{
 		s64 xe;
 
-		ASSERT(mp->m_base_epoch <= mp->m_epoch);
-		xe = mp->m_epoch;
-		mp->m_epoch = su_timespec_current(tsp_or_nil)->ts_sec;
+		ASSERT(gp->g_base_epoch <= gp->g_epoch);
+		xe = gp->g_epoch;
+		gp->g_epoch = tsp_or_nil->ts_sec;
 		t = pgp->pg_gc_timeout;
 
 		if(UNLIKELY(tsp_or_nil->ts_sec < xe)){
 			su_log_write(su_LOG_INFO, _("gray DB resets time base due to clock jump"));
 			xe -= tsp_or_nil->ts_sec;
-			mp->m_base_epoch -= xe; /* easier+cheaper than updating the DB; incorrect, hmm */
+			gp->g_base_epoch -= xe; /* easier+cheaper than updating the DB; incorrect, hmm */
 			if(only_time_tick)
 				goto jleave;
 			xe = 0;
 		}else{
-			xe = tsp_or_nil->ts_sec - mp->m_base_epoch;
+			xe = tsp_or_nil->ts_sec - gp->g_base_epoch;
 			if(LIKELY(!su_state_has(su_STATE_REPRODUCIBLE)))
 				xe /= su_TIME_MIN_SECS;
-			/* If at all possible, do nothing but tracking as time goes */
-			if(LIKELY(only_time_tick && xe < S16_MAX - a_DB_CLEANUP_MIN_DELAY_MINS &&
-					(xe < t || (f & a_GC_LINGER)))){
+			/* If at all possible, do nothing but tracking as time goes; expiry is up to sweeps and lookups */
+			if(LIKELY(only_time_tick && xe < S16_MAX - a_DB_CLEANUP_MIN_DELAY_MINS)){
 				a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: only_time_tick, bye");)
-				mp->m_epoch_min = S(s16,xe);
+				gp->g_epoch_min = S(s16,xe);
 				goto jleave;
 			}
 
-			mp->m_base_epoch = mp->m_epoch;
-			mp->m_epoch_min = 0;
+			if(xe > S16_MAX)
+				xe = S16_MAX;
+			gp->g_base_epoch = gp->g_epoch;
+			gp->g_epoch_min = 0;
+			gp->g_wheel_base += xe;
+			a_server__gray_wheel_tick(gp);
 
-			if(xe >= t){
+			/* Shortcut if all entries timed out */
+			if(xe >= t && a_server__gray_wheel_count(&gp->g_wheel[0], t, TRU1) +
+					a_server__gray_wheel_count(&gp->g_wheel[1], t, TRU1) == a_server__gray_st_count(gp)){
 				if(!(f & a_GC_LINGER)){
 					/* Drop content regardless of xlimit etc, delay should be pretty small.
 					 * Do not call clear(), but keep the node array to shortcut this run */
@@ -2608,7 +8608,8 @@ a_server__gray_maintenance(struct a_pg *pgp, boole only_time_tick, u32 xlimit, s
 						su_log_write(su_LOG_INFO,
 							_("gray DB dropped due to overall timeout in %s"),
 							pgp->pg_store_path);
-					su_cs_dict_clear_elems(&mp->m_gray);
+					a_server__gray_st_clear(gp);
+					a_server__gray_wheel_reset(gp);
 					goto jleave;
 				}
 				/* If gc-timeout is due, delete regardless of only_time_tick xxx no force mode?? */
@@ -2620,19 +8621,19 @@ a_server__gray_maintenance(struct a_pg *pgp, boole only_time_tick, u32 xlimit, s
 		oe_ne_min = S(s16,xe);
 	}
 
-	/* We will iterate all entries and update their time.  We may need to cleanup even, check some thresholds */
-	c_88 = c_75 = c_50 = c_linger = c_gray_c1 = c_gray = 0;
-	t_88 = t_75 = t_50 = t;
-	t_50 >>= 1;
-	t_75 -= t >> 2;
-	t_88 -= t >> 3;
+	su_timespec_current(&tsb);
 
-	c = su_cs_dict_count(&mp->m_gray);
+	/* We will iterate all entries and update their time, and recount them in the wheels.  We may need to cleanup
+	 * even, check some thresholds.  Growth continues in steps, both of its stores are covered */
+	c_linger = c_gray_c1 = c_gray = 0;
+
+	c = a_server__gray_st_count(gp);
 	if(f & a_XLIMIT)
 		f |= a_GC_DEL_FORCE | a_GC_DEL_TIMEOUT | a_GC_DEL_GRAY;
 	else{
 		/* ~88 percent xlimit is documented for --limit! */
-		xlimit = pgp->pg_limit - (pgp->pg_limit >> 3);
+		xlimit = a_server__gray_limit(pgp, gp, FAL0);
+		xlimit -= xlimit >> 3;
 
 		if(c > xlimit)
 			f |= a_GC_DEL_FORCE | a_GC_DEL_TIMEOUT | a_GC_DEL_GRAY;
@@ -2645,34 +8646,37 @@ a_server__gray_maintenance(struct a_pg *pgp, boole only_time_tick, u32 xlimit, s
 
 	a_DBGM9E(su_log_write(su_LOG_DEBUG,
 		"gray DB main5ce: start%s count=%u target=%u epoch=%lu min=%d del=%d/%d linger=%d "
-			"t/88/75/50=%hd/%hd/%hd/%hd oe_ne_min=%hd",
-		((f & a_GC_DEL_FORCE) ? _(" in force mode") : su_empty), c, xlimit, S(ul,mp->m_epoch), mp->m_epoch_min,
-		!!(f & a_GC_DEL_TIMEOUT), !!(f & a_GC_DEL_GRAY), !!(f & a_GC_LINGER), t, t_88, t_75, t_50, oe_ne_min);)
+			"t=%hd oe_ne_min=%hd",
+		((f & a_GC_DEL_FORCE) ? _(" in force mode") : su_empty), c, xlimit, S(ul,gp->g_epoch), gp->g_epoch_min,
+		!!(f & a_GC_DEL_TIMEOUT), !!(f & a_GC_DEL_GRAY), !!(f & a_GC_LINGER), t, oe_ne_min);)
 	if(a_DBGIF || (pgp->pg_flags & a_F_V))
 		su_log_write(su_LOG_INFO,
 			_("gray DB main5ce: count=%u target=%u force-del=%d del-timeout=%d del-gray=%d in %s"),
 			c, xlimit, !!(f & a_GC_DEL_FORCE), !!(f & a_GC_DEL_TIMEOUT), !!(f & a_GC_DEL_GRAY),
 			pgp->pg_store_path);
-	ASSERT(su_cs_dict_flags(&mp->m_gray) & su_CS_DICT_FROZEN);
+	ASSERT(a_GRAY_IS_FP(gp) || (su_cs_dict_flags(&gp->g_dict) & su_CS_DICT_FROZEN));
 
 	/* Round 1: update time, remove "dead" entries; possibly collect statistics for later removal decisions.
 	 * We *never* throw away even LINGER entries in the first round to address attacks where many new graylisted
 	 * entries filled the cache */
-	for(su_cs_dict_view_begin(su_cs_dict_view_setup(&dv, &mp->m_gray)); su_cs_dict_view_is_valid(&dv);){
+	a_server__gray_wheel_reset(gp);
+	sgp = gp;
+jround1:
+	for(a_server__gray_st_view_begin(a_server__gray_st_view(&gv, sgp)); a_server__gray_st_view_is_valid(&gv);){
 		s16 nmin;
 		up d;
 
-		d = R(up,su_cs_dict_view_data(&dv));
+		d = a_server__gray_st_view_data(&gv);
 		nmin = S(s16,d & U16_MAX);
 		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce/1: gray=%d nmin=%hd count=%d: %s",
-			!(d & 0x80000000), nmin, S(int,(d & 0x7FFF0000) >> 16), su_cs_dict_view_key(&dv));)
+			!(d & 0x80000000), nmin, S(int,(d & 0x7FFF0000) >> 16), a_server__gray_st_view_key(&gv));)
 
 		if(UNLIKELY(oe_ne_min < 0)){
 			ASSERT(f & a_GC_LINGER);
 			ASSERT(f & a_GC_DEL_GRAY);
 			if(!(d & 0x80000000)){
 				a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce timeout gray: %s",
-					su_cs_dict_view_key(&dv)));
+					a_server__gray_st_view_key(&gv)));
 				goto jgray;
 			}
 			nmin = S16_MIN; /* timeout */
@@ -2693,7 +8697,7 @@ jtimeout:
 					ASSERT(d & 0x80000000);
 					if(!(f & a_GC_LINGER) && (f & a_GC_DEL_TIMEOUT)){
 						a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce timeout 1: %s",
-							su_cs_dict_view_key(&dv));)
+							a_server__gray_st_view_key(&gv));)
 						goto jdel;
 					}
 					nmin = S16_MIN;
@@ -2702,12 +8706,13 @@ jtimeout:
 jgray:
 				if(f & a_GC_DEL_GRAY){
 					a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce gray >delay-max: %s",
-						su_cs_dict_view_key(&dv));)
+						a_server__gray_st_view_key(&gv));)
 jdel:
 					f |= a_GC_DEL_ANY;
 					a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce delete/1: %s",
-						su_cs_dict_view_key(&dv));)
-					su_cs_dict_view_remove(&dv);
+						a_server__gray_st_view_key(&gv));)
+					a_server__gray_jnl_add(pgp, a_server__gray_st_view_key(&gv), 0, -1);
+					a_server__gray_st_view_remove(&gv);
 					--c;
 					continue;
 				}
@@ -2726,24 +8731,21 @@ jdel:
 					++c_gray_c1;
 			}else if(nmin == S16_MIN)
 				++c_linger;
-			else if(-nmin >= t_88)
-				++c_88;
-			else if(-nmin >= t_75)
-				++c_75;
-			else if(-nmin >= t_50)
-				++c_50;
 		}
 
 		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce keep%s: new min=%hd: %s",
-			(f & a_GC_DEL_FORCE ? " yet" : su_empty), nmin, su_cs_dict_view_key(&dv));)
-		su_cs_dict_view_set_data(&dv, R(void*,d));
-		su_cs_dict_view_next(&dv);
+			(f & a_GC_DEL_FORCE ? " yet" : su_empty), nmin, a_server__gray_st_view_key(&gv));)
+		a_server__gray_st_view_set_data(&gv, d);
+		a_server__gray_wheel_add(gp, d);
+		a_server__gray_st_view_next(&gv);
 	}
+	if((sgp = a_GRAY_ST_NEXT(gp, sgp)) != NIL)
+		goto jround1;
 
 	/* If we are forced to give away more, we have to decide what "good" entries to delete */
 	if(!(f & a_GC_DEL_FORCE))
 		goto jdone;
-	ASSERT(c == su_cs_dict_count(&mp->m_gray));
+	ASSERT(c == a_server__gray_st_count(gp));
 	if(!(f & a_XLIMIT)){
 		if(c <= xlimit)
 			goto jdone;
@@ -2779,111 +8781,220 @@ jdel:
 			goto jgc2;
 	}
 
-	ASSERT(c >= c_88 && c >= c_75 && c >= c_50);
+	/* Pop the oldest wheel buckets of accepted entries (lingering ones included) until the target is reached;
+	 * otherwise delete until limit reached! */
 	f |= a_GC2_DEL_TIMEOUT;
-	if(c - c_88 <= xlimit)
-		t = t_88;
-	else if(c - c_75 <= xlimit)
-		t = t_75;
-	else if(c - c_50 <= xlimit)
-		t = t_50;
-	/* Otherwise delete until limit reached! */
-	else
-		t = 0;
+	t = a_server__gray_wheel_cutoff(&gp->g_wheel[1], c - xlimit + c_linger);
 
 jgc2:
-	c = su_cs_dict_count(&mp->m_gray);
+	c = a_server__gray_st_count(gp);
 	a_DBGM9E(su_log_write(su_LOG_DEBUG,
 		"gray DB main5ce, STILL (%u -> %u); "
-			"cnts=88/75/50=%u/%u/%u (del=%d); linger=%u (del=%d); "
-			"times=100/88/75/50=%hd/%hd/%hd/%hd=%hd; "
+			"linger=%u (del=%d); time=%hd/%hd (del=%d); "
 			"gray=%d (%u) gray-cnt-1=%d (%u)",
 		c, xlimit,
-		c_88, c_75, c_50, !!(f & a_GC2_DEL_TIMEOUT), c_linger, !!(f & a_GC2_DEL_LINGER),
-		pgp->pg_gc_timeout, t_88, t_75, t_50, t,
+		c_linger, !!(f & a_GC2_DEL_LINGER), pgp->pg_gc_timeout, t, !!(f & a_GC2_DEL_TIMEOUT),
 		!!(f & a_GC2_DEL_GRAY), c_gray, !!(f & a_GC2_DEL_GRAY_C1), c_gray_c1);)
-	for(su_cs_dict_view_begin(&dv); su_cs_dict_view_is_valid(&dv);){
+	sgp = gp;
+jround2:
+	for(a_server__gray_st_view_begin(a_server__gray_st_view(&gv, sgp)); a_server__gray_st_view_is_valid(&gv);){
 		s16 nmin;
 		up d;
 
-		d = R(up,su_cs_dict_view_data(&dv));
+		d = a_server__gray_st_view_data(&gv);
 		nmin = S(s16,d & U16_MAX);
 		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce/2: gray=%d nmin=%hd count=%d: %s",
-			!(d & 0x80000000), nmin, S(int,(d & 0x7FFF0000) >> 16), su_cs_dict_view_key(&dv));)
+			!(d & 0x80000000), nmin, S(int,(d & 0x7FFF0000) >> 16), a_server__gray_st_view_key(&gv));)
 		ASSERT(nmin <= 0);
 
 		if(LIKELY(d & 0x80000000)){
 			if(f & a_GC2_DEL_LINGER){
 				if(nmin == S16_MIN){
 					a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce del/TIME: lingers: %s",
-						su_cs_dict_view_key(&dv));)
+						a_server__gray_st_view_key(&gv));)
 					goto jdel2;
 				}
 			}
 			if(f & a_GC2_DEL_TIMEOUT){
 				if(-nmin >= t){
 					a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce del/TIME: min=%hd>%hd: %s",
-						nmin, t, su_cs_dict_view_key(&dv));)
+						nmin, t, a_server__gray_st_view_key(&gv));)
 					goto jdel2;
 				}
 			}
 		}else if(f & a_GC2_DEL_GRAY){
-			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce del/GRAY: %s", su_cs_dict_view_key(&dv));)
+			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce del/GRAY: %s", a_server__gray_st_view_key(&gv));)
 			goto jdel2;
 		}else if((f & a_GC2_DEL_GRAY_C1) && (d & 0x7FFF000u) == (1u << 16)){
 			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce del/GRAY: C=1: %s",
-				su_cs_dict_view_key(&dv));)
+				a_server__gray_st_view_key(&gv));)
 			goto jdel2;
 		}
 
-		su_cs_dict_view_next(&dv);
+		a_server__gray_st_view_next(&gv);
 		continue;
 jdel2:
 		f |= a_GC_DEL_ANY;
-		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce delete/2: %s", su_cs_dict_view_key(&dv));)
-		su_cs_dict_view_remove(&dv);
+		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce delete/2: %s", a_server__gray_st_view_key(&gv));)
+		a_server__gray_jnl_add(pgp, a_server__gray_st_view_key(&gv), 0, -1);
+		a_server__gray_wheel_del(gp, d);
+		a_server__gray_st_view_remove(&gv);
 		--c;
 
 		if(c <= xlimit)
 			goto jdone;
 	}
+	if((sgp = a_GRAY_ST_NEXT(gp, sgp)) != NIL)
+		goto jround2;
 
 jdone:
-	if(mp->m_cleanup_cnt < S16_MAX)
-		++mp->m_cleanup_cnt;
+	if(gp->g_cleanup_cnt < S16_MAX)
+		++gp->g_cleanup_cnt;
 
-	/* Do not balance when forced-deletion (a_XLIMIT) is on, client is waiting */
-	if((f & a_GC_DEL_ANY) && !(f & a_XLIMIT) && !only_time_tick &&
-			mp->m_cleanup_cnt >= pgp->pg_gc_rebalance && pgp->pg_gc_rebalance != 0){
-		su_cs_dict_add_flags(su_cs_dict_balance(&mp->m_gray), su_CS_DICT_FROZEN);
+	/* Removals in the old store invalidate the migration position, it starts over */
+	if(gp->g_rh != NIL && (f & a_GC_DEL_ANY))
+		gp->g_rh->rh_begun = FAL0;
+
+	/* Do not balance when forced-deletion (a_XLIMIT) is on, client is waiting; growth rebuilds anyway */
+	if((f & a_GC_DEL_ANY) && !(f & a_XLIMIT) && !only_time_tick && gp->g_rh == NIL &&
+			gp->g_cleanup_cnt >= pgp->pg_gc_rebalance && pgp->pg_gc_rebalance != 0){
+		a_server__gray_st_balance(gp);
 		a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce rebalance after %u: count=%u, new size=%u",
-			mp->m_cleanup_cnt, su_cs_dict_count(&mp->m_gray), su_cs_dict_size(&mp->m_gray));)
-		mp->m_cleanup_cnt = 0;
+			gp->g_cleanup_cnt, a_server__gray_st_count(gp), a_server__gray_st_size(gp));)
+		gp->g_cleanup_cnt = 0;
 		f |= a_GC_BALANCED;
 	}
 
+	a_server__hist_usec(&gp->g_hist_main5ce, &tsb);
+
 	if(a_DBGIF || (pgp->pg_flags & a_F_V)){
 		struct su_timespec ts2;
 
 		su_timespec_sub(su_timespec_current(&ts2), tsp_or_nil);
 		su_log_write(su_LOG_INFO,
 			_("gray DB main5ce forced=%d count=%u balanced=%d/%hu took %lu:%09lu seconds in %s"),
-			!!(f & a_GC_DEL_FORCE), su_cs_dict_count(&mp->m_gray), !!(f & a_GC_BALANCED), mp->m_cleanup_cnt,
+			!!(f & a_GC_DEL_FORCE), a_server__gray_st_count(gp), !!(f & a_GC_BALANCED), gp->g_cleanup_cnt,
 			S(ul,ts2.ts_sec), S(ul,ts2.ts_nano), pgp->pg_store_path);
 	}
 
 jleave:
+	a_server__gray_wheel_tick(gp);
+
 	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce leave epoch_min=%hd base_epoch=%lu epoch=%lu count=%u\n",
-		mp->m_epoch_min, mp->m_base_epoch, mp->m_epoch, su_cs_dict_count(&mp->m_gray));)
+		gp->g_epoch_min, gp->g_base_epoch, gp->g_epoch, a_server__gray_st_count(gp));)
+	NYD_OU;
+} /* }}} */
+
+static u32
+a_server__gray_limit(struct a_pg *pgp, struct a_gray const *gp, boole delay){
+	u64 m, x;
+	u32 rv, c;
+	struct a_master *mp;
+	NYD2_IN;
+
+	mp = pgp->pg_master;
+	rv = a_GRAY_SHARE(mp, (delay ? pgp->pg_limit_delay : pgp->pg_limit));
+
+	if((x = (delay ? pgp->pg_mem_limit_delay : pgp->pg_mem_limit)) != 0 &&
+			(c = a_server__gray_st_count(gp)) > 0){
+		x <<= 20;
+		x = a_GRAY_SHARE(mp, x);
+		m = a_server__gray_st_mem(gp) / c;
+		x /= MAX(m, 1);
+		x = MAX(x, 1);
+		if(rv == 0 || x < rv)
+			rv = S(u32,x);
+	}
+
+	NYD2_OU;
+	return rv;
+}
+
+static void
+a_server__gray_afterwork(struct a_pg *pgp){ /* {{{ */
+	struct a_gray *gp;
+	u32 i, j;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	for(i = 0; i < mp->m_gray_no; ++i){
+		gp = &mp->m_grays[i];
+#ifdef a_HAVE_MT
+		/* In use: next time */
+		if(pthread_mutex_trylock(&gp->g_mtx) != 0)
+			continue;
+#endif
+
+		/* Full DB cleanup once the time base has aged halfway to its limit, or daily when near --limit.
+		 * Expiry is otherwise done by sweeps, in bounded steps; need to recalculate */
+		ASSERT(gp->g_epoch_min == S(u16,(gp->g_epoch - gp->g_base_epoch) /
+				(su_state_has(su_STATE_REPRODUCIBLE) ? 1 : su_TIME_MIN_SECS)));
+		j = a_server__gray_limit(pgp, gp, FAL0);
+		j -= j >> 3;
+		if(S(u16,gp->g_epoch_min) >= (S16_MAX >> 1) ||
+				(S(u16,gp->g_epoch_min) >= su_TIME_DAY_MINS && /* xxx magic */
+				 a_server__gray_st_count(gp) >= j)){
+			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call by event loop, afterwork");)
+			a_server__gray_maintenance(pgp, gp, FAL0, 0, NIL);
+		}else{
+			if(a_server__gray_sweep_due(pgp, gp))
+				a_server__gray_sweep(pgp, gp);
+
+			/* --stats samples */
+			if(gp->g_epoch - gp->g_hist_epoch >= su_TIME_MIN_SECS){
+				gp->g_hist_epoch = gp->g_epoch;
+				a_server__hist_add(&gp->g_hist_count, a_server__gray_st_count(gp));
+				a_server__hist_add(&gp->g_hist_mem, a_server__gray_st_mem(gp));
+			}
+
+			a_server__gray_grow(pgp, gp, VAL_GRAY_REHASH_STEP);
+		}
+
+		a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+	}
+
+	/* Group commit of the journal records of this round; master performs checkpoints */
+	if(a_server__gray_jnl_sync(pgp) && mp->m_thr_no > 0){
+		a_MT( a_server__mt_wake(mp); )
+	}
+
+	if(mp->m_peer_no > 0)
+		a_server__peer_flush(pgp);
+
 	NYD_OU;
 } /* }}} */
 
+static void
+a_server__gray_grow(struct a_pg *pgp, struct a_gray *gp, u32 no){
+	NYD2_IN;
+
+	/* We may need to allow the store to grow; it is frozen all the time to move expensive growing out
+	 * of the way of waiting clients, and grows incrementally, a step per request and per round of
+	 * _afterwork().  Misuse MIN_LIMIT for that! */
+	if(gp->g_rh != NIL)
+		a_server__gray_st_rehash_step(gp, no);
+	else if(a_server__gray_st_count(gp) > gp->g_ograycnt){
+		gp->g_ograycnt = a_server__gray_st_count(gp) + a_GRAY_SHARE(pgp->pg_master, a_GRAY_MIN_LIMIT);
+		gp->g_cleanup_cnt = 0;
+		a_server__gray_st_grow(gp);
+	}
+
+	NYD2_OU;
+}
+
 static char
-a_server__gray_lookup(struct a_pg *pgp, char const *key){ /* {{{ */
-	struct su_cs_dict_view dv;
-	s16 min, xmin;
-	up d;
+a_server__gray_lookup(struct a_pg *pgp, char const *key, u32 khash){ /* {{{ */
+	struct a_gray_view gv;
+	u64 fp;
+	s32 xmin;
+	s16 min;
+	up d, od;
 	u16 cnt;
+	u32 lim;
+	boole peer;
+	struct a_gray *gp;
 	struct a_master *mp;
 	char rv;
 	NYD_IN;
@@ -2891,33 +9002,51 @@ a_server__gray_lookup(struct a_pg *pgp, char const *key){ /* {{{ */
 	rv = a_ANSWER_NODEFER;
 	mp = pgp->pg_master;
 	cnt = 0;
+	od = 0;
+
+	/* Fingerprints are calculated outside the lock and pick their shard themselves */
+	fp = 0;
+	gp = a_GRAY_IS_FP(&mp->m_grays[0]) ? a_server__gray_shard(pgp, key, &fp) : a_GRAY_SHARD_OF(mp, khash);
+	a_MT( pthread_mutex_lock(&gp->g_mtx); )
+
+	/* epoch housekeeping, incremental growth */
+	a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call by lookup");)
+	a_server__gray_maintenance(pgp, gp, TRU1, 0, NIL);
+	if(UNLIKELY(gp->g_rh != NIL))
+		a_server__gray_st_rehash_step(gp, VAL_GRAY_REHASH_STEP);
 
 	/* Key already known, .. or can be added? */
-	if(!su_cs_dict_view_find(su_cs_dict_view_setup(&dv, &mp->m_gray), key)){
+	if(!a_server__gray_st_view_find(a_server__gray_st_view(&gv, gp), key, fp)){
 		u32 i;
 
+		/* --gray-lazy-load: the entry may still come */
+		if(UNLIKELY(gp->g_lazy != a_GRAY_LAZY_NONE))
+			goto jlazy;
+
 jretry_nent:
-		i = su_cs_dict_count(&mp->m_gray);
-		rv = (pgp->pg_limit_delay != 0 && i >= pgp->pg_limit_delay) ? a_ANSWER_DEFER_SLEEP : a_ANSWER_DEFER;
+		i = a_server__gray_st_count(gp);
+		lim = a_server__gray_limit(pgp, gp, TRU1);
+		rv = (lim != 0 && i >= lim) ? a_ANSWER_DEFER_SLEEP : a_ANSWER_DEFER;
 
 		/* New entry may be disallowed */
-		if(i < pgp->pg_limit){
+		lim = a_server__gray_limit(pgp, gp, FAL0);
+		if(i < lim){
 			d = (pgp->pg_count == 0) ? 0x80000000u : 0;
 			goto jgray_set;
 		}
 
 		/* We ran against this wall, try a cleanup if allowed */
-		if(UCMP(16, mp->m_epoch_min, >=, a_DB_CLEANUP_MIN_DELAY_MINS)){
+		if(UCMP(16, gp->g_epoch_min, >=, a_DB_CLEANUP_MIN_DELAY_MINS)){
 			a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call by insert, limit excess");)
-			a_server__gray_maintenance(pgp, FAL0, (pgp->pg_limit - (pgp->pg_limit >> 3)), NIL);
+			a_server__gray_maintenance(pgp, gp, FAL0, (lim - (lim >> 3)), NIL);
 			goto jretry_nent;
 		}
 
 		if(!(pgp->pg_flags & a_F_MASTER_LIMIT_EXCESS_LOGGED)){
 			pgp->pg_flags |= a_F_MASTER_LIMIT_EXCESS_LOGGED;
 			/*if(pgp->pg_flags & a_F_V)*/
-				su_log_write(su_LOG_WARN, _("Reached --limit=%lu, excess not handled; "
-						"condition is logged once only"), S(ul,pgp->pg_limit));
+				su_log_write(su_LOG_WARN, _("Reached --limit=%lu (--memory-limit=%lu), excess not handled; "
+						"condition is logged once only"), S(ul,pgp->pg_limit), S(ul,pgp->pg_mem_limit));
 		}
 
 		/* XXX Make limit excess return configurable? REJECT?? */
@@ -2925,28 +9054,38 @@ jretry_nent:
 		goto jleave;
 	}
 
-	/* Key is known */
-	d = R(up,su_cs_dict_view_data(&dv));
+	/* Key is known; (a journal may still update it) */
+	if(UNLIKELY(gp->g_lazy == a_GRAY_LAZY_JNL))
+		goto jlazy;
+	od = d = a_server__gray_st_view_data(&gv);
+	min = S(s16,d & U16_MAX);
+	ASSERT(min != S16_MAX);
+	xmin = gp->g_epoch_min - min;
+	ASSERT(xmin >= 0); /* (- - = +) */
 
-	/* If yet accepted, update it quick */
+	/* If yet accepted, update it quick -- unless it timed out, but no sweep saw that yet */
 	if(d & 0x80000000u){
-		a_DBG(su_log_write(su_LOG_DEBUG, "gray up quick accepted: %s", key);)
-		ASSERT(rv == a_ANSWER_NODEFER);
+		if(!(pgp->pg_flags & a_F_GC_LINGER) && (min == S16_MIN || xmin >= pgp->pg_gc_timeout)){
+			a_DBG(su_log_write(su_LOG_DEBUG, "gray accepted timed out: %s", key);)
+			d = (pgp->pg_count == 0) ? 0x80000000u : 0;
+			if(pgp->pg_count != 0)
+				rv = a_ANSWER_DEFER;
+			++pgp->pg_cnt->c_gray_new;
+		}else{
+			a_DBG(su_log_write(su_LOG_DEBUG, "gray up quick accepted: %s", key);)
+			ASSERT(rv == a_ANSWER_NODEFER);
+		}
 		ASSERT(cnt == 0);
 		goto jgray_set;
 	}
 
-	min = S(s16,d & U16_MAX);
-	ASSERT(min != S16_MAX);
 	cnt = S(u16,(d >> 16) & S16_MAX) + 1;
-	xmin = mp->m_epoch_min - min;
-	ASSERT(xmin >= 0); /* (- - = +) */
 
 	/* Totally ignore it if not enough time passed */
 	ASSERT(S(uz,pgp->pg_delay_min) * cnt < pgp->pg_delay_max); /* conf_finish() asserted */
 	if(xmin < pgp->pg_delay_min * (pgp->pg_flags & a_F_DELAY_PROGRESSIVE ? cnt : 1)){
 		a_DBG(su_log_write(su_LOG_DEBUG, "gray too soon: %s (%lu,%lu,%lu)",
-			key, S(ul,min), S(ul,mp->m_epoch_min), S(ul,xmin));)
+			key, S(ul,min), S(ul,gp->g_epoch_min), S(ul,xmin));)
 		--cnt; /* (Logging) */
 		rv = a_ANSWER_DEFER;
 		goto jleave;
@@ -2955,7 +9094,7 @@ jretry_nent:
 	/* If too much time passed, reset: this is a new thing! */
 	if(xmin > pgp->pg_delay_max){
 		a_DBG(su_log_write(su_LOG_DEBUG, "gray too late: %s (%lu,%lu,%lu)",
-			key, S(ul,min), S(ul,mp->m_epoch_min), S(ul,xmin));)
+			key, S(ul,min), S(ul,gp->g_epoch_min), S(ul,xmin));)
 		rv = a_ANSWER_DEFER;
 		cnt = 0;
 	}
@@ -2971,61 +9110,612 @@ jretry_nent:
 	}
 
 jgray_set:
-	d = (d & 0x80000000u) | (S(up,cnt) << 16) | S(u16,mp->m_epoch_min);
-	if(su_cs_dict_view_is_valid(&dv))
-		su_cs_dict_view_set_data(&dv, R(void*,d));
-	else{
+	d = (d & 0x80000000u) | (S(up,cnt) << 16) | S(u16,gp->g_epoch_min);
+#ifdef a_HAVE_GRAY_SHM
+	if(pgp->pg_shm != NIL && (d & 0x80000000u) && rv == a_ANSWER_NODEFER)
+		a_server__gray_shm_put(pgp, key, pgp->pg_key_len, gp->g_epoch);
+#endif
+	/* Peers see new entries and state changes, and entries in use again with each half --gc-timeout period
+	 * of wheel minutes (so that theirs do not expire); only what we stored ourselves */
+	peer = FAL0;
+	if(mp->m_peer_no > 0){
+		lim = MAX(1, pgp->pg_gc_timeout >> 1);
+		peer = (!a_server__gray_st_view_is_valid(&gv) || ((d ^ od) & 0xFFFF0000u) ||
+				(gp->g_wheel_base + gp->g_epoch_min) / lim != (gp->g_wheel_base + S(s16,od & U16_MAX)) / lim);
+	}
+	if(a_server__gray_st_view_is_valid(&gv)){
+		a_server__gray_st_view_set_data(&gv, d);
+		a_server__gray_wheel_del(gp, od);
+		a_server__gray_wheel_add(gp, d);
+		a_server__gray_jnl_add(pgp, key, d, gp->g_epoch);
+	}else{
 		u32 i;
 
-		++mp->m_cnt_gray_new;
+		++pgp->pg_cnt->c_gray_new;
 		a_DBG(su_log_write(su_LOG_DEBUG, "gray new entry: %s", key);)
 		ASSERT(rv != a_ANSWER_NODEFER);
 
 		/* Need to handle memory failures */
-		for(i = 0; su_cs_dict_insert(&mp->m_gray, key, R(void*,d)) > su_ERR_NONE; ++i){
+		for(i = 0; a_server__gray_st_insert(gp, key, fp, d) > su_ERR_NONE; ++i){
 			a_DBG(su_log_write(su_LOG_DEBUG, "out of OS memory resources, waiting a bit");)
 			su_time_msleep(250, TRU1);
 
 			/* We ran against this wall, try a cleanup if allowed */
-			if(UCMP(16, mp->m_epoch_min, >=, a_DB_CLEANUP_MIN_DELAY_MINS)){
+			if(UCMP(16, gp->g_epoch_min, >=, a_DB_CLEANUP_MIN_DELAY_MINS)){
 				a_DBG(su_log_write(su_LOG_DEBUG, "out of OS memory resources, trying gray DB cleanup");)
-				i = su_cs_dict_count(&mp->m_gray);
+				i = a_server__gray_st_count(gp);
 				i = i - (i >> 2); /* xxx config?? */
 				a_DBGM9E(su_log_write(su_LOG_DEBUG, "gray DB main5ce: call by insert, enomem");)
-				a_server__gray_maintenance(pgp, FAL0, i, NIL);
+				a_server__gray_maintenance(pgp, gp, FAL0, i, NIL);
+			}
+
+			if(!(pgp->pg_flags & a_F_MASTER_NOMEM_LOGGED)){
+				pgp->pg_flags |= a_F_MASTER_NOMEM_LOGGED;
+				/*if(pgp->pg_flags & a_F_V)*/
+					su_log_write(su_LOG_WARN,
+						_("out-of-memory, --limit or --memory-limit too high (logged once only)?"));
+			}
+
+			if(i == 3){
+				/* XXX Make limit excess return configurable? REJECT?? */
+				rv = a_ANSWER_NODEFER;
+				break;
+			}
+		}
+		if(i != 3){
+			a_server__gray_wheel_add(gp, d);
+			a_server__gray_jnl_add(pgp, key, d, gp->g_epoch);
+		}else
+			peer = FAL0;
+
+		if(pgp->pg_count == 0)
+			rv = a_ANSWER_NODEFER;
+	}
+	if(peer)
+		a_server__peer_add(pgp, key, d, gp->g_epoch);
+
+	if(0){
+jlazy:
+		rv = (pgp->pg_flags & a_F_GRAY_LAZY_PASS) ? a_ANSWER_NODEFER : a_ANSWER_DEFER;
+		a_DBG(su_log_write(su_LOG_DEBUG, "gray DB still loading: %s", key);)
+	}
+
+jleave:
+	a_MT( pthread_mutex_unlock(&gp->g_mtx); )
+
+	if(rv != a_ANSWER_NODEFER)
+		++pgp->pg_cnt->c_gray_defer;
+	else
+		++pgp->pg_cnt->c_gray_pass;
+	if(pgp->pg_flags & a_F_V)
+		su_log_write(su_LOG_INFO, "### gray (defer=%d [and count=%lu]): %s",
+			(rv != a_ANSWER_NODEFER), S(ul,cnt), key);
+
+	NYD_OU;
+	return rv;
+} /* }}} */
+/* }}} */
+/* }}} */
+
+#if VAL_GRAY_BENCH /* gray bench {{{ */
+static s32
+a_bench(struct a_pg *pgp, u32 argc, char const *const *argv){
+	static char const *const a_entries[] = {"242000", "1000000", "10000000", NIL};
+
+	struct su_pathinfo pi;
+	struct a_master m;
+	u32 entries;
+	s32 rv;
+	NYD_IN;
+
+	/* Keys and timings shall not depend on the environment; note: "minutes" are seconds */
+	su_state_set(su_STATE_REPRODUCIBLE);
+
+	STRUCT_ZERO(struct a_master, &m);
+	m.m_jnl.gj_fd = -1;
+	m.m_polfd = -1;
+	m.m_gray_no = MAX(1, pgp->pg_server_threads);
+	pgp->pg_master = &m;
+	pgp->pg_cnt = &m.m_cnt;
+
+	/* Never clobber a gray DB in use */
+	if(!su_path_chdir(pgp->pg_store_path)){
+		su_log_write(su_LOG_CRIT, _("cannot change directory to %s: %s"),
+			pgp->pg_store_path, V_(su_err_doc(-1)));
+		rv = su_EX_NOINPUT;
+		goto jleave;
+	}
+	if(su_pathinfo_lstat(&pi, a_GRAY_DB_NAME) || su_pathinfo_lstat(&pi, a_GRAY_JNL_NAME) ||
+			su_pathinfo_lstat(&pi, a_REA_NAME)){
+		su_log_write(su_LOG_CRIT, _("will not benchmark in %s: gray DB, journal or server exist"),
+			pgp->pg_store_path);
+		rv = su_EX_CANTCREAT;
+		goto jleave;
+	}
+
+	/* Entries must not hit limits, and no --limit-delay */
+	pgp->pg_limit = S32_MAX;
+	pgp->pg_limit_delay = 0;
+	pgp->pg_mem_limit = pgp->pg_mem_limit_delay = 0;
+
+	fprintf(stdout, "store=%s\nshards=%lu\nformat=%s\nrehash_step=%lu\n",
+		((pgp->pg_flags & a_F_GRAY_FPRINT) ? "fingerprint" : "dict"), S(ul,m.m_gray_no),
+		(a_GRAY_SAVE_TEXT(pgp) ? "text" : "binary"), S(ul,VAL_GRAY_REHASH_STEP));
+
+	for(rv = su_EX_OK, argv = (argc > 0) ? argv : a_entries; *argv != NIL; ++argv){
+		if((su_idec_u32(&entries, *argv, UZ_MAX, 10, NIL) & (su_IDEC_STATE_EMASK | su_IDEC_STATE_CONSUMED)
+				) != su_IDEC_STATE_CONSUMED || entries == 0 || entries > S32_MAX){
+			fprintf(stderr, _("Invalid entry count: %s\n"), *argv);
+			rv = su_EX_USAGE;
+			break;
+		}
+		if((rv = a_bench__run(pgp, entries)) != su_EX_OK)
+			break;
+		if(argc > 0 && --argc == 0)
+			break;
+	}
+
+jleave:
+	pgp->pg_master = NIL;
+	pgp->pg_cnt = NIL;
+
+	NYD_OU;
+	return rv;
+}
+
+static s32
+a_bench__run(struct a_pg *pgp, u32 entries){ /* {{{ */
+	struct a_gray_view gv;
+	struct su_timespec ts;
+	u64 x;
+	u32 i, cnt;
+	struct a_gray *gp;
+	struct a_master *mp;
+	s32 rv;
+	char key[a_BUF_SIZE];
+	NYD_IN;
+
+	rv = su_EX_OK;
+	mp = pgp->pg_master;
+
+	a_bench__create(pgp);
+
+	/* New keys, as with the first delivery attempt; the event loop (and thus growth) runs once per batch */
+	su_timespec_current(&ts);
+	for(i = 0; i < entries; ++i){
+		a_bench__key(key, 'r', i);
+		a_server__gray_lookup(pgp, key, a_GRAY_KEY_HASH(key));
+		if((i & (a_EV_BATCH - 1)) == a_EV_BATCH - 1)
+			a_server__gray_afterwork(pgp);
+	}
+	a_bench__out("insert", entries, entries, &ts);
+
+	for(x = 0, cnt = 0, i = 0; i < mp->m_gray_no; ++i){
+		cnt += a_server__gray_st_count(&mp->m_grays[i]);
+		x += a_server__gray_st_mem(&mp->m_grays[i]);
+	}
+	fprintf(stdout, "entries=%lu count=%lu mem=%" PRIu64 " mem_per_entry=%" PRIu64 "\n",
+		S(ul,entries), S(ul,cnt), x, x / MAX(1, cnt));
+
+	/* Retries */
+	su_timespec_current(&ts);
+	for(i = 0; i < entries; ++i){
+		a_bench__key(key, 'r', i);
+		a_server__gray_lookup(pgp, key, a_GRAY_KEY_HASH(key));
+		if((i & (a_EV_BATCH - 1)) == a_EV_BATCH - 1)
+			a_server__gray_afterwork(pgp);
+	}
+	a_bench__out("lookup_hit", entries, entries, &ts);
+
+	/* Unknown keys, store lookup only (a request would insert them) */
+	su_timespec_current(&ts);
+	for(cnt = 0, i = 0; i < entries; ++i){
+		u64 fp;
+
+		a_bench__key(key, 'm', i);
+		fp = 0;
+		gp = a_GRAY_IS_FP(&mp->m_grays[0]) ? a_server__gray_shard(pgp, key, &fp)
+				: a_GRAY_SHARD_OF(mp, a_GRAY_KEY_HASH(key));
+		if(a_server__gray_st_view_find(a_server__gray_st_view(&gv, gp), key, fp))
+			++cnt;
+	}
+	a_bench__out("lookup_miss", entries, entries, &ts);
+	if(cnt > 0)
+		fprintf(stderr, _("entries=%lu: %lu unknown keys were found (fingerprint collisions?)\n"),
+			S(ul,entries), S(ul,cnt));
+
+	for(cnt = 0, i = 0; i < mp->m_gray_no; ++i)
+		cnt += a_server__gray_st_count(&mp->m_grays[i]);
+
+	su_timespec_current(&ts);
+	if(!a_server__gray_save(pgp, FAL0)){
+		rv = su_EX_IOERR;
+		goto jleave;
+	}
+	a_bench__out("save", entries, cnt, &ts);
+
+	a_bench__gut(pgp);
+	su_timespec_current(&ts);
+	a_bench__create(pgp);
+	a_bench__out("load", entries, cnt, &ts);
+
+	for(x = 0, i = 0; i < mp->m_gray_no; ++i)
+		x += a_server__gray_st_count(&mp->m_grays[i]);
+	if(x != cnt){
+		fprintf(stderr, _("entries=%lu: saved %lu, but loaded %lu entries\n"), S(ul,entries), S(ul,cnt), S(ul,x));
+		rv = su_EX_SOFTWARE;
+		goto jleave;
+	}
+
+	/* Full maintenance pass without deletions, then one evicting least recently used half */
+	su_timespec_current(&ts);
+	for(i = 0; i < mp->m_gray_no; ++i)
+		a_server__gray_maintenance(pgp, &mp->m_grays[i], FAL0, 0, NIL);
+	a_bench__out("main5ce", entries, cnt, &ts);
+
+	su_timespec_current(&ts);
+	for(i = 0; i < mp->m_gray_no; ++i){
+		gp = &mp->m_grays[i];
+		a_server__gray_maintenance(pgp, gp, FAL0, a_server__gray_st_count(gp) >> 1, NIL);
+	}
+	for(x = 0, i = 0; i < mp->m_gray_no; ++i)
+		x += a_server__gray_st_count(&mp->m_grays[i]);
+	a_bench__out("expire", entries, S(u32,cnt - x), &ts);
+
+jleave:
+	a_bench__gut(pgp);
+	if(!su_path_rm(a_GRAY_DB_NAME) && su_err() != su_ERR_NOENT)
+		su_log_write(su_LOG_ERR, _("cannot remove %s/%s: %s"),
+			pgp->pg_store_path, a_GRAY_DB_NAME, V_(su_err_doc(-1)));
+
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static void
+a_bench__create(struct a_pg *pgp){
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	a_server__gray_create(pgp);
+
+	/* Journal I/O is not of interest */
+	if(mp->m_jnl.gj_fd >= 0){
+		close(mp->m_jnl.gj_fd);
+		mp->m_jnl.gj_fd = -1;
+		su_path_rm(a_GRAY_JNL_NAME);
+	}
+
+	NYD_OU;
+}
+
+static void
+a_bench__gut(struct a_pg *pgp){
+	u32 i;
+	struct a_master *mp;
+	NYD_IN;
+
+	mp = pgp->pg_master;
+
+	if(mp->m_grays != NIL){
+		for(i = 0; i < mp->m_gray_no; ++i){
+			a_server__gray_st_gut(&mp->m_grays[i]);
+			a_MT( pthread_mutex_destroy(&mp->m_grays[i].g_mtx); )
+		}
+		su_FREE(mp->m_grays);
+		mp->m_grays = NIL;
+	}
+
+	if(mp->m_jnl.gj_buf != NIL){
+		su_FREE(mp->m_jnl.gj_buf);
+		a_MT( pthread_mutex_destroy(&mp->m_jnl.gj_mtx); )
+	}
+	STRUCT_ZERO(struct a_gray_jnl, &mp->m_jnl);
+	mp->m_jnl.gj_fd = -1;
+
+	NYD_OU;
+}
+
+static void
+a_bench__key(char key[a_BUF_SIZE], char pre, u32 no){
+	static char const a_sfx[] = "@bench.invalid/sender@bench.invalid/192.0.2.0";
+
+	char *cp, *xcp;
+	uz i;
+	char ibuf[su_IENC_BUFFER_SIZE];
+	NYD2_IN;
+
+	cp = key;
+	*cp++ = pre;
+	xcp = su_ienc_u32(ibuf, no, 10);
+	i = su_cs_len(xcp);
+	su_mem_copy(cp, xcp, i);
+	cp += i;
+	su_mem_copy(cp, a_sfx, sizeof(a_sfx));
+
+	NYD2_OU;
+}
+
+static void
+a_bench__out(char const *op, u32 entries, u32 ops, struct su_timespec const *tsp){
+	struct su_timespec ts;
+	u64 ns;
+	NYD2_IN;
+
+	su_timespec_sub(su_timespec_current(&ts), tsp);
+	ns = (ts.ts_sec < 0) ? 0 : S(u64,ts.ts_sec) * su_TIMESPEC_SEC_MILLIS * 1000000u + S(u64,ts.ts_nano);
+
+	fprintf(stdout, "entries=%lu op=%s ops=%lu nsec=%" PRIu64 " nsec_per_op=%" PRIu64 "\n",
+		S(ul,entries), op, S(ul,ops), ns, ns / MAX(1, ops));
+
+	NYD2_OU;
+}
+#endif /* VAL_GRAY_BENCH }}} */
+
+/* compile {{{ */
+static s32
+a_compile(struct a_pg *pgp){ /* {{{ */
+	struct su_avopt avo;
+	u32 ca[2], ca_mask[2], srch[2][a_SRCH_TYPE__MAX], dom, i, j;
+	struct a_lim_hdr *lhp;
+	struct a_compile c;
+	struct a_master m;
+	char *tmp;
+	s32 rv, fd;
+	NYD_IN;
+
+	STRUCT_ZERO(struct a_master, &m);
+	m.m_jnl.gj_fd = -1;
+	m.m_polfd = m.m_peer_fd = -1;
+	pgp->pg_master = &m;
+	pgp->pg_cnt = &m.m_cnt;
+	su_cs_dict_create(&m.m_white.wb_ca, a_WB_CA_FLAGS, NIL);
+	su_cs_dict_create(&m.m_black.wb_ca, a_WB_CA_FLAGS, NIL);
+	c.c_buf = tmp = NIL;
+	c.c_len = c.c_size = 0;
+
+	/* Paths are relative to --store-path, as for the server */
+	if(!su_path_chdir(pgp->pg_store_path)){
+		su_log_write(su_LOG_CRIT, _("cannot change directory to %s: %s"),
+			pgp->pg_store_path, V_(su_err_doc(-1)));
+		rv = su_EX_NOINPUT;
+		goto jleave;
+	}
+
+	/* Like __wb_setup() */
+	su_cs_dict_add_flags(&m.m_white.wb_ca, su_CS_DICT_FROZEN);
+	su_cs_dict_add_flags(&m.m_black.wb_ca, su_CS_DICT_FROZEN);
+
+	pgp->pg_flags |= a_F_MASTER_IN_SETUP;
+	su_avopt_setup(&avo, pgp->pg_argc, C(char const*const*,pgp->pg_argv), a_sopts, a_lopts);
+	while((rv = su_avopt_parse(&avo)) != su_AVOPT_STATE_DONE){
+		switch(rv){
+		a_AVOPT_CASES
+			if((rv = a_conf_arg(pgp, rv, avo.avo_current_arg, a_AVO_FULL | a_AVO_RELOAD)) < 0){
+				rv = -rv;
+				goto jleave;
 			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	su_cs_dict_balance(&m.m_white.wb_ca);
+	su_cs_dict_balance(&m.m_black.wb_ca);
+
+	/* Header is filled in last, the buffer moves */
+	a_compile__put(&c, sizeof(*lhp));
+	for(i = 0; i < 2; ++i){
+		struct a_wb *wbp;
+
+		wbp = (i == 0) ? &m.m_white : &m.m_black;
+		ca[i] = a_compile__ca(&c, &wbp->wb_ca, &ca_mask[i]);
+		for(j = 0; j < a_SRCH_TYPE__MAX; ++j)
+			srch[i][j] = a_compile__srch(&c, wbp->wb_srch[j]);
+	}
+	dom = a_compile__dom(&c, m.m_dom);
+	a_compile__put(&c, 1);
+
+	if(c.c_len > S(u32,S32_MAX)){
+		su_log_write(su_LOG_CRIT, _("--compile-lists: image too large: %s"), pgp->pg_compile);
+		rv = su_EX_DATAERR;
+		goto jleave;
+	}
+
+	lhp = R(struct a_lim_hdr*,c.c_buf);
+	su_mem_copy(lhp->lh_magic, a_LIM_MAGIC, sizeof(a_LIM_MAGIC));
+	lhp->lh_bom = a_GRAY_BIN_BOM;
+	lhp->lh_version = a_LIM_VERSION;
+	lhp->lh_size = S(u32,c.c_len);
+	lhp->lh_4_mask = pgp->pg_4_mask;
+	lhp->lh_6_mask = pgp->pg_6_mask;
+	lhp->lh_dom = dom;
+	lhp->lh_dom_no = S(u32,m.m_dom_no);
+	for(i = 0; i < 2; ++i){
+		struct a_lim_wb *lwp;
+		struct a_wb *wbp;
+
+		wbp = (i == 0) ? &m.m_white : &m.m_black;
+		lwp = &lhp->lh_wb[i];
+		lwp->lw_ca = ca[i];
+		lwp->lw_ca_mask = ca_mask[i];
+		lwp->lw_ca_no = S(u32,su_cs_dict_count(&wbp->wb_ca));
+		for(j = 0; j < a_SRCH_TYPE__MAX; ++j)
+			lwp->lw_srch[j] = srch[i][j];
+		lwp->lw_srch_no = S(u32,wbp->wb_srch_cnt);
+		lwp->lw_cname_no = S(u32,wbp->wb_cname_cnt);
+	}
+
+	/* A running server maps the old or the new image, never a partial one */
+	i = S(u32,su_cs_len(pgp->pg_compile));
+	tmp = su_TALLOC(char, i + sizeof(a_LIM_TMP_SUF));
+	su_mem_copy(tmp, pgp->pg_compile, i);
+	su_mem_copy(&tmp[i], a_LIM_TMP_SUF, sizeof(a_LIM_TMP_SUF));
+
+	while((fd = open(tmp, (O_WRONLY | O_CREAT | O_TRUNC | a_O_NOFOLLOW | a_O_NOCTTY),
+			S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1){
+		if((rv = su_err_by_errno()) == su_ERR_INTR)
+			continue;
+		if(a_misc_os_resource_delay(rv))
+			continue;
+		su_log_write(su_LOG_CRIT, _("--compile-lists: cannot create %s: %s"), tmp, V_(su_err_doc(rv)));
+		rv = su_EX_CANTCREAT;
+		goto jleave;
+	}
+
+	rv = (a_misc_write_all(fd, c.c_buf, c.c_len) && fsync(fd) != -1) ? su_ERR_NONE : su_err_by_errno();
+	close(fd);
+	if(rv == su_ERR_NONE && rename(tmp, pgp->pg_compile) == -1)
+		rv = su_err_by_errno();
+
+	if(rv != su_ERR_NONE){
+		su_path_rm(tmp);
+		su_log_write(su_LOG_CRIT, _("--compile-lists: cannot write %s: %s"), pgp->pg_compile, V_(su_err_doc(rv)));
+		rv = su_EX_IOERR;
+		goto jleave;
+	}
+
+	if(pgp->pg_flags & a_F_V)
+		su_log_write(su_LOG_INFO, _("--compile-lists: %s: %lu bytes; white: CA %lu / %lu, CNAME %lu; "
+				"black: CA %lu / %lu, CNAME %lu; %lu domain nodes"),
+			pgp->pg_compile, S(ul,lhp->lh_size),
+			S(ul,lhp->lh_wb[0].lw_ca_no), S(ul,lhp->lh_wb[0].lw_srch_no), S(ul,lhp->lh_wb[0].lw_cname_no),
+			S(ul,lhp->lh_wb[1].lw_ca_no), S(ul,lhp->lh_wb[1].lw_srch_no), S(ul,lhp->lh_wb[1].lw_cname_no),
+			S(ul,lhp->lh_dom_no));
+	rv = su_EX_OK;
+
+jleave:
+	pgp->pg_flags &= ~S(uz,a_F_MASTER_IN_SETUP);
+
+	if(tmp != NIL)
+		su_FREE(tmp);
+	if(c.c_buf != NIL)
+		su_FREE(c.c_buf);
+
+	a_server__wb_reset(&m);
+	su_cs_dict_gut(&m.m_black.wb_ca);
+	su_cs_dict_gut(&m.m_white.wb_ca);
+	a_sandbox_path_reset(pgp, TRU1);
+
+	pgp->pg_master = NIL;
+	pgp->pg_cnt = NIL;
+
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static uz
+a_compile__put(struct a_compile *cp, uz len){
+	uz rv;
+	NYD2_IN;
+
+	len = (len + 3) & ~S(uz,3);
+	rv = cp->c_len;
+
+	if(cp->c_size - rv < len){
+		cp->c_size = MAX(cp->c_size << 1, rv + len + su_PAGE_SIZE);
+		cp->c_buf = su_TREALLOC(char, cp->c_buf, cp->c_size);
+	}
+
+	su_mem_set(&cp->c_buf[rv], 0, len);
+	cp->c_len = rv + len;
+
+	NYD2_OU;
+	return rv;
+}
+
+static u32
+a_compile__ca(struct a_compile *cp, struct su_cs_dict *dictp, u32 *maskp){
+	struct su_cs_dict_view dv;
+	char const *key;
+	uz rv, o, l;
+	u32 m, i;
+	NYD2_IN;
+
+	rv = 0;
+	*maskp = 0;
+
+	/* At most half full */
+	if((i = su_cs_dict_count(dictp)) > 0){
+		for(m = 2; m >> 1 < i; m <<= 1){
+		}
+		rv = a_compile__put(cp, S(uz,m) << 2);
+		*maskp = --m;
+
+		su_CS_DICT_FOREACH(dictp, &dv){
+			key = su_cs_dict_view_key(&dv);
+			l = su_cs_len(key);
+			o = a_compile__put(cp, l + 1);
+			su_mem_copy(&cp->c_buf[o], key, l);
+
+			for(i = a_misc_cksum(a_MISC_CKSUM_INIT, key, l) & m;; i = (i + 1) & m)
+				if(R(u32*,&cp->c_buf[rv])[i] == 0){
+					R(u32*,&cp->c_buf[rv])[i] = S(u32,o);
+					break;
+				}
+		}
+	}
+
+	NYD2_OU;
+	return S(u32,rv);
+}
+
+static u32
+a_compile__srch(struct a_compile *cp, struct a_srch const *sp){
+	struct a_lim_srch *lsp;
+	u32 k0, k1;
+	uz rv;
+	NYD2_IN;
 
-			if(!(pgp->pg_flags & a_F_MASTER_NOMEM_LOGGED)){
-				pgp->pg_flags |= a_F_MASTER_NOMEM_LOGGED;
-				/*if(pgp->pg_flags & a_F_V)*/
-					su_log_write(su_LOG_WARN,
-						_("out-of-memory, --limit too high (logged once only)?"));
-			}
+	rv = 0;
 
-			if(i == 3){
-				/* XXX Make limit excess return configurable? REJECT?? */
-				rv = a_ANSWER_NODEFER;
-				break;
-			}
-		}
+	if(sp != NIL){
+		rv = a_compile__put(cp, sizeof(*lsp));
+		k0 = a_compile__srch(cp, sp->s_kid[0]);
+		k1 = a_compile__srch(cp, sp->s_kid[1]);
 
-		if(pgp->pg_count == 0)
-			rv = a_ANSWER_NODEFER;
+		lsp = R(struct a_lim_srch*,&cp->c_buf[rv]);
+		lsp->ls_kid[0] = k0;
+		lsp->ls_kid[1] = k1;
+		lsp->ls_plen = sp->s_plen;
+		lsp->ls_term = (sp->s_term != FAL0);
+		su_mem_copy(lsp->ls_key, sp->s_key, sizeof(lsp->ls_key));
 	}
 
-jleave:
-	if(rv != a_ANSWER_NODEFER)
-		++mp->m_cnt_gray_defer;
-	else
-		++mp->m_cnt_gray_pass;
-	if(pgp->pg_flags & a_F_V)
-		su_log_write(su_LOG_INFO, "### gray (defer=%d [and count=%lu]): %s",
-			(rv != a_ANSWER_NODEFER), S(ul,cnt), key);
+	NYD2_OU;
+	return S(u32,rv);
+}
 
-	NYD_OU;
-	return rv;
-} /* }}} */
-/* }}} */
+static u32
+a_compile__dom(struct a_compile *cp, struct a_dom const *dp){
+	struct a_lim_dom *ldp;
+	u32 kid;
+	uz rv, o, po;
+	NYD2_IN;
+
+	/* Siblings iteratively, children recursively (depth is bound by name length) */
+	for(rv = po = 0; dp != NIL; po = o, dp = dp->d_sib){
+		o = a_compile__put(cp, su_VSTRUCT_SIZEOF(struct a_lim_dom,ld_edge) + dp->d_len);
+		if(po != 0)
+			R(struct a_lim_dom*,&cp->c_buf[po])->ld_sib = S(u32,o);
+		else
+			rv = o;
+
+		kid = a_compile__dom(cp, dp->d_kid);
+
+		ldp = R(struct a_lim_dom*,&cp->c_buf[o]);
+		ldp->ld_kid = kid;
+		ldp->ld_len = dp->d_len;
+		ldp->ld_flags = dp->d_flags;
+		su_mem_copy(ldp->ld_edge, dp->d_edge, dp->d_len);
+	}
+
+	NYD2_OU;
+	return S(u32,rv);
+}
 /* }}} */
 
 /* conf {{{ */
@@ -3050,6 +9740,9 @@ a_conf_setup(struct a_pg *pgp, BITENUM(u32,a_avo_flags) f){
 	pgp->pg_gc_timeout = U16_MAX;
 	LCTAV(VAL_SERVER_TIMEOUT <= S16_MAX);
 	pgp->pg_server_timeout = U16_MAX;
+	pgp->pg_client_cache = U16_MAX;
+	LCTAV(a_GRAY_SHM_TIME <= S16_MAX);
+	pgp->pg_gray_shared_time = U16_MAX;
 
 	LCTAV(VAL_COUNT <= S32_MAX);
 	pgp->pg_count = U32_MAX;
@@ -3057,13 +9750,23 @@ a_conf_setup(struct a_pg *pgp, BITENUM(u32,a_avo_flags) f){
 	pgp->pg_limit = U32_MAX;
 	LCTAV(VAL_LIMIT_DELAY <= S32_MAX);
 	pgp->pg_limit_delay = U32_MAX;
+	LCTAV(a_LIMIT_DELAY_MSECS <= S32_MAX);
+	pgp->pg_limit_delay_time = pgp->pg_limit_delay_time_max = U32_MAX;
+	pgp->pg_mem_limit = pgp->pg_mem_limit_delay = U32_MAX;
 
 	if(!(f & a_AVO_RELOAD)){
 		LCTAV(VAL_SERVER_QUEUE <= S32_MAX);
 		pgp->pg_server_queue = U32_MAX;
+		LCTAV(VAL_SERVER_THREADS <= S16_MAX);
+		pgp->pg_server_threads = U16_MAX;
 
 		pgp->pg_msg_allow = pgp->pg_msg_block = pgp->pg_msg_defer = NIL;
 		pgp->pg_store_path = NIL;
+		pgp->pg_policy_listen = NIL;
+		pgp->pg_peer_listen = NIL;
+		pgp->pg_peer_key = NIL;
+		pgp->pg_peers = NIL;
+		pgp->pg_peer_no = 0;
 	}
 
 	NYD2_OU;
@@ -3088,6 +9791,10 @@ a_conf_finish(struct a_pg *pgp, BITENUM(u32,a_avo_flags) f){
 		pgp->pg_gc_timeout = VAL_GC_TIMEOUT;
 	if(pgp->pg_server_timeout == U16_MAX)
 		pgp->pg_server_timeout = VAL_SERVER_TIMEOUT;
+	if(pgp->pg_client_cache == U16_MAX)
+		pgp->pg_client_cache = 0;
+	if(pgp->pg_gray_shared_time == U16_MAX)
+		pgp->pg_gray_shared_time = a_GRAY_SHM_TIME;
 
 	if(pgp->pg_count == U32_MAX)
 		pgp->pg_count = VAL_COUNT;
@@ -3095,12 +9802,23 @@ a_conf_finish(struct a_pg *pgp, BITENUM(u32,a_avo_flags) f){
 		pgp->pg_limit = VAL_LIMIT;
 	if(pgp->pg_limit_delay == U32_MAX)
 		pgp->pg_limit_delay = VAL_LIMIT_DELAY;
+	if(pgp->pg_limit_delay_time == U32_MAX)
+		pgp->pg_limit_delay_time = a_LIMIT_DELAY_MSECS;
+	if(pgp->pg_limit_delay_time_max == U32_MAX)
+		pgp->pg_limit_delay_time_max = pgp->pg_limit_delay_time;
+	if(pgp->pg_mem_limit == U32_MAX)
+		pgp->pg_mem_limit = 0;
+	if(pgp->pg_mem_limit_delay == U32_MAX)
+		pgp->pg_mem_limit_delay = 0;
 
 	if(!(f & a_AVO_RELOAD)){
 		if(pgp->pg_server_queue == U32_MAX)
 			pgp->pg_server_queue = VAL_SERVER_QUEUE;
 		/* Note: sandbox__rlimit() builds upon _this_ maximum! */
-		pgp->pg_server_queue = MIN(S32_MAX - 10, pgp->pg_server_queue);
+		pgp->pg_server_queue = MIN(S32_MAX - 10 - 5 - (S16_MAX * 3), pgp->pg_server_queue);
+
+		if(pgp->pg_server_threads == U16_MAX)
+			pgp->pg_server_threads = VAL_SERVER_THREADS;
 
 		if(pgp->pg_msg_allow == NIL){
 			char const * const ccp = VAL_MSG_ALLOW;
@@ -3126,7 +9844,7 @@ a_conf_finish(struct a_pg *pgp, BITENUM(u32,a_avo_flags) f){
 
 	/* */
 	/* C99 */{
-		char const *em_arr[6], **empp = em_arr;
+		char const *em_arr[12], **empp = em_arr;
 
 		if(pgp->pg_delay_max >= pgp->pg_gc_timeout && pgp->pg_gc_timeout != 0){
 			*empp++ = _("delay-max is >= gc-timeout: adjusting to x-1\n");
@@ -3146,10 +9864,44 @@ a_conf_finish(struct a_pg *pgp, BITENUM(u32,a_avo_flags) f){
 			*empp++ = _("limit-delay is >= limit\n");
 			pgp->pg_limit_delay = 0;
 		}
+		if(pgp->pg_limit_delay_time_max < pgp->pg_limit_delay_time){
+			*empp++ = _("limit-delay-time maximum is < minimum\n");
+			pgp->pg_limit_delay_time_max = pgp->pg_limit_delay_time;
+		}
+		if(pgp->pg_mem_limit != 0 && pgp->pg_mem_limit_delay >= pgp->pg_mem_limit){
+			*empp++ = _("memory-limit-delay is >= memory-limit\n");
+			pgp->pg_mem_limit_delay = 0;
+		}
 		if(pgp->pg_server_queue == 0){
 			*empp++ = _("server-queue must be greater than 0\n");
 			pgp->pg_server_queue = 1;
 		}
+		if(pgp->pg_server_threads > 0){
+#ifndef a_HAVE_MT
+			*empp++ = _("server-threads not supported\n");
+			pgp->pg_server_threads = 0;
+#else
+			LCTAV(a_SERVER_THREADS_MAX == 256);
+			if(pgp->pg_server_threads > a_SERVER_THREADS_MAX){
+				*empp++ = _("server-threads is > 256\n");
+				pgp->pg_server_threads = a_SERVER_THREADS_MAX;
+			}
+			if(pgp->pg_server_threads > pgp->pg_server_queue){
+				*empp++ = _("server-threads is > server-queue\n");
+				pgp->pg_server_threads = S(u16,MIN(S16_MAX, pgp->pg_server_queue));
+			}
+#endif
+		}
+		if(!(f & a_AVO_RELOAD) && (pgp->pg_peer_no > 0 || pgp->pg_peer_listen != NIL) &&
+				(pgp->pg_peer_key == NIL || su_cs_len(pgp->pg_peer_key) < a_PEER_KEY_MIN)){
+			*empp++ = _("peer and peer-listen require a peer-key of at least 16 characters: turning them off\n");
+			if(pgp->pg_peer_listen != NIL){
+				su_FREE(UNCONST(char*,pgp->pg_peer_listen));
+				pgp->pg_peer_listen = NIL;
+			}
+			while(pgp->pg_peer_no > 0)
+				su_FREE(pgp->pg_peers[--pgp->pg_peer_no]);
+		}
 
 		*empp = NIL;
 
@@ -3162,12 +9914,14 @@ a_conf_finish(struct a_pg *pgp, BITENUM(u32,a_avo_flags) f){
 
 static void
 a_conf_list_values(struct a_pg *pgp){
+	u32 i;
 	NYD2_IN;
 
 	/* NOTE!  For the test the four last fields must be msg-*, then store-path! */
 	fprintf(stdout,
 		"4-mask %lu\n"
 			"6-mask %lu\n"
+		"client-cache %lu\n"
 		"count %lu\n"
 			"delay-max %lu\n"
 			"delay-min %lu\n"
@@ -3177,10 +9931,50 @@ a_conf_list_values(struct a_pg *pgp){
 			"%s"
 			"gc-rebalance %lu\n"
 			"gc-timeout %lu\n"
+			"%s"
+			"gray-format %s\n"
+			"%s"
+			"%s"
+			"%s"
+			"gray-shared-time %lu\n"
 			"limit %lu\n"
 			"limit-delay %lu\n"
-		"%s"
+			"limit-delay-time %lu"
+		,
+		S(ul,pgp->pg_4_mask), S(ul,pgp->pg_6_mask),
+		S(ul,pgp->pg_client_cache),
+		S(ul,pgp->pg_count), S(ul,pgp->pg_delay_max), S(ul,pgp->pg_delay_min),
+			(pgp->pg_flags & a_F_DELAY_PROGRESSIVE ? "delay-progressive\n" : su_empty),
+			(pgp->pg_flags & a_F_FOCUS_DOMAIN ? "focus-domain\n" : su_empty),
+			(pgp->pg_flags & a_F_FOCUS_SENDER ? "focus-sender\n" : su_empty),
+			(pgp->pg_flags & a_F_GC_LINGER ? "gc-linger\n" : su_empty),
+			S(ul,pgp->pg_gc_rebalance), S(ul,pgp->pg_gc_timeout),
+			(pgp->pg_flags & a_F_GRAY_FPRINT ? "gray-fingerprint\n" : su_empty),
+			(pgp->pg_flags & a_F_GRAY_BINARY ? "binary" : "text"),
+			(!(pgp->pg_flags & a_F_GRAY_LAZY) ? su_empty
+				: (pgp->pg_flags & a_F_GRAY_LAZY_PASS) ? "gray-lazy-load pass\n" : "gray-lazy-load defer\n"),
+			(pgp->pg_flags & a_F_GRAY_SAVE_BG ? "gray-save-background\n" : su_empty),
+			(pgp->pg_flags & a_F_GRAY_SHM ? "gray-shared\n" : su_empty),
+			S(ul,pgp->pg_gray_shared_time),
+			S(ul,pgp->pg_limit), S(ul,pgp->pg_limit_delay), S(ul,pgp->pg_limit_delay_time)
+		);
+	if(pgp->pg_limit_delay_time_max != pgp->pg_limit_delay_time)
+		fprintf(stdout, ":%lu", S(ul,pgp->pg_limit_delay_time_max));
+	fprintf(stdout, "\nmemory-limit %lu\nmemory-limit-delay %lu\n%s",
+		S(ul,pgp->pg_mem_limit), S(ul,pgp->pg_mem_limit_delay),
+		(pgp->pg_flags & a_F_CLIENT_ONCE ? "once\n" : su_empty));
+
+	for(i = 0; i < pgp->pg_peer_no; ++i)
+		fprintf(stdout, "peer %s\n", pgp->pg_peers[i]);
+	if(pgp->pg_peer_key != NIL)
+		fprintf(stdout, "peer-key %s\n", pgp->pg_peer_key);
+	if(pgp->pg_peer_listen != NIL)
+		fprintf(stdout, "peer-listen %s\n", pgp->pg_peer_listen);
+
+	fprintf(stdout,
+		"%s%s%s"
 		"server-queue %lu\n"
+			"server-threads %lu\n"
 			"server-timeout %lu\n"
 		"%s"
 		"%s""%s"
@@ -3189,16 +9983,10 @@ a_conf_list_values(struct a_pg *pgp){
 			"msg-defer %s\n"
 		"store-path %s\n"
 		,
-		S(ul,pgp->pg_4_mask), S(ul,pgp->pg_6_mask),
-		S(ul,pgp->pg_count), S(ul,pgp->pg_delay_max), S(ul,pgp->pg_delay_min),
-			(pgp->pg_flags & a_F_DELAY_PROGRESSIVE ? "delay-progressive\n" : su_empty),
-			(pgp->pg_flags & a_F_FOCUS_DOMAIN ? "focus-domain\n" : su_empty),
-			(pgp->pg_flags & a_F_FOCUS_SENDER ? "focus-sender\n" : su_empty),
-			(pgp->pg_flags & a_F_GC_LINGER ? "gc-linger\n" : su_empty),
-			S(ul,pgp->pg_gc_rebalance), S(ul,pgp->pg_gc_timeout),
-			S(ul,pgp->pg_limit), S(ul,pgp->pg_limit_delay),
-		(pgp->pg_flags & a_F_CLIENT_ONCE ? "once\n" : su_empty),
-		S(ul,pgp->pg_server_queue), S(ul,pgp->pg_server_timeout),
+		(pgp->pg_policy_listen != NIL ? "policy-listen " : su_empty),
+			(pgp->pg_policy_listen != NIL ? pgp->pg_policy_listen : su_empty),
+			(pgp->pg_policy_listen != NIL ? "\n" : su_empty),
+		S(ul,pgp->pg_server_queue), S(ul,pgp->pg_server_threads), S(ul,pgp->pg_server_timeout),
 		(pgp->pg_flags & a_F_UNTAMED ? "untamed\n" : su_empty),
 		(pgp->pg_flags & a_F_V ? "verbose\n" : su_empty),
 			(pgp->pg_flags & a_F_VV ? "verbose\n" : su_empty),
@@ -3264,6 +10052,16 @@ a_conf_arg(struct a_pg *pgp, s32 o, char const *arg, BITENUM(u32,a_avo_flags) f)
 					) ? NIL : &pgp->pg_master->m_black));
 		break;
 
+	case -13:
+		if((su_idec_u16(&pgp->pg_client_cache, arg, UZ_MAX, 10, NIL) &
+					(su_IDEC_STATE_EMASK | su_IDEC_STATE_CONSUMED)) != su_IDEC_STATE_CONSUMED ||
+				pgp->pg_client_cache > a_CLIENT_CACHE_MAX){
+			a_conf__err(pgp, _("--client-cache: invalid number or limit excess: %s\n"), arg);
+			o = -su_EX_DATAERR;
+			goto jleave;
+		}
+		o = su_EX_OK;
+		break;
 	case 'c': p.i32 = &pgp->pg_count; goto ji32;
 	case 'D': p.i16 = &pgp->pg_delay_max; goto ji16;
 	case 'd': p.i16 = &pgp->pg_delay_min; goto ji16;
@@ -3273,8 +10071,117 @@ a_conf_arg(struct a_pg *pgp, s32 o, char const *arg, BITENUM(u32,a_avo_flags) f)
 	case 'G': p.i16 = &pgp->pg_gc_rebalance; goto ji16;
 	case 'g': p.i16 = &pgp->pg_gc_timeout; goto ji16;
 	case -1: pgp->pg_flags |= a_F_GC_LINGER; o = su_EX_OK; break;
+	case -3:
+		if(!(f & a_AVO_RELOAD))
+			pgp->pg_flags |= a_F_GRAY_FPRINT;
+		o = su_EX_OK;
+		break;
+	case -16:
+		if(!(f & a_AVO_RELOAD))
+			pgp->pg_flags |= a_F_GRAY_SAVE_BG;
+		o = su_EX_OK;
+		break;
+	case -2:
+		if(!su_cs_cmp_case(arg, "text"))
+			pgp->pg_flags &= ~S(uz,a_F_GRAY_BINARY);
+		else if(!su_cs_cmp_case(arg, "binary"))
+			pgp->pg_flags |= a_F_GRAY_BINARY;
+		else{
+			a_conf__err(pgp, _("--gray-format: invalid format: %s\n"), arg);
+			o = -su_EX_DATAERR;
+			break;
+		}
+		o = su_EX_OK;
+		break;
+	case -14:
+		if(!su_cs_cmp_case(arg, "pass"))
+			pgp->pg_flags |= a_F_GRAY_LAZY_PASS;
+		else if(!su_cs_cmp_case(arg, "defer"))
+			pgp->pg_flags &= ~S(uz,a_F_GRAY_LAZY_PASS);
+		else{
+			a_conf__err(pgp, _("--gray-lazy-load: invalid answer: %s\n"), arg);
+			o = -su_EX_DATAERR;
+			break;
+		}
+		if(!(f & a_AVO_RELOAD))
+			pgp->pg_flags |= a_F_GRAY_LAZY;
+		o = su_EX_OK;
+		break;
+	case -5:
+		if(!(f & a_AVO_RELOAD))
+			pgp->pg_flags |= a_F_GRAY_SHM;
+		o = su_EX_OK;
+		break;
+	case -17:
+		if((su_idec_u16(&pgp->pg_gray_shared_time, arg, UZ_MAX, 10, NIL) &
+					(su_IDEC_STATE_EMASK | su_IDEC_STATE_CONSUMED)) != su_IDEC_STATE_CONSUMED ||
+				pgp->pg_gray_shared_time > S16_MAX){
+			a_conf__err(pgp, _("--gray-shared-time: invalid number or limit excess: %s\n"), arg);
+			o = -su_EX_DATAERR;
+			goto jleave;
+		}
+		o = su_EX_OK;
+		break;
 	case 'L': p.i32 = &pgp->pg_limit; goto ji32;
 	case 'l': p.i32 = &pgp->pg_limit_delay; goto ji32;
+	case -10:
+		/* C99 */{
+			char const *cp;
+			uz l;
+			u32 i, j;
+
+			l = ((cp = su_cs_find_c(arg, ':')) != NIL) ? P2UZ(cp - arg) : UZ_MAX;
+			if((su_idec_u32(&i, arg, l, 10, NIL) & (su_IDEC_STATE_EMASK | su_IDEC_STATE_CONSUMED)
+					) != su_IDEC_STATE_CONSUMED || UCMP(32, i, >, S32_MAX))
+				goto jeldt;
+			j = i;
+			if(cp != NIL && ((su_idec_u32(&j, ++cp, UZ_MAX, 10, NIL) &
+						(su_IDEC_STATE_EMASK | su_IDEC_STATE_CONSUMED)) != su_IDEC_STATE_CONSUMED ||
+					UCMP(32, j, >, S32_MAX))){
+jeldt:
+				a_conf__err(pgp, _("--limit-delay-time: invalid number or limit excess: %s\n"), arg);
+				o = -su_EX_DATAERR;
+				goto jleave;
+			}
+			pgp->pg_limit_delay_time = i;
+			pgp->pg_limit_delay_time_max = j;
+		}
+		o = su_EX_OK;
+		break;
+	case -11:
+	case -12:
+		p.i32 = (o == -11) ? &pgp->pg_mem_limit : &pgp->pg_mem_limit_delay;
+		if((su_idec_u32(p.i32, arg, UZ_MAX, 10, NIL) & (su_IDEC_STATE_EMASK | su_IDEC_STATE_CONSUMED)
+				) != su_IDEC_STATE_CONSUMED || UCMP(32, *p.i32, >, S32_MAX)){
+			a_conf__err(pgp, _("--memory-limit%s: invalid number or limit excess: %s\n"),
+				(o == -11 ? su_empty : "-delay"), arg);
+			o = -su_EX_DATAERR;
+			goto jleave;
+		}
+		o = su_EX_OK;
+		break;
+	case -9:
+		/* (The image is not compiled into itself) */
+		if((f & a_AVO_FULL) && !(pgp->pg_flags & a_F_MODE_COMPILE)){
+			char const *lim;
+
+			if((p.cp = a_sandbox_path_check(pgp, arg)) == NIL){
+				a_conf__err(pgp, _("--list-image: invalid path: %s: %s\n"), arg, V_(su_err_doc(-1)));
+				o = -su_EX_DATAERR;
+				goto jleave;
+			}
+			if((o = a_misc_lim_open(pgp, p.cp, &lim)) != su_EX_OK)
+				goto jleave;
+			if(pgp->pg_flags & a_F_MODE_TEST)
+				a_misc_lim_close(lim);
+			else{
+				if(pgp->pg_master->m_lim != NIL)
+					a_misc_lim_close(pgp->pg_master->m_lim);
+				pgp->pg_master->m_lim = lim;
+			}
+		}
+		o = su_EX_OK;
+		break;
 
 	case 'm': p.cpp = &pgp->pg_msg_defer; goto jmsg;
 	case '~': p.cpp = &pgp->pg_msg_allow; goto jmsg;
@@ -3282,6 +10189,54 @@ a_conf_arg(struct a_pg *pgp, s32 o, char const *arg, BITENUM(u32,a_avo_flags) f)
 
 	case 'o': pgp->pg_flags |= a_F_CLIENT_ONCE; break;
 
+	case 'P':
+		if(f & (a_AVO_FULL | a_AVO_RELOAD))
+			break;
+		/* C99 */{
+			union a_sockaddr sa;
+
+			if(a_misc_policy_addr(arg, &sa, FAL0) == 0){
+				a_conf__err(pgp, _("--policy-listen: invalid socket name or loopback ADDR:PORT: %s\n"), arg);
+				o = -su_EX_DATAERR;
+				goto jleave;
+			}
+		}
+		if(pgp->pg_policy_listen != NIL)
+			su_FREE(UNCONST(char*,pgp->pg_policy_listen));
+		pgp->pg_policy_listen = su_cs_dup(arg, su_STATE_ERR_NOPASS);
+		break;
+
+	case -6:
+	case -7:
+		if(!(f & (a_AVO_FULL | a_AVO_RELOAD))){
+			union a_sockaddr sa;
+
+			if(a_misc_policy_addr(arg, &sa, TRU1) == 0){
+				a_conf__err(pgp, _("--peer%s: invalid ADDR:PORT: %s\n"), (o == -6 ? su_empty : "-listen"), arg);
+				o = -su_EX_DATAERR;
+				goto jleave;
+			}
+
+			if(o == -7){
+				if(pgp->pg_peer_listen != NIL)
+					su_FREE(UNCONST(char*,pgp->pg_peer_listen));
+				pgp->pg_peer_listen = su_cs_dup(arg, su_STATE_ERR_NOPASS);
+			}else{
+				pgp->pg_peers = su_TREALLOC(char*, pgp->pg_peers, pgp->pg_peer_no + 1);
+				pgp->pg_peers[pgp->pg_peer_no++] = su_cs_dup(arg, su_STATE_ERR_NOPASS);
+			}
+		}
+		o = su_EX_OK;
+		break;
+	case -15:
+		if(!(f & (a_AVO_FULL | a_AVO_RELOAD))){
+			if(pgp->pg_peer_key != NIL)
+				su_FREE(UNCONST(char*,pgp->pg_peer_key));
+			pgp->pg_peer_key = su_cs_dup(arg, su_STATE_ERR_NOPASS);
+		}
+		o = su_EX_OK;
+		break;
+
 	case 'R':
 		p.cp = arg;
 		if((f & a_AVO_FULL) && (p.cp = a_sandbox_path_check(pgp, arg)) == NIL)
@@ -3294,6 +10249,11 @@ a_conf_arg(struct a_pg *pgp, s32 o, char const *arg, BITENUM(u32,a_avo_flags) f)
 			break;
 		p.i32 = &pgp->pg_server_queue;
 		goto ji32;
+	case 'T':
+		if(f & a_AVO_RELOAD)
+			break;
+		p.i16 = &pgp->pg_server_threads;
+		goto ji16;
 	case 't': p.i16 = &pgp->pg_server_timeout; goto ji16;
 
 	case 's':
@@ -3375,6 +10335,7 @@ jmsg:
 
 static s32
 a_conf__AB(struct a_pg *pgp, char const *path, struct a_wb *wbp){
+	struct a_compile st;
 	struct a_line line;
 	sz lnr;
 	s32 fd, rv;
@@ -3386,10 +10347,19 @@ a_conf__AB(struct a_pg *pgp, char const *path, struct a_wb *wbp){
 		goto jleave;
 	}
 
+#ifdef a_HAVE_MT
+	if(a_conf__AB_par(pgp, fd, wbp, &rv))
+		goto jclose;
+#endif
+
+	STRUCT_ZERO(struct a_compile, &st);
 	a_LINE_SETUP(&line);
 	rv = su_EX_OK;
 	while((lnr = a_misc_line_get(pgp, fd, &line)) != -1){
-		if(lnr != 0 && (rv = a_conf__ab(pgp, line.l_buf, wbp)) != su_EX_OK){
+		if(lnr == 0)
+			continue;
+		a_conf__ab_parse(pgp, line.l_buf, &st);
+		if((rv = a_conf__ab_apply(pgp, &st, wbp)) != su_EX_OK){
 			if(!(pgp->pg_flags & a_F_MODE_TEST))
 				break;
 			rv = su_EX_OK;
@@ -3398,6 +10368,12 @@ a_conf__AB(struct a_pg *pgp, char const *path, struct a_wb *wbp){
 	if(rv == su_EX_OK && line.l_err != su_ERR_NONE)
 		rv = -su_EX_IOERR;
 
+	if(st.c_buf != NIL)
+		su_FREE(st.c_buf);
+
+#ifdef a_HAVE_MT
+jclose:
+#endif
 	close(fd);
 
 jleave:
@@ -3405,17 +10381,130 @@ jleave:
 	return rv;
 }
 
+#ifdef a_HAVE_MT
+static boole
+a_conf__AB_par(struct a_pg *pgp, s32 fd, struct a_wb *wbp, s32 *rvp){ /* {{{ */
+	struct stat sb;
+	struct a_conf_ab_par *cabpp, *xcabpp;
+	char const *map, *cp, *xp, *top;
+	uz len, no, i;
+	boole rv;
+	NYD2_IN;
+
+	rv = FAL0;
+
+	/* No new threads (and files) once sandboxed */
+	if(pgp->pg_server_threads <= 1 || !(pgp->pg_flags & (a_F_MODE_TEST | a_F_MASTER_IN_SETUP)))
+		goto jleave;
+	if(fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || S(u64,sb.st_size) >= UZ_MAX ||
+			(no = S(uz,sb.st_size) / a_CONF_AB_PAR_MIN) <= 1)
+		goto jleave;
+	len = S(uz,sb.st_size);
+	no = MIN(no, pgp->pg_server_threads);
+
+	if((map = S(char*,mmap(NIL, len, PROT_READ, MAP_PRIVATE, fd, 0))) == MAP_FAILED)
+		goto jleave;
+
+	cabpp = su_TCALLOC(struct a_conf_ab_par, no);
+
+	/* Chunks end after a newline not escaped by a reverse solidus, see a_misc_line_get() */
+	for(cp = map, top = &map[len], i = 0; i < no; ++i){
+		xcabpp = &cabpp[i];
+		xcabpp->cabp_pgp = pgp;
+		xcabpp->cabp_dat = cp;
+
+		if(i + 1 == no)
+			cp = top;
+		else{
+			for(xp = MAX(cp, &map[len / no * (i + 1)]); xp < top; ++xp)
+				if(*xp == '\n' && xp != map && xp[-1] != '\\'){
+					++xp;
+					break;
+				}
+			cp = xp;
+		}
+		xcabpp->cabp_len = P2UZ(cp - xcabpp->cabp_dat);
+
+		if(i > 0 && xcabpp->cabp_len > 0)
+			xcabpp->cabp_thr = (pthread_create(&xcabpp->cabp_tid, NIL, &a_conf__AB_par_worker, xcabpp) == 0);
+	}
+
+	/* Apply in file order; the first chunk (and those without a thread) are parsed here */
+	*rvp = su_EX_OK;
+	for(i = 0; i < no; ++i){
+		xcabpp = &cabpp[i];
+
+		if(xcabpp->cabp_thr)
+			pthread_join(xcabpp->cabp_tid, NIL);
+		else if(*rvp == su_EX_OK)
+			a_conf__AB_par_worker(xcabpp);
+
+		if(*rvp == su_EX_OK && (*rvp = a_conf__ab_apply(pgp, &xcabpp->cabp_st, wbp)) != su_EX_OK &&
+				(pgp->pg_flags & a_F_MODE_TEST))
+			*rvp = su_EX_OK;
+
+		if(xcabpp->cabp_st.c_buf != NIL)
+			su_FREE(xcabpp->cabp_st.c_buf);
+	}
+
+	su_FREE(cabpp);
+	munmap(C(char*,map), len);
+
+	rv = TRU1;
+jleave:
+	NYD2_OU;
+	return rv;
+} /* }}} */
+
+static void *
+a_conf__AB_par_worker(void *vp){
+	struct a_line_mem lm;
+	struct a_conf_ab_par *cabpp;
+	sz lnr;
+	NYD_IN;
+
+	cabpp = S(struct a_conf_ab_par*,vp);
+
+	a_LINE_SETUP(&lm.lm_line);
+	lm.lm_dat = cabpp->cabp_dat;
+	lm.lm_len = cabpp->cabp_len;
+	lm.lm_st = &cabpp->cabp_st;
+
+	while((lnr = a_misc_line_get(cabpp->cabp_pgp, -1, &lm.lm_line)) != -1)
+		if(lnr != 0)
+			a_conf__ab_parse(cabpp->cabp_pgp, lm.lm_line.l_buf, &cabpp->cabp_st);
+
+	NYD_OU;
+	return NIL;
+}
+#endif /* a_HAVE_MT */
+
 static s32
-a_conf__ab(struct a_pg *pgp, char *entry, struct a_wb *wbp){ /* {{{ */
+a_conf__ab(struct a_pg *pgp, char *entry, struct a_wb *wbp){
+	struct a_compile st;
+	s32 rv;
+	NYD2_IN;
+
+	STRUCT_ZERO(struct a_compile, &st);
+	a_conf__ab_parse(pgp, entry, &st);
+	rv = a_conf__ab_apply(pgp, &st, wbp);
+
+	if(st.c_buf != NIL)
+		su_FREE(st.c_buf);
+
+	NYD2_OU;
+	return rv;
+}
+
+static void
+a_conf__ab_parse(struct a_pg const *pgp, char *entry, struct a_compile *stp){ /* {{{ */
 	union a_srch_ip sip;
-	struct a_srch *pgsp;
+	char const *emsg;
 	u32 m;
 	char c, *cp;
-	s32 rv;
+	s32 af;
 	NYD2_IN;
 
-	rv = su_EX_OK;
-
 	/* A bit of cleanup first */
 	while((c = *entry) != '\0' && su_cs_is_space(c))
 		++entry;
@@ -3442,27 +10531,27 @@ a_conf__ab(struct a_pg *pgp, char *entry, struct a_wb *wbp){ /* {{{ */
 		*cp++ = '\0';
 		if((su_idec_u32(&m, cp, UZ_MAX, 10, NIL) & (su_IDEC_STATE_EMASK | su_IDEC_STATE_CONSUMED)
 				) != su_IDEC_STATE_CONSUMED || /* unrecog. otherw. */m == U32_MAX){
-			sip.cp = N_("Invalid CIDR mask: %s/%s\n");
+			emsg = N_("Invalid CIDR mask: %s/%s\n");
 			goto jedata;
 		}
 	}
 
 	if(su_cs_find_c(entry, ':') != NIL){
 		if(m != U32_MAX && m > 128){
-			sip.cp = N_("Invalid IPv6 mask: %s/%s\n");
+			emsg = N_("Invalid IPv6 mask: %s/%s\n");
 			goto jedata;
 		}
-		rv = AF_INET6;
+		af = AF_INET6;
 		goto jca;
 	}else if(su_cs_first_not_of(entry, "0123456789.") == UZ_MAX){
 		if(m != U32_MAX && m > 32){
-			sip.cp = N_("Invalid IPv4 mask: %s/%s\n");
+			emsg = N_("Invalid IPv4 mask: %s/%s\n");
 			goto jedata;
 		}
-		rv = AF_INET;
+		af = AF_INET;
 		goto jca;
 	}else if(m != U32_MAX){
-		sip.cp = N_("CIDR notation unexpected: %s/%s\n");
+		emsg = N_("CIDR notation unexpected: %s/%s\n");
 		goto jedata;
 	}else{
 		m = 0;
@@ -3471,45 +10560,25 @@ a_conf__ab(struct a_pg *pgp, char *entry, struct a_wb *wbp){ /* {{{ */
 
 jleave:
 	NYD2_OU;
-	return rv;
+	return;
 
 jcname:
-	/* So be easy and use the norm_triple normalizer */
-	sip.cp = pgp->pg_cname;
-	pgp->pg_cname = entry;
-	if(a_norm_triple_cname(pgp)){
-		cp = pgp->pg_cname;
-		pgp->pg_cname = UNCONST(char*,sip.cp);
-
-		if(!(pgp->pg_flags & a_F_MODE_TEST)){
-			union {void *p; up v;} u;
-
-			u.v = (m == 0) ? TRU1 : TRU2; /* "is exact" */
-			su_cs_dict_insert(&wbp->wb_cname, cp, u.p);
-		}else{
-			char const *me;
-
-			/* xxx could use C++ dns hostname check, too */
-			me = (wbp != NIL) ? "allow" : "block";
-			fprintf(stdout, "%s %s%s\n", me, (m == 0 ? su_empty : "."), cp);
-		}
-	}else{
-		pgp->pg_cname = UNCONST(char*,sip.cp);
-
-		sip.cp = N_("Invalid domain name: %s\n");
+	if((cp = a_norm_cname(entry)) == NIL){
+		emsg = N_("Invalid domain name: %s\n");
 		cp = UNCONST(char*,su_empty);
 		goto jedata;
 	}
-	ASSERT(rv == su_EX_OK);
+	a_conf__ab_rec(stp, (m == 0 ? a_CONF_AB_CNAME : a_CONF_AB_CNAME_WILD), NIL, cp, NIL, NIL);
 	goto jleave;
 
 jca:/* C99 */{
 	char buf[INET6_ADDRSTRLEN];
 	union a_srch_ip sip_test;
+	struct a_conf_ab_rec *cabrp;
 	boole redo, exact;
 
-	if(inet_pton(rv, entry, (rv == AF_INET ? S(void*,&sip.v4) : S(void*,&sip.v6))) != 1){
-		sip.cp = N_("Invalid internet address: %s\n");
+	if(inet_pton(af, entry, (af == AF_INET ? S(void*,&sip.v4) : S(void*,&sip.v6))) != 1){
+		emsg = N_("Invalid internet address: %s\n");
 		cp = UNCONST(char*,su_empty);
 		goto jedata;
 	}
@@ -3522,7 +10591,7 @@ jca:/* C99 */{
 		u8 g_m;
 
 		/* We have the implicit global masks! */
-		g_m = (rv == AF_INET) ? pgp->pg_4_mask : pgp->pg_6_mask;
+		g_m = (af == AF_INET) ? pgp->pg_4_mask : pgp->pg_6_mask;
 		if(g_m != 0 && m >= g_m){
 			m = g_m;
 			exact = TRU1;
@@ -3534,7 +10603,7 @@ jca:/* C99 */{
 		uz max, i;
 		u32 *ip, mask;
 
-		if(rv == AF_INET){
+		if(af == AF_INET){
 			LCTA(su_FIELD_OFFSETOF(struct in_addr,s_addr) % sizeof(u32) == 0,
 				"Alignment constraint of IPv4 address member not satisfied");
 			ip = R(u32*,&sip.v4.s_addr);
@@ -3567,11 +10636,12 @@ jca:/* C99 */{
 			redo = ((max == 1) ? !su_mem_cmp(&sip.v4.s_addr, &sip_test.v4.s_addr, sizeof(sip.v4.s_addr))
 					: !su_mem_cmp(sip.v6.s6_addr, sip_test.v6.s6_addr, sizeof(sip.v6.s6_addr)));
 			if(!redo){
-				if(inet_ntop(rv, (rv == AF_INET ? S(void*,&sip.v4) : S(void*,&sip.v6)),
+				if(inet_ntop(af, (af == AF_INET ? S(void*,&sip.v4) : S(void*,&sip.v6)),
 						buf, sizeof(buf)) == NIL)
 					goto jca_err;
 				*--cp = '/';
-				a_conf__err(pgp, _("Address masked, should be %s/%s not %s\n"), buf, &cp[1], entry);
+				a_conf__ab_rec(stp, a_CONF_AB_WARN, N_("Address masked, should be %s/%s not %s\n"),
+					buf, &cp[1], entry);
 				*cp = '\0';
 				/*su_mem_copy(&sip, &sip_test, sizeof(sip));*/
 			}
@@ -3583,47 +10653,130 @@ jca:/* C99 */{
 	/* We need to normalize through the system's C library to match it!
 	 * This only for exact match or test mode, however */
 	if((exact || (pgp->pg_flags & a_F_MODE_TEST)) &&
-			inet_ntop(rv, (rv == AF_INET ? S(void*,&sip.v4) : S(void*,&sip.v6)), buf, sizeof(buf)) == NIL){
+			inet_ntop(af, (af == AF_INET ? S(void*,&sip.v4) : S(void*,&sip.v6)), buf, sizeof(buf)) == NIL){
 jca_err:
-		sip.cp = N_("Invalid internet address: %s\n");
+		emsg = N_("Invalid internet address: %s\n");
 		cp = UNCONST(char*,su_empty);
 		goto jedata;
 	}
 
-	if(!(pgp->pg_flags & a_F_MODE_TEST)){
-		if(exact)
-			su_cs_dict_insert(&wbp->wb_ca, buf, NIL);
-		else{
-			ASSERT(m != U32_MAX);
-			pgsp = su_TALLOC(struct a_srch, 1);
-			if(wbp->wb_srch == NIL)
-				wbp->wb_srch = pgsp;
-			else
-				*wbp->wb_srch_tail = pgsp;
-			wbp->wb_srch_tail = &pgsp->s_next;
-			pgsp->s_next = NIL;
-			pgsp->s_type = (rv == AF_INET) ? a_SRCH_TYPE_IPV4 : a_SRCH_TYPE_IPV6;
-			pgsp->s_mask = m;
-			su_mem_copy(&pgsp->s_ip, &sip, sizeof(sip));
-		}
-	}else{
-		char const *me;
-
-		me = (wbp != NIL) ? "allow" : "block";
-		if(exact)
-			fprintf(stdout, "%s %s\n", me, buf);
-		else
-			fprintf(stdout, "%s %s/%lu\n", me, buf, S(ul,m));
+	if(exact)
+		a_conf__ab_rec(stp, a_CONF_AB_CA, NIL, buf, NIL, NIL);
+	else{
+		ASSERT(m != U32_MAX);
+		cabrp = a_conf__ab_rec(stp, a_CONF_AB_SRCH, NIL,
+				((pgp->pg_flags & a_F_MODE_TEST) ? buf : su_empty), NIL, NIL);
+		cabrp->cabr_v6 = (af == AF_INET6);
+		cabrp->cabr_mask = m;
+		su_mem_copy(&cabrp->cabr_ip, &sip, sizeof(sip));
 	}
-	rv = su_EX_OK;
 	}goto jleave;
 
 jedata:
-	a_conf__err(pgp, V_(sip.cp), entry, cp);
-	rv = -su_EX_DATAERR;
+	a_conf__ab_rec(stp, a_CONF_AB_ERR, emsg, entry, cp, NIL);
 	goto jleave;
 } /* }}} */
 
+static s32
+a_conf__ab_apply(struct a_pg *pgp, struct a_compile *stp, struct a_wb *wbp){ /* {{{ */
+	struct a_conf_ab_rec *cabrp;
+	char const *me, *s2;
+	uz i;
+	s32 rv;
+	NYD2_IN;
+
+	me = (wbp != NIL) ? "allow" : "block";
+	rv = su_EX_OK;
+
+	for(i = 0; i < stp->c_len; i += cabrp->cabr_len){
+		cabrp = R(struct a_conf_ab_rec*,&stp->c_buf[i]);
+
+		switch(cabrp->cabr_type){
+		case a_CONF_AB_CNAME:
+		case a_CONF_AB_CNAME_WILD:
+			if(!(pgp->pg_flags & a_F_MODE_TEST)){
+				BITENUM(u32,a_dom_flags) f;
+
+				f = (cabrp->cabr_type == a_CONF_AB_CNAME) ? a_DOM_ALLOW : a_DOM_ALLOW_WILD;
+				if(wbp != &pgp->pg_master->m_white)
+					f <<= 2;
+				if(a_server__dom_insert(pgp->pg_master, cabrp->cabr_dat, f))
+					++wbp->wb_cname_cnt;
+			}else
+				/* xxx could use C++ dns hostname check, too */
+				fprintf(stdout, "%s %s%s\n", me, (cabrp->cabr_type == a_CONF_AB_CNAME ? su_empty : "."),
+					cabrp->cabr_dat);
+			break;
+
+		case a_CONF_AB_CA:
+			if(!(pgp->pg_flags & a_F_MODE_TEST))
+				su_cs_dict_insert(&wbp->wb_ca, cabrp->cabr_dat, NIL);
+			else
+				fprintf(stdout, "%s %s\n", me, cabrp->cabr_dat);
+			break;
+
+		case a_CONF_AB_SRCH:
+			if(!(pgp->pg_flags & a_F_MODE_TEST)){
+				if(a_server__srch_insert(&wbp->wb_srch[cabrp->cabr_v6 ? a_SRCH_TYPE_IPV6 : a_SRCH_TYPE_IPV4],
+						(cabrp->cabr_v6 ? cabrp->cabr_ip.v6.s6_addr : R(u8*,&cabrp->cabr_ip.v4.s_addr)),
+						cabrp->cabr_mask))
+					++wbp->wb_srch_cnt;
+			}else
+				fprintf(stdout, "%s %s/%lu\n", me, cabrp->cabr_dat, S(ul,cabrp->cabr_mask));
+			break;
+
+		case a_CONF_AB_ELONG:
+			su_log_write(su_LOG_ERR, _("line too long, skip: %s"), cabrp->cabr_dat);
+			break;
+
+		default:
+			s2 = &cabrp->cabr_dat[su_cs_len(cabrp->cabr_dat) + 1];
+			a_conf__err(pgp, V_(cabrp->cabr_msg), cabrp->cabr_dat, s2, &s2[su_cs_len(s2) + 1]);
+			if(cabrp->cabr_type == a_CONF_AB_ERR){
+				rv = -su_EX_DATAERR;
+				if(!(pgp->pg_flags & a_F_MODE_TEST))
+					goto jleave;
+			}
+			break;
+		}
+	}
+
+jleave:
+	stp->c_len = 0;
+
+	NYD2_OU;
+	return rv;
+} /* }}} */
+
+static struct a_conf_ab_rec *
+a_conf__ab_rec(struct a_compile *stp, enum a_conf_ab_type type, char const *msg,
+		char const *s1, char const *s2, char const *s3){
+	struct a_conf_ab_rec *cabrp;
+	uz l1, l2, l3, len, o;
+	NYD2_IN;
+
+	l1 = (s1 != NIL) ? su_cs_len(s1) : 0;
+	l2 = (s2 != NIL) ? su_cs_len(s2) : 0;
+	l3 = (s3 != NIL) ? su_cs_len(s3) : 0;
+	len = ALIGN_Z(su_VSTRUCT_SIZEOF(struct a_conf_ab_rec,cabr_dat) + l1 +1 + l2 +1 + l3 +1);
+
+	o = a_compile__put(stp, len);
+	cabrp = R(struct a_conf_ab_rec*,&stp->c_buf[o]);
+	cabrp->cabr_msg = msg;
+	cabrp->cabr_len = S(u32,len);
+	cabrp->cabr_type = S(u8,type);
+	/* (Zeroed: terminators are in place) */
+	if(l1 > 0)
+		su_mem_copy(cabrp->cabr_dat, s1, l1);
+	if(l2 > 0)
+		su_mem_copy(&cabrp->cabr_dat[l1 + 1], s2, l2);
+	if(l3 > 0)
+		su_mem_copy(&cabrp->cabr_dat[l1 + 1 + l2 + 1], s3, l3);
+
+	NYD2_OU;
+	return cabrp;
+}
+
 static s32
 a_conf__R(struct a_pg *pgp, char const *path, BITENUM(u32,a_avo_flags) f){
 	struct a_line line;
@@ -3788,161 +10941,472 @@ a_norm_triple_s(struct a_pg *pgp){ /* XXX-3 should normalize addresses */
 		}
 	}
 
-	/* "Normalize" domain */
-	ASSERT(*cp != '\0');
-	d = ++cp;
-	while((c = *cp) != '\0')
-		*cp++ = S(char,su_cs_to_lower(c));
+	/* "Normalize" domain */
+	ASSERT(*cp != '\0');
+	d = ++cp;
+	while((c = *cp) != '\0')
+		*cp++ = S(char,su_cs_to_lower(c));
+
+	/* Now fill the hole */
+	if(d < cp){
+		if(focus_domain)
+			s = d;
+		/* To avoid overzealous fortify implementations, use _move() */
+		else if(ue != NIL)
+			su_mem_move(&ue[1], d, P2UZ(++cp - d));
+	}else
+		s = NIL;
+
+jleave:
+	pgp->pg_s = s;
+
+	NYD2_OU;
+	return (s != NIL);
+}
+
+static boole
+a_norm_triple_ca(struct a_pg *pgp){
+	union a_srch_ip a;
+	u32 *ip, mask, max, i;
+	char *ca, *cp;
+	NYD2_IN;
+
+	cp = pgp->pg_ca;
+
+	while(su_cs_is_space(*cp))
+		++cp;
+
+	ca = cp;
+	cp += su_cs_len(cp);
+
+	while(cp > ca && su_cs_is_space(cp[-1]))
+		--cp;
+	*cp = '\0';
+
+	cp = ca;
+
+	if(su_cs_find_c(cp, ':') != NIL){
+		if(inet_pton(AF_INET6, cp, &a.v6) != 1){
+			ca = NIL;
+			goto jleave;
+		}
+		LCTA(su_FIELD_OFFSETOF(struct in6_addr,s6_addr) % sizeof(u32) == 0,
+			"Alignment constraint of IPv6 address member not satisfied");
+		ip = R(u32*,a.v6.s6_addr);
+		mask = pgp->pg_6_mask;
+		max = 4;
+	}else{
+		if(inet_pton(AF_INET, cp, &a.v4) != 1){
+			ca = NIL;
+			goto jleave;
+		}
+		LCTA(su_FIELD_OFFSETOF(struct in_addr,s_addr) % sizeof(u32) == 0,
+			"Alignment constraint of IPv4 address member not satisfied");
+		ip = R(u32*,&a.v4.s_addr);
+		mask = pgp->pg_4_mask;
+		max = 1;
+	}
+
+	i = 0;
+	do{
+		u32 m;
+
+		if((m = mask) != 0){
+			m = 0xFFFFFFFFu;
+			if((i + 1) << 5 >= mask){
+				if((mask &= 31))
+					m <<= (32 - mask);
+				mask = 0;
+			}
+		}
+
+		ip[i] &= su_boswap_net_32(m);
+	}while(++i != max);
+
+	/* (Passed to server in binary) */
+	pgp->pg_ca_type = (max == 1) ? a_SRCH_TYPE_IPV4 : a_SRCH_TYPE_IPV6;
+	su_mem_copy(pgp->pg_ca_ip, ip, max * sizeof(u32));
+
+	/* XXX As long as we use inet_ntop() .pg_ca needs to have been "allocated"
+	 * XXX with sufficient room to place INET6_ADDSTRLEN +1! */
+	if(inet_ntop((max == 1 ? AF_INET : AF_INET6), ip, ca = pgp->pg_ca, INET6_ADDRSTRLEN) == NIL){
+		ca = NIL;
+		goto jleave;
+	}
+
+	/* My preferred style is superfluous here as long as it is normalized
+	 *for(cp = ca; (a.c = *cp) != '\0'; ++cp)
+	 *   *cp = su_cs_to_upper(a.c); */
+
+jleave:
+	pgp->pg_ca = ca;
+
+	NYD2_OU;
+	return (ca != NIL);
+}
+
+static boole
+a_norm_triple_cname(struct a_pg *pgp){
+	boole rv;
+	NYD2_IN;
+
+	pgp->pg_cname = a_norm_cname(pgp->pg_cname);
+	rv = (pgp->pg_cname != NIL);
+
+	NYD2_OU;
+	return rv;
+}
+
+static char *
+a_norm_cname(char *cn){
+	/* This bails for the root label . */
+	char *cp, *ds, c;
+	NYD2_IN;
+
+	while(su_cs_is_space(*cn))
+		++cn;
+
+	cp = cn;
+	cp += su_cs_len(cp);
+
+	while(cp > cn && su_cs_is_space(cp[-1]))
+		--cp;
+	*cp = '\0';
+
+	cp = cn;
+
+	/* "Normalize" domain */
+	ds = cp;
+	while((c = *cp) != '\0'){
+		if(!su_cs_is_alnum(c) && (cp == ds || (c != '-' && c != '.'))){
+			cn = NIL;
+			break;
+		}
+		c = S(char,su_cs_to_lower(c));
+		*cp++ = c;
+	}
+	if(&ds[1] >= cp)
+		cn = NIL;
+
+	NYD2_OU;
+	return cn;
+}
+/* }}} */
+
+/* misc {{{ */
+static boole
+a_misc_os_resource_delay(s32 err){
+	boole rv;
+	NYD_IN;
+
+	rv = (err == su_ERR_MFILE || err == su_ERR_NFILE || err == su_ERR_NOBUFS/*hm*/ || err == su_ERR_NOMEM);
+
+	if(rv){
+		a_DBG(su_log_write(su_LOG_DEBUG, "out of OS resources while creating file descriptor, waiting a bit");)
+		su_time_msleep(250, TRU1);
+	}
+
+	NYD_OU;
+	return rv;
+}
+
+static boole
+a_misc_write_all(s32 fd, void const *dat, uz len){
+	union {void const *v; char const *c;} p;
+	sz w;
+	NYD_IN;
+
+	for(p.v = dat; len > 0; p.c += w, len -= S(uz,w)){
+		if((w = write(fd, p.v, len)) == -1){
+			if(su_err_by_errno() == su_ERR_INTR){
+				w = 0;
+				continue;
+			}
+			break;
+		}
+	}
+
+	NYD_OU;
+	return (len == 0);
+}
+
+static enum a_policy
+a_misc_policy_block(struct a_pg *pgp, s32 fd, struct a_line *lp){ /* {{{ */
+	char *bp;
+	sz lnr;
+	boole use_this, seen_any;
+	enum a_policy rv;
+	NYD_IN;
+
+	bp = pgp->pg_buf;
+	pgp->pg_r = pgp->pg_s = pgp->pg_ca = pgp->pg_cname = NIL;
+	use_this = TRU1;
+	seen_any = FAL0;
+
+	while((lnr = a_misc_line_get(pgp, fd, lp)) != -1){
+		/* Until an empty line ends one block, collect data */
+		if(lnr == 0){
+			if(use_this && ((pgp->pg_flags & a_F_FOCUS_SENDER) || pgp->pg_r != NIL) &&
+					pgp->pg_s != NIL && pgp->pg_ca != NIL && pgp->pg_cname != NIL)
+				rv = a_POLICY_TRIPLE;
+			else
+				rv = seen_any ? a_POLICY_DUNNO : a_POLICY_EMPTY;
+			goto jleave;
+		}else{
+			/* We assume no WS at BOL and EOL, nor in between key, =, and value.  We use the first value
+			 * shall an attribute appear multiple times; this also aids in bp handling simplicity */
+			uz i;
+			char *cp, *xcp;
+
+			seen_any = TRU1;
+
+			if(!use_this)
+				continue;
+
+			cp = lp->l_buf;
+
+			if((xcp = su_cs_find_c(cp, '=')) == NIL){
+				rv = a_POLICY_PROTO;
+				goto jleave;
+			}
+
+			i = P2UZ(xcp++ - cp);
+			lnr -= i + 1;
+
+			/* An empty sender= we dig; rest fails later upon normalization */
+			/*if(lnr == 0)
+			 *	continue;*/
+
+			if(i == sizeof("request") -1 && !su_mem_cmp(cp, "request", sizeof("request") -1)){
+				if(lnr != sizeof("smtpd_access_policy") -1 || su_mem_cmp(xcp, "smtpd_access_policy",
+							sizeof("smtpd_access_policy") -1)){
+					/* We are the wrong policy server for this -- log? */
+					a_DBG(su_log_write(su_LOG_DEBUG, "client got wrong request=%s (=DUNNO)", xcp);)
+					use_this = FAL0;
+					continue;
+				}
+			}else if(i == sizeof("recipient") -1 && !(pgp->pg_flags & a_F_FOCUS_SENDER) &&
+					!su_mem_cmp(cp, "recipient", sizeof("recipient") -1)){
+				if(pgp->pg_r != NIL)
+					continue;
+				pgp->pg_r = bp;
+			}else if(i == sizeof("sender") -1 && !su_mem_cmp(cp, "sender", sizeof("sender") -1)){
+				if(pgp->pg_s != NIL)
+					continue;
+				pgp->pg_s = bp;
+			}else if(i == sizeof("client_address") -1 &&
+					!su_mem_cmp(cp, "client_address", sizeof("client_address") -1)){
+				if(pgp->pg_ca != NIL)
+					continue;
+				pgp->pg_ca = bp;
+			}else if(i == sizeof("client_name") -1 &&
+					!su_mem_cmp(cp, "client_name", sizeof("client_name") -1)){
+				if(pgp->pg_cname != NIL)
+					continue;
+				pgp->pg_cname = bp;
+			}else
+				continue;
+
+			/* XXX We do have no control over inet_ntop(3) formatting, so in order
+			 * XXX to be able, reserve INET6_A8N bytes! -> SU ip_addr */
+			if(UCMP(z, lnr, >=, P2UZ(&pgp->pg_buf[sizeof(pgp->pg_buf) - ALIGN_Z(INET6_ADDRSTRLEN+1) -1
+					] - bp))){
+				a_DBG(su_log_write(su_LOG_DEBUG, "client buffer too small!!!");)
+				use_this = FAL0;
+			}else{
+				char *top;
+
+				top = (pgp->pg_ca == bp) ? &bp[ALIGN_Z(INET6_ADDRSTRLEN +1)] : NIL;
+				bp = &su_cs_pcopy(bp, xcp)[1];
+				if(top != NIL){
+					ASSERT(bp <= top);
+					bp = top;
+				}
+			}
+		}
+	}
+	rv = a_POLICY_EOF;
+
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
 
-	/* Now fill the hole */
-	if(d < cp){
-		if(focus_domain)
-			s = d;
-		/* To avoid overzealous fortify implementations, use _move() */
-		else if(ue != NIL)
-			su_mem_move(&ue[1], d, P2UZ(++cp - d));
-	}else
-		s = NIL;
+static boole
+a_misc_policy_answer(struct a_pg *pgp, s32 fd, char const *action){
+	char *xp;
+	boole rv;
+	NYD_IN;
 
-jleave:
-	pgp->pg_s = s;
+	xp = pgp->pg_buf;
+	xp = su_cs_pcopy(xp, "action=");
+	xp = su_cs_pcopy(xp, action);
+	xp[0] = '\n';
+	xp[1] = '\n';
+	xp[2] = '\0'; /* hmm */
+	xp += 2;
 
-	NYD2_OU;
-	return (s != NIL);
+	rv = a_misc_write_all(fd, pgp->pg_buf, P2UZ(xp - pgp->pg_buf));
+
+	NYD_OU;
+	return rv;
 }
 
 static boole
-a_norm_triple_ca(struct a_pg *pgp){
-	union a_srch_ip a;
-	u32 *ip, mask, max, i;
-	char *ca, *cp;
+a_misc_policy_pending(struct a_line const *lp){
+	char const *cp, *top;
+	boole rv;
 	NYD2_IN;
 
-	cp = pgp->pg_ca;
-
-	while(su_cs_is_space(*cp))
-		++cp;
+	/* An empty line ends a block, we may be positioned at it; (an escaped LF continues a line) */
+	for(rv = FAL0, cp = &lp->l_buf[lp->l_curr], top = &lp->l_buf[lp->l_fill]; cp < top; ++cp)
+		if(*cp == '\n' && (cp == &lp->l_buf[lp->l_curr] ||
+				(cp[-1] == '\n' && (cp - 1 == &lp->l_buf[lp->l_curr] || cp[-2] != '\\')))){
+			rv = TRU1;
+			break;
+		}
 
-	ca = cp;
-	cp += su_cs_len(cp);
+	NYD2_OU;
+	return rv;
+}
 
-	while(cp > ca && su_cs_is_space(cp[-1]))
-		--cp;
-	*cp = '\0';
+static u32
+a_misc_policy_addr(char const *spec, union a_sockaddr *sap, boole peer){ /* {{{ */
+	char hbuf[INET6_ADDRSTRLEN];
+	u16 port;
+	char const *cp;
+	uz i;
+	u32 rv;
+	NYD2_IN;
 
-	cp = ca;
+	rv = 0;
+	STRUCT_ZERO(union a_sockaddr, sap);
 
-	if(su_cs_find_c(cp, ':') != NIL){
-		if(inet_pton(AF_INET6, cp, &a.v6) != 1){
-			ca = NIL;
-			goto jleave;
-		}
-		LCTA(su_FIELD_OFFSETOF(struct in6_addr,s6_addr) % sizeof(u32) == 0,
-			"Alignment constraint of IPv6 address member not satisfied");
-		ip = R(u32*,a.v6.s6_addr);
-		mask = pgp->pg_6_mask;
-		max = 4;
-	}else{
-		if(inet_pton(AF_INET, cp, &a.v4) != 1){
-			ca = NIL;
+	/* A socket name within --store-path */
+	if((cp = su_cs_rfind_c(spec, ':')) == NIL){
+		if(peer || *spec == '\0' || su_cs_find_c(spec, '/') != NIL ||
+				(i = su_cs_len(spec)) >= sizeof(sap->un.sun_path))
 			goto jleave;
-		}
-		LCTA(su_FIELD_OFFSETOF(struct in_addr,s_addr) % sizeof(u32) == 0,
-			"Alignment constraint of IPv4 address member not satisfied");
-		ip = R(u32*,&a.v4.s_addr);
-		mask = pgp->pg_4_mask;
-		max = 1;
+		sap->un.sun_family = AF_UNIX;
+		su_mem_copy(sap->un.sun_path, spec, i +1);
+		rv = sizeof(sap->un);
+		goto jleave;
 	}
 
-	i = 0;
-	do{
-		u32 m;
-
-		if((m = mask) != 0){
-			m = 0xFFFFFFFFu;
-			if((i + 1) << 5 >= mask){
-				if((mask &= 31))
-					m <<= (32 - mask);
-				mask = 0;
-			}
-		}
-
-		ip[i] &= su_boswap_net_32(m);
-	}while(++i != max);
-
-	/* XXX As long as we use inet_ntop() .pg_ca needs to have been "allocated"
-	 * XXX with sufficient room to place INET6_ADDSTRLEN +1! */
-	if(inet_ntop((max == 1 ? AF_INET : AF_INET6), ip, ca = pgp->pg_ca, INET6_ADDRSTRLEN) == NIL){
-		ca = NIL;
+	/* ADDR:PORT, [ADDR]:PORT, on loopback only (unless peer) */
+	if((su_idec_u16(&port, &cp[1], UZ_MAX, 10, NIL) & (su_IDEC_STATE_EMASK | su_IDEC_STATE_CONSUMED)
+			) != su_IDEC_STATE_CONSUMED || port == 0)
 		goto jleave;
+
+	i = P2UZ(cp - spec);
+	if(i > 1 && spec[0] == '[' && spec[i - 1] == ']'){
+		++spec;
+		i -= 2;
 	}
+	if(i == 0 || i >= sizeof(hbuf))
+		goto jleave;
+	su_mem_copy(hbuf, spec, i);
+	hbuf[i] = '\0';
 
-	/* My preferred style is superfluous here as long as it is normalized
-	 *for(cp = ca; (a.c = *cp) != '\0'; ++cp)
-	 *   *cp = su_cs_to_upper(a.c); */
+	if(su_cs_find_c(hbuf, ':') != NIL){
+		if(inet_pton(AF_INET6, hbuf, &sap->in6.sin6_addr) != 1 ||
+				(!peer && !IN6_IS_ADDR_LOOPBACK(&sap->in6.sin6_addr)))
+			goto jleave;
+		sap->in6.sin6_family = AF_INET6;
+		sap->in6.sin6_port = su_boswap_net_16(port);
+		rv = sizeof(sap->in6);
+	}else{
+		if(inet_pton(AF_INET, hbuf, &sap->in.sin_addr) != 1 ||
+				(!peer && (su_boswap_net_32(sap->in.sin_addr.s_addr) >> 24) != 127))
+			goto jleave;
+		sap->in.sin_family = AF_INET;
+		sap->in.sin_port = su_boswap_net_16(port);
+		rv = sizeof(sap->in);
+	}
 
 jleave:
-	pgp->pg_ca = ca;
-
 	NYD2_OU;
-	return (ca != NIL);
-}
-
-static boole
-a_norm_triple_cname(struct a_pg *pgp){
-	/* This bails for the root label . */
-	char *cn, *cp, *ds, c;
-	NYD2_IN;
-
-	cn = pgp->pg_cname;
+	return rv;
+} /* }}} */
 
-	while(su_cs_is_space(*cn))
-		++cn;
+static u32
+a_misc_cksum(u32 h, void const *dat, uz len){
+	u8 const *p;
+	NYD_IN;
 
-	cp = cn;
-	cp += su_cs_len(cp);
+	for(p = S(u8 const*,dat); len > 0; ++p, --len){
+		h ^= *p;
+		h *= 0x01000193u;
+	}
 
-	while(cp > cn && su_cs_is_space(cp[-1]))
-		--cp;
-	*cp = '\0';
+	NYD_OU;
+	return h;
+}
 
-	cp = cn;
+static u64
+a_misc_fprint(u64 const key[2], void const *dat, uz len){ /* {{{ */
+#undef a_ROTL
+#define a_ROTL(X,B) (((X) << (B)) | ((X) >> (64 - (B))))
+#undef a_ROUND
+#define a_ROUND() \
+do{\
+	v0 += v1; v1 = a_ROTL(v1, 13); v1 ^= v0; v0 = a_ROTL(v0, 32);\
+	v2 += v3; v3 = a_ROTL(v3, 16); v3 ^= v2;\
+	v0 += v3; v3 = a_ROTL(v3, 21); v3 ^= v0;\
+	v2 += v1; v1 = a_ROTL(v1, 17); v1 ^= v2; v2 = a_ROTL(v2, 32);\
+}while(0)
+
+	u64 v0, v1, v2, v3, m;
+	uz i;
+	u8 const *p;
+	NYD_IN;
 
-	/* "Normalize" domain */
-	ds = cp;
-	while((c = *cp) != '\0'){
-		if(!su_cs_is_alnum(c) && (cp == ds || (c != '-' && c != '.'))){
-			cn = NIL;
-			break;
-		}
-		c = S(char,su_cs_to_lower(c));
-		*cp++ = c;
+	v0 = key[0] ^ U64_C(0x736F6D6570736575);
+	v1 = key[1] ^ U64_C(0x646F72616E646F6D);
+	v2 = key[0] ^ U64_C(0x6C7967656E657261);
+	v3 = key[1] ^ U64_C(0x7465646279746573);
+
+	for(p = S(u8 const*,dat); len >= 8; p += 8, len -= 8){
+		for(m = 0, i = 8; i-- > 0;)
+			m = (m << 8) | p[i];
+		v3 ^= m;
+		a_ROUND();
+		v0 ^= m;
 	}
-	if(&ds[1] >= cp)
-		cn = NIL;
 
-	pgp->pg_cname = cn;
+	/* (Only the low byte of the total length counts) */
+	for(m = 0, i = len; i-- > 0;)
+		m = (m << 8) | p[i];
+	m |= S(u64,P2UZ(p - S(u8 const*,dat)) + len) << 56;
+	v3 ^= m;
+	a_ROUND();
+	v0 ^= m;
+
+	v2 ^= 0xFF;
+	a_ROUND();
+	a_ROUND();
+	a_ROUND();
+	m = v0 ^ v1 ^ v2 ^ v3;
+	if(UNLIKELY(m == 0))
+		m = 1;
 
-	NYD2_OU;
-	return (cn != NIL);
-}
-/* }}} */
+	NYD_OU;
+	return m;
 
-/* misc {{{ */
-static boole
-a_misc_os_resource_delay(s32 err){
-	boole rv;
-	NYD_IN;
+#undef a_ROUND
+#undef a_ROTL
+} /* }}} */
 
-	rv = (err == su_ERR_MFILE || err == su_ERR_NFILE || err == su_ERR_NOBUFS/*hm*/ || err == su_ERR_NOMEM);
+static void
+a_misc_fprint_hex(char buf[16], u64 fp){
+	static char const a_hex[] = "0123456789ABCDEF";
+	u32 i;
+	NYD2_IN;
 
-	if(rv){
-		a_DBG(su_log_write(su_LOG_DEBUG, "out of OS resources while creating file descriptor, waiting a bit");)
-		su_time_msleep(250, TRU1);
-	}
+	for(i = 16; i-- > 0; fp >>= 4)
+		buf[i] = a_hex[fp & 0xF];
 
-	NYD_OU;
-	return rv;
+	NYD2_OU;
 }
 
 static s32
@@ -3980,6 +11444,93 @@ a_misc_open(struct a_pg *pgp, char const *path){
 	return fd;
 }
 
+static s32
+a_misc_lim_open(struct a_pg *pgp, char const *path, char const **limp){ /* {{{ */
+	struct su_pathinfo pi;
+	struct a_lim_hdr const *lhp;
+	char const *emsg;
+	void *vp;
+	u32 i;
+	s32 fd, rv;
+	NYD_IN;
+
+	*limp = NIL;
+
+	if((fd = a_misc_open(pgp, path)) == -1){
+		a_conf__err(pgp, _("--list-image: cannot open %s: %s\n"), path, V_(su_err_doc(-1)));
+		rv = -su_EX_IOERR;
+		goto jleave;
+	}
+
+	rv = -su_EX_DATAERR;
+	emsg = _("not an image, or corrupt");
+
+	if(!su_pathinfo_fstat(&pi, fd)){
+		emsg = V_(su_err_doc(-1));
+		rv = -su_EX_IOERR;
+	}else if(pi.pi_size < sizeof(*lhp) || pi.pi_size > S(u32,S32_MAX)){
+	}else if((vp = mmap(NIL, S(u32,pi.pi_size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+			) == MAP_FAILED){
+		emsg = V_(su_err_doc(su_err_by_errno()));
+		rv = -su_EX_IOERR;
+	}else{
+		/* A private snapshot: truncation or rewrite of the file cannot fault us, nor change the data */
+		for(i = 0; i < S(u32,pi.pi_size);){
+			sz r;
+
+			if((r = read(fd, &S(char*,vp)[i], S(u32,pi.pi_size) - i)) > 0)
+				i += S(u32,r);
+			else if(r == 0 || (r = su_err_by_errno()) != su_ERR_INTR){
+				if(r != 0){
+					emsg = V_(su_err_doc(S(s32,r)));
+					rv = -su_EX_IOERR;
+				}
+				break;
+			}
+		}
+
+		lhp = S(struct a_lim_hdr const*,vp);
+
+		if(i != S(u32,pi.pi_size)){
+		}else if(su_mem_cmp(lhp->lh_magic, a_LIM_MAGIC, sizeof(a_LIM_MAGIC)) || lhp->lh_bom != a_GRAY_BIN_BOM ||
+				lhp->lh_version != a_LIM_VERSION || lhp->lh_size != S(u32,pi.pi_size) ||
+				S(char const*,vp)[lhp->lh_size - 1] != '\0'){
+		}else if(lhp->lh_4_mask != pgp->pg_4_mask || lhp->lh_6_mask != pgp->pg_6_mask)
+			emsg = _("compiled with different --4-mask or --6-mask");
+		else{
+			/* Anything else is checked upon access */
+			for(i = 0; i < NELEM(lhp->lh_wb); ++i)
+				if(lhp->lh_wb[i].lw_ca_mask >= lhp->lh_size >> 2)
+					break;
+			if(i == NELEM(lhp->lh_wb)){
+				*limp = S(char const*,vp);
+				rv = su_EX_OK;
+			}
+		}
+
+		if(rv != su_EX_OK)
+			munmap(vp, S(u32,pi.pi_size));
+	}
+
+	close(fd);
+
+	if(rv != su_EX_OK)
+		a_conf__err(pgp, _("--list-image: %s: %s\n"), path, emsg);
+
+jleave:
+	NYD_OU;
+	return rv;
+} /* }}} */
+
+static void
+a_misc_lim_close(char const *lim){
+	NYD_IN;
+
+	munmap(C(char*,lim), R(struct a_lim_hdr const*,lim)->lh_size);
+
+	NYD_OU;
+}
+
 static sz
 a_misc_line_get(struct a_pg *pgp, s32 fd, struct a_line *lp){
 	/* XXX a_LINE_GETC(): tremendous optimization possible! */
@@ -4037,7 +11588,10 @@ jleave:
 
 jelong:
 	*cp = '\0';
-	su_log_write(su_LOG_ERR, _("line too long, skip: %s"), cp);
+	if(fd != -1)
+		su_log_write(su_LOG_ERR, _("line too long, skip: %s"), lp->l_buf);
+	else
+		a_conf__ab_rec(R(struct a_line_mem*,lp)->lm_st, a_CONF_AB_ELONG, NIL, lp->l_buf, NIL, NIL);
 jskip:
 	for(cx = '#';;){
 		s32 c;
@@ -4063,7 +11617,17 @@ a_misc_line__uflow(s32 fd, struct a_line *lp){
 	for(;;){
 		ssize_t r;
 
-		r = read(fd, &lp->l_buf[a_BUF_SIZE + 1], FIELD_SIZEOF(struct a_line,l_buf) - a_BUF_SIZE - 2);
+		if(fd != -1)
+			r = read(fd, &lp->l_buf[a_BUF_SIZE + 1], FIELD_SIZEOF(struct a_line,l_buf) - a_BUF_SIZE - 2);
+		else{
+			struct a_line_mem *lmp;
+
+			lmp = R(struct a_line_mem*,lp);
+			r = S(ssize_t,MIN(lmp->lm_len, FIELD_SIZEOF(struct a_line,l_buf) - a_BUF_SIZE - 2));
+			su_mem_copy(&lp->l_buf[a_BUF_SIZE + 1], lmp->lm_dat, S(uz,r));
+			lmp->lm_dat += r;
+			lmp->lm_len -= S(uz,r);
+		}
 		if(r == -1){
 			if((rv = su_err_by_errno()) == su_ERR_INTR)
 				continue;
@@ -4145,12 +11709,17 @@ a_misc_log_write(u32 lvl_a_flags, char const *msg, uz len){
 	/* We need to deal with CANcelled newlines .. */
 	static char xb[1024];
 	static uz xl;
+#ifdef a_HAVE_MT
+	static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 	LCTAV(su_LOG_EMERG == LOG_EMERG && su_LOG_ALERT == LOG_ALERT && su_LOG_CRIT == LOG_CRIT &&
 		su_LOG_ERR == LOG_ERR && su_LOG_WARN == LOG_WARNING && su_LOG_NOTICE == LOG_NOTICE &&
 		su_LOG_INFO == LOG_INFO && su_LOG_DEBUG == LOG_DEBUG);
 	LCTAV(su_LOG_PRIMASK < (1u << 6));
 
+	a_MT( pthread_mutex_lock(&mtx); )
+
 #ifdef a_HAVE_LOG_FIFO
 	if(xl == 0 && a_pg_i->pg_log_fd != -1){
 		xb[0] = (a_pg_i->pg_flags & a_F_MASTER_FLAG) ? '\01' : '\02';
@@ -4225,6 +11794,7 @@ a_misc_log_write(u32 lvl_a_flags, char const *msg, uz len){
 		syslog(S(int,lvl_a_flags & su_LOG_PRIMASK), "%.950s", msg);
 
 jleave:;
+	a_MT( pthread_mutex_unlock(&mtx); )
 }
 
 static void
@@ -4375,8 +11945,15 @@ jreavo:
 
 		/* In long-option order (mostly) */
 		switch(mpv){
+		case -8:
+			pg.pg_flags |= a_F_MODE_COMPILE;
+			if(pg.pg_compile != NIL)
+				su_FREE(C(char*,pg.pg_compile));
+			pg.pg_compile = su_cs_dup(avo.avo_current_arg, su_STATE_ERR_NOPASS);
+			break;
 		case '.': pg.pg_flags |= a_F_MODE_SHUTDOWN; break;
 		case '@': pg.pg_flags |= a_F_MODE_STARTUP; break;
+		case -4: pg.pg_flags |= a_F_MODE_STATS; break;
 		case '%': pg.pg_flags |= a_F_MODE_STATUS; break;
 		case '#': pg.pg_flags |= a_F_MODE_TEST; break;
 
@@ -4424,20 +12001,22 @@ jeusage:
 	if(!(f & a_AVO_FULL)){
 		switch(pg.pg_flags & a__F_MODE_MASK){
 		case 0:
+		case a_F_MODE_COMPILE:
 		case a_F_MODE_SHUTDOWN:
 		case a_F_MODE_STARTUP:
+		case a_F_MODE_STATS:
 		case a_F_MODE_STATUS:
 		case a_F_MODE_TEST:
 			break;
 		default:
-			fprintf(stderr, _("Only none or one of --shutdown, --startup, --status, --test-mode\n"));
+			fprintf(stderr, _("Only none or one of --compile-lists, --shutdown, --startup, --stats, --status, --test-mode\n"));
 			if(!(pg.pg_flags & a_F_MODE_TEST))
 				goto jeusage;
 			pg.pg_flags |= a_F_TEST_ERRORS;
 			break;
 		}
 
-		if(avo.avo_argc != 0){
+		if(avo.avo_argc != 0 && (!VAL_GRAY_BENCH || (pg.pg_flags & a__F_MODE_MASK))){
 			fprintf(stderr, _("%d excess arguments given: "), avo.avo_argc);
 			while(avo.avo_argc-- != 0)
 				fprintf(stderr, "%s%s", *avo.avo_argv++, (avo.avo_argc > 0 ? ", " : su_empty));
@@ -4450,8 +12029,16 @@ jeusage:
 		a_conf_finish(&pg, a_AVO_NONE);
 	}
 
-	if(!(pg.pg_flags & a_F_MODE_TEST))
-		mpv = a_client(&pg);
+	if(!(pg.pg_flags & a_F_MODE_TEST)){
+		if(pg.pg_flags & a_F_MODE_COMPILE)
+			mpv = a_compile(&pg);
+#if VAL_GRAY_BENCH
+		else if(!(pg.pg_flags & a__F_MODE_MASK))
+			mpv = a_bench(&pg, S(u32,avo.avo_argc), avo.avo_argv);
+#endif
+		else
+			mpv = a_client(&pg);
+	}
 	else if(!(f & a_AVO_FULL)){
 		f = a_AVO_FULL;
 		goto jreavo;
@@ -4471,6 +12058,19 @@ jleave:
 
 	if(!(pg.pg_flags & a_F_NOFREE_STORE_PATH) && pg.pg_store_path != NIL)
 		su_FREE(C(char*,pg.pg_store_path));
+	if(pg.pg_policy_listen != NIL)
+		su_FREE(C(char*,pg.pg_policy_listen));
+	if(pg.pg_compile != NIL)
+		su_FREE(C(char*,pg.pg_compile));
+	if(pg.pg_peer_listen != NIL)
+		su_FREE(C(char*,pg.pg_peer_listen));
+	if(pg.pg_peer_key != NIL)
+		su_FREE(C(char*,pg.pg_peer_key));
+	if(pg.pg_peers != NIL){
+		while(pg.pg_peer_no > 0)
+			su_FREE(pg.pg_peers[--pg.pg_peer_no]);
+		su_FREE(pg.pg_peers);
+	}
 
 	su_state_gut(mpv == su_EX_OK
 		? su_STATE_GUT_ACT_NORM /*DVL( | su_STATE_GUT_MEM_TRACE )*/
@@ -4514,8 +12114,9 @@ a_sandbox__rlimit(struct a_pg *pgp, boole server){
 
 	rl.rlim_cur = rl.rlim_max = 0;
 
+	/* (--gray-save-background server fork(2)s) */
 # if !su_OS_SOLARIS && !su_OS_SUNOS /* XXX ifdef RLIMIT_NPROC? */
-	if(setrlimit(RLIMIT_NPROC, &rl) == -1)
+	if((!server || !(pgp->pg_flags & a_F_GRAY_SAVE_BG)) && setrlimit(RLIMIT_NPROC, &rl) == -1)
 		a_sandbox__err("setrlimit", "NPROC", 0);
 # endif
 
@@ -4531,6 +12132,14 @@ a_sandbox__rlimit(struct a_pg *pgp, boole server){
 		u64 xl;
 
 		rl.rlim_cur = rl.rlim_max = pgp->pg_server_queue + 10; /* Note: ensured by a_conf_finish()! */
+		rl.rlim_cur = rl.rlim_max += 2; /* Gray DB journal, save */
+		if(pgp->pg_master->m_polfd >= 0)
+			rl.rlim_cur = rl.rlim_max += 1;
+		if(pgp->pg_master->m_thr_no > 0) /* Wakeup and worker pipes */
+			rl.rlim_cur = rl.rlim_max += 2 + (pgp->pg_master->m_thr_no * 2);
+# if defined a_HAVE_EV_EPOLL || defined a_HAVE_EV_KQUEUE
+		rl.rlim_cur = rl.rlim_max += 1 + pgp->pg_master->m_thr_no; /* Event queues */
+# endif
 		if(setrlimit(RLIMIT_NOFILE, &rl) == -1)
 			a_sandbox__err("setrlimit", "NOFILE", 0);
 
@@ -4553,6 +12162,7 @@ a_sandbox__rlimit(struct a_pg *pgp, boole server){
 static void
 a_sandbox__os(struct a_pg *pgp, boole server){
 	cap_rights_t rights;
+	u32 i;
 	s32 e;
 	pid_t pid;
 	NYD_IN;
@@ -4574,8 +12184,10 @@ a_sandbox__os(struct a_pg *pgp, boole server){
 				(e = su_err_by_errno()) != su_ERR_INTR)
 			a_sandbox__err("open", "--store-path for capsicum(4) openat(2) support", e);
 
-		cap_rights_init(&rights, CAP_CREATE, CAP_FSTAT, CAP_FSYNC, CAP_FTRUNCATE, CAP_LOOKUP, CAP_READ,
+		cap_rights_init(&rights, CAP_CREATE, CAP_FSTAT, CAP_FSYNC, CAP_FTRUNCATE, CAP_LOOKUP, CAP_MMAP_R, CAP_READ,
 				CAP_UNLINKAT, CAP_WRITE);
+		if(server && (pgp->pg_flags & a_F_GRAY_SAVE_BG))
+			cap_rights_set(&rights, CAP_RENAMEAT_SOURCE, CAP_RENAMEAT_TARGET);
 		if(cap_rights_limit(pgp->pg_store_path_fd, &rights) == -1 && (e = su_err_by_errno()) != su_ERR_NOSYS)
 			a_sandbox__err("cap_rights_limit", "--store-path, for openat(2)", e);
 	}
@@ -4596,6 +12208,19 @@ a_sandbox__os(struct a_pg *pgp, boole server){
 		cap_rights_init(&rights, CAP_ACCEPT, CAP_EVENT, CAP_READ, CAP_WRITE);
 		if(cap_rights_limit(pgp->pg_clima_fd, &rights) == -1 && (e = su_err_by_errno()) != su_ERR_NOSYS)
 			a_sandbox__err("cap_rights_limit", "server socket", e);
+		if(pgp->pg_master->m_polfd >= 0 && cap_rights_limit(pgp->pg_master->m_polfd, &rights) == -1 &&
+				(e = su_err_by_errno()) != su_ERR_NOSYS)
+			a_sandbox__err("cap_rights_limit", "--policy-listen socket", e);
+
+		cap_rights_init(&rights, CAP_EVENT, CAP_READ);
+		if(pgp->pg_master->m_peer_fd >= 0 && cap_rights_limit(pgp->pg_master->m_peer_fd, &rights) == -1 &&
+				(e = su_err_by_errno()) != su_ERR_NOSYS)
+			a_sandbox__err("cap_rights_limit", "--peer-listen socket", e);
+		cap_rights_init(&rights, CAP_WRITE);
+		for(i = 0; i < pgp->pg_master->m_peer_no; ++i)
+			if(cap_rights_limit(pgp->pg_master->m_peers[i].p_fd, &rights) == -1 &&
+					(e = su_err_by_errno()) != su_ERR_NOSYS)
+				a_sandbox__err("cap_rights_limit", "--peer socket", e);
 	}
 
 	cap_rights_init(&rights, CAP_FSYNC, CAP_WRITE);
@@ -4630,12 +12255,14 @@ a_sandbox_open(struct a_pg *pgp, boole store_path, char const *path, int flags,
 	else if((rv = openat(pgp->pg_store_path_fd, path, flags, mode)) != -1){
 		cap_rights_t rights;
 
-		if(flags & O_WRONLY)
+		if(flags & O_APPEND) /* (Gray DB journal checkpoint) */
+			cap_rights_init(&rights, CAP_FSTAT, CAP_FSYNC, CAP_FTRUNCATE, CAP_WRITE);
+		else if(flags & O_WRONLY)
 			cap_rights_init(&rights, CAP_FSTAT, CAP_FSYNC, CAP_WRITE);
 		else if(flags & O_RDWR)
 			cap_rights_init(&rights, CAP_FSTAT, CAP_FSYNC, CAP_READ, CAP_WRITE);
-		else
-			cap_rights_init(&rights, CAP_FSTAT, CAP_READ);
+		else /* (--list-image) */
+			cap_rights_init(&rights, CAP_FSTAT, CAP_MMAP_R, CAP_READ);
 
 		if(cap_rights_limit(rv, &rights) == -1 && (mode = su_err_by_errno()) != su_ERR_NOSYS){
 			close(rv);
@@ -4657,7 +12284,8 @@ a_sandbox_sock_accepted(struct a_pg *pgp, s32 sockfd){
 	e = su_ERR_NONE;
 
 	if(!(pgp->pg_flags & a_F_UNTAMED)){
-		cap_rights_init(&rights, CAP_EVENT, CAP_READ, CAP_WRITE);
+		/* (CAP_FCNTL: O_NONBLOCK toggle for split requests) */
+		cap_rights_init(&rights, CAP_EVENT, CAP_FCNTL, CAP_READ, CAP_WRITE);
 		if(cap_rights_limit(sockfd, &rights) == -1){
 			if((e = su_err_by_errno()) == su_ERR_NOSYS)
 				e = su_ERR_NONE;
@@ -4699,6 +12327,7 @@ a_sandbox_sock_accepted(struct a_pg *pgp, s32 sockfd){
 # define a_EXIT_GROUP
 # define a_NEWFSTATAT
 # define a_FSTATAT64
+# define a_FTRUNCATE64
 # define a_OPENAT
 
 # define a_RT_SIGACTION
@@ -4724,6 +12353,10 @@ a_sandbox_sock_accepted(struct a_pg *pgp, s32 sockfd){
 #  undef a_FSTATAT64
 #  define a_FSTATAT64 a_Y(__NR_fstatat64),
 # endif
+# ifdef __NR_ftruncate64
+#  undef a_FTRUNCATE64
+#  define a_FTRUNCATE64 a_Y(__NR_ftruncate64),
+# endif
 # ifdef __NR_openat
 #  undef a_OPENAT
 #  define a_OPENAT a_Y(__NR_openat),
@@ -4796,6 +12429,10 @@ static struct sock_filter const a_sandbox__client_flt[] = {
 # ifdef VAL_OS_SANDBOX_CLIENT_RULES
 	VAL_OS_SANDBOX_CLIENT_RULES
 # else
+#  ifdef a_HAVE_GRAY_SHM
+	/* --gray-shared, if vDSO falls back */
+	a_Y(__NR_clock_gettime),
+#  endif
 # endif
 # ifdef su_NYD_ENABLE
 	a_Y(__NR_open),a_OPENAT
@@ -4808,7 +12445,18 @@ static struct sock_filter const a_sandbox__server_flt[] = {
 # ifdef VAL_OS_SANDBOX_SERVER_RULES
 	VAL_OS_SANDBOX_SERVER_RULES
 # else
+#  ifdef SOCK_NONBLOCK
+	a_Y(__NR_accept4),
+#  else
 	a_Y(__NR_accept),
+#  endif
+	/* --policy-listen: recv(2) MSG_PEEK; --peer-listen: recvfrom(2) */
+#  ifdef __NR_recv
+	a_Y(__NR_recv),
+#  endif
+#  ifdef __NR_recvfrom
+	a_Y(__NR_recvfrom),
+#  endif
 	a_Y(__NR_clock_gettime),
 #  ifdef __NR_clock_nanosleep
 	a_Y(__NR_clock_nanosleep),
@@ -4818,9 +12466,18 @@ static struct sock_filter const a_sandbox__server_flt[] = {
 #  endif
 	a_Y(__NR_fcntl),
 	a_Y(__NR_fsync),
+	a_Y(__NR_ftruncate),a_FTRUNCATE64
 	a_Y(__NR_open),a_OPENAT
+#  ifdef a_HAVE_EV_EPOLL
+	a_Y(__NR_epoll_ctl),
+	a_Y(__NR_epoll_pwait),
+#  else
 	a_Y(__NR_pselect6),
+#  endif
 	a_Y(__NR_unlink),
+#  ifdef a_HAVE_MT
+	a_Y(__NR_futex),
+#  endif
 
 	/* Possible memory allocator stuff */
 	a_Y(__NR_brk),
@@ -4835,11 +12492,44 @@ static struct sock_filter const a_sandbox__server_flt[] = {
 	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1),
 	a_ALLOW,
 	a_LOAD_SYSNR,
+#  ifdef a_HAVE_MT
+	/* Thread arenas of the memory allocator grow via mprotect(2); ditto */
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_mprotect, 0, 7),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, FIELD_OFFSETOF(struct seccomp_data,args[2]) + a_ARG_LO_OFF),
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, ~S(u32,PROT_READ | PROT_WRITE)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 3),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, FIELD_OFFSETOF(struct seccomp_data,args[2]) + a_ARG_HI_OFF),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1),
+	a_ALLOW,
+	a_LOAD_SYSNR,
+#  endif
 
 # endif /* !VAL_OS_SANDBOX_SERVER_RULES */
 	a_SHARED
 };
 
+/* --gray-save-background: prepended to a_sandbox__server_flt: child, rename(2) into place */
+static struct sock_filter const a_sandbox__save_bg_flt[] = {
+	a_LOAD_SYSNR,
+	a_Y(__NR_clone),
+# ifdef __NR_fork
+	a_Y(__NR_fork),
+# endif
+# ifdef __NR_set_robust_list
+	a_Y(__NR_set_robust_list),
+# endif
+	a_Y(__NR_wait4),
+# ifdef __NR_rename
+	a_Y(__NR_rename),
+# endif
+# ifdef __NR_renameat
+	a_Y(__NR_renameat),
+# endif
+# ifdef __NR_renameat2
+	a_Y(__NR_renameat2),
+# endif
+};
+
 # undef a_LOAD_SYSNR
 # undef a_ALLOW
 # undef a_FAIL
@@ -4849,6 +12539,7 @@ static struct sock_filter const a_sandbox__server_flt[] = {
 # undef a_EXIT_GROUP
 # undef a_NEWFSTATAT
 # undef a_STATAT64
+# undef a_FTRUNCATE64
 # undef a_OPENAT
 # undef a_RT_SIGACTION
 # undef a_SIGACTION
@@ -4895,11 +12586,12 @@ a_sandbox__osdeath(int no, siginfo_t *sip, void *vp){
 
 static void
 a_sandbox__os(struct a_pg *pgp, boole server){
+	struct sock_fprog bgp;
+	struct sock_fprog const *sfpp;
 # if VAL_OS_SANDBOX > 1
 	struct sigaction sa;
 # endif
 	NYD_IN;
-	UNUSED(pgp);
 
 	/* Avoid ptrace; as this assigns /proc/PID to (some user namespace's) root:root the "user" will not be able
 	 * to call "kill -TERM" on the program, only root can; as we are not privileged, and so as to avoid to play
@@ -4922,9 +12614,31 @@ a_sandbox__os(struct a_pg *pgp, boole server){
 	sigaction(a_HAVE_SANDBOX_SIGNAL, &sa, NIL);
 # endif
 
-	if(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, (server ? &a_sandbox__server_prg : &a_sandbox__client_prg)) == -1)
+	sfpp = server ? &a_sandbox__server_prg : &a_sandbox__client_prg;
+	bgp.filter = NIL;
+	if(server && (pgp->pg_flags & a_F_GRAY_SAVE_BG)){
+		bgp.len = S(us,NELEM(a_sandbox__save_bg_flt) + NELEM(a_sandbox__server_flt));
+		bgp.filter = su_TALLOC(struct sock_filter, bgp.len);
+		su_mem_copy(bgp.filter, a_sandbox__save_bg_flt, sizeof(a_sandbox__save_bg_flt));
+		su_mem_copy(&bgp.filter[NELEM(a_sandbox__save_bg_flt)], a_sandbox__server_flt,
+			sizeof(a_sandbox__server_flt));
+		sfpp = &bgp;
+	}
+
+# ifdef a_HAVE_MT
+	/* Server threads need the filter, too */
+	if(server && pgp->pg_master->m_thr_no > 0){
+		if(syscall(__NR_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_TSYNC, sfpp) != 0)
+			a_sandbox__err("seccomp", "SET_MODE_FILTER,FILTER_FLAG_TSYNC", 0);
+	}else
+# endif
+	if(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, sfpp) == -1)
 		a_sandbox__err("prctl", "SET_SECCOMP", 0);
 
+	/* (The kernel has its copy) */
+	if(bgp.filter != NIL)
+		su_FREE(bgp.filter);
+
 	NYD_OU;
 }
 #endif /* }}} VAL_OS_SANDBOX>0 && su_OS_LINUX */
@@ -4951,8 +12665,19 @@ a_sandbox__os(struct a_pg *pgp, boole server){
 
 		if(unveil(pgp->pg_master->m_sockpath, "c") == -1)
 			a_sandbox__err("unveil", pgp->pg_master->m_sockpath, 0);
+		if(pgp->pg_master->m_polfd >= 0 && su_cs_find_c(pgp->pg_policy_listen, ':') == NIL &&
+				unveil(pgp->pg_policy_listen, "c") == -1)
+			a_sandbox__err("unveil", pgp->pg_policy_listen, 0);
 		if(unveil(a_GRAY_DB_NAME, "rwc") == -1)
 			a_sandbox__err("unveil", a_GRAY_DB_NAME, 0);
+		if((pgp->pg_flags & a_F_GRAY_SAVE_BG) && unveil(a_GRAY_DB_TMP_NAME, "rwc") == -1)
+			a_sandbox__err("unveil", a_GRAY_DB_TMP_NAME, 0);
+		if(unveil(a_GRAY_JNL_NAME, "rwc") == -1)
+			a_sandbox__err("unveil", a_GRAY_JNL_NAME, 0);
+		if(unveil(a_GRAY_JNL_OLD_NAME, "rwc") == -1)
+			a_sandbox__err("unveil", a_GRAY_JNL_OLD_NAME, 0);
+		if(pgp->pg_shm != NIL && unveil(a_GRAY_SHM_NAME, "c") == -1)
+			a_sandbox__err("unveil", a_GRAY_SHM_NAME, 0);
 # ifdef su_NYD_ENABLE
 		unveil(a_NYD_FILE, "w");
 # endif
@@ -4961,7 +12686,10 @@ a_sandbox__os(struct a_pg *pgp, boole server){
 			if(unveil(a_sandbox__paths[i], "r") == -1)
 				a_sandbox__err("unveil", a_sandbox__paths[i], 0);
 
-		if(pledge("stdio inet rpath wpath cpath", "") == -1)
+		if(pgp->pg_flags & a_F_GRAY_SAVE_BG){
+			if(pledge("stdio inet proc rpath wpath cpath", "") == -1)
+				a_sandbox__err("pledge", "stdio inet proc rpath wpath cpath", 0);
+		}else if(pledge("stdio inet rpath wpath cpath", "") == -1)
 			a_sandbox__err("pledge", "stdio inet rpath wpath cpath", 0);
 	}
 